@@ -0,0 +1,356 @@
+/***********************************************************************
+ * Copyright 2026 by the California Institute of Technology
+ * ALL RIGHTS RESERVED. United States Government Sponsorship acknowledged.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * @file        loco.hpp
+ * @date        2026-10-18
+ * @brief       Header-only C++ wrapper for LOCO (de)compression
+ *
+ * An Encoder or Decoder owns its state, allocated once when it is made, and
+ * can be moved but not copied. Images and compressed data are views of
+ * buffers the caller owns: results point into them, and compressing or
+ * decompressing a frame allocates nothing. Pixels the size of
+ * LocoPixelType (uint16_t, int16_t) are read and written in place; uint8_t
+ * pixels, for bit depths up to 8, are copied through a buffer the coder
+ * keeps, every frame, and the buffer is only reallocated for a larger
+ * image than it has seen.
+ *
+ * The bit depth is a template parameter, checked against the pixel type at
+ * compile time. Errors are returned as the C library's status flags.
+ */
+
+#ifndef LOCO_HPP
+#define LOCO_HPP
+
+#include <loco/loco_pub.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#if __cplusplus >= 202002L
+#include <span>
+#endif
+
+namespace loco {
+
+/// A contiguous range of elements the caller owns
+template <typename T>
+class Span {
+public:
+    Span() : data_(nullptr), size_(0) {}
+    Span(T *data, std::size_t size) : data_(data), size_(size) {}
+    template <typename Container,
+              typename = decltype(std::declval<Container&>().data())>
+    Span(Container &container)
+        : data_(container.data()), size_(container.size()) {}
+#if __cplusplus >= 202002L
+    template <std::size_t Extent>
+    Span(std::span<T, Extent> span) : data_(span.data()), size_(span.size()) {}
+#endif
+
+    T *data() const { return data_; }
+    std::size_t size() const { return size_; }
+    std::size_t size_bytes() const { return size_ * sizeof(T); }
+
+private:
+    T *data_;
+    std::size_t size_;
+};
+
+/// Pixels the caller owns: height rows of width pixels, stride pixels apart
+template <typename Pixel>
+struct ImageView {
+    Span<Pixel> pixels;     /// At least height * stride pixels
+    I32 width;
+    I32 height;
+    I32 stride;             /// Pixels from one row to the next, >= width
+
+    ImageView() : width(0), height(0), stride(0) {}
+    ImageView(Span<Pixel> pixels_in, I32 width_in, I32 height_in,
+            I32 stride_in = 0)
+        : pixels(pixels_in), width(width_in), height(height_in),
+          stride((stride_in != 0) ? stride_in : width_in) {}
+
+    Pixel *row(I32 y) const { return pixels.data() + (std::size_t)y * stride; }
+};
+
+/// Whether the coder can use Pixel in place of LocoPixelType
+template <typename Pixel>
+struct IsInPlacePixel : std::integral_constant<bool,
+        std::is_integral<Pixel>::value
+        && sizeof(Pixel) == sizeof(LocoPixelType)> {};
+
+/// Checks, at compile time, that BitDepth is valid, and that Pixel can hold it
+template <int BitDepth, typename Pixel>
+struct CheckPixel {
+    static_assert(BitDepth >= 1 && BitDepth <= 12,
+            "loco bit depths are 1 to 12");
+    static_assert(std::is_integral<Pixel>::value,
+            "pixels must be integers");
+    static_assert(IsInPlacePixel<Pixel>::value
+            || (sizeof(Pixel) == 1 && BitDepth <= 8),
+            "pixels must be 16 bit, or 8 bit for bit depths up to 8");
+};
+
+/// Result of compression, pointing into the caller's output buffer
+struct Compressed {
+    I32 status;                         /// Flags, as from loco_compress_ext()
+    LocoCompressedImage image;          /// Data and segments, in the buffer
+
+    bool ok() const { return status == LOCO_OK; }
+    const LocoCompressedSegments &segments() const { return image.segments; }
+    I32 size_bytes() const { return image.compressed_size_bytes; }
+};
+
+/// Result of decompression, pointing into the caller's image buffer
+template <typename Pixel>
+struct Decompressed {
+    I32 status;                         /// Flags, as from loco_decompress_ext()
+    ImageView<Pixel> image;             /// The image, rows width apart
+    I32 n_segs;
+
+    bool ok() const { return status == LOCO_OK; }
+};
+
+namespace detail {
+
+/// The most bytes the C library's I32 sizes can describe
+const std::size_t max_size_bytes = 0x7fffffff;
+
+/// A buffer's size for the C library: larger buffers are used in part
+inline I32 size_bytes(std::size_t bytes)
+{
+    return (I32)((bytes < max_size_bytes) ? bytes : max_size_bytes);
+}
+
+/* Widening and narrowing of 8 bit pixels, and a no-op for pixels used in
+   place */
+template <typename Pixel, bool InPlace = IsInPlacePixel<Pixel>::value>
+struct PixelBuffer {
+    static LocoPixelType *wrap(std::vector<LocoPixelType> &buffer,
+            const ImageView<const Pixel> &view)
+    {
+        (void)buffer;
+        return const_cast<LocoPixelType *>(
+                reinterpret_cast<const LocoPixelType *>(view.pixels.data()));
+    }
+    static LocoPixelType *output(std::vector<LocoPixelType> &buffer,
+            Span<Pixel> out)
+    {
+        (void)buffer;
+        return reinterpret_cast<LocoPixelType *>(out.data());
+    }
+    static void narrow(const std::vector<LocoPixelType> &buffer,
+            Span<Pixel> out, std::size_t n)
+    {
+        (void)buffer;
+        (void)out;
+        (void)n;
+    }
+};
+
+template <typename Pixel>
+struct PixelBuffer<Pixel, false> {
+    static LocoPixelType *wrap(std::vector<LocoPixelType> &buffer,
+            const ImageView<const Pixel> &view)
+    {
+        std::size_t n = (std::size_t)view.height * view.stride;
+        if (buffer.size() < n) {
+            buffer.resize(n);
+        }
+        for (std::size_t i = 0; i < n; i++) {
+            buffer[i] = (LocoPixelType)view.pixels.data()[i];
+        }
+        return buffer.data();
+    }
+    static LocoPixelType *output(std::vector<LocoPixelType> &buffer,
+            Span<Pixel> out)
+    {
+        if (buffer.size() < out.size()) {
+            buffer.resize(out.size());
+        }
+        return buffer.data();
+    }
+    static void narrow(const std::vector<LocoPixelType> &buffer,
+            Span<Pixel> out, std::size_t n)
+    {
+        for (std::size_t i = 0; i < n; i++) {
+            out.data()[i] = (Pixel)buffer[i];
+        }
+    }
+};
+
+} // namespace detail
+
+/** Compresses images of BitDepth bits, reusing one state. 16 bit pixels are
+ *  compressed in place; uint8_t pixels are first widened into a buffer the
+ *  encoder keeps, which copies every pixel of every frame. */
+template <int BitDepth>
+class Encoder {
+public:
+    Encoder() : state_(new LocoCompressState) {}
+    Encoder(Encoder &&) = default;
+    Encoder &operator=(Encoder &&) = default;
+    Encoder(const Encoder &) = delete;
+    Encoder &operator=(const Encoder &) = delete;
+
+    /**
+     * @brief Compress an image into the caller's buffer
+     * @param image The pixels.
+     * @param n_segs Number of segments.
+     * @param out Buffer for the compressed data; loco_compressed_size_bound()
+     *            bytes always suffice.
+     * @param options Compression options, or nullptr for the defaults.
+     * @param stats Statistics for each segment, or nullptr if not wanted.
+     * @return The result, whose data and segments are in out. Its status is
+     *         LOCO_SMALL_BUFFER_FLAG | LOCO_ABORT_COMPRESSION_FLAG if the
+     *         image is smaller than its view says, or its view is more than
+     *         the C library's I32 sizes can describe.
+     */
+    template <typename Pixel>
+    Compressed compress(const ImageView<const Pixel> &image, I32 n_segs,
+            Span<LocoBitstreamType> out,
+            const LocoCompressOptions *options = nullptr,
+            LocoCompressStats *stats = nullptr)
+    {
+        CheckPixel<BitDepth, Pixel> check;
+        (void)check;
+
+        Compressed result;
+        std::memset(&result, 0, sizeof(result));
+        result.image.data = out.data();
+        result.image.size_data_bytes = detail::size_bytes(out.size_bytes());
+        bool bad_view = image.width < 0 || image.height < 0
+                || image.stride < image.width;
+        std::size_t n_pixels = bad_view ? 0
+                : (std::size_t)image.height * (std::size_t)image.stride;
+        if (bad_view || image.pixels.size() < n_pixels
+                || n_pixels > detail::max_size_bytes / sizeof(LocoPixelType)) {
+            result.status = LOCO_SMALL_BUFFER_FLAG | LOCO_ABORT_COMPRESSION_FLAG;
+            return result;
+        }
+
+        LocoImage loco_image;
+        loco_image.width = image.width;
+        loco_image.height = image.height;
+        loco_image.space_width = image.stride;
+        loco_image.bit_depth = BitDepth;
+        loco_image.n_segs = n_segs;
+        loco_image.size_data_bytes = (I32)(n_pixels * sizeof(LocoPixelType));
+        loco_image.data = detail::PixelBuffer<Pixel>::wrap(widened_, image);
+        result.status = loco_compress_ext(state_.get(), &loco_image, options,
+                &result.image, stats);
+        return result;
+    }
+
+    /// Compress an image of mutable pixels
+    template <typename Pixel>
+    Compressed compress(const ImageView<Pixel> &image, I32 n_segs,
+            Span<LocoBitstreamType> out,
+            const LocoCompressOptions *options = nullptr,
+            LocoCompressStats *stats = nullptr)
+    {
+        ImageView<const Pixel> view(Span<const Pixel>(image.pixels.data(),
+                image.pixels.size()), image.width, image.height, image.stride);
+        return compress(view, n_segs, out, options, stats);
+    }
+
+    /// The state, for calls to the C library
+    LocoCompressState *state() { return state_.get(); }
+
+private:
+    std::unique_ptr<LocoCompressState> state_;
+    std::vector<LocoPixelType> widened_;    // 8 bit pixels, widened
+};
+
+/** Decompresses images of BitDepth bits, reusing one state. 16 bit pixels
+ *  are decompressed in place; uint8_t pixels are decompressed into a buffer
+ *  the decoder keeps, then narrowed, which copies every pixel of every
+ *  frame. */
+template <int BitDepth>
+class Decoder {
+public:
+    Decoder() : state_(new LocoDecompressState) {}
+    Decoder(Decoder &&) = default;
+    Decoder &operator=(Decoder &&) = default;
+    Decoder(const Decoder &) = delete;
+    Decoder &operator=(const Decoder &) = delete;
+
+    /**
+     * @brief Decompress an image into the caller's buffer
+     * @param segments The compressed segments, e.g. Compressed::segments().
+     * @param out Buffer for the image, which is stored with rows width apart.
+     * @param options Decompression options, or nullptr for the defaults.
+     * @return The result, whose image is in out. Its status is
+     *         DELOCO_BADDATA_FLAG if the image was coded for other bit
+     *         depths: up to 8 bits, or 9 to 12, as BitDepth is not.
+     *         Status of each segment is in seg_data().
+     */
+    template <typename Pixel>
+    Decompressed<Pixel> decompress(const LocoCompressedSegments &segments,
+            Span<Pixel> out, const LocoDecompressOptions *options = nullptr)
+    {
+        CheckPixel<BitDepth, Pixel> check;
+        (void)check;
+
+        Decompressed<Pixel> result;
+        result.n_segs = 0;
+        LocoImageInfo info;
+        result.status = loco_peek(state_.get(), &segments, &info);
+        if (result.status != LOCO_OK) {
+            return result;
+        }
+        if ((info.bit_depth <= 8) != (BitDepth <= 8)) {
+            result.status = DELOCO_BADDATA_FLAG;
+            return result;
+        }
+
+        LocoImage loco_image;
+        std::memset(&loco_image, 0, sizeof(loco_image));
+        loco_image.data = detail::PixelBuffer<Pixel>::output(narrowed_, out);
+        loco_image.size_data_bytes = detail::size_bytes(
+                out.size() * sizeof(LocoPixelType));
+        result.status = loco_decompress_ext(state_.get(), &segments, options,
+                &loco_image, seg_data_);
+        std::size_t n = (std::size_t)loco_image.width * loco_image.height;
+        if (n > out.size()) {
+            n = 0;  // nothing was decompressed
+        }
+        detail::PixelBuffer<Pixel>::narrow(narrowed_, out, n);
+        result.image = ImageView<Pixel>(out, loco_image.width,
+                loco_image.height);
+        result.n_segs = loco_image.n_segs;
+        return result;
+    }
+
+    /// Status of each segment from the last decompression
+    const LocoSegmentData *seg_data() const { return seg_data_; }
+
+    /// The state, for calls to the C library
+    LocoDecompressState *state() { return state_.get(); }
+
+private:
+    std::unique_ptr<LocoDecompressState> state_;
+    std::vector<LocoPixelType> narrowed_;   // decoded 8 bit pixels
+    LocoSegmentData seg_data_[LOCO_MAX_SEGS];
+};
+
+} // namespace loco
+
+#endif // LOCO_HPP
@@ -61,6 +61,37 @@ enum {
 
     HEADER_CODE_FOR_12BIT = 01,
     HEADER_CODE_FOR_8BIT = 00,
+    /* Followed (after the segment index) by the code for the bit depth,
+       in HEADER_CODE_BITS, and HEADER_FLAGS_BITS of flags. */
+    HEADER_CODE_EXTENDED = 02,
+
+    HEADER_FLAGS_BITS = 8,
+    HEADER_FLAG_RAW = 0x01,   /* Pixels stored uncompressed, from the next byte */
+    HEADER_FLAG_LIMIT = 0x02, /* Unary codes limited, see LIMIT_UNARY_* */
+    HEADER_FLAG_NEAR = 0x04,  /* Near-lossless, followed by NEAR in NEAR_BITS */
+    HEADER_FLAG_LAYOUT = 0x08, /* Not a grid layout, followed (after any NEAR)
+                                  by the LOCO_LAYOUT_* in LAYOUT_BITS, and for
+                                  LOCO_LAYOUT_BALANCED, the end row of each
+                                  band but the last in IMAGEHEIGHT_BITS */
+    HEADER_FLAG_TEMPORAL = 0x10, /* Predicted from the difference with a
+                                    reference frame, which is not coded */
+    HEADER_FLAG_PRIOR = 0x20, /* Context statistics start from a
+                                 LocoContextModel, which is not coded */
+    HEADER_FLAG_SHARED = 0x40, /* Context statistics start from the image's
+                                  shared model. In segment 0, followed (after
+                                  any layout) by the Golomb parameter k of
+                                  each context: a 0 bit if it is the k of the
+                                  context before (0 before the first), else a
+                                  1 bit and k in SHARED_K_BITS */
+    HEADER_FLAGS_KNOWN = HEADER_FLAG_RAW | HEADER_FLAG_LIMIT | HEADER_FLAG_NEAR
+            | HEADER_FLAG_LAYOUT | HEADER_FLAG_TEMPORAL | HEADER_FLAG_PRIOR
+            | HEADER_FLAG_SHARED,
+    NEAR_BITS = 7,            /* Must accommodate LOCO_MAX_NEAR */
+    LAYOUT_BITS = 2,          /* Must accommodate the LOCO_LAYOUT_* */
+    SHARED_K_BITS = 4,        /* Must accommodate BITDEPTH_12BIT-1 */
+    SHARED_MODEL_COUNT = 4,   /* Count each context of a shared model starts
+                                 with, which sets how fast segments adapt
+                                 away from it */
 
     BITDEPTH_12BIT = 12,
     BITDEPTH_8BIT = 8,
@@ -76,6 +107,17 @@ enum {
 
     INITCMS_12BIT = 24,
     INITCMS_8BIT = 12,
+
+    /* With HEADER_FLAG_LIMIT, a residual whose unary part would be at least
+       this long is instead coded as this many zeros and a one (an escape),
+       followed by the unary part's value in the bit depth's bits.  As in
+       JPEG-LS, this is LIMIT - bitdepth - 1, with
+       LIMIT = 2 * (bitdepth + max(8, bitdepth)). Since k <= bitdepth, a
+       pixel takes at most 2 * bitdepth + LIMIT_UNARY + 1 bits: 40 bits for
+       8 bit images, and 60 bits for 12 bit images. */
+    LIMIT_UNARY_12BIT = 35,
+    LIMIT_UNARY_8BIT = 23,
+    UNARY_UNLIMITED = 0x7fffffff,
 };
 
 LOCO_COMPILE_ASSERT(LOCO_MAX_IMAGE_WIDTH  <= 1 << IMAGEWIDTH_BITS,
@@ -84,6 +126,10 @@ LOCO_COMPILE_ASSERT(LOCO_MAX_IMAGE_HEIGHT <= 1 << IMAGEHEIGHT_BITS,
         not_enough_height_bits);
 LOCO_COMPILE_ASSERT(LOCO_MAX_SEGS <= 1 << SEGINDEX_BITS,
         not_enough_segment_bits);
+LOCO_COMPILE_ASSERT(LOCO_MAX_NEAR < 1 << NEAR_BITS,
+        not_enough_near_bits);
+LOCO_COMPILE_ASSERT(LOCO_LAYOUT_BALANCED < 1 << LAYOUT_BITS,
+        not_enough_layout_bits);
 
 /* The following allows the compressor to produce the same output on
    a little-endian (e.g. Intel) machine.
@@ -104,8 +150,30 @@ LOCO_COMPILE_ASSERT(LOCO_MAX_SEGS <= 1 << SEGINDEX_BITS,
 // FIX_WORD assumes BitstreamType is 32 bit
 LOCO_COMPILE_ASSERT(sizeof(LocoBitstreamType) == sizeof(I32), bad_bitstream_size);
 
+// context quantization tables, used in both compress and decompress
+extern const U8 loco_quantize_table_8bit[512];
+extern const U8 loco_quantize_table_12bit[1024];
+extern const I16 loco_context_info_table[2048];
+
+// Macros for performing context-determination-related table lookups: the
+// level of a gradient above or to the left, in bits 5 to 7, and of a
+// gradient along the row, in bits 0 and 1
+#define G_TO_CTXT_8BIT(g)  (loco_quantize_table_8bit[(g) & 511] & 0xe0)
+#define G_TO_CTXT_12BIT(g)  (loco_quantize_table_12bit[((g)>>3) & 1023] & 0xe0)
+#define GFOUR_TO_CTXT_8BIT(g)  (loco_quantize_table_8bit[(g) & 511] & 0x03)
+#define GFOUR_TO_CTXT_12BIT(g)  (loco_quantize_table_12bit[((g)>>3) & 1023] & 0x03)
+
 // segment image into n_segs segments. used in both compress and decompress
 void loco_setup_segs(I32 image_width, I32 image_height, I32 n_segs,
         LocoRect seg_rect[LOCO_MAX_SEGS]);
 
+// segment image with one of the LOCO_LAYOUT_* layouts, 0 if it cannot be
+I32 loco_setup_layout(I32 image_width, I32 image_height, I32 n_segs,
+        I32 layout, const I32 band_end[LOCO_MAX_SEGS],
+        LocoRect seg_rect[LOCO_MAX_SEGS]);
+
+// context model that starts each context with the Golomb parameter k[i]
+void loco_expand_shared_model(const U8 k[LOCO_NCONTEXTS], I32 bit_depth,
+        LocoContextModel *model);
+
 #endif
@@ -52,6 +52,359 @@ I32 loco_compress(
         const LocoImage *image,
         LocoCompressedImage *result);
 
+/**
+ * @brief Compress an image, and report statistics about each segment
+ *
+ * Produces the same output as loco_compress().
+ *
+ * @param state Pointer to a state variable for working memory.
+ *              Need not be initialized.
+ * @param image Image to be compressed.
+ * @param result Space where compressed image will be stored, and related output data.
+ * @param stats Space where statistics for each segment will be stored,
+ *              or NULL if statistics are not needed.
+ * @return LOCO_OK if image was compressed, an error code otherwise
+ */
+I32 loco_compress_with_stats(
+        LocoCompressState *state,
+        const LocoImage *image,
+        LocoCompressedImage *result,
+        LocoCompressStats stats[LOCO_MAX_SEGS]);
+
+/**
+ * @brief Set compression options to their defaults
+ *
+ * The defaults produce the same output as loco_compress().
+ *
+ * @param options Options to be initialized.
+ */
+void loco_init_compress_options(LocoCompressOptions *options);
+
+/**
+ * @brief Set a context model to the statistics a segment starts from
+ *        without a prior
+ *
+ * @param model Model to be initialized.
+ * @param bit_depth Bit depth of the images the model is for.
+ */
+void loco_init_context_model(LocoContextModel *model, I32 bit_depth);
+
+/**
+ * @brief Check that a context model can be used as a prior
+ *
+ * A model is valid if it is for the same bit depth class (up to 8, or over
+ * 8) and its statistics are within the ranges in LocoContextModel, as those
+ * from LocoCompressOptions.models_out always are.
+ *
+ * @param model Model to be checked.
+ * @param bit_depth Bit depth of the image it is to be used for.
+ * @return 1 if the model is valid, 0 if not.
+ */
+I32 loco_check_context_model(const LocoContextModel *model, I32 bit_depth);
+
+/**
+ * @brief Compress an image with the given options
+ *
+ * With options->size_only set, no output is written and result->data may be
+ * NULL; result->segments.n_bits and result->compressed_size_bytes are set to
+ * what compression with a large enough buffer would produce.
+ *
+ * @param state Pointer to a state variable for working memory.
+ *              Need not be initialized.
+ * @param image Image to be compressed.
+ * @param options Compression options, or NULL for defaults.
+ * @param result Space where compressed image will be stored, and related output data.
+ * @param stats Space where statistics for each segment will be stored,
+ *              or NULL if statistics are not needed.
+ * @return LOCO_OK if image was compressed, an error code otherwise
+ */
+I32 loco_compress_ext(
+        LocoCompressState *state,
+        const LocoImage *image,
+        const LocoCompressOptions *options,
+        LocoCompressedImage *result,
+        LocoCompressStats stats[LOCO_MAX_SEGS]);
+
+/**
+ * @brief Compress an image, each segment into its own buffer
+ *
+ * Produces the same segments as loco_compress_ext(), but segment i is written
+ * at the start of seg_out[i].data, so segments can be coded straight into the
+ * memory they are sent from. segments->seg_ptr[i] points to seg_out[i].data,
+ * and segments->n_bits[i] is the segment's size; segments can be passed to
+ * loco_decompress() as is. The end pointers (seg_ptr[i+1] as the end of
+ * segment i) are not meaningful for scattered segments.
+ *
+ * A segment that does not fit its buffer is cut short, without affecting
+ * other segments, and LOCO_BUFFER_FILLED_FLAG is returned. A buffer of
+ * loco_compressed_size_bound() bytes always holds any one segment.
+ *
+ * With options->size_only set, the data pointers may be NULL.
+ *
+ * @param state Pointer to a state variable for working memory.
+ *              Need not be initialized.
+ * @param image Image to be compressed.
+ * @param options Compression options, or NULL for defaults.
+ * @param seg_out A buffer for each of the image's segments.
+ * @param segments Space where the segment pointers and sizes will be stored.
+ * @param stats Space where statistics for each segment will be stored,
+ *              or NULL if statistics are not needed.
+ * @return LOCO_OK if image was compressed, an error code otherwise
+ */
+I32 loco_compress_scatter(
+        LocoCompressState *state,
+        const LocoImage *image,
+        const LocoCompressOptions *options,
+        const LocoSegmentBuffer seg_out[LOCO_MAX_SEGS],
+        LocoCompressedSegments *segments,
+        LocoCompressStats stats[LOCO_MAX_SEGS]);
+
+/**
+ * @brief Compress one segment of an image into its own buffer
+ *
+ * Segments are coded independently, so different segments of the same image
+ * can be compressed at the same time by different threads, each with its own
+ * state, into the same segments structure. The segment is the same as
+ * loco_compress_scatter() produces. Only segments->seg_ptr[seg] and
+ * segments->n_bits[seg] are set; once every segment is compressed, the
+ * caller sets segments->n_segs to image->n_segs.
+ *
+ * Rate control (options->target_bytes) needs the whole image, and is
+ * rejected with LOCO_BAD_OPTIONS_FLAG.
+ *
+ * @param state Pointer to a state variable for working memory.
+ *              Need not be initialized.
+ * @param image Image to be compressed.
+ * @param options Compression options, or NULL for defaults.
+ * @param seg Index of the segment to compress, less than image->n_segs.
+ * @param seg_out Buffer for the segment.
+ * @param segments Space where the segment's pointer and size will be stored.
+ * @param stats Space where statistics for the segment will be stored,
+ *              or NULL if statistics are not needed.
+ * @return LOCO_OK if the segment was compressed, an error code otherwise
+ */
+I32 loco_compress_segment(
+        LocoCompressState *state,
+        const LocoImage *image,
+        const LocoCompressOptions *options,
+        I32 seg,
+        const LocoSegmentBuffer *seg_out,
+        LocoCompressedSegments *segments,
+        LocoCompressStats *stats);
+
+/**
+ * @brief Compress an image into fixed-size packets
+ *
+ * Produces the same segments as loco_compress_ext(), cut into packets as
+ * described for LocoPacketOutput, written straight into the packet ring.
+ * Losing a packet loses only the rest of its segment. The number of packets
+ * a segment needs is its size divided by the payload size,
+ * packet_bytes - LOCO_PACKET_HEADER_BYTES, rounded up.
+ *
+ * If the ring fills up without a packet_done callback, the remaining
+ * segments are cut short, and LOCO_BUFFER_FILLED_FLAG is returned.
+ * options->raw_fallback and options->size_only cannot be used with packets,
+ * and are rejected with LOCO_BAD_OPTIONS_FLAG.
+ *
+ * @param state Pointer to a state variable for working memory.
+ *              Need not be initialized.
+ * @param image Image to be compressed.
+ * @param options Compression options, or NULL for defaults.
+ * @param packets The packet ring, and the number of packets produced.
+ * @param stats Space where statistics for each segment will be stored,
+ *              or NULL if statistics are not needed.
+ * @return LOCO_OK if image was compressed, an error code otherwise
+ */
+I32 loco_compress_packets(
+        LocoCompressState *state,
+        const LocoImage *image,
+        const LocoCompressOptions *options,
+        LocoPacketOutput *packets,
+        LocoCompressStats stats[LOCO_MAX_SEGS]);
+
+/**
+ * @brief Start compressing an image a slice at a time
+ *
+ * Sets up compression as loco_compress_ext() does, but codes nothing;
+ * loco_compress_continue() then codes the image a few rows at a time, so
+ * that no one call runs for long. Everything needed to resume is kept in
+ * state, so the output is identical to loco_compress_ext(). The image,
+ * result buffer and stats must stay in place, and state must not be used
+ * for anything else, until compression is done.
+ *
+ * Rate control (options->target_bytes) sizes the whole image before coding
+ * any of it, and is rejected with LOCO_BAD_OPTIONS_FLAG.
+ *
+ * @param state Pointer to a state variable for working memory.
+ *              Need not be initialized.
+ * @param image Image to be compressed.
+ * @param options Compression options, or NULL for defaults.
+ * @param result Space where the compressed image will be stored.
+ * @param stats Space where statistics for each segment will be stored,
+ *              or NULL if statistics are not needed.
+ * @return LOCO_IN_PROGRESS_FLAG if compression was started,
+ *         an error code otherwise
+ */
+I32 loco_compress_start(
+        LocoCompressState *state,
+        const LocoImage *image,
+        const LocoCompressOptions *options,
+        LocoCompressedImage *result,
+        LocoCompressStats stats[LOCO_MAX_SEGS]);
+
+/**
+ * @brief Compress more of an image started with loco_compress_start()
+ *
+ * Codes whole rows of the current segment, and then of the following ones,
+ * until about pixel_budget pixels are coded. At least one row is coded per
+ * call, so a call may code up to one row more than its budget. When raw
+ * fallback gives up on coding a segment, its pixels are stored in the call
+ * that finds it incompressible.
+ *
+ * @param state State passed to loco_compress_start().
+ * @param pixel_budget Number of pixels to code in this call, at least 1.
+ * @return LOCO_IN_PROGRESS_FLAG while part of the image is left to code,
+ *         then the status loco_compress_ext() would have returned
+ */
+I32 loco_compress_continue(
+        LocoCompressState *state,
+        I32 pixel_budget);
+
+/**
+ * @brief Compress many images into one packed output
+ *
+ * Compresses each image as loco_compress_ext() would, one after the other
+ * into result->data, with the same state and options, and records where
+ * each is in index (see LocoBatchEntry). Suited to many small images, which
+ * then need no output buffer or call of their own. The batch packs images;
+ * it does not save setup. Each image is checked, laid out and started with
+ * fresh contexts as loco_compress_ext() does, which even at 64 x 64 is a
+ * small part of coding it (see LocoTest.BatchPerformance).
+ *
+ * An image that cannot be compressed has size 0, and its status in index;
+ * the others are still compressed. If the buffer fills up, the image being
+ * compressed is cut short, later images have size 0, and
+ * LOCO_BUFFER_FILLED_FLAG is set in their statuses.
+ * result->compressed_size_bytes is set to the packed size; result->segments
+ * is not used. Rate control (options->target_bytes) is rejected with
+ * LOCO_BAD_OPTIONS_FLAG.
+ *
+ * @param state Pointer to a state variable for working memory.
+ *              Need not be initialized.
+ * @param images Images to be compressed.
+ * @param n_images Number of images.
+ * @param options Compression options, or NULL for defaults.
+ * @param result Space where the packed images will be stored.
+ * @param index Space where the position and status of each image will
+ *              be stored.
+ * @return The statuses of the images or-ed together
+ */
+I32 loco_compress_batch(
+        LocoCompressState *state,
+        const LocoImage images[],
+        I32 n_images,
+        const LocoCompressOptions *options,
+        LocoCompressedImage *result,
+        LocoBatchEntry index[]);
+
+/**
+ * @brief Quickly estimate the compressed size of an image
+ *
+ * The first sample_period rows of each segment, while the context statistics
+ * adapt, are coded exactly (without writing output). After that, only every
+ * sample_period-th row is coded, against its true previous row, and its bits
+ * are scaled up to the rows skipped. Work is about 2/sample_period of
+ * loco_compress_ext() with options->size_only set.
+ *
+ * result->segments.n_bits and result->compressed_size_bytes are set to the
+ * estimate, padded to whole words as compression would pad them;
+ * result->data is not used and may be NULL. Bits per pixel is
+ * 8 * compressed_size_bytes / (width * height).
+ *
+ * Error: with LOCO_ESTIMATE_SAMPLE_PERIOD, the estimate is within 3% of the
+ * true size for camera images, within 1% for smooth or flat images, and within
+ * 4% for noise. It tends to be high, because the sampled rows adapt the
+ * context statistics over fewer pixels. The error is not bounded for images
+ * whose rows vary with the sampling period (e.g. stripes with a period
+ * dividing sample_period); a different sample_period helps there.
+ * A sample_period of 1 gives the exact size.
+ *
+ * @param state Pointer to a state variable for working memory.
+ *              Need not be initialized.
+ * @param image Image whose compressed size is to be estimated.
+ * @param sample_period Distance between coded rows, at least 1.
+ * @param result Space where the estimated sizes will be stored.
+ * @return LOCO_OK if the size was estimated, an error code otherwise
+ */
+I32 loco_estimate_size(
+        LocoCompressState *state,
+        const LocoImage *image,
+        I32 sample_period,
+        LocoCompressedImage *result);
+
+/**
+ * @brief Learn a model for all segments of an image to share
+ *
+ * Codes each segment from the initial statistics without writing output,
+ * as loco_estimate_size() does with LOCO_ESTIMATE_SAMPLE_PERIOD, and pools
+ * the statistics of all segments. Work is about a quarter of
+ * loco_compress_ext() for lossless images; near-lossless, or with a
+ * reference frame, every row is coded, as with options->size_only. Set
+ * LocoCompressOptions.shared_model to the model, for this image or for
+ * similar ones (such as the next frames), so that each segment starts from
+ * what the whole image has taught.
+ *
+ * The model holds only each context's Golomb parameter, which is all the
+ * compressor keeps of any shared model.
+ *
+ * @param state Pointer to a state variable for working memory.
+ *              Need not be initialized.
+ * @param image Image to learn from.
+ * @param options Options it will be compressed with (the near-lossless
+ *                bound and reference frame matter), or NULL for defaults.
+ * @param model Space where the model will be stored.
+ * @return LOCO_OK if the model was learned, an error code otherwise
+ */
+I32 loco_learn_shared_model(
+        LocoCompressState *state,
+        const LocoImage *image,
+        const LocoCompressOptions *options,
+        LocoContextModel *model);
+
+/**
+ * @brief Largest compressed size of any image with the given parameters
+ *
+ * A result buffer of this many bytes always holds the whole image compressed
+ * with these options, without setting LOCO_BUFFER_FILLED_FLAG. The bound
+ * accounts for each segment's header, first pixels and padding to a whole
+ * word, with the segments laid out as compression lays them out.
+ *
+ * How tight the bound is depends on the options. With raw fallback, each
+ * segment is at most its pixels stored raw (see
+ * LOCO_RAW_FALLBACK_BOUND_BYTES). With limited Golomb codes, each pixel is at
+ * most 40 bits (8 bit images) or 60 bits (12 bit images). Otherwise, a
+ * pixel's unary code is not limited, and a pixel can take 256 or 4096 bits,
+ * so a 12 bit image of more than about 2^22 pixels (2048 x 2048) has no
+ * bound that fits in an I32, and 0 is returned: large 12 bit images need
+ * limit_golomb for a usable bound. With a target size, the bound is at most
+ * target_bytes.
+ *
+ * @param width Image width.
+ * @param height Image height.
+ * @param bit_depth Image bit depth.
+ * @param n_segs Number of segments.
+ * @param options Compression options, or NULL for defaults.
+ * @return The bound in bytes, or 0 if an image with these parameters
+ *         cannot be compressed (see loco_check_image()), or if the bound
+ *         does not fit in an I32.
+ */
+I32 loco_compressed_size_bound(
+        I32 width,
+        I32 height,
+        I32 bit_depth,
+        I32 n_segs,
+        const LocoCompressOptions *options);
+
 /**
  * @brief Decompress an image
  * @param state Pointer to a state variable for working memory.
@@ -67,6 +420,446 @@ I32 loco_decompress(
         LocoImage *image_out,
         LocoSegmentData seg_data[LOCO_MAX_SEGS]);
 
+/**
+ * @brief Decompress an image, which may be predicted from a reference frame
+ *
+ * As loco_decompress(), but segments compressed with a reference frame
+ * (LocoCompressOptions.reference) are predicted from reference, which must
+ * be the frame they were compressed with (for near-lossless, as it was
+ * decompressed). Such segments are given DELOCO_NO_REFERENCE_FLAG, and are
+ * not decompressed, if reference is NULL or does not match the image.
+ * Segments compressed without a reference decompress as usual.
+ *
+ * @param state Pointer to a state variable for working memory.
+ *              Need not be initialized.
+ * @param compressed_in Compressed segements to be decompressed.
+ * @param reference Reference frame, or NULL.
+ * @param image_out
+ * @param seg_data
+ * @return LOCO_OK if image was decompressed, an error code otherwise
+ */
+I32 loco_decompress_with_reference(
+        LocoDecompressState * state,
+        const LocoCompressedSegments * compressed_in,
+        const LocoImage *reference,
+        LocoImage *image_out,
+        LocoSegmentData seg_data[LOCO_MAX_SEGS]);
+
+/**
+ * @brief Set decompression options to their defaults
+ *
+ * The defaults decompress as loco_decompress().
+ *
+ * @param options Options to be initialized.
+ */
+void loco_init_decompress_options(LocoDecompressOptions *options);
+
+/**
+ * @brief Decompress an image with the given options
+ *
+ * As loco_decompress_with_reference(), with the reference frame in
+ * options->reference. Segments compressed with priors
+ * (LocoCompressOptions.priors) start from options->priors, which must be
+ * the models they were compressed with. Such segments are given
+ * DELOCO_NO_PRIOR_FLAG, and are not decompressed, if options->priors is NULL
+ * or the segment's model is not valid for the image's bit depth.
+ *
+ * @param state Pointer to a state variable for working memory.
+ *              Need not be initialized.
+ * @param compressed_in Compressed segements to be decompressed.
+ * @param options Decompression options, or NULL for defaults.
+ * @param image_out
+ * @param seg_data
+ * @return LOCO_OK if image was decompressed, an error code otherwise
+ */
+I32 loco_decompress_ext(
+        LocoDecompressState * state,
+        const LocoCompressedSegments * compressed_in,
+        const LocoDecompressOptions *options,
+        LocoImage *image_out,
+        LocoSegmentData seg_data[LOCO_MAX_SEGS]);
+
+/**
+ * @brief Read the image parameters from compressed segments, without
+ *        decompressing
+ *
+ * Reads the header of the first segment whose header is whole and valid,
+ * as loco_decompress() would, so that an output buffer of the right size
+ * can be found before decompressing. Only the header bits are read.
+ *
+ * @param state Pointer to a state variable for working memory.
+ *              Need not be initialized.
+ * @param compressed_in Compressed segments to be decompressed.
+ * @param info Space where the image parameters will be stored.
+ * @return LOCO_OK if the parameters were found, DELOCO_BADNUMDATASEG_FLAG
+ *         or DELOCO_NOGOODSEGMENTS_FLAG otherwise
+ */
+I32 loco_peek(
+        LocoDecompressState * state,
+        const LocoCompressedSegments * compressed_in,
+        LocoImageInfo *info);
+
+/**
+ * @brief Find the segments of one image in the output of
+ *        loco_compress_batch()
+ *
+ * With the segments, the image can be decompressed or peeked at on its own.
+ *
+ * @param batch The packed images; data and compressed_size_bytes must be set.
+ * @param entry The image's entry in the index.
+ * @param segments Space where the image's segments will be stored.
+ * @return LOCO_OK if the segments were found, otherwise
+ *         DELOCO_BADNUMDATASEG_FLAG if the entry has a bad number of
+ *         segments, or DELOCO_BADDATA_FLAG if the entry or table does not
+ *         fit the packed images.
+ */
+I32 loco_batch_segments(
+        const LocoCompressedImage *batch,
+        const LocoBatchEntry *entry,
+        LocoCompressedSegments *segments);
+
+/**
+ * @brief Decompress every image in the output of loco_compress_batch()
+ *
+ * Decompresses each image as loco_decompress() would, with the same state,
+ * into images_out, each of which must have data and size_data_bytes set.
+ * Images that were not compressed (size 0) are skipped, with status
+ * DELOCO_NOGOODSEGMENTS_FLAG. Use loco_batch_segments() and
+ * loco_decompress() for an image whose segment details are needed.
+ *
+ * @param state Pointer to a state variable for working memory.
+ *              Need not be initialized.
+ * @param batch The packed images; data and compressed_size_bytes must be set.
+ * @param index The index of the images.
+ * @param n_images Number of images.
+ * @param images_out Space for each decompressed image.
+ * @param statuses Space where the status of each image will be stored.
+ * @return The statuses of the images or-ed together
+ */
+I32 loco_decompress_batch(
+        LocoDecompressState * state,
+        const LocoCompressedImage *batch,
+        const LocoBatchEntry index[],
+        I32 n_images,
+        LocoImage images_out[],
+        I32 statuses[]);
+
+/**
+ * @brief Start decompressing one segment, before all of its data has arrived
+ *
+ * Reads the segment's header, and decompresses as far as the first n_bits of
+ * data allow. As more data arrives after it in the same buffer, call
+ * loco_decompress_segment_continue() to carry on from where decompression
+ * stopped. The header must have arrived; if not, DELOCO_NOGOODSEGMENTS_FLAG
+ * is returned with DELOCO_SHORTDATASEG_FLAG in seg_data->status, and start
+ * can be called again once more data is there.
+ *
+ * Each segment in progress needs its own state. Set image_out->n_segs to 0
+ * before starting the first segment of an image: that segment sets up the
+ * image as loco_decompress() does, and later segments must agree with it.
+ * Different segments of an image can be decompressed at the same time.
+ * Pixels not yet decompressed are 0. Segments predicted from a reference
+ * frame cannot be decompressed this way, and are given
+ * DELOCO_NO_REFERENCE_FLAG; nor can segments compressed with priors or a
+ * shared model, which are given DELOCO_NO_PRIOR_FLAG.
+ *
+ * @param state Pointer to a state variable for working memory, kept for
+ *              the segment until it is finished. Need not be initialized.
+ * @param data The segment's data, as it arrives.
+ * @param n_bits Number of bits of data that have arrived.
+ * @param image_out Image the segment is decompressed into.
+ * @param seg_data Status and bounds of the segment. n_missing_pixels is the
+ *                 number of pixels not yet decompressed.
+ * @return LOCO_OK if the segment was started, an error code otherwise
+ */
+I32 loco_decompress_segment_start(
+        LocoDecompressState *state,
+        U8 *data,
+        I32 n_bits,
+        LocoImage *image_out,
+        LocoSegmentData *seg_data);
+
+/**
+ * @brief Continue decompressing a segment as more of its data arrives
+ *
+ * A pixel whose code is cut short by the end of the data is decompressed by
+ * a later call, so the result is the same however the data is split up.
+ *
+ * @param state State passed to loco_decompress_segment_start().
+ * @param n_bits Number of bits of data that have arrived in all, at least
+ *               as many as in the previous call.
+ * @param seg_data Status of the segment, as for
+ *                 loco_decompress_segment_start().
+ * @return The number of pixels not yet decompressed, 0 when the segment is
+ *         complete
+ */
+I32 loco_decompress_segment_continue(
+        LocoDecompressState *state,
+        I32 n_bits,
+        LocoSegmentData *seg_data);
+
+/**
+ * @brief Reassemble the segments of packets from loco_compress_packets()
+ *
+ * The packets must be in the order they were produced, but any may be
+ * missing. Each segment is copied up to its first missing packet, so what
+ * arrived can be passed to loco_decompress() as result->segments. Repeated
+ * packets are skipped.
+ *
+ * @param packets Pointers to the packets received.
+ * @param n_packets Number of packets received.
+ * @param packet_bytes Size of each packet.
+ * @param result Space where the segments will be stored; data and
+ *               size_data_bytes must be set.
+ * @return 0 if every segment is complete, otherwise
+ *         DELOCO_MISSING_DATA_FLAG if a segment lost packets,
+ *         DELOCO_BADDATA_FLAG if a packet had a bad header and was skipped,
+ *         DELOCO_BUFTOOSMALL_FLAG if result's buffer was too small, and
+ *         DELOCO_NOGOODSEGMENTS_FLAG if there were no good packets.
+ */
+I32 loco_unpack_packets(
+        const LocoBitstreamType *const packets[],
+        I32 n_packets,
+        I32 packet_bytes,
+        LocoCompressedImage *result);
+
+/**
+ * @brief Set up a pool of workers for compression and decompression jobs
+ *
+ * The pool does not start threads: each worker is run by the caller, by
+ * calling loco_pool_run_worker() from its own thread, or
+ * loco_pool_run_task() from wherever there is time (e.g. a periodic task).
+ * Without a thread running each worker, jobs are only done as
+ * loco_pool_run_task() is called; see LocoPoolHooks.
+ * Worker i uses compress_states[i] and decompress_states[i], so the states
+ * are allocated once, not per job.
+ *
+ * @param pool The pool.
+ * @param n_workers Number of workers, in [1, LOCO_POOL_MAX_WORKERS].
+ * @param compress_states A compression state for each worker.
+ * @param decompress_states A decompression state for each worker.
+ * @param hooks Locking for the pool's threads.
+ * @return LOCO_OK if the pool was set up, LOCO_POOL_BAD_PARAMS_FLAG otherwise
+ */
+I32 loco_pool_init(
+        LocoPool *pool,
+        I32 n_workers,
+        LocoCompressState *const compress_states[],
+        LocoDecompressState *const decompress_states[],
+        const LocoPoolHooks *hooks);
+
+/**
+ * @brief Queue a job on a pool
+ *
+ * The job's tasks are queued for the next worker in turn; idle workers
+ * steal them. job->done is set, and job->job_done called, when the job is
+ * done. A job by segment needs a task for each segment (and one more to
+ * set up decompression), and the pool has room for
+ * n_workers * LOCO_POOL_MAX_TASKS tasks at once.
+ *
+ * @param pool The pool.
+ * @param job The job, with its inputs set.
+ * @return LOCO_OK if the job was queued, otherwise
+ *         LOCO_POOL_FULL_FLAG, LOCO_POOL_STOPPED_FLAG or
+ *         LOCO_POOL_BAD_PARAMS_FLAG.
+ */
+I32 loco_pool_submit(
+        LocoPool *pool,
+        LocoJob *job);
+
+/**
+ * @brief Run a worker until the pool is stopped
+ *
+ * Runs tasks, from the worker's own queue or stolen from others, and waits
+ * for more when there are none. Returns once the pool is stopped and every
+ * queued task has run.
+ *
+ * @param pool The pool.
+ * @param worker Index of the worker, less than the pool's n_workers.
+ */
+void loco_pool_run_worker(
+        LocoPool *pool,
+        I32 worker);
+
+/**
+ * @brief Run one task as a worker, if there is one, without waiting
+ * @param pool The pool.
+ * @param worker Index of the worker, less than the pool's n_workers.
+ * @return 1 if a task was run, 0 if there were none
+ */
+I32 loco_pool_run_task(
+        LocoPool *pool,
+        I32 worker);
+
+/**
+ * @brief Wait until a job is done
+ *
+ * Only for pools whose workers run on other threads: the job's tasks are
+ * run by those threads while this one waits with the wait hook.
+ *
+ * @param pool The pool the job was submitted to.
+ * @param job The job.
+ * @return The job's status
+ */
+I32 loco_pool_wait(
+        LocoPool *pool,
+        LocoJob *job);
+
+/**
+ * @brief Stop a pool: take no more jobs, and let workers return once the
+ *        queued tasks have run
+ * @param pool The pool.
+ */
+void loco_pool_stop(
+        LocoPool *pool);
+
+/**
+ * @brief Find the memory needed to compress and decompress images
+ *
+ * States are the same size for every image; the buffers depend on the
+ * image's size and the options. With these, every state and buffer can be
+ * allocated up front, so that compressing and decompressing frames
+ * allocates nothing.
+ *
+ * @param width Image width.
+ * @param height Image height.
+ * @param bit_depth Image bit depth.
+ * @param n_segs Number of segments.
+ * @param options Compression options, or NULL for defaults.
+ * @param sizes Where the sizes are stored.
+ * @return LOCO_OK, or LOCO_POOL_BAD_PARAMS_FLAG if an image with these
+ *         parameters cannot be compressed, or has no compressed size bound
+ *         that fits an I32 (see loco_compressed_size_bound(): large 12 bit
+ *         images need options->limit_golomb), or its bytes do not fit one
+ */
+I32 loco_working_sizes(
+        I32 width,
+        I32 height,
+        I32 bit_depth,
+        I32 n_segs,
+        const LocoCompressOptions *options,
+        LocoWorkingSizes *sizes);
+
+/**
+ * @brief Set up a pool of states, allocating them all
+ *
+ * Each state is allocated with alloc, LOCO_STATE_ALIGN_BYTES aligned. If
+ * any allocation fails, those already made are freed.
+ *
+ * @param pool The pool.
+ * @param n_compress Number of compression states, in
+ *                   [0, LOCO_STATE_POOL_MAX_STATES].
+ * @param n_decompress Number of decompression states, in
+ *                     [0, LOCO_STATE_POOL_MAX_STATES].
+ * @param alloc Allocation for the states.
+ * @param hooks Locking for the threads sharing the pool; only lock and
+ *              unlock are used.
+ * @return LOCO_OK if the pool was set up, otherwise
+ *         LOCO_POOL_BAD_PARAMS_FLAG or LOCO_POOL_NO_MEMORY_FLAG
+ */
+I32 loco_state_pool_init(
+        LocoStatePool *pool,
+        I32 n_compress,
+        I32 n_decompress,
+        const LocoAllocHooks *alloc,
+        const LocoPoolHooks *hooks);
+
+/**
+ * @brief Take a compression state from a pool, without allocating
+ * @param pool The pool.
+ * @return The state, or NULL if all are in use
+ */
+LocoCompressState *loco_state_pool_acquire_compress(
+        LocoStatePool *pool);
+
+/**
+ * @brief Take a decompression state from a pool, without allocating
+ * @param pool The pool.
+ * @return The state, or NULL if all are in use
+ */
+LocoDecompressState *loco_state_pool_acquire_decompress(
+        LocoStatePool *pool);
+
+/**
+ * @brief Give a compression state back to the pool it was taken from
+ * @param pool The pool.
+ * @param state The state, from loco_state_pool_acquire_compress().
+ */
+void loco_state_pool_release_compress(
+        LocoStatePool *pool,
+        LocoCompressState *state);
+
+/**
+ * @brief Give a decompression state back to the pool it was taken from
+ * @param pool The pool.
+ * @param state The state, from loco_state_pool_acquire_decompress().
+ */
+void loco_state_pool_release_decompress(
+        LocoStatePool *pool,
+        LocoDecompressState *state);
+
+/**
+ * @brief Free a pool's states, all of which must have been given back
+ * @param pool The pool.
+ */
+void loco_state_pool_free(
+        LocoStatePool *pool);
+
+/**
+ * @brief Start compressing an image through a two stage pipeline
+ *
+ * Planning a row's estimates and contexts depends only on the pixels, so it
+ * can run ahead of coding, which adapts the context statistics in order.
+ * Once started, loco_pipeline_run_planner() and loco_pipeline_run_coder()
+ * must run at once, on different threads; the planner stays at most
+ * LOCO_PIPELINE_ROWS rows ahead, and the stages hand rows over
+ * LOCO_PIPELINE_BATCH at a time, taking the lock once for each batch. The
+ * output is the same as from loco_compress_ext().
+ *
+ * The coder does most of the work, so the gain is modest, and only with a
+ * core for each stage: on a 2048 x 2048 image, the coding stage took about
+ * 10% less CPU time than loco_compress_ext() (8 and 12 bit), and planning
+ * about a fifth to a third as much. With one core, the pipeline is slower.
+ *
+ * Only lossless compression without a reference is pipelined, and without
+ * a target size.
+ *
+ * @param pipe The pipeline.
+ * @param state Compression state, used by the stages.
+ * @param image The image to compress.
+ * @param options Compression options, or NULL for the defaults.
+ * @param result Where to place the compressed image.
+ * @param stats Statistics for each segment, or NULL if not wanted.
+ * @param hooks Locking for the two threads.
+ * @return LOCO_OK if the stages can run, otherwise flags as from
+ *         loco_compress_ext(); LOCO_BAD_OPTIONS_FLAG if the options
+ *         cannot be pipelined. If compression aborted, the stages
+ *         return at once.
+ */
+I32 loco_pipeline_start(
+        LocoPipeline *pipe,
+        LocoCompressState *state,
+        const LocoImage   *image,
+        const LocoCompressOptions *options,
+        LocoCompressedImage *result,
+        LocoCompressStats stats[LOCO_MAX_SEGS],
+        const LocoPoolHooks *hooks);
+
+/**
+ * @brief Run the planning stage of a pipeline, until every row is planned
+ * @param pipe The started pipeline.
+ */
+void loco_pipeline_run_planner(
+        LocoPipeline *pipe);
+
+/**
+ * @brief Run the coding stage of a pipeline, until the image is compressed
+ * @param pipe The started pipeline.
+ * @return Status, as from loco_compress_ext()
+ */
+I32 loco_pipeline_run_coder(
+        LocoPipeline *pipe);
+
 #ifdef __cplusplus
    }
 #endif
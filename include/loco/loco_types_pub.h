@@ -73,6 +73,8 @@
 #define LOCO_BAD_BIT_DEPTH_FLAG     (0x00000200)
 /** image size is smaller that space_width*height*pixel size */
 #define LOCO_SMALL_BUFFER_FLAG      (0x00000400)
+/** A compression option was out of range */
+#define LOCO_BAD_OPTIONS_FLAG       (0x00000800)
 /** The output buffer filled up because the image was not sufficiently
  *  compressible (by LOCO, at least).
  *  This does NOT cause compression to abort, and in fact all of the data
@@ -80,6 +82,13 @@
  *  Some compressed segments may have zero length.
  *  (This flag has no approximate equivalent in ICER.) */
 #define LOCO_BUFFER_FILLED_FLAG     (0x00002000)
+/** Rate control could not fit every segment in the target size, even at the
+ *  largest near-lossless bound, so it left out the least important segments.
+ *  The segments that were kept are complete; the others have zero length. */
+#define LOCO_SEGMENTS_DROPPED_FLAG  (0x00004000)
+/** loco_compress_start() or loco_compress_continue() has not yet coded the
+ *  whole image; call loco_compress_continue() again to go on. */
+#define LOCO_IN_PROGRESS_FLAG       (0x00008000)
 /** Everything is OK */
 #define LOCO_OK                     (0x00000000)
 
@@ -109,12 +118,20 @@
  *  was not in the valid range.  */
 #define DELOCO_BADDATA_FLAG (0x0020)
 /** The header code of the data segment was not HEADER_CODE_FOR_8BIT
- *  or HEADER_CODE_FOR_12BIT.  */
+ *  or HEADER_CODE_FOR_12BIT, or an extended header had unknown flags.  */
 #define DELOCO_BAD_HEADER_CODE_FLAG (0x0040)
 /** The decompressor ran out of data before decompression of the segment was
  *  complete.  As a result, the reconstructed image will have a gap
  *  (pixels of value 0) in this segment.  */
 #define DELOCO_MISSING_DATA_FLAG (0x0080)
+/** The segment was predicted from a reference frame, and no reference frame
+ *  was given, or its width, height or bit depth did not match the segment's.
+ *  The segment was not decompressed. */
+#define DELOCO_NO_REFERENCE_FLAG (0x0100)
+/** The segment's context statistics start from a prior
+ *  (see LocoCompressOptions.priors), and no prior was given, or it was not
+ *  valid for the segment's bit depth. The segment was not decompressed. */
+#define DELOCO_NO_PRIOR_FLAG (0x0200)
 
 
 enum {
@@ -125,11 +142,41 @@ enum {
     LOCO_MIN_SEGMENT_PIXELS = 200, /// Minimum number of pixels in an image
     LOCO_MAX_SEGS = 32,            /// Maximum number of segments in an image
     LOCO_NCONTEXTS = 1024,         /// Max number of contexts
+    LOCO_STATS_K_BINS = 16,        /// Bins in the Golomb parameter histogram
+    LOCO_STATS_UNARY_BINS = 32,    /// Bins in the unary code length histogram
+    LOCO_ESTIMATE_SAMPLE_PERIOD = 8, /// Default row sampling period of estimates
+    LOCO_MAX_NEAR = 127,           /// Maximum near-lossless error bound
+    LOCO_PACKET_HEADER_BYTES = 8,  /// Size of the header of each packet
+    LOCO_MIN_PACKET_BYTES = 12,    /// Minimum packet size, header and a word
+    LOCO_MAX_PACKET_BYTES = 65536, /// Maximum packet size
+};
+
+/// Segment layouts, for LocoCompressOptions.layout
+enum {
+    LOCO_LAYOUT_GRID = 0,     /// Near-square grid, from loco_setup_segs()
+    LOCO_LAYOUT_BANDS = 1,    /// Full-width bands of equal height
+    LOCO_LAYOUT_STRIPS = 2,   /// Full-height strips of equal width
+    LOCO_LAYOUT_BALANCED = 3, /** Full-width bands of about equal coded size,
+                                  estimated from the image */
 };
 
 typedef I16 LocoPixelType;
 typedef I32 LocoBitstreamType;
 
+/** Largest compressed size, in bytes, of a width x height image of
+ *  bit_depth bits in n_segs segments, compressed with raw fallback
+ *  (LocoCompressOptions.raw_fallback). A segment then takes at most its
+ *  pixels (8 bits each, or 12 for bit depths over 8), after a 48 bit header,
+ *  padded to a whole word. One spare word is included, so a buffer of this
+ *  size never sets LOCO_BUFFER_FILLED_FLAG. Holds for any layout but
+ *  LOCO_LAYOUT_BALANCED. A constant expression for constant arguments; see
+ *  loco_compressed_size_bound() for other options. */
+#define LOCO_RAW_FALLBACK_BOUND_BYTES(width, height, bit_depth, n_segs) \
+    ((I32)sizeof(LocoBitstreamType) \
+     * (((width) * (height) * (((bit_depth) <= 8) ? 8 : 12) \
+         + (n_segs) * (48 + 8 * (I32)sizeof(LocoBitstreamType) - 1)) \
+        / (8 * (I32)sizeof(LocoBitstreamType)) + 1))
+
 /** Uncompressed image.
  *  Passed as input to compression, or as output to decompression.
  *
@@ -191,7 +238,9 @@ typedef struct {
  *  nature can be decompressed, but some segments will be missing.
  *
  *  A good data buffer size is at least the size of the input image,
- *  which should suceed in all but the worst cases.
+ *  which should suceed in all but the worst cases. A buffer of
+ *  loco_compressed_size_bound() bytes (or LOCO_RAW_FALLBACK_BOUND_BYTES,
+ *  with raw fallback) always holds the whole compressed image.
  */
 typedef struct {
     // The following values are output from compression, and input to decompression
@@ -204,6 +253,55 @@ typedef struct {
     LocoBitstreamType * data;       /// Pointer to the compressed data
 } LocoCompressedImage;
 
+/** Output buffer for one compressed segment, for scatter output.
+ *
+ *  The data pointer must point to an allocated buffer, and the size must be
+ *  initialized. The compressed segment starts at the beginning of the buffer.
+ */
+typedef struct {
+    LocoBitstreamType *data;    /// Pointer to the segment's buffer
+    I32 size_data_bytes;        /// Size of the buffer
+} LocoSegmentBuffer;
+
+/** Called when a packet is complete. packet points to the packet's header,
+ *  and index counts the packets produced, from 0. After the call returns,
+ *  the packet's memory may be reused for a later packet. */
+typedef void (*LocoPacketDone)(void *context, const LocoBitstreamType *packet,
+        I32 index);
+
+/** Packetized compressed output.
+ *
+ *  The compressed segments are cut into packets of packet_bytes each, a
+ *  LOCO_PACKET_HEADER_BYTES header then payload. Each packet holds part of one
+ *  segment; a segment starts in a new packet, and the last packet of a segment
+ *  may be partly filled. The header, in bytes:
+ *
+ *      0     segment index, or'd with LOCO_PACKET_LAST_FLAG in the last
+ *            packet of the segment
+ *      1     number of segments in the image
+ *      2-3   bytes of payload, most significant byte first
+ *      4-7   offset in bits of the payload in the segment, most significant
+ *            byte first
+ *
+ *  The packets are written to a ring of n_packets slots in data. With a
+ *  packet_done callback, each packet is passed to it when complete, and the
+ *  ring wraps around; without, compression stops when the ring is full.
+ */
+typedef struct {
+    LocoBitstreamType *data;    /// n_packets slots of packet_bytes each
+    I32 packet_bytes;           /** Size of each packet, a multiple of 4 in
+                                    [LOCO_MIN_PACKET_BYTES, LOCO_MAX_PACKET_BYTES] */
+    I32 n_packets;              /// Number of slots in the ring
+    LocoPacketDone packet_done; /// Callback for each packet, or NULL
+    void *context;              /// Passed to packet_done
+
+    // Output from compression
+    I32 n_packets_out;          /// Number of packets produced
+} LocoPacketOutput;
+
+/** Marks the last packet of a segment, in the segment index byte */
+#define LOCO_PACKET_LAST_FLAG (0x80)
+
 /// Output info about a decompressed segment
 typedef struct {
     I32   real_num;             /// Segment number
@@ -215,6 +313,162 @@ typedef struct {
     I32   n_missing_pixels;     /// Number of pixels missing from the segment
 } LocoSegmentData;
 
+/** Where an image is in the packed output of loco_compress_batch().
+ *
+ *  Each image starts on a word boundary, with a table of the size in bits of
+ *  each of its segments, one big-endian word per segment, followed by the
+ *  segments one after the other, as loco_compress_ext() lays them out. */
+typedef struct {
+    I32   offset_bytes;         /// Offset of the image in the packed output
+    I32   size_bytes;           /// Size of the image, with its table
+    I32   n_segs;               /// Number of segments, and words in the table
+    I32   status;               /// Status of the image's compression
+} LocoBatchEntry;
+
+/** Output info about a compressed segment.
+ *
+ *  Optional output from compression, gathered while the segment is coded.
+ *  Residual statistics do not include the first two pixels of a segment,
+ *  which are written directly.
+ */
+typedef struct {
+    I32   n_pixels;             /// Number of pixels in the segment
+    I32   n_bits;               /// Bits needed to code the segment,
+                                /// not counting padding of the last word
+    I32   bits_per_pixel_q8;    /// n_bits / n_pixels, in units of 1/256 bit
+    I32   mean_abs_residual_q8; /// Mean prediction residual magnitude,
+                                /// in units of 1/256
+    I32   k_hist[LOCO_STATS_K_BINS];         /** Number of pixels coded with
+                                                 each Golomb parameter k. The
+                                                 last bin also counts larger k */
+    I32   unary_hist[LOCO_STATS_UNARY_BINS]; /** Number of pixels with each
+                                                 unary code length. The last
+                                                 bin also counts longer codes */
+    I32   max_unary;            /// Longest unary code in the segment
+    I32   n_contexts_used;      /// Number of contexts used by the segment
+    I32   truncated;            /// 1 if the output buffer filled up before
+                                /// the segment was completely stored, else 0
+    I32   raw;                  /** 1 if the segment was stored uncompressed,
+                                    else 0. If 1, n_bits is the stored size,
+                                    and the other fields describe the part of
+                                    the segment coded before the fallback */
+    I32   near;                 /// Near-lossless bound used for the segment
+    I32   dropped;              /// 1 if rate control left the segment out
+} LocoCompressStats;
+
+/** Statistics of each context, as a coder has them.
+ *
+ *  The final statistics of a segment, or a prior that a segment's statistics
+ *  start from instead of the fixed initial values, so that a small segment
+ *  does not spend much of its length learning them. Initialize a prior with
+ *  loco_init_context_model(), or take it from a segment of an earlier frame.
+ *  Counts are in [1, 127] for 8 bit coding and [1, 63] for 12 bit coding,
+ *  and each magnitude sum in [0, count * 128] or [0, count * 2048].
+ */
+typedef struct {
+    I32 bit_depth;                  /// 8 or 12: the coding the model is for
+    I16 c_count[LOCO_NCONTEXTS];    /// Residuals seen, with halving
+    I32 c_mag_sum[LOCO_NCONTEXTS];  /// Sum of residual magnitudes
+    I32 c_sum[LOCO_NCONTEXTS];      /// Sum of residuals, less the bias
+    I16 c_bias[LOCO_NCONTEXTS];     /// Correction to the estimate
+} LocoContextModel;
+
+/** Options for compression.
+ *
+ *  Initialize with loco_init_compress_options(), then change fields as needed.
+ */
+typedef struct {
+    I32 size_only;  /** If nonzero, compute the size of each compressed segment
+                        without writing any output. The result data pointer
+                        may be NULL, and the segment pointers are not set. */
+    I32 raw_fallback; /** If nonzero, a segment that would code to more words
+                          than its uncompressed pixels is stored uncompressed
+                          instead, under an extended header. Coding of the
+                          segment stops as soon as a row ends over that size.
+                          Decompressors predating this option cannot read
+                          such segments, so it is off by default. */
+    I32 limit_golomb; /** If nonzero, limit the length of each pixel's code,
+                          as in JPEG-LS: a residual whose unary part would be
+                          long is escaped and written in full. This bounds a
+                          pixel's code to 40 bits for 8 bit images and 60 for
+                          12 bit images, so decode time per pixel is bounded.
+                          Uses an extended header; off by default. */
+    I32 near;         /** Near-lossless error bound, as NEAR in JPEG-LS: each
+                          decompressed pixel differs from the original by at
+                          most this much. 0 (the default) is lossless; at
+                          most LOCO_MAX_NEAR. Nonzero values use an extended
+                          header, and a slower coder than lossless. */
+    I32 target_bytes; /** If nonzero, rate control: the compressed image
+                          must fit in this many bytes (and in the result
+                          buffer). Each segment gets the smallest
+                          near-lossless bound, at least near, that lets all
+                          segments fit, so every segment decodes. Segments
+                          are coded without output to find their sizes, so
+                          this takes several times longer. Only if the
+                          largest bound does not fit are segments dropped,
+                          least important first. */
+    const I32 *seg_priority; /** Importance of each segment for rate
+                          control, one value per segment, higher is more
+                          important; or NULL (the default) for equal
+                          importance, where earlier segments are kept and
+                          refined first. */
+    I32 layout;       /** How the image is divided into segments, one of the
+                          LOCO_LAYOUT_*. Bands suit streaming, strips suit
+                          wide images, and balanced bands take about equal
+                          time to decode. Bands need at least n_segs rows,
+                          and strips n_segs columns. Layouts other than
+                          LOCO_LAYOUT_GRID (the default) are written in an
+                          extended header, and balanced bands add
+                          12 * (n_segs - 1) bits to each header. */
+    const LocoImage *reference; /** If not NULL, a frame of the same width
+                          and height, and bit depth also up to 8 or also
+                          over 8, such as the previous frame
+                          of a sequence: each pixel is predicted from its
+                          difference with the co-located reference pixel,
+                          which suits frames that change little. Decompress
+                          with loco_decompress_with_reference() and the
+                          same reference; when near-lossless, that is the
+                          decompressed frame, not the original. Uses an
+                          extended header, and the slower coder that
+                          near-lossless uses. NULL by default. */
+    const LocoContextModel *priors; /** If not NULL, one model per segment,
+                          that the segment's context statistics start from,
+                          for example models_out of the previous frame, or
+                          a trained prior repeated for each segment.
+                          Decompress with loco_decompress_ext() and the same
+                          priors. Uses an extended header; NULL by default. */
+    LocoContextModel *models_out; /** If not NULL, space for one model per
+                          segment, where the final context statistics of each
+                          are stored. A segment stored raw or dropped gets
+                          its prior, or the initial values. NULL by default. */
+    const LocoContextModel *shared_model; /** If not NULL, a model that all
+                          segments start from, such as one from
+                          loco_learn_shared_model(), so that many segments
+                          cost little more than one. Only each context's
+                          Golomb parameter is kept, and coded once, in
+                          segment 0's header (at most 640 B, usually much
+                          less): segments still decode on their own, but
+                          only if segment 0 arrives. Not with priors or
+                          target_bytes. NULL by default. */
+} LocoCompressOptions;
+
+/** Options for decompression.
+ *
+ *  Initialize with loco_init_decompress_options(), then change fields as
+ *  needed. These must match the options the image was compressed with.
+ */
+typedef struct {
+    const LocoImage *reference; /** Reference frame, for segments compressed
+                          with LocoCompressOptions.reference, or NULL */
+    const LocoContextModel *priors; /** One model per segment, for segments
+                          compressed with LocoCompressOptions.priors, or NULL */
+    LocoContextModel *models_out; /** If not NULL, space for one model per
+                          segment, where the final context statistics of each
+                          are stored, as LocoCompressOptions.models_out. They
+                          match the compressor's only for segments that were
+                          decompressed whole. */
+} LocoDecompressOptions;
+
 /// A rectangle / segment coordinates
 typedef struct {
     I32 xstart; /// left edge
@@ -223,6 +477,30 @@ typedef struct {
     I32 yend;   /// bottom edge
 } LocoRect;
 
+/// Image parameters read from a segment header by loco_peek()
+typedef struct {
+    I32 width;                  /// Image width
+    I32 height;                 /// Image height
+    I32 bit_depth;              /// Image bit depth
+    I32 n_segs;                 /// Number of segments in the image
+    I32 layout;                 /// Segment layout, one of the LOCO_LAYOUT_*
+    I32 size_data_bytes;        /// Size of buffer the decompressed image needs
+    I32 first_good_seg;         /** Index in the compressed segments of the
+                                    segment whose header was read */
+    I32 temporal;               /** 1 if that segment needs a reference frame
+                                    (see LocoCompressOptions.reference) */
+    LocoRect seg_bound[LOCO_MAX_SEGS]; /// Rectangle of each segment
+} LocoImageInfo;
+
+/** One row as the pipeline plans it before coding: for each pixel, the
+ *  estimate before bias correction, and the context. */
+typedef struct {
+    I16 est[LOCO_MAX_IMAGE_WIDTH];          /// Estimate, from its neighbours
+    U16 context_info[LOCO_MAX_IMAGE_WIDTH]; /** Context, shifted left by one,
+                                                or-ed with 1 if the residual
+                                                is inverted */
+} LocoRowPlan;
+
 /// struct for holding loco compressor state
 typedef struct {
     I16 c_count[LOCO_NCONTEXTS];
@@ -237,6 +515,7 @@ typedef struct {
     I32 n_segs;
     I32 image_width;
     I32 image_height;
+    I32 bit_depth;
 
     I32 is_little_endian;
 
@@ -245,6 +524,46 @@ typedef struct {
     I32 bit_count;
     LocoBitstreamType out_word;
 
+    I32 size_only;                // count bits instead of writing them
+    I32 raw_fallback;             // store incompressible segments raw
+    I32 header_flags;             // flags in coded segment headers
+    I32 unary_limit;              // longest unary code, or UNARY_UNLIMITED
+    I32 near;                     // near-lossless error bound, 0 if lossless
+    I32 layout;                   // segment layout, a LOCO_LAYOUT_*
+    I32 band_end[LOCO_MAX_SEGS];  // row after each band, if balanced
+    LocoPixelType near_rows[2][LOCO_MAX_IMAGE_WIDTH]; // reconstructed rows,
+                                  // indexed by row parity, if near-lossless;
+                                  // less the reference, plus PMAX, if temporal
+    const LocoPixelType *ref_data; // reference frame, or NULL
+    I32 ref_space_width;          // its space between rows
+    const LocoContextModel *priors; // model each segment starts from, or NULL
+    LocoContextModel *models_out; // where final models are stored, or NULL
+    U8 shared_k[LOCO_NCONTEXTS];  // Golomb parameters of the shared model
+    I32 shared_bits;              // bits they take in segment 0's header
+    LocoContextModel shared_model; // model all segments start from, if
+                                  // HEADER_FLAG_SHARED
+    I32 seg;                      // segment being output
+    I32 seg_uncoded;              // it was stored raw or dropped
+    I32 seg_bits;                 // coded bits in current segment, counted
+                                  // when sizing or gathering stats
+    LocoCompressStats *seg_stats; // stats for current segment, or NULL
+    U32 stats_abs_sum_lo;         // sum of residual magnitudes, low word
+    U32 stats_abs_sum_hi;         // sum of residual magnitudes, high word
+    LocoPacketOutput *packets;    // packetized output, or NULL
+    LocoBitstreamType *packet_payload; // payload of the open packet, or NULL
+    I32 packet_seg;               // segment being packetized
+    I32 packet_seg_words;         // words of the segment in earlier packets
+    I32 packets_exhausted;        // the packet ring filled up
+    LocoBitstreamType *p_seg_start; // where the current segment starts
+    I32 seg_y;                    // next row of the current segment to code
+    LocoCompressedImage *slice_result; // output of time-sliced compression,
+                                  // or NULL if none is in progress
+    LocoCompressStats *slice_stats; // its statistics, or NULL
+    I32 slice_near;               // its near-lossless bound
+    I32 slice_seg;                // segment it is coding
+    I32 slice_in_seg;             // slice_seg has been started
+    I32 slice_status;             // its status so far
+
 } LocoCompressState;
 
 /// struct for holding loco decompressor state
@@ -264,6 +583,11 @@ typedef struct {
     I32 is_little_endian;
 
     I32 header_code;
+    I32 header_flags;
+    I32 unary_limit;
+    I32 near;
+    I32 layout;
+    I32 band_end[LOCO_MAX_SEGS];
     I32 invert_flag;
     I32 context;
 
@@ -272,6 +596,20 @@ typedef struct {
     I32 bit_count;
 
     I32 out_of_bits;
+    I32 bad_code;                 // a code ran past the unary limit
+
+    I32 seg;            // segment being decompressed
+    I32 resume_x;       // next pixel to decompress
+    I32 resume_y;
+    I32 n_left;         // pixels not yet decompressed
+    I32 raw_start;      // byte where pixels start, if stored raw
+    const LocoPixelType *ref_data; // reference frame, or NULL
+    I32 ref_space_width;           // its space between rows
+    const LocoContextModel *prior; // model the segment starts from, if
+                                   // HEADER_FLAG_PRIOR or HEADER_FLAG_SHARED
+    U8 shared_k[LOCO_NCONTEXTS];   // Golomb parameters, from segment 0
+    I32 have_shared;               // the shared model was found
+    LocoContextModel shared_model; // and is this
 
     /* Encoder constants */
     I32 bitdepth;
@@ -285,4 +623,181 @@ typedef struct {
 
 } LocoDecompressState;
 
+
+/* Job pool */
+
+enum {
+    LOCO_POOL_MAX_WORKERS = 16,    /// Maximum number of workers in a pool
+    LOCO_POOL_MAX_TASKS = 64,      /// Tasks each worker can have queued
+};
+
+/* pool status flags */
+
+/** There was no room in the pool's queues for the job's tasks. The job was
+ *  not submitted; submit it again once other jobs are done. */
+#define LOCO_POOL_FULL_FLAG       (0x01)
+/** The pool was stopped, and takes no more jobs. */
+#define LOCO_POOL_STOPPED_FLAG    (0x02)
+/** A job or pool parameter was out of range. */
+#define LOCO_POOL_BAD_PARAMS_FLAG (0x04)
+/** A state pool's allocator could not allocate its states. */
+#define LOCO_POOL_NO_MEMORY_FLAG  (0x08)
+
+/// Kinds of job
+enum {
+    LOCO_JOB_COMPRESS = 0,         /// Compress image
+    LOCO_JOB_DECOMPRESS = 1,       /// Decompress compressed_in
+};
+
+struct LocoJobStruct;
+
+/** Called by the worker that finishes a job, once its outputs and status
+ *  are set, but before it is marked done. */
+typedef void (*LocoJobDone)(void *context, struct LocoJobStruct *job);
+
+/** A compression or decompression job for a LocoPool.
+ *
+ *  A whole-image compress job is loco_compress_ext(), from image into
+ *  result. A compress job by segment is loco_compress_segment() for each
+ *  segment, from image into seg_out, setting segments. A whole-image
+ *  decompress job is loco_decompress(), from compressed_in into image_out and
+ *  seg_data; by segment, the image is set up as loco_decompress() does, then
+ *  each segment is loco_decompress_segment_start(). Fields not used by a
+ *  job's kind may be left unset. Everything a job points to, and the job
+ *  itself, must stay in place until it is done.
+ */
+typedef struct LocoJobStruct {
+    // Input
+    I32 kind;                   /// LOCO_JOB_COMPRESS or LOCO_JOB_DECOMPRESS
+    I32 by_segment;             /** If nonzero, each segment is a separate
+                                    task, so segments of the job run on
+                                    different workers at once */
+    const LocoImage *image;     /// Image to compress
+    const LocoCompressOptions *options; /// Compression options, or NULL
+    LocoCompressedImage *result;        /// Output of whole-image compression
+    const LocoSegmentBuffer *seg_out;   /** Buffer for each segment, when
+                                            compressing by segment */
+    LocoCompressedSegments *segments;   /** Segments compressed by segment */
+    LocoCompressStats *stats;   /// Statistics for each segment, or NULL
+    const LocoCompressedSegments *compressed_in; /// Segments to decompress
+    LocoImage *image_out;       /// Decompressed image
+    LocoSegmentData *seg_data;  /// Information about each decompressed segment
+    LocoJobDone job_done;       /// Callback when done, or NULL
+    void *context;              /// Passed to job_done
+
+    // Output
+    I32 status;                 /** Status of the job: what the compress or
+                                    decompress function returned, or the
+                                    statuses of its segments or-ed together */
+    I32 done;                   /// Nonzero once the job is done
+
+    // Private to the pool
+    I32 n_tasks_left;
+    I32 n_good_segs;
+} LocoJob;
+
+/** Locking for a LocoPool, which the caller provides for its threads, e.g.
+ *  with a mutex and a condition variable. A pool used by one thread only may
+ *  use functions that do nothing, but that thread must then run the tasks
+ *  itself with loco_pool_run_task() until each job is done: waiting, in
+ *  loco_pool_wait() or loco_pool_run_worker(), would never return. */
+typedef struct {
+    void (*lock)(void *context);     /// Lock the pool
+    void (*unlock)(void *context);   /// Unlock the pool
+    void (*wait)(void *context);     /** Called locked: unlock, wait for
+                                         wake_all, and lock again */
+    void (*wake_all)(void *context); /// Wake every waiting thread
+    void *context;                   /// Passed to the functions
+} LocoPoolHooks;
+
+/// A task in a worker's queue: a job, and the segment to work on
+typedef struct {
+    LocoJob *job;
+    I32 seg;
+} LocoPoolTask;
+
+/** A pool of workers for compression and decompression jobs, each with its
+ *  own states. Each worker queues tasks at one end of its own queue, and
+ *  works from that end; a worker with nothing to do steals from the other
+ *  end of another worker's queue. */
+typedef struct {
+    LocoCompressState *compress_states[LOCO_POOL_MAX_WORKERS];
+    LocoDecompressState *decompress_states[LOCO_POOL_MAX_WORKERS];
+    I32 n_workers;
+    LocoPoolHooks hooks;
+
+    LocoPoolTask tasks[LOCO_POOL_MAX_WORKERS][LOCO_POOL_MAX_TASKS];
+    I32 task_first[LOCO_POOL_MAX_WORKERS]; // oldest task in each queue
+    I32 n_tasks[LOCO_POOL_MAX_WORKERS];    // tasks in each queue
+    I32 n_free;                 // queue space not used or promised to jobs
+    I32 next_worker;            // queue for the next job
+    I32 stopped;
+} LocoPool;
+
+/* State pool */
+
+enum {
+    LOCO_STATE_POOL_MAX_STATES = 64,  /// Maximum states of each kind in a pool
+    LOCO_STATE_ALIGN_BYTES = 16,      /// Alignment states are allocated with
+};
+
+/** Allocation for a LocoStatePool, which the caller provides, e.g. from an
+ *  arena, huge pages, or memory local to the threads that will use it. It
+ *  is only called when the pool is set up and freed. */
+typedef struct {
+    void *(*allocate)(void *context, I32 size_bytes, I32 align_bytes);
+                                     /** Allocate size_bytes, aligned to
+                                         align_bytes; NULL if there is no
+                                         memory */
+    void (*release)(void *context, void *ptr); /// Free what allocate returned
+    void *context;                   /// Passed to the functions
+} LocoAllocHooks;
+
+/** A pool of compression and decompression states, allocated when it is set
+ *  up, and lent out and given back, e.g. for each frame, without further
+ *  allocation. */
+typedef struct {
+    LocoAllocHooks alloc;
+    LocoPoolHooks hooks;
+    LocoCompressState *compress_states[LOCO_STATE_POOL_MAX_STATES];
+    LocoDecompressState *decompress_states[LOCO_STATE_POOL_MAX_STATES];
+    I32 n_compress;                 // states allocated
+    I32 n_decompress;
+    I32 n_compress_free;            // states not lent out, first in the arrays
+    I32 n_decompress_free;
+} LocoStatePool;
+
+/** Memory needed to compress and decompress images of one size and set of
+ *  options, from loco_working_sizes(). The library allocates nothing
+ *  itself: these are the caller's buffers and states. */
+typedef struct {
+    I32 compress_state_bytes;   /// A LocoCompressState, for any image
+    I32 decompress_state_bytes; /// A LocoDecompressState, for any image
+    I32 image_bytes;            /// A decompressed image, rows width apart
+    I32 compressed_bytes;       /** Compressed image, or any one segment,
+                                    as loco_compressed_size_bound() */
+} LocoWorkingSizes;
+
+/* Pipelined compression */
+
+enum {
+    LOCO_PIPELINE_ROWS = 8,        /// Rows the modelling stage can run ahead
+    LOCO_PIPELINE_BATCH = 4,       /// Rows the stages hand over at once
+};
+
+/** A two stage pipeline compressing an image: one thread plans each row's
+ *  estimates and contexts, which depend only on the pixels, while another
+ *  corrects the estimates for bias, adapts the statistics, and codes. */
+typedef struct {
+    LocoCompressState *state;
+    LocoCompressedImage *result;
+    LocoCompressStats *stats;
+    LocoPoolHooks hooks;
+    I32 status;                 // status when started
+
+    LocoRowPlan plans[LOCO_PIPELINE_ROWS]; // ring of planned rows
+    I32 n_planned;              // rows planned, over all segments
+    I32 n_coded;                // rows coded, over all segments
+} LocoPipeline;
+
 #endif // LOCO_PUB_TYPES_H
@@ -53,7 +53,7 @@
     --state->bit_count; \
     if (state->bit_count == -1) { \
         state->bit_count = 8*sizeof(LocoBitstreamType)-1; \
-        if (state->p_out < state->p_stop) {                 \
+        if (state->p_out < state->p_stop || loco_next_packet(state)) { \
             *state->p_out = FIX_WORD(state->out_word, state->is_little_endian); \
             state->p_out++; \
         }                                            \
@@ -61,420 +61,85 @@
     } \
 }
 
-// Macros for performing context-determination-related table lookups
-#define G_TO_CTXT_8BIT(g)  (loco_g_table_8bit[(g) & 511])
-#define G_TO_CTXT_12BIT(g)  (loco_g_table_12bit[((g)>>3) & 1023])
-#define GFOUR_TO_CTXT_8BIT(g)  (loco_gfour_table_8bit[(g) & 511])
-#define GFOUR_TO_CTXT_12BIT(g)  (loco_gfour_table_12bit[((g)>>3) & 1023])
-
-/* lookup tables */
-
-LOCO_PRIVATE const U8 loco_g_table_8bit[512] =
-     {   0,   0,  32,  32,  32,  64,  64,  64,  64,  64,  64,  64,
-        64,  96,  96,  96,  96,  96,  96,  96,  96,  96,  96,  96,
-        96,  96,  96,  96,  96,  96,  96,  96,  96,  96,  96,  96,
-        96,  96,  96,  96,  96,  96,  96,  96,  96,  96,  96,  96,
-        96,  96,  96,  96,  96,  96,  96,  96,  96,  96,  96,  96,
-        96,  96,  96,  96,  96,  96,  96,  96,  96,  96,  96,  96,
-        96,  96,  96,  96,  96,  96,  96,  96,  96,  96,  96,  96,
-        96,  96,  96,  96,  96,  96,  96,  96,  96,  96,  96,  96,
-        96,  96,  96,  96,  96,  96,  96,  96,  96,  96,  96,  96,
-        96,  96,  96,  96,  96,  96,  96,  96,  96,  96,  96,  96,
-        96,  96,  96,  96,  96,  96,  96,  96,  96,  96,  96,  96,
-        96,  96,  96,  96,  96,  96,  96,  96,  96,  96,  96,  96,
-        96,  96,  96,  96,  96,  96,  96,  96,  96,  96,  96,  96,
-        96,  96,  96,  96,  96,  96,  96,  96,  96,  96,  96,  96,
-        96,  96,  96,  96,  96,  96,  96,  96,  96,  96,  96,  96,
-        96,  96,  96,  96,  96,  96,  96,  96,  96,  96,  96,  96,
-        96,  96,  96,  96,  96,  96,  96,  96,  96,  96,  96,  96,
-        96,  96,  96,  96,  96,  96,  96,  96,  96,  96,  96,  96,
-        96,  96,  96,  96,  96,  96,  96,  96,  96,  96,  96,  96,
-        96,  96,  96,  96,  96,  96,  96,  96,  96,  96,  96,  96,
-        96,  96,  96,  96,  96,  96,  96,  96,  96,  96,  96,  96,
-        96,  96,  96,  96, 224, 224, 224, 224, 224, 224, 224, 224,
-       224, 224, 224, 224, 224, 224, 224, 224, 224, 224, 224, 224,
-       224, 224, 224, 224, 224, 224, 224, 224, 224, 224, 224, 224,
-       224, 224, 224, 224, 224, 224, 224, 224, 224, 224, 224, 224,
-       224, 224, 224, 224, 224, 224, 224, 224, 224, 224, 224, 224,
-       224, 224, 224, 224, 224, 224, 224, 224, 224, 224, 224, 224,
-       224, 224, 224, 224, 224, 224, 224, 224, 224, 224, 224, 224,
-       224, 224, 224, 224, 224, 224, 224, 224, 224, 224, 224, 224,
-       224, 224, 224, 224, 224, 224, 224, 224, 224, 224, 224, 224,
-       224, 224, 224, 224, 224, 224, 224, 224, 224, 224, 224, 224,
-       224, 224, 224, 224, 224, 224, 224, 224, 224, 224, 224, 224,
-       224, 224, 224, 224, 224, 224, 224, 224, 224, 224, 224, 224,
-       224, 224, 224, 224, 224, 224, 224, 224, 224, 224, 224, 224,
-       224, 224, 224, 224, 224, 224, 224, 224, 224, 224, 224, 224,
-       224, 224, 224, 224, 224, 224, 224, 224, 224, 224, 224, 224,
-       224, 224, 224, 224, 224, 224, 224, 224, 224, 224, 224, 224,
-       224, 224, 224, 224, 224, 224, 224, 224, 224, 224, 224, 224,
-       224, 224, 224, 224, 224, 224, 224, 224, 224, 224, 224, 224,
-       224, 224, 224, 224, 224, 224, 224, 224, 224, 224, 224, 224,
-       224, 224, 224, 224, 224, 224, 224, 224, 224, 224, 224, 224,
-       224, 224, 224, 224, 224, 224, 224, 224, 192, 192, 192, 192,
-       192, 192, 192, 192, 160, 160, 160,   0};
-
-
-LOCO_PRIVATE const U8 loco_gfour_table_8bit[512] =
-    {0,0,0,0,0,0,1,1, 1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1,
-     1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1,
-     1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1,
-     1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1,
-     1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1,
-     1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1,
-     1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1,
-     1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1,
-
-     3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3,
-     3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3,
-     3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3,
-     3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3,
-     3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3,
-     3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3,
-     3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3,
-     3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3, 3,3,3,0,0,0,0,0};
-
-
-LOCO_PRIVATE const U8 loco_g_table_12bit[1024] =
-       {  0,   0,  32,  32,  32,  32,  64,  64,  64,  64,  64,  64,
-         64,  64,  64,  64,  96,  96,  96,  96,  96,  96,  96,  96,
-         96,  96,  96,  96,  96,  96,  96,  96,  96,  96,  96,  96,
-         96,  96,  96,  96,  96,  96,  96,  96,  96,  96,  96,  96,
-         96,  96,  96,  96,  96,  96,  96,  96,  96,  96,  96,  96,
-         96,  96,  96,  96,  96,  96,  96,  96,  96,  96,  96,  96,
-         96,  96,  96,  96,  96,  96,  96,  96,  96,  96,  96,  96,
-         96,  96,  96,  96,  96,  96,  96,  96,  96,  96,  96,  96,
-         96,  96,  96,  96,  96,  96,  96,  96,  96,  96,  96,  96,
-         96,  96,  96,  96,  96,  96,  96,  96,  96,  96,  96,  96,
-         96,  96,  96,  96,  96,  96,  96,  96,  96,  96,  96,  96,
-         96,  96,  96,  96,  96,  96,  96,  96,  96,  96,  96,  96,
-         96,  96,  96,  96,  96,  96,  96,  96,  96,  96,  96,  96,
-         96,  96,  96,  96,  96,  96,  96,  96,  96,  96,  96,  96,
-         96,  96,  96,  96,  96,  96,  96,  96,  96,  96,  96,  96,
-         96,  96,  96,  96,  96,  96,  96,  96,  96,  96,  96,  96,
-         96,  96,  96,  96,  96,  96,  96,  96,  96,  96,  96,  96,
-         96,  96,  96,  96,  96,  96,  96,  96,  96,  96,  96,  96,
-         96,  96,  96,  96,  96,  96,  96,  96,  96,  96,  96,  96,
-         96,  96,  96,  96,  96,  96,  96,  96,  96,  96,  96,  96,
-         96,  96,  96,  96,  96,  96,  96,  96,  96,  96,  96,  96,
-         96,  96,  96,  96,  96,  96,  96,  96,  96,  96,  96,  96,
-         96,  96,  96,  96,  96,  96,  96,  96,  96,  96,  96,  96,
-         96,  96,  96,  96,  96,  96,  96,  96,  96,  96,  96,  96,
-         96,  96,  96,  96,  96,  96,  96,  96,  96,  96,  96,  96,
-         96,  96,  96,  96,  96,  96,  96,  96,  96,  96,  96,  96,
-         96,  96,  96,  96,  96,  96,  96,  96,  96,  96,  96,  96,
-         96,  96,  96,  96,  96,  96,  96,  96,  96,  96,  96,  96,
-         96,  96,  96,  96,  96,  96,  96,  96,  96,  96,  96,  96,
-         96,  96,  96,  96,  96,  96,  96,  96,  96,  96,  96,  96,
-         96,  96,  96,  96,  96,  96,  96,  96,  96,  96,  96,  96,
-         96,  96,  96,  96,  96,  96,  96,  96,  96,  96,  96,  96,
-         96,  96,  96,  96,  96,  96,  96,  96,  96,  96,  96,  96,
-         96,  96,  96,  96,  96,  96,  96,  96,  96,  96,  96,  96,
-         96,  96,  96,  96,  96,  96,  96,  96,  96,  96,  96,  96,
-         96,  96,  96,  96,  96,  96,  96,  96,  96,  96,  96,  96,
-         96,  96,  96,  96,  96,  96,  96,  96,  96,  96,  96,  96,
-         96,  96,  96,  96,  96,  96,  96,  96,  96,  96,  96,  96,
-         96,  96,  96,  96,  96,  96,  96,  96,  96,  96,  96,  96,
-         96,  96,  96,  96,  96,  96,  96,  96,  96,  96,  96,  96,
-         96,  96,  96,  96,  96,  96,  96,  96,  96,  96,  96,  96,
-         96,  96,  96,  96,  96,  96,  96,  96,  96,  96,  96,  96,
-         96,  96,  96,  96,  96,  96,  96,  96, 224, 224, 224, 224,
-        224, 224, 224, 224, 224, 224, 224, 224, 224, 224, 224, 224,
-        224, 224, 224, 224, 224, 224, 224, 224, 224, 224, 224, 224,
-        224, 224, 224, 224, 224, 224, 224, 224, 224, 224, 224, 224,
-        224, 224, 224, 224, 224, 224, 224, 224, 224, 224, 224, 224,
-        224, 224, 224, 224, 224, 224, 224, 224, 224, 224, 224, 224,
-        224, 224, 224, 224, 224, 224, 224, 224, 224, 224, 224, 224,
-        224, 224, 224, 224, 224, 224, 224, 224, 224, 224, 224, 224,
-        224, 224, 224, 224, 224, 224, 224, 224, 224, 224, 224, 224,
-        224, 224, 224, 224, 224, 224, 224, 224, 224, 224, 224, 224,
-        224, 224, 224, 224, 224, 224, 224, 224, 224, 224, 224, 224,
-        224, 224, 224, 224, 224, 224, 224, 224, 224, 224, 224, 224,
-        224, 224, 224, 224, 224, 224, 224, 224, 224, 224, 224, 224,
-        224, 224, 224, 224, 224, 224, 224, 224, 224, 224, 224, 224,
-        224, 224, 224, 224, 224, 224, 224, 224, 224, 224, 224, 224,
-        224, 224, 224, 224, 224, 224, 224, 224, 224, 224, 224, 224,
-        224, 224, 224, 224, 224, 224, 224, 224, 224, 224, 224, 224,
-        224, 224, 224, 224, 224, 224, 224, 224, 224, 224, 224, 224,
-        224, 224, 224, 224, 224, 224, 224, 224, 224, 224, 224, 224,
-        224, 224, 224, 224, 224, 224, 224, 224, 224, 224, 224, 224,
-        224, 224, 224, 224, 224, 224, 224, 224, 224, 224, 224, 224,
-        224, 224, 224, 224, 224, 224, 224, 224, 224, 224, 224, 224,
-        224, 224, 224, 224, 224, 224, 224, 224, 224, 224, 224, 224,
-        224, 224, 224, 224, 224, 224, 224, 224, 224, 224, 224, 224,
-        224, 224, 224, 224, 224, 224, 224, 224, 224, 224, 224, 224,
-        224, 224, 224, 224, 224, 224, 224, 224, 224, 224, 224, 224,
-        224, 224, 224, 224, 224, 224, 224, 224, 224, 224, 224, 224,
-        224, 224, 224, 224, 224, 224, 224, 224, 224, 224, 224, 224,
-        224, 224, 224, 224, 224, 224, 224, 224, 224, 224, 224, 224,
-        224, 224, 224, 224, 224, 224, 224, 224, 224, 224, 224, 224,
-        224, 224, 224, 224, 224, 224, 224, 224, 224, 224, 224, 224,
-        224, 224, 224, 224, 224, 224, 224, 224, 224, 224, 224, 224,
-        224, 224, 224, 224, 224, 224, 224, 224, 224, 224, 224, 224,
-        224, 224, 224, 224, 224, 224, 224, 224, 224, 224, 224, 224,
-        224, 224, 224, 224, 224, 224, 224, 224, 224, 224, 224, 224,
-        224, 224, 224, 224, 224, 224, 224, 224, 224, 224, 224, 224,
-        224, 224, 224, 224, 224, 224, 224, 224, 224, 224, 224, 224,
-        224, 224, 224, 224, 224, 224, 224, 224, 224, 224, 224, 224,
-        224, 224, 224, 224, 224, 224, 224, 224, 224, 224, 224, 224,
-        224, 224, 224, 224, 224, 224, 224, 224, 224, 224, 224, 224,
-        224, 224, 224, 224, 224, 224, 224, 224, 224, 224, 224, 224,
-        224, 224, 224, 224, 224, 224, 224, 224, 224, 224, 224, 224,
-        192, 192, 192, 192, 192, 192, 192, 192, 192, 192, 160, 160,
-        160, 160,   0,   0};
-
-
-LOCO_PRIVATE const U8 loco_gfour_table_12bit[1024] =
-    {0,0,0,0,0,0,0,0, 1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1,
-     1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1,
-     1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1,
-     1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1,
-     1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1,
-     1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1,
-     1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1,
-     1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1,
-
-     1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1,
-     1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1,
-     1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1,
-     1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1,
-     1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1,
-     1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1,
-     1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1,
-     1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1,
-
-     3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3,
-     3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3,
-     3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3,
-     3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3,
-     3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3,
-     3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3,
-     3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3,
-     3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3,
-
-     3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3,
-     3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3,
-     3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3,
-     3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3,
-     3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3,
-     3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3,
-     3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3,
-     3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3, 0,0,0,0,0,0,0,0};
-
-
-LOCO_PRIVATE const I16 loco_context_info_table[2048] =
-    {   0,    2,    1,    3,    8,   10,   12,   14,   16,   18,
-       20,   22,   24,   26,   28,   30,    1,    7,    1,    3,
-        9,   15,    9,   11,   17,   23,   17,   19,   25,   31,
-       25,   27,   64,   66,   68,   70,   72,   74,   76,   78,
-       80,   82,   84,   86,   88,   90,   92,   94,   96,   98,
-      100,  102,  104,  106,  108,  110,  112,  114,  116,  118,
-      120,  122,  124,  126,  128,  130,  132,  134,  136,  138,
-      140,  142,  144,  146,  148,  150,  152,  154,  156,  158,
-      160,  162,  164,  166,  168,  170,  172,  174,  176,  178,
-      180,  182,  184,  186,  188,  190,  192,  194,  196,  198,
-      200,  202,  204,  206,  208,  210,  212,  214,  216,  218,
-      220,  222,  224,  226,  228,  230,  232,  234,  236,  238,
-      240,  242,  244,  246,  248,  250,  252,  254,    1,    7,
-        1,    3,   41,   47,   41,   43,   49,   55,   49,   51,
-       57,   63,   57,   59,    1,    7,    1,    3,    9,   15,
-        9,   11,   17,   23,   17,   19,   25,   31,   25,   27,
-       65,   71,   65,   67,  105,  111,  105,  107,  113,  119,
-      113,  115,  121,  127,  121,  123,   65,   71,   65,   67,
-       73,   79,   73,   75,   81,   87,   81,   83,   89,   95,
-       89,   91,  129,  135,  129,  131,  169,  175,  169,  171,
-      177,  183,  177,  179,  185,  191,  185,  187,  129,  135,
-      129,  131,  137,  143,  137,  139,  145,  151,  145,  147,
-      153,  159,  153,  155,  193,  199,  193,  195,  233,  239,
-      233,  235,  241,  247,  241,  243,  249,  255,  249,  251,
-      193,  199,  193,  195,  201,  207,  201,  203,  209,  215,
-      209,  211,  217,  223,  217,  219,  512,  514,  516,  518,
-      520,  522,  524,  526,  528,  530,  532,  534,  536,  538,
-      540,  542,  544,  546,  548,  550,  552,  554,  556,  558,
-      560,  562,  564,  566,  568,  570,  572,  574,  576,  578,
-      580,  582,  584,  586,  588,  590,  592,  594,  596,  598,
-      600,  602,  604,  606,  608,  610,  612,  614,  616,  618,
-      620,  622,  624,  626,  628,  630,  632,  634,  636,  638,
-      640,  642,  644,  646,  648,  650,  652,  654,  656,  658,
-      660,  662,  664,  666,  668,  670,  672,  674,  676,  678,
-      680,  682,  684,  686,  688,  690,  692,  694,  696,  698,
-      700,  702,  704,  706,  708,  710,  712,  714,  716,  718,
-      720,  722,  724,  726,  728,  730,  732,  734,  736,  738,
-      740,  742,  744,  746,  748,  750,  752,  754,  756,  758,
-      760,  762,  764,  766,  768,  770,  772,  774,  776,  778,
-      780,  782,  784,  786,  788,  790,  792,  794,  796,  798,
-      800,  802,  804,  806,  808,  810,  812,  814,  816,  818,
-      820,  822,  824,  826,  828,  830,  832,  834,  836,  838,
-      840,  842,  844,  846,  848,  850,  852,  854,  856,  858,
-      860,  862,  864,  866,  868,  870,  872,  874,  876,  878,
-      880,  882,  884,  886,  888,  890,  892,  894,  896,  898,
-      900,  902,  904,  906,  908,  910,  912,  914,  916,  918,
-      920,  922,  924,  926,  928,  930,  932,  934,  936,  938,
-      940,  942,  944,  946,  948,  950,  952,  954,  956,  958,
-      960,  962,  964,  966,  968,  970,  972,  974,  976,  978,
-      980,  982,  984,  986,  988,  990,  992,  994,  996,  998,
-     1000, 1002, 1004, 1006, 1008, 1010, 1012, 1014, 1016, 1018,
-     1020, 1022, 1024, 1026, 1028, 1030, 1032, 1034, 1036, 1038,
-     1040, 1042, 1044, 1046, 1048, 1050, 1052, 1054, 1056, 1058,
-     1060, 1062, 1064, 1066, 1068, 1070, 1072, 1074, 1076, 1078,
-     1080, 1082, 1084, 1086, 1088, 1090, 1092, 1094, 1096, 1098,
-     1100, 1102, 1104, 1106, 1108, 1110, 1112, 1114, 1116, 1118,
-     1120, 1122, 1124, 1126, 1128, 1130, 1132, 1134, 1136, 1138,
-     1140, 1142, 1144, 1146, 1148, 1150, 1152, 1154, 1156, 1158,
-     1160, 1162, 1164, 1166, 1168, 1170, 1172, 1174, 1176, 1178,
-     1180, 1182, 1184, 1186, 1188, 1190, 1192, 1194, 1196, 1198,
-     1200, 1202, 1204, 1206, 1208, 1210, 1212, 1214, 1216, 1218,
-     1220, 1222, 1224, 1226, 1228, 1230, 1232, 1234, 1236, 1238,
-     1240, 1242, 1244, 1246, 1248, 1250, 1252, 1254, 1256, 1258,
-     1260, 1262, 1264, 1266, 1268, 1270, 1272, 1274, 1276, 1278,
-     1280, 1282, 1284, 1286, 1288, 1290, 1292, 1294, 1296, 1298,
-     1300, 1302, 1304, 1306, 1308, 1310, 1312, 1314, 1316, 1318,
-     1320, 1322, 1324, 1326, 1328, 1330, 1332, 1334, 1336, 1338,
-     1340, 1342, 1344, 1346, 1348, 1350, 1352, 1354, 1356, 1358,
-     1360, 1362, 1364, 1366, 1368, 1370, 1372, 1374, 1376, 1378,
-     1380, 1382, 1384, 1386, 1388, 1390, 1392, 1394, 1396, 1398,
-     1400, 1402, 1404, 1406, 1408, 1410, 1412, 1414, 1416, 1418,
-     1420, 1422, 1424, 1426, 1428, 1430, 1432, 1434, 1436, 1438,
-     1440, 1442, 1444, 1446, 1448, 1450, 1452, 1454, 1456, 1458,
-     1460, 1462, 1464, 1466, 1468, 1470, 1472, 1474, 1476, 1478,
-     1480, 1482, 1484, 1486, 1488, 1490, 1492, 1494, 1496, 1498,
-     1500, 1502, 1504, 1506, 1508, 1510, 1512, 1514, 1516, 1518,
-     1520, 1522, 1524, 1526, 1528, 1530, 1532, 1534, 1536, 1538,
-     1540, 1542, 1544, 1546, 1548, 1550, 1552, 1554, 1556, 1558,
-     1560, 1562, 1564, 1566, 1568, 1570, 1572, 1574, 1576, 1578,
-     1580, 1582, 1584, 1586, 1588, 1590, 1592, 1594, 1596, 1598,
-     1600, 1602, 1604, 1606, 1608, 1610, 1612, 1614, 1616, 1618,
-     1620, 1622, 1624, 1626, 1628, 1630, 1632, 1634, 1636, 1638,
-     1640, 1642, 1644, 1646, 1648, 1650, 1652, 1654, 1656, 1658,
-     1660, 1662, 1664, 1666, 1668, 1670, 1672, 1674, 1676, 1678,
-     1680, 1682, 1684, 1686, 1688, 1690, 1692, 1694, 1696, 1698,
-     1700, 1702, 1704, 1706, 1708, 1710, 1712, 1714, 1716, 1718,
-     1720, 1722, 1724, 1726, 1728, 1730, 1732, 1734, 1736, 1738,
-     1740, 1742, 1744, 1746, 1748, 1750, 1752, 1754, 1756, 1758,
-     1760, 1762, 1764, 1766, 1768, 1770, 1772, 1774, 1776, 1778,
-     1780, 1782, 1784, 1786, 1788, 1790, 1792, 1794, 1796, 1798,
-     1800, 1802, 1804, 1806, 1808, 1810, 1812, 1814, 1816, 1818,
-     1820, 1822, 1824, 1826, 1828, 1830, 1832, 1834, 1836, 1838,
-     1840, 1842, 1844, 1846, 1848, 1850, 1852, 1854, 1856, 1858,
-     1860, 1862, 1864, 1866, 1868, 1870, 1872, 1874, 1876, 1878,
-     1880, 1882, 1884, 1886, 1888, 1890, 1892, 1894, 1896, 1898,
-     1900, 1902, 1904, 1906, 1908, 1910, 1912, 1914, 1916, 1918,
-     1920, 1922, 1924, 1926, 1928, 1930, 1932, 1934, 1936, 1938,
-     1940, 1942, 1944, 1946, 1948, 1950, 1952, 1954, 1956, 1958,
-     1960, 1962, 1964, 1966, 1968, 1970, 1972, 1974, 1976, 1978,
-     1980, 1982, 1984, 1986, 1988, 1990, 1992, 1994, 1996, 1998,
-     2000, 2002, 2004, 2006, 2008, 2010, 2012, 2014, 2016, 2018,
-     2020, 2022, 2024, 2026, 2028, 2030, 2032, 2034, 2036, 2038,
-     2040, 2042, 2044, 2046,    1,    7,    1,    3,   41,   47,
-       41,   43,   49,   55,   49,   51,   57,   63,   57,   59,
-        1,    7,    1,    3,    9,   15,    9,   11,   17,   23,
-       17,   19,   25,   31,   25,   27,  321,  327,  321,  323,
-      361,  367,  361,  363,  369,  375,  369,  371,  377,  383,
-      377,  379,  321,  327,  321,  323,  329,  335,  329,  331,
-      337,  343,  337,  339,  345,  351,  345,  347,  385,  391,
-      385,  387,  425,  431,  425,  427,  433,  439,  433,  435,
-      441,  447,  441,  443,  385,  391,  385,  387,  393,  399,
-      393,  395,  401,  407,  401,  403,  409,  415,  409,  411,
-      449,  455,  449,  451,  489,  495,  489,  491,  497,  503,
-      497,  499,  505,  511,  505,  507,  449,  455,  449,  451,
-      457,  463,  457,  459,  465,  471,  465,  467,  473,  479,
-      473,  475,    1,    7,    1,    3,   41,   47,   41,   43,
-       49,   55,   49,   51,   57,   63,   57,   59,    1,    7,
-        1,    3,    9,   15,    9,   11,   17,   23,   17,   19,
-       25,   31,   25,   27,   65,   71,   65,   67,  105,  111,
-      105,  107,  113,  119,  113,  115,  121,  127,  121,  123,
-       65,   71,   65,   67,   73,   79,   73,   75,   81,   87,
-       81,   83,   89,   95,   89,   91,  129,  135,  129,  131,
-      169,  175,  169,  171,  177,  183,  177,  179,  185,  191,
-      185,  187,  129,  135,  129,  131,  137,  143,  137,  139,
-      145,  151,  145,  147,  153,  159,  153,  155,  193,  199,
-      193,  195,  233,  239,  233,  235,  241,  247,  241,  243,
-      249,  255,  249,  251,  193,  199,  193,  195,  201,  207,
-      201,  203,  209,  215,  209,  211,  217,  223,  217,  219,
-      513,  519,  513,  515,  553,  559,  553,  555,  561,  567,
-      561,  563,  569,  575,  569,  571,  513,  519,  513,  515,
-      521,  527,  521,  523,  529,  535,  529,  531,  537,  543,
-      537,  539,  833,  839,  833,  835,  873,  879,  873,  875,
-      881,  887,  881,  883,  889,  895,  889,  891,  833,  839,
-      833,  835,  841,  847,  841,  843,  849,  855,  849,  851,
-      857,  863,  857,  859,  897,  903,  897,  899,  937,  943,
-      937,  939,  945,  951,  945,  947,  953,  959,  953,  955,
-      897,  903,  897,  899,  905,  911,  905,  907,  913,  919,
-      913,  915,  921,  927,  921,  923,  961,  967,  961,  963,
-     1001, 1007, 1001, 1003, 1009, 1015, 1009, 1011, 1017, 1023,
-     1017, 1019,  961,  967,  961,  963,  969,  975,  969,  971,
-      977,  983,  977,  979,  985,  991,  985,  987,  513,  519,
-      513,  515,  553,  559,  553,  555,  561,  567,  561,  563,
-      569,  575,  569,  571,  513,  519,  513,  515,  521,  527,
-      521,  523,  529,  535,  529,  531,  537,  543,  537,  539,
-      577,  583,  577,  579,  617,  623,  617,  619,  625,  631,
-      625,  627,  633,  639,  633,  635,  577,  583,  577,  579,
-      585,  591,  585,  587,  593,  599,  593,  595,  601,  607,
-      601,  603,  641,  647,  641,  643,  681,  687,  681,  683,
-      689,  695,  689,  691,  697,  703,  697,  699,  641,  647,
-      641,  643,  649,  655,  649,  651,  657,  663,  657,  659,
-      665,  671,  665,  667,  705,  711,  705,  707,  745,  751,
-      745,  747,  753,  759,  753,  755,  761,  767,  761,  763,
-      705,  711,  705,  707,  713,  719,  713,  715,  721,  727,
-      721,  723,  729,  735,  729,  731, 1025, 1031, 1025, 1027,
-     1065, 1071, 1065, 1067, 1073, 1079, 1073, 1075, 1081, 1087,
-     1081, 1083, 1025, 1031, 1025, 1027, 1033, 1039, 1033, 1035,
-     1041, 1047, 1041, 1043, 1049, 1055, 1049, 1051, 1345, 1351,
-     1345, 1347, 1385, 1391, 1385, 1387, 1393, 1399, 1393, 1395,
-     1401, 1407, 1401, 1403, 1345, 1351, 1345, 1347, 1353, 1359,
-     1353, 1355, 1361, 1367, 1361, 1363, 1369, 1375, 1369, 1371,
-     1409, 1415, 1409, 1411, 1449, 1455, 1449, 1451, 1457, 1463,
-     1457, 1459, 1465, 1471, 1465, 1467, 1409, 1415, 1409, 1411,
-     1417, 1423, 1417, 1419, 1425, 1431, 1425, 1427, 1433, 1439,
-     1433, 1435, 1473, 1479, 1473, 1475, 1513, 1519, 1513, 1515,
-     1521, 1527, 1521, 1523, 1529, 1535, 1529, 1531, 1473, 1479,
-     1473, 1475, 1481, 1487, 1481, 1483, 1489, 1495, 1489, 1491,
-     1497, 1503, 1497, 1499, 1025, 1031, 1025, 1027, 1065, 1071,
-     1065, 1067, 1073, 1079, 1073, 1075, 1081, 1087, 1081, 1083,
-     1025, 1031, 1025, 1027, 1033, 1039, 1033, 1035, 1041, 1047,
-     1041, 1043, 1049, 1055, 1049, 1051, 1089, 1095, 1089, 1091,
-     1129, 1135, 1129, 1131, 1137, 1143, 1137, 1139, 1145, 1151,
-     1145, 1147, 1089, 1095, 1089, 1091, 1097, 1103, 1097, 1099,
-     1105, 1111, 1105, 1107, 1113, 1119, 1113, 1115, 1153, 1159,
-     1153, 1155, 1193, 1199, 1193, 1195, 1201, 1207, 1201, 1203,
-     1209, 1215, 1209, 1211, 1153, 1159, 1153, 1155, 1161, 1167,
-     1161, 1163, 1169, 1175, 1169, 1171, 1177, 1183, 1177, 1179,
-     1217, 1223, 1217, 1219, 1257, 1263, 1257, 1259, 1265, 1271,
-     1265, 1267, 1273, 1279, 1273, 1275, 1217, 1223, 1217, 1219,
-     1225, 1231, 1225, 1227, 1233, 1239, 1233, 1235, 1241, 1247,
-     1241, 1243, 1537, 1543, 1537, 1539, 1577, 1583, 1577, 1579,
-     1585, 1591, 1585, 1587, 1593, 1599, 1593, 1595, 1537, 1543,
-     1537, 1539, 1545, 1551, 1545, 1547, 1553, 1559, 1553, 1555,
-     1561, 1567, 1561, 1563, 1857, 1863, 1857, 1859, 1897, 1903,
-     1897, 1899, 1905, 1911, 1905, 1907, 1913, 1919, 1913, 1915,
-     1857, 1863, 1857, 1859, 1865, 1871, 1865, 1867, 1873, 1879,
-     1873, 1875, 1881, 1887, 1881, 1883, 1921, 1927, 1921, 1923,
-     1961, 1967, 1961, 1963, 1969, 1975, 1969, 1971, 1977, 1983,
-     1977, 1979, 1921, 1927, 1921, 1923, 1929, 1935, 1929, 1931,
-     1937, 1943, 1937, 1939, 1945, 1951, 1945, 1947, 1985, 1991,
-     1985, 1987, 2025, 2031, 2025, 2027, 2033, 2039, 2033, 2035,
-     2041, 2047, 2041, 2043, 1985, 1991, 1985, 1987, 1993, 1999,
-     1993, 1995, 2001, 2007, 2001, 2003, 2009, 2015, 2009, 2011,
-     1537, 1543, 1537, 1539, 1577, 1583, 1577, 1579, 1585, 1591,
-     1585, 1587, 1593, 1599, 1593, 1595, 1537, 1543, 1537, 1539,
-     1545, 1551, 1545, 1547, 1553, 1559, 1553, 1555, 1561, 1567,
-     1561, 1563, 1601, 1607, 1601, 1603, 1641, 1647, 1641, 1643,
-     1649, 1655, 1649, 1651, 1657, 1663, 1657, 1659, 1601, 1607,
-     1601, 1603, 1609, 1615, 1609, 1611, 1617, 1623, 1617, 1619,
-     1625, 1631, 1625, 1627, 1665, 1671, 1665, 1667, 1705, 1711,
-     1705, 1707, 1713, 1719, 1713, 1715, 1721, 1727, 1721, 1723,
-     1665, 1671, 1665, 1667, 1673, 1679, 1673, 1675, 1681, 1687,
-     1681, 1683, 1689, 1695, 1689, 1691, 1729, 1735, 1729, 1731,
-     1769, 1775, 1769, 1771, 1777, 1783, 1777, 1779, 1785, 1791,
-     1785, 1787, 1729, 1735, 1729, 1731, 1737, 1743, 1737, 1739,
-     1745, 1751, 1745, 1747, 1753, 1759, 1753, 1755};
-
 // function prototypes
-LOCO_PRIVATE void loco_compress_segment_8bit(LocoCompressState * state,
-        I32 seg, I32 xstart, I32 xend, I32 ystart, I32 yend);
-LOCO_PRIVATE void loco_compress_segment_12bit(LocoCompressState * state,
-        I32 seg, I32 xstart, I32 xend, I32 ystart, I32 yend);
+LOCO_PRIVATE I32 loco_prepare_image(LocoCompressState *state,
+        const LocoImage *image);
+LOCO_PRIVATE void loco_clear_segments(LocoCompressedSegments *segments);
+LOCO_PRIVATE I32 loco_begin_compress(LocoCompressState *state,
+        const LocoImage *image, const LocoCompressOptions *options, I32 budget,
+        I32 seg_near[LOCO_MAX_SEGS], I32 seg_keep[LOCO_MAX_SEGS]);
+LOCO_PRIVATE I32 loco_output_segment(LocoCompressState *state, I32 seg,
+        I32 near, I32 keep, LocoCompressStats *seg_stats);
+LOCO_PRIVATE void loco_begin_output_segment(LocoCompressState *state, I32 seg,
+        I32 near, I32 keep, LocoCompressStats *seg_stats);
+LOCO_PRIVATE I32 loco_end_output_segment(LocoCompressState *state);
+LOCO_PRIVATE void loco_begin_result(LocoCompressState *state,
+        LocoCompressedImage *result);
+LOCO_PRIVATE void loco_record_segment(LocoCompressState *state,
+        LocoCompressedImage *result, I32 seg);
+LOCO_PRIVATE I32 loco_end_compress(LocoCompressState *state,
+        LocoCompressedImage *result, I32 rate_controlled, I32 status);
+LOCO_PRIVATE I32 loco_output_segment_to(LocoCompressState *state, I32 seg,
+        const LocoSegmentBuffer *seg_out, I32 near, I32 keep,
+        LocoCompressedSegments *segments, LocoCompressStats *seg_stats);
+LOCO_PRIVATE I32 loco_open_packet(LocoCompressState *state);
+LOCO_PRIVATE void loco_finish_packet(LocoCompressState *state, I32 last);
+LOCO_PRIVATE I32 loco_next_packet(LocoCompressState *state);
+LOCO_PRIVATE void loco_set_near(LocoCompressState * state, I32 near);
+LOCO_PRIVATE void loco_code_segment(LocoCompressState * state, I32 seg);
+LOCO_PRIVATE void loco_begin_segment(LocoCompressState * state, I32 seg);
+LOCO_PRIVATE void loco_code_segment_rows(LocoCompressState * state, I32 seg,
+        I32 n_rows);
+LOCO_PRIVATE I32 loco_segment_bytes(LocoCompressState * state, I32 seg, I32 near);
+LOCO_PRIVATE I32 loco_rung_near(const LocoCompressOptions * options, I32 first,
+        I32 rung);
+LOCO_PRIVATE I32 loco_rung_bytes(LocoCompressState * state,
+        const LocoCompressOptions * options, I32 first, I32 seg, I32 rung,
+        I32 seg_bytes[]);
+LOCO_PRIVATE I32 loco_allocate_budget(LocoCompressState * state,
+        const LocoCompressOptions * options, I32 budget,
+        I32 seg_near[LOCO_MAX_SEGS], I32 seg_keep[LOCO_MAX_SEGS]);
+LOCO_PRIVATE void loco_start_segment(LocoCompressState * state, I32 seg);
+LOCO_PRIVATE void loco_init_contexts(LocoCompressState * state, I32 seg);
+LOCO_PRIVATE const LocoContextModel * loco_segment_prior(
+        const LocoCompressState * state, I32 seg);
+LOCO_PRIVATE I32 loco_shared_k(I32 count, I32 mag_sum);
+LOCO_PRIVATE void loco_set_shared_model(LocoCompressState * state,
+        const LocoContextModel * model);
+LOCO_PRIVATE void loco_compress_rows(LocoCompressState * state,
+        I32 seg, I32 y_begin, I32 y_end);
+LOCO_PRIVATE void loco_compress_rows_8bit(LocoCompressState * state,
+        I32 seg, I32 y_begin, I32 y_end);
+LOCO_PRIVATE void loco_compress_rows_12bit(LocoCompressState * state,
+        I32 seg, I32 y_begin, I32 y_end);
+LOCO_PRIVATE void loco_compress_rows_near(LocoCompressState * state,
+        I32 seg, I32 y_begin, I32 y_end);
+LOCO_PRIVATE void loco_plan_row(const LocoCompressState * state,
+        I32 seg, I32 y, LocoRowPlan * plan);
+LOCO_PRIVATE void loco_code_planned_row(LocoCompressState * state,
+        I32 seg, I32 y, const LocoRowPlan * plan);
+LOCO_PRIVATE void loco_code_residual(LocoCompressState * state,
+        I32 context, I32 residual);
+LOCO_PRIVATE void loco_write_residual(LocoCompressState * state,
+        I32 mapped_residual, I32 n, I32 msum);
+LOCO_PRIVATE I32 loco_g_to_ctxt(const LocoCompressState * state, I32 g);
+LOCO_PRIVATE I32 loco_gfour_to_ctxt(const LocoCompressState * state, I32 g);
 LOCO_PRIVATE void loco_write_integer(LocoCompressState * state, I32 val, I32 bits);
+LOCO_PRIVATE void loco_write_header(LocoCompressState * state, I32 seg, I32 flags);
+LOCO_PRIVATE I32 loco_layout_header_bits(I32 layout, I32 n_segs);
+LOCO_PRIVATE void loco_balance_bands(LocoCompressState * state);
+LOCO_PRIVATE I32 loco_row_cost(const LocoCompressState * state, I32 y);
+LOCO_PRIVATE I32 loco_raw_segment_bits(LocoCompressState * state, I32 seg);
+LOCO_PRIVATE void loco_store_raw_segment(LocoCompressState * state, I32 seg,
+        LocoBitstreamType *p_seg_start);
+LOCO_PRIVATE void loco_stats_begin_segment(LocoCompressState * state,
+        LocoCompressStats * seg_stats, I32 seg);
+LOCO_PRIVATE void loco_stats_record_pixel(LocoCompressState * state,
+        I32 mapped_residual, I32 k, I32 unary);
+LOCO_PRIVATE void loco_stats_end_segment(LocoCompressState * state,
+        I32 n_stored_bits, I32 initcc);
+LOCO_PRIVATE I32 loco_scaled_quotient(U32 num_hi, U32 num_lo, U32 den);
+LOCO_PRIVATE I32 loco_mul_div(U32 a, U32 b, U32 den);
 
 // functions
 
@@ -484,30 +149,34 @@ LOCO_PRIVATE void loco_clear_result(LocoCompressedImage *result)
     LOCO_ASSERT(result != NULL);
     // Clear result
     result->compressed_size_bytes = 0;
-    result->segments.n_segs = 0;
-    for (I32 seg = 0; seg<LOCO_MAX_SEGS; seg++) {
-        result->segments.seg_ptr[seg] = NULL;
-        result->segments.n_bits[seg] = 0;
-    }
-    result->segments.seg_ptr[LOCO_MAX_SEGS] = NULL;
+    loco_clear_segments(&result->segments);
 }
 
-I32 loco_compress(
-    LocoCompressState *state,
-    const LocoImage   *image,
-    LocoCompressedImage *result)
+// Copy image parameters to the state, check the image, and set up the
+// row pointers and segment rectangles
+LOCO_PRIVATE I32 loco_prepare_image(LocoCompressState *state,
+        const LocoImage *image)
 {
     LOCO_ASSERT(state != NULL);
     LOCO_ASSERT(image != NULL);
-    LOCO_ASSERT(image->data != NULL);
-    LOCO_ASSERT(result != NULL);
-    LOCO_ASSERT(result->data != NULL);
-    loco_clear_result(result);
 
     /* Copy some parameters to equivalent globals */
     state->image_width = image->width;
     state->image_height = image->height;
     state->n_segs = image->n_segs;
+    state->bit_depth = image->bit_depth;
+    state->header_flags = 0;
+    state->unary_limit = UNARY_UNLIMITED;
+    state->near = 0;
+    state->layout = LOCO_LAYOUT_GRID;
+    state->packets = NULL;
+    state->packet_payload = NULL;
+    state->slice_result = NULL;
+    state->ref_data = NULL;
+    state->ref_space_width = 0;
+    state->priors = NULL;
+    state->models_out = NULL;
+    state->shared_bits = 0;
 
     U32 endian = 1;
     state->is_little_endian = *((U8*)(&endian));
@@ -533,112 +202,1647 @@ I32 loco_compress(
     loco_setup_segs(state->image_width, state->image_height, state->n_segs,
             state->seg_bound);
 
-    /* Setup output bitstream pointers */
-    state->p_out = result->data;
-    I32 result_buf_size_local = result->size_data_bytes;
-    if (result_buf_size_local < 0) {
-        result_buf_size_local = 0;
+    return status;
+}
+
+// Clear compressed segments
+LOCO_PRIVATE void loco_clear_segments(LocoCompressedSegments *segments)
+{
+    LOCO_ASSERT(segments != NULL);
+    segments->n_segs = 0;
+    for (I32 seg = 0; seg<LOCO_MAX_SEGS; seg++) {
+        segments->seg_ptr[seg] = NULL;
+        segments->n_bits[seg] = 0;
+    }
+    segments->seg_ptr[LOCO_MAX_SEGS] = NULL;
+}
+
+/* Prepare the image, check and apply the options, and choose the
+   near-lossless bound of each segment, and which segments to store. With
+   rate control, all segments must fit in budget bytes. */
+LOCO_PRIVATE I32 loco_begin_compress(LocoCompressState *state,
+        const LocoImage *image, const LocoCompressOptions *options, I32 budget,
+        I32 seg_near[LOCO_MAX_SEGS], I32 seg_keep[LOCO_MAX_SEGS])
+{
+    LOCO_ASSERT(state != NULL);
+    LOCO_ASSERT(options != NULL);
+
+    state->size_only = (options->size_only != 0);
+    state->raw_fallback = (options->raw_fallback != 0);
+
+    I32 status = loco_prepare_image(state, image);
+    if (status & LOCO_ABORT_COMPRESSION_FLAG) {
+        return status;
+    }
+
+    if (options->near < 0 || options->near > LOCO_MAX_NEAR) {
+        status |= LOCO_BAD_OPTIONS_FLAG | LOCO_ABORT_COMPRESSION_FLAG;
+        LOCO_WARN2(LOCO_COMPRESS_ABORT,
+                "In loco_compress(), near (%d) was not in the range [0, %d].",
+                options->near, LOCO_MAX_NEAR);
+        return status;
+    }
+    if (options->target_bytes < 0) {
+        status |= LOCO_BAD_OPTIONS_FLAG | LOCO_ABORT_COMPRESSION_FLAG;
+        LOCO_WARN2(LOCO_COMPRESS_ABORT,
+                "In loco_compress(), target_bytes (%d) was less than %d.",
+                options->target_bytes, 0);
+        return status;
+    }
+    if (options->limit_golomb) {
+        state->header_flags |= HEADER_FLAG_LIMIT;
+        state->unary_limit = (state->bit_depth <= BITDEPTH_8BIT) ?
+                LIMIT_UNARY_8BIT : LIMIT_UNARY_12BIT;
+    }
+    if (options->layout != LOCO_LAYOUT_GRID) {
+        I32 n_across = (options->layout == LOCO_LAYOUT_STRIPS) ?
+                state->image_width : state->image_height;
+        if (options->layout < LOCO_LAYOUT_GRID || options->layout > LOCO_LAYOUT_BALANCED
+                || n_across < state->n_segs) {
+            status |= LOCO_BAD_OPTIONS_FLAG | LOCO_ABORT_COMPRESSION_FLAG;
+            LOCO_WARN4(LOCO_COMPRESS_ABORT,
+                    "In loco_compress(), layout %d cannot divide a %d x %d image "
+                    "into %d segments.", options->layout, state->image_width,
+                    state->image_height, state->n_segs);
+            return status;
+        }
+        if (options->layout == LOCO_LAYOUT_BALANCED) {
+            loco_balance_bands(state);
+        }
+        I32 laid_out = loco_setup_layout(state->image_width, state->image_height,
+                state->n_segs, options->layout, state->band_end, state->seg_bound);
+        LOCO_ASSERT_1(laid_out, options->layout);
+        state->layout = options->layout;
+        state->header_flags |= HEADER_FLAG_LAYOUT;
+    }
+    if (options->reference != NULL) {
+        const LocoImage *reference = options->reference;
+        LOCO_ASSERT(reference->data != NULL);
+        if (reference->width != state->image_width
+                || reference->height != state->image_height
+                || (reference->bit_depth <= BITDEPTH_8BIT)
+                    != (state->bit_depth <= BITDEPTH_8BIT)
+                || reference->space_width < reference->width
+                || reference->size_data_bytes < reference->height
+                    * reference->space_width * (I32)sizeof(LocoPixelType)) {
+            status |= LOCO_BAD_OPTIONS_FLAG | LOCO_ABORT_COMPRESSION_FLAG;
+            LOCO_WARN6(LOCO_COMPRESS_ABORT,
+                    "In loco_compress(), the %d x %d x %d bit reference "
+                    "(space_width %d) did not match the %d x %d image.",
+                    reference->width, reference->height, reference->bit_depth,
+                    reference->space_width, state->image_width,
+                    state->image_height);
+            return status;
+        }
+        state->ref_data = reference->data;
+        state->ref_space_width = reference->space_width;
+        state->header_flags |= HEADER_FLAG_TEMPORAL;
+    }
+    if (options->priors != NULL) {
+        for (I32 seg=0; seg<state->n_segs; seg++) {
+            if (!loco_check_context_model(&options->priors[seg], state->bit_depth)) {
+                status |= LOCO_BAD_OPTIONS_FLAG | LOCO_ABORT_COMPRESSION_FLAG;
+                LOCO_WARN2(LOCO_COMPRESS_ABORT,
+                        "In loco_compress(), the prior for segment %d was not "
+                        "a valid context model for bit depth %d.",
+                        seg, state->bit_depth);
+                return status;
+            }
+        }
+        state->priors = options->priors;
+        state->header_flags |= HEADER_FLAG_PRIOR;
+    }
+    if (options->shared_model != NULL) {
+        /* Segment 0 carries the model, so must not be dropped */
+        if (options->priors != NULL || options->target_bytes > 0
+                || !loco_check_context_model(options->shared_model,
+                    state->bit_depth)) {
+            status |= LOCO_BAD_OPTIONS_FLAG | LOCO_ABORT_COMPRESSION_FLAG;
+            LOCO_WARN2(LOCO_COMPRESS_ABORT,
+                    "In loco_compress(), the shared model was not valid for bit "
+                    "depth %d, or priors or a target size (%d) were also given.",
+                    state->bit_depth, options->target_bytes);
+            return status;
+        }
+        loco_set_shared_model(state, options->shared_model);
+        state->header_flags |= HEADER_FLAG_SHARED;
     }
-    LOCO_COMPILE_ASSERT(sizeof(LocoBitstreamType) != 0, loco_bitstream_zero);
-    state->p_stop = result->data + result_buf_size_local/sizeof(LocoBitstreamType);
-    result->segments.seg_ptr[0] = (U8*)result->data;
+    state->models_out = options->models_out;
 
-    // Compress the segments
     for (I32 seg=0; seg<state->n_segs; seg++) {
-        /* Reset bitstream output word */
+        seg_near[seg] = options->near;
+        seg_keep[seg] = 1;
+    }
+    if (options->target_bytes > 0) {
+        status |= loco_allocate_budget(state, options, budget, seg_near, seg_keep);
+    }
+    return status;
+}
+
+/* Code a segment into the output, from state->p_out up to state->p_stop,
+   unless it was dropped, and return its size in bits, padded to a whole word */
+LOCO_PRIVATE I32 loco_output_segment(LocoCompressState *state, I32 seg,
+        I32 near, I32 keep, LocoCompressStats *seg_stats)
+{
+    LOCO_ASSERT(state != NULL);
+
+    loco_begin_output_segment(state, seg, near, keep, seg_stats);
+    loco_code_segment_rows(state, seg, LOCO_MAX_IMAGE_HEIGHT);
+    return loco_end_output_segment(state);
+}
+
+/* Start a segment of the output: gather statistics if wanted, and start
+   coding unless the segment was dropped */
+LOCO_PRIVATE void loco_begin_output_segment(LocoCompressState *state, I32 seg,
+        I32 near, I32 keep, LocoCompressStats *seg_stats)
+{
+    LOCO_ASSERT(state != NULL);
+
+    loco_stats_begin_segment(state, seg_stats, seg);
+
+    state->seg = seg;
+    state->seg_uncoded = !keep;
+    loco_set_near(state, near);
+    if (state->seg_stats != NULL) {
+        state->seg_stats->near = near;
+        state->seg_stats->dropped = !keep;
+    }
+    if (keep) {
+        loco_begin_segment(state, seg);
+    } else {
+        state->p_seg_start = state->p_out;
         state->bit_count = 8*sizeof(LocoBitstreamType)-1;
-        state->out_word = 0;
+        state->seg_bits = 0;
+        state->seg_y = state->seg_bound[seg].yend;
+    }
+}
 
-        /* Compress the segment */
-        LOCO_ASSERT_1(image->bit_depth > 0 && image->bit_depth <= BITDEPTH_12BIT,
-                image->bit_depth);
-        if (image->bit_depth <= BITDEPTH_8BIT) {
-            loco_compress_segment_8bit(state, seg, state->seg_bound[seg].xstart,
-                    state->seg_bound[seg].xend, state->seg_bound[seg].ystart,
-                    state->seg_bound[seg].yend);
-        } else {
-            loco_compress_segment_12bit(state, seg, state->seg_bound[seg].xstart,
-                    state->seg_bound[seg].xend, state->seg_bound[seg].ystart,
-                    state->seg_bound[seg].yend);
-        }
+/* Finish a segment of the output, once all its rows are coded, and return
+   its size in bits, padded to a whole word */
+LOCO_PRIVATE I32 loco_end_output_segment(LocoCompressState *state)
+{
+    LOCO_ASSERT(state != NULL);
 
-        /* Store last word (if necessary) and record position of end of segment */
+    I32 n_bits;
+    if (state->size_only) {
+        /* Record the size the segment would have, padded to a whole word */
+        I32 word_bits = (I32)(8*sizeof(LocoBitstreamType));
+        n_bits = ((state->seg_bits + word_bits - 1) / word_bits) * word_bits;
+    } else {
+        /* Store last word (if necessary) */
         if (state->bit_count < (I32)(8*sizeof(LocoBitstreamType)-1)
-                && state->p_out < state->p_stop) {
+                && (state->p_out < state->p_stop || loco_next_packet(state))) {
             *state->p_out++ = FIX_WORD(state->out_word, state->is_little_endian);
         }
+        if (state->packets != NULL) {
+            n_bits = state->packet_seg_words;
+            if (state->packet_payload != NULL) {
+                n_bits += (I32)(state->p_out - state->packet_payload);
+            }
+            n_bits *= 8 * (I32)sizeof(LocoBitstreamType);
+        } else {
+            n_bits = 8 * (I32)sizeof(LocoBitstreamType)
+                    * (I32)(state->p_out - state->p_seg_start);
+        }
+    }
+
+    loco_stats_end_segment(state, n_bits,
+            (state->bit_depth <= BITDEPTH_8BIT) ? INITCC_8BIT : INITCC_12BIT);
+
+    if (state->models_out != NULL) {
+        /* A segment not coded leaves the statistics where they start, as
+           the decompressor has them */
+        if (state->seg_uncoded) {
+            loco_init_contexts(state, state->seg);
+        }
+        LocoContextModel *model = &state->models_out[state->seg];
+        model->bit_depth = (state->bit_depth <= BITDEPTH_8BIT) ?
+                BITDEPTH_8BIT : BITDEPTH_12BIT;
+        for (I32 i=0; i<LOCO_NCONTEXTS; i++) {
+            model->c_count[i] = state->c_count[i];
+            model->c_mag_sum[i] = state->c_mag_sum[i];
+            model->c_sum[i] = state->c_sum[i];
+            model->c_bias[i] = state->c_bias[i];
+        }
+    }
+    return n_bits;
+}
+
+/* Set up the output bitstream pointers for contiguous output */
+LOCO_PRIVATE void loco_begin_result(LocoCompressState *state,
+        LocoCompressedImage *result)
+{
+    LOCO_ASSERT(state != NULL);
+    LOCO_ASSERT(result != NULL);
+
+    if (state->size_only) {
+        state->p_out = NULL;
+        state->p_stop = NULL;
+    } else {
+        state->p_out = result->data;
+        I32 result_buf_size_local = result->size_data_bytes;
+        if (result_buf_size_local < 0) {
+            result_buf_size_local = 0;
+        }
+        LOCO_COMPILE_ASSERT(sizeof(LocoBitstreamType) != 0, loco_bitstream_zero);
+        state->p_stop = result->data + result_buf_size_local/sizeof(LocoBitstreamType);
+        result->segments.seg_ptr[0] = (U8*)result->data;
+    }
+}
+
+/* Record the end of a segment of contiguous output, whose size has been
+   stored */
+LOCO_PRIVATE void loco_record_segment(LocoCompressState *state,
+        LocoCompressedImage *result, I32 seg)
+{
+    LOCO_ASSERT(state != NULL);
+    LOCO_ASSERT(result != NULL);
+
+    if (state->size_only) {
+        result->compressed_size_bytes += result->segments.n_bits[seg] / 8;
+    } else {
         result->segments.seg_ptr[seg+1] = (U8*)state->p_out;
-        result->segments.n_bits[seg] =
-                8 * (I32) (result->segments.seg_ptr[seg + 1]
-                           - result->segments.seg_ptr[seg]);
     }
+}
+
+/* Finish contiguous output once all segments are coded, and return the
+   status */
+LOCO_PRIVATE I32 loco_end_compress(LocoCompressState *state,
+        LocoCompressedImage *result, I32 rate_controlled, I32 status)
+{
+    LOCO_ASSERT(state != NULL);
+    LOCO_ASSERT(result != NULL);
+
     result->segments.n_segs = state->n_segs;
+    if (state->size_only) {
+        // size was summed over the segments, and nothing was written
+        return status;
+    }
     result->compressed_size_bytes = (I32) (result->segments.seg_ptr[result->segments.n_segs]
                - result->segments.seg_ptr[0]);
 
-    /* Check if the output buffer filled up, and return */
-    if (state->p_out == state->p_stop) {
+    /* Check if the output buffer filled up, and return.  With rate control,
+       the segment sizes were known to fit, so the buffer may be exactly full. */
+    if (state->p_out == state->p_stop && !rate_controlled) {
         status |= LOCO_BUFFER_FILLED_FLAG;
     }
     return status;
 }
 
-// Check if an image is valid for compression
-I32 loco_check_image(const LocoImage *image)
+/* Code a segment into its own buffer, and record it in segments */
+LOCO_PRIVATE I32 loco_output_segment_to(LocoCompressState *state, I32 seg,
+        const LocoSegmentBuffer *seg_out, I32 near, I32 keep,
+        LocoCompressedSegments *segments, LocoCompressStats *seg_stats)
 {
-    I32 status = 0;
+    LOCO_ASSERT(state != NULL);
+    LOCO_ASSERT(seg_out != NULL);
+    LOCO_ASSERT(segments != NULL);
+
+    if (state->size_only) {
+        state->p_out = NULL;
+        state->p_stop = NULL;
+    } else {
+        LOCO_ASSERT(seg_out->data != NULL);
+        I32 buf_size_local = seg_out->size_data_bytes;
+        if (buf_size_local < 0) {
+            buf_size_local = 0;
+        }
+        state->p_out = seg_out->data;
+        state->p_stop = seg_out->data + buf_size_local/sizeof(LocoBitstreamType);
+    }
+
+    segments->seg_ptr[seg] = (U8*)seg_out->data;
+    segments->n_bits[seg] = loco_output_segment(state, seg, near, keep, seg_stats);
+
+    if (!state->size_only && state->p_out == state->p_stop) {
+        return LOCO_BUFFER_FILLED_FLAG;
+    }
+    return 0;
+}
+
+I32 loco_compress(
+    LocoCompressState *state,
+    const LocoImage   *image,
+    LocoCompressedImage *result)
+{
+    return loco_compress_ext(state, image, NULL, result, NULL);
+}
+
+I32 loco_compress_with_stats(
+    LocoCompressState *state,
+    const LocoImage   *image,
+    LocoCompressedImage *result,
+    LocoCompressStats stats[LOCO_MAX_SEGS])
+{
+    return loco_compress_ext(state, image, NULL, result, stats);
+}
+
+void loco_init_compress_options(LocoCompressOptions *options)
+{
+    LOCO_ASSERT(options != NULL);
+    options->size_only = 0;
+    options->raw_fallback = 0;
+    options->limit_golomb = 0;
+    options->near = 0;
+    options->target_bytes = 0;
+    options->seg_priority = NULL;
+    options->layout = LOCO_LAYOUT_GRID;
+    options->reference = NULL;
+    options->priors = NULL;
+    options->models_out = NULL;
+    options->shared_model = NULL;
+}
 
+I32 loco_compress_ext(
+    LocoCompressState *state,
+    const LocoImage   *image,
+    const LocoCompressOptions *options,
+    LocoCompressedImage *result,
+    LocoCompressStats stats[LOCO_MAX_SEGS])
+{
+    LOCO_ASSERT(state != NULL);
     LOCO_ASSERT(image != NULL);
+    LOCO_ASSERT(image->data != NULL);
+    LOCO_ASSERT(result != NULL);
 
-    /* Check that image dimensions are not too large */
-    if (image->width > LOCO_MAX_IMAGE_WIDTH) {
-        status |= LOCO_BIG_WIDTH_FLAG | LOCO_ABORT_COMPRESSION_FLAG;
+    LocoCompressOptions default_options;
+    if (options == NULL) {
+        loco_init_compress_options(&default_options);
+        options = &default_options;
     }
-    if (image->height > LOCO_MAX_IMAGE_HEIGHT) {
-        status |= LOCO_BIG_HEIGHT_FLAG | LOCO_ABORT_COMPRESSION_FLAG;
+    if (!options->size_only) {
+        LOCO_ASSERT(result->data != NULL);
+    }
+    loco_clear_result(result);
+
+    /* With rate control, the result buffer also limits the size */
+    I32 budget = options->target_bytes;
+    if (!options->size_only && result->size_data_bytes < budget) {
+        budget = result->size_data_bytes;
+    }
+    I32 seg_near[LOCO_MAX_SEGS];
+    I32 seg_keep[LOCO_MAX_SEGS];
+    I32 status = loco_begin_compress(state, image, options, budget,
+            seg_near, seg_keep);
+    if (status & LOCO_ABORT_COMPRESSION_FLAG) {
+        return status;
+    }
+
+    loco_begin_result(state, result);
+
+    // Compress the segments, one after the other in the buffer
+    for (I32 seg=0; seg<state->n_segs; seg++) {
+        result->segments.n_bits[seg] = loco_output_segment(state, seg,
+                seg_near[seg], seg_keep[seg], (stats != NULL) ? &stats[seg] : NULL);
+        loco_record_segment(state, result, seg);
+    }
+
+    return loco_end_compress(state, result, options->target_bytes > 0, status);
+}
+
+I32 loco_compress_start(
+    LocoCompressState *state,
+    const LocoImage   *image,
+    const LocoCompressOptions *options,
+    LocoCompressedImage *result,
+    LocoCompressStats stats[LOCO_MAX_SEGS])
+{
+    LOCO_ASSERT(state != NULL);
+    LOCO_ASSERT(image != NULL);
+    LOCO_ASSERT(image->data != NULL);
+    LOCO_ASSERT(result != NULL);
+
+    LocoCompressOptions default_options;
+    if (options == NULL) {
+        loco_init_compress_options(&default_options);
+        options = &default_options;
+    }
+    if (!options->size_only) {
+        LOCO_ASSERT(result->data != NULL);
+    }
+    loco_clear_result(result);
+
+    /* Rate control sizes every segment before coding any, which cannot
+       be sliced */
+    if (options->target_bytes != 0) {
+        LOCO_WARN2(LOCO_COMPRESS_ABORT,
+                "In loco_compress_start(), target_bytes (%d) was not %d.",
+                options->target_bytes, 0);
+        return LOCO_BAD_OPTIONS_FLAG | LOCO_ABORT_COMPRESSION_FLAG;
+    }
+
+    I32 seg_near[LOCO_MAX_SEGS];
+    I32 seg_keep[LOCO_MAX_SEGS];
+    I32 status = loco_begin_compress(state, image, options, 0,
+            seg_near, seg_keep);
+    if (status & LOCO_ABORT_COMPRESSION_FLAG) {
+        return status;
+    }
+
+    loco_begin_result(state, result);
+    state->slice_result = result;
+    state->slice_stats = stats;
+    state->slice_near = options->near;
+    state->slice_seg = 0;
+    state->slice_in_seg = 0;
+    state->slice_status = status;
+
+    return status | LOCO_IN_PROGRESS_FLAG;
+}
+
+I32 loco_compress_continue(
+    LocoCompressState *state,
+    I32 pixel_budget)
+{
+    LOCO_ASSERT(state != NULL);
+    LOCO_ASSERT(state->slice_result != NULL);
+    LOCO_ASSERT_1(pixel_budget > 0, pixel_budget);
+
+    LocoCompressedImage *result = state->slice_result;
+    while (state->slice_seg < state->n_segs && pixel_budget > 0) {
+        I32 seg = state->slice_seg;
+        if (!state->slice_in_seg) {
+            loco_begin_output_segment(state, seg, state->slice_near, 1,
+                    (state->slice_stats != NULL) ? &state->slice_stats[seg] : NULL);
+            state->slice_in_seg = 1;
+        }
+
+        /* Whole rows, at least one */
+        I32 seg_width = state->seg_bound[seg].xend - state->seg_bound[seg].xstart;
+        I32 n_rows = (pixel_budget > seg_width) ? pixel_budget / seg_width : 1;
+        loco_code_segment_rows(state, seg, n_rows);
+        pixel_budget -= n_rows * seg_width;
+
+        if (state->seg_y == state->seg_bound[seg].yend) {
+            result->segments.n_bits[seg] = loco_end_output_segment(state);
+            loco_record_segment(state, result, seg);
+            state->slice_in_seg = 0;
+            state->slice_seg++;
+        }
+    }
+
+    if (state->slice_seg < state->n_segs) {
+        return state->slice_status | LOCO_IN_PROGRESS_FLAG;
+    }
+    state->slice_result = NULL;
+    return loco_end_compress(state, result, 0, state->slice_status);
+}
+
+I32 loco_compress_batch(
+    LocoCompressState *state,
+    const LocoImage images[],
+    I32 n_images,
+    const LocoCompressOptions *options,
+    LocoCompressedImage *result,
+    LocoBatchEntry index[])
+{
+    LOCO_ASSERT(state != NULL);
+    LOCO_ASSERT(images != NULL);
+    LOCO_ASSERT(result != NULL);
+    LOCO_ASSERT(index != NULL);
+    LOCO_ASSERT_1(n_images >= 0, n_images);
+
+    LocoCompressOptions default_options;
+    if (options == NULL) {
+        loco_init_compress_options(&default_options);
+        options = &default_options;
+    }
+    if (!options->size_only) {
+        LOCO_ASSERT(result->data != NULL);
+    }
+    loco_clear_result(result);
+
+    /* Rate control is for one image, not a batch */
+    if (options->target_bytes != 0) {
+        LOCO_WARN2(LOCO_COMPRESS_ABORT,
+                "In loco_compress_batch(), target_bytes (%d) was not %d.",
+                options->target_bytes, 0);
+        return LOCO_BAD_OPTIONS_FLAG | LOCO_ABORT_COMPRESSION_FLAG;
+    }
+
+    /* Output pointers carry on from one image to the next */
+    LocoBitstreamType *p_out = NULL;
+    LocoBitstreamType *p_stop = NULL;
+    if (!options->size_only) {
+        I32 result_buf_size_local = result->size_data_bytes;
+        if (result_buf_size_local < 0) {
+            result_buf_size_local = 0;
+        }
+        p_out = result->data;
+        p_stop = result->data + result_buf_size_local/sizeof(LocoBitstreamType);
+    }
+
+    I32 batch_status = 0;
+    I32 seg_near[LOCO_MAX_SEGS];
+    I32 seg_keep[LOCO_MAX_SEGS];
+    for (I32 i=0; i<n_images; i++) {
+        LocoBatchEntry *entry = &index[i];
+        entry->offset_bytes = result->compressed_size_bytes;
+        entry->size_bytes = 0;
+        entry->n_segs = 0;
+        LOCO_ASSERT(images[i].data != NULL);
+        I32 status = loco_begin_compress(state, &images[i], options, 0,
+                seg_near, seg_keep);
+
+        if (status & LOCO_ABORT_COMPRESSION_FLAG) {
+            /* Nothing is stored for an image that cannot be compressed */
+        } else if (!state->size_only && p_stop - p_out < state->n_segs) {
+            /* No room for the table */
+            p_out = p_stop;
+            status |= LOCO_BUFFER_FILLED_FLAG;
+        } else {
+            /* The table of segment sizes, then the segments */
+            LocoBitstreamType *table = p_out;
+            state->p_out = state->size_only ? NULL : p_out + state->n_segs;
+            state->p_stop = p_stop;
+            entry->n_segs = state->n_segs;
+            entry->size_bytes = state->n_segs * (I32)sizeof(LocoBitstreamType);
+            for (I32 seg=0; seg<state->n_segs; seg++) {
+                I32 n_bits = loco_output_segment(state, seg,
+                        seg_near[seg], seg_keep[seg], NULL);
+                if (!state->size_only) {
+                    table[seg] = FIX_WORD(n_bits, state->is_little_endian);
+                }
+                entry->size_bytes += n_bits / 8;
+            }
+            if (!state->size_only) {
+                p_out = state->p_out;
+                if (p_out == p_stop) {
+                    status |= LOCO_BUFFER_FILLED_FLAG;
+                }
+            }
+        }
+
+        result->compressed_size_bytes += entry->size_bytes;
+        entry->status = status;
+        batch_status |= status;
+    }
+    return batch_status;
+}
+
+I32 loco_pipeline_start(
+    LocoPipeline *pipe,
+    LocoCompressState *state,
+    const LocoImage   *image,
+    const LocoCompressOptions *options,
+    LocoCompressedImage *result,
+    LocoCompressStats stats[LOCO_MAX_SEGS],
+    const LocoPoolHooks *hooks)
+{
+    LOCO_ASSERT(pipe != NULL);
+    LOCO_ASSERT(state != NULL);
+    LOCO_ASSERT(image != NULL);
+    LOCO_ASSERT(image->data != NULL);
+    LOCO_ASSERT(result != NULL);
+    LOCO_ASSERT(hooks != NULL);
+    LOCO_ASSERT(hooks->lock != NULL);
+    LOCO_ASSERT(hooks->unlock != NULL);
+    LOCO_ASSERT(hooks->wait != NULL);
+    LOCO_ASSERT(hooks->wake_all != NULL);
+
+    LocoCompressOptions default_options;
+    if (options == NULL) {
+        loco_init_compress_options(&default_options);
+        options = &default_options;
+    }
+    if (!options->size_only) {
+        LOCO_ASSERT(result->data != NULL);
+    }
+    loco_clear_result(result);
+
+    pipe->state = state;
+    pipe->result = result;
+    pipe->stats = stats;
+    pipe->hooks = *hooks;
+    pipe->n_planned = 0;
+    pipe->n_coded = 0;
+
+    /* Rows are planned from the original pixels, which the near-lossless
+       coder (also used with a reference) does not predict from; and rate
+       control codes each segment several times */
+    if (options->near != 0 || options->reference != NULL
+            || options->target_bytes != 0) {
+        LOCO_WARN2(LOCO_COMPRESS_ABORT,
+                "In loco_pipeline_start(), near (%d) or target_bytes (%d) was "
+                "not 0, or there was a reference.",
+                options->near, options->target_bytes);
+        pipe->status = LOCO_BAD_OPTIONS_FLAG | LOCO_ABORT_COMPRESSION_FLAG;
+        return pipe->status;
+    }
+
+    I32 seg_near[LOCO_MAX_SEGS];
+    I32 seg_keep[LOCO_MAX_SEGS];
+    pipe->status = loco_begin_compress(state, image, options, 0,
+            seg_near, seg_keep);
+    if (pipe->status & LOCO_ABORT_COMPRESSION_FLAG) {
+        return pipe->status;
+    }
+    loco_begin_result(state, result);
+    return pipe->status;
+}
+
+void loco_pipeline_run_planner(
+    LocoPipeline *pipe)
+{
+    LOCO_ASSERT(pipe != NULL);
+
+    if (pipe->status & LOCO_ABORT_COMPRESSION_FLAG) {
+        return;
+    }
+
+    const LocoCompressState *state = pipe->state;
+    I32 row = 0;
+    I32 n_free = 0;     // plans the coder has freed, as last seen
+    for (I32 seg=0; seg<state->n_segs; seg++) {
+        for (I32 y=state->seg_bound[seg].ystart; y<state->seg_bound[seg].yend; y++) {
+            /* Hand the rows planned so far to the coder a batch at a time,
+               and wait for it to free a plan when there are none */
+            if (n_free == 0 || row % LOCO_PIPELINE_BATCH == 0) {
+                pipe->hooks.lock(pipe->hooks.context);
+                pipe->n_planned = row;
+                pipe->hooks.wake_all(pipe->hooks.context);
+                while (row - pipe->n_coded >= LOCO_PIPELINE_ROWS) {
+                    pipe->hooks.wait(pipe->hooks.context);
+                }
+                n_free = LOCO_PIPELINE_ROWS - (row - pipe->n_coded);
+                pipe->hooks.unlock(pipe->hooks.context);
+            }
+
+            loco_plan_row(state, seg, y, &pipe->plans[row % LOCO_PIPELINE_ROWS]);
+            row++;
+            n_free--;
+        }
+    }
+
+    pipe->hooks.lock(pipe->hooks.context);
+    pipe->n_planned = row;
+    pipe->hooks.wake_all(pipe->hooks.context);
+    pipe->hooks.unlock(pipe->hooks.context);
+}
+
+I32 loco_pipeline_run_coder(
+    LocoPipeline *pipe)
+{
+    LOCO_ASSERT(pipe != NULL);
+
+    if (pipe->status & LOCO_ABORT_COMPRESSION_FLAG) {
+        return pipe->status;
+    }
+
+    LocoCompressState *state = pipe->state;
+    LocoCompressedImage *result = pipe->result;
+    I32 row = 0;
+    I32 n_ready = 0;    // rows planned and not yet coded, as last seen
+    for (I32 seg=0; seg<state->n_segs; seg++) {
+        I32 yend = state->seg_bound[seg].yend;
+        loco_begin_output_segment(state, seg, 0, 1,
+                (pipe->stats != NULL) ? &pipe->stats[seg] : NULL);
+        I32 raw_bits = state->raw_fallback ?
+                loco_raw_segment_bits(state, seg) : 0x7fffffff;
+
+        for (I32 y=state->seg_bound[seg].ystart; y<yend; y++) {
+            /* Free the plans coded so far a batch at a time, and wait for
+               the planner when no plan is ready */
+            if (n_ready == 0 || row % LOCO_PIPELINE_BATCH == 0) {
+                pipe->hooks.lock(pipe->hooks.context);
+                pipe->n_coded = row;
+                pipe->hooks.wake_all(pipe->hooks.context);
+                while (pipe->n_planned <= row) {
+                    pipe->hooks.wait(pipe->hooks.context);
+                }
+                n_ready = pipe->n_planned - row;
+                pipe->hooks.unlock(pipe->hooks.context);
+            }
+
+            /* As loco_code_segment_rows(): with raw fallback, stop coding
+               once the segment cannot be smaller than raw, and store it raw.
+               Later rows of the segment are planned, but not used. */
+            if (state->seg_y == y && state->seg_bits <= raw_bits) {
+                loco_code_planned_row(state, seg, y,
+                        &pipe->plans[row % LOCO_PIPELINE_ROWS]);
+                state->seg_y++;
+            }
+            if (state->seg_bits > raw_bits && !state->seg_uncoded) {
+                loco_store_raw_segment(state, seg, state->p_seg_start);
+                state->seg_y = yend;
+            }
+            row++;
+            n_ready--;
+        }
+
+        result->segments.n_bits[seg] = loco_end_output_segment(state);
+        loco_record_segment(state, result, seg);
+    }
+
+    return loco_end_compress(state, result, 0, pipe->status);
+}
+
+I32 loco_compress_scatter(
+    LocoCompressState *state,
+    const LocoImage   *image,
+    const LocoCompressOptions *options,
+    const LocoSegmentBuffer seg_out[LOCO_MAX_SEGS],
+    LocoCompressedSegments *segments,
+    LocoCompressStats stats[LOCO_MAX_SEGS])
+{
+    LOCO_ASSERT(state != NULL);
+    LOCO_ASSERT(image != NULL);
+    LOCO_ASSERT(image->data != NULL);
+    LOCO_ASSERT(seg_out != NULL);
+    LOCO_ASSERT(segments != NULL);
+
+    LocoCompressOptions default_options;
+    if (options == NULL) {
+        loco_init_compress_options(&default_options);
+        options = &default_options;
+    }
+    loco_clear_segments(segments);
+
+    I32 seg_near[LOCO_MAX_SEGS];
+    I32 seg_keep[LOCO_MAX_SEGS];
+    I32 status = loco_begin_compress(state, image, options,
+            options->target_bytes, seg_near, seg_keep);
+    if (status & LOCO_ABORT_COMPRESSION_FLAG) {
+        return status;
+    }
+
+    // Compress each segment into its own buffer
+    for (I32 seg=0; seg<state->n_segs; seg++) {
+        status |= loco_output_segment_to(state, seg, &seg_out[seg],
+                seg_near[seg], seg_keep[seg], segments,
+                (stats != NULL) ? &stats[seg] : NULL);
+    }
+    segments->n_segs = state->n_segs;
+
+    return status;
+}
+
+I32 loco_compress_segment(
+    LocoCompressState *state,
+    const LocoImage   *image,
+    const LocoCompressOptions *options,
+    I32 seg,
+    const LocoSegmentBuffer *seg_out,
+    LocoCompressedSegments *segments,
+    LocoCompressStats *stats)
+{
+    LOCO_ASSERT(state != NULL);
+    LOCO_ASSERT(image != NULL);
+    LOCO_ASSERT(image->data != NULL);
+    LOCO_ASSERT(seg_out != NULL);
+    LOCO_ASSERT(segments != NULL);
+
+    LocoCompressOptions default_options;
+    if (options == NULL) {
+        loco_init_compress_options(&default_options);
+        options = &default_options;
+    }
+
+    /* Rate control needs every segment, so is not available here */
+    if (options->target_bytes != 0) {
+        LOCO_WARN2(LOCO_COMPRESS_ABORT,
+                "In loco_compress_segment(), target_bytes (%d) was not %d.",
+                options->target_bytes, 0);
+        return LOCO_BAD_OPTIONS_FLAG | LOCO_ABORT_COMPRESSION_FLAG;
+    }
+
+    I32 seg_near[LOCO_MAX_SEGS];
+    I32 seg_keep[LOCO_MAX_SEGS];
+    I32 status = loco_begin_compress(state, image, options, 0,
+            seg_near, seg_keep);
+    if (status & LOCO_ABORT_COMPRESSION_FLAG) {
+        return status;
+    }
+    if (seg < 0 || seg >= state->n_segs) {
+        LOCO_WARN2(LOCO_COMPRESS_ABORT,
+                "In loco_compress_segment(), seg (%d) was not less than n_segs (%d).",
+                seg, state->n_segs);
+        return status | LOCO_BAD_OPTIONS_FLAG | LOCO_ABORT_COMPRESSION_FLAG;
+    }
+
+    return status | loco_output_segment_to(state, seg, seg_out,
+            seg_near[seg], seg_keep[seg], segments, stats);
+}
+
+I32 loco_compress_packets(
+    LocoCompressState *state,
+    const LocoImage   *image,
+    const LocoCompressOptions *options,
+    LocoPacketOutput *packets,
+    LocoCompressStats stats[LOCO_MAX_SEGS])
+{
+    LOCO_ASSERT(state != NULL);
+    LOCO_ASSERT(image != NULL);
+    LOCO_ASSERT(image->data != NULL);
+    LOCO_ASSERT(packets != NULL);
+    LOCO_ASSERT(packets->data != NULL);
+
+    LocoCompressOptions default_options;
+    if (options == NULL) {
+        loco_init_compress_options(&default_options);
+        options = &default_options;
+    }
+    packets->n_packets_out = 0;
+
+    /* Packets are sent as they fill, so a segment cannot be taken back and
+       stored raw; and sizing writes no packets. */
+    if (options->raw_fallback || options->size_only
+            || packets->packet_bytes < LOCO_MIN_PACKET_BYTES
+            || packets->packet_bytes > LOCO_MAX_PACKET_BYTES
+            || packets->packet_bytes % (I32)sizeof(LocoBitstreamType) != 0
+            || packets->n_packets < 1) {
+        LOCO_WARN4(LOCO_COMPRESS_ABORT,
+                "In loco_compress_packets(), packet_bytes (%d) or n_packets (%d) "
+                "was bad, or raw_fallback (%d) or size_only (%d) was set.",
+                packets->packet_bytes, packets->n_packets,
+                options->raw_fallback, options->size_only);
+        return LOCO_BAD_OPTIONS_FLAG | LOCO_ABORT_COMPRESSION_FLAG;
+    }
+
+    I32 seg_near[LOCO_MAX_SEGS];
+    I32 seg_keep[LOCO_MAX_SEGS];
+    I32 status = loco_begin_compress(state, image, options,
+            options->target_bytes, seg_near, seg_keep);
+    if (status & LOCO_ABORT_COMPRESSION_FLAG) {
+        return status;
+    }
+
+    // Compress each segment into packets of its own
+    state->packets = packets;
+    state->packets_exhausted = 0;
+    for (I32 seg=0; seg<state->n_segs; seg++) {
+        state->packet_seg = seg;
+        state->packet_seg_words = 0;
+        (void)loco_open_packet(state);
+        (void)loco_output_segment(state, seg, seg_near[seg], seg_keep[seg],
+                (stats != NULL) ? &stats[seg] : NULL);
+        loco_finish_packet(state, 1);
+    }
+    state->packets = NULL;
+
+    if (state->packets_exhausted) {
+        status |= LOCO_BUFFER_FILLED_FLAG;
+    }
+    return status;
+}
+
+I32 loco_estimate_size(
+    LocoCompressState *state,
+    const LocoImage   *image,
+    I32 sample_period,
+    LocoCompressedImage *result)
+{
+    LOCO_ASSERT(state != NULL);
+    LOCO_ASSERT(image != NULL);
+    LOCO_ASSERT(image->data != NULL);
+    LOCO_ASSERT(result != NULL);
+    LOCO_ASSERT_1(sample_period >= 1, sample_period);
+
+    state->size_only = 1;
+    loco_clear_result(result);
+
+    I32 status = loco_prepare_image(state, image);
+    if (status & LOCO_ABORT_COMPRESSION_FLAG) {
+        return status;
+    }
+
+    state->p_out = NULL;
+    state->p_stop = NULL;
+    for (I32 seg=0; seg<state->n_segs; seg++) {
+        LocoRect *rect = &state->seg_bound[seg];
+        I32 seg_width = rect->xend - rect->xstart;
+        I32 seg_pixels = seg_width * (rect->yend - rect->ystart);
+
+        state->bit_count = 8*sizeof(LocoBitstreamType)-1;
+        state->out_word = 0;
+        state->seg_bits = 0;
+        loco_stats_begin_segment(state, NULL, seg);
+
+        /* Header and the first rows, while the contexts adapt, are exact;
+           sample the rest */
+        I32 y_sampled = rect->ystart + sample_period;
+        if (y_sampled > rect->yend) {
+            y_sampled = rect->yend;
+        }
+        loco_start_segment(state, seg);
+        loco_compress_rows(state, seg, rect->ystart, y_sampled);
+        I32 exact_bits = state->seg_bits;
+        I32 coded_pixels = 0;
+        for (I32 y = y_sampled; y < rect->yend; y += sample_period) {
+            loco_compress_rows(state, seg, y, y + 1);
+            coded_pixels += seg_width;
+        }
+
+        I32 est_bits = exact_bits;
+        if (coded_pixels > 0) {
+            est_bits += loco_mul_div((U32)(state->seg_bits - exact_bits),
+                    (U32)(seg_pixels - seg_width * (y_sampled - rect->ystart)),
+                    (U32)coded_pixels);
+        }
+
+        I32 word_bits = (I32)(8*sizeof(LocoBitstreamType));
+        I32 n_words = (est_bits + word_bits - 1) / word_bits;
+        result->segments.n_bits[seg] = n_words * word_bits;
+        result->compressed_size_bytes += n_words * (I32)sizeof(LocoBitstreamType);
+    }
+    result->segments.n_segs = state->n_segs;
+
+    return status;
+}
+
+I32 loco_learn_shared_model(
+    LocoCompressState *state,
+    const LocoImage   *image,
+    const LocoCompressOptions *options,
+    LocoContextModel *model)
+{
+    LOCO_ASSERT(state != NULL);
+    LOCO_ASSERT(image != NULL);
+    LOCO_ASSERT(image->data != NULL);
+    LOCO_ASSERT(model != NULL);
+
+    /* Learn from the initial statistics, without output */
+    LocoCompressOptions learn_options;
+    if (options == NULL) {
+        loco_init_compress_options(&learn_options);
+    } else {
+        learn_options = *options;
+    }
+    learn_options.size_only = 1;
+    learn_options.target_bytes = 0;
+    learn_options.priors = NULL;
+    learn_options.models_out = NULL;
+    learn_options.shared_model = NULL;
+
+    I32 seg_near[LOCO_MAX_SEGS];
+    I32 seg_keep[LOCO_MAX_SEGS];
+    I32 status = loco_begin_compress(state, image, &learn_options, 0,
+            seg_near, seg_keep);
+    if (status & LOCO_ABORT_COMPRESSION_FLAG) {
+        return status;
+    }
+
+    for (I32 i=0; i<LOCO_NCONTEXTS; i++) {
+        model->c_count[i] = 0;
+        model->c_mag_sum[i] = 0;
+    }
+    state->p_out = NULL;
+    state->p_stop = NULL;
+    for (I32 seg=0; seg<state->n_segs; seg++) {
+        LocoRect *rect = &state->seg_bound[seg];
+
+        state->bit_count = 8*sizeof(LocoBitstreamType)-1;
+        state->out_word = 0;
+        state->seg_bits = 0;
+        loco_stats_begin_segment(state, NULL, seg);
+        loco_set_near(state, seg_near[seg]);
+
+        /* The first rows, while the contexts adapt, then sampled rows, as
+           loco_estimate_size(). The near-lossless coder (also used with a
+           reference) predicts from the rows it reconstructed, so needs
+           every row. */
+        I32 period = (state->near > 0 || state->ref_data != NULL) ?
+                1 : LOCO_ESTIMATE_SAMPLE_PERIOD;
+        I32 y_sampled = rect->ystart + period;
+        if (y_sampled > rect->yend) {
+            y_sampled = rect->yend;
+        }
+        loco_start_segment(state, seg);
+        loco_compress_rows(state, seg, rect->ystart, y_sampled);
+        for (I32 y = y_sampled; y < rect->yend; y += period) {
+            loco_compress_rows(state, seg, y, y + 1);
+        }
+
+        /* Counts and magnitude sums are halved together, so their sums over
+           segments keep each context's Golomb parameter */
+        for (I32 i=0; i<LOCO_NCONTEXTS; i++) {
+            model->c_count[i] += state->c_count[i];
+            model->c_mag_sum[i] += state->c_mag_sum[i];
+        }
+    }
+
+    /* A context no segment used takes the parameter of the one before, which
+       is cheapest to code */
+    I32 is_8bit = (state->bit_depth <= BITDEPTH_8BIT);
+    I32 initcc = is_8bit ? INITCC_8BIT : INITCC_12BIT;
+    I32 initcms = is_8bit ? INITCMS_8BIT : INITCMS_12BIT;
+    I32 k_prev = 0;
+    for (I32 i=0; i<LOCO_NCONTEXTS; i++) {
+        if (model->c_count[i] != state->n_segs * initcc
+                || model->c_mag_sum[i] != state->n_segs * initcms) {
+            k_prev = loco_shared_k(model->c_count[i], model->c_mag_sum[i]);
+        }
+        state->shared_k[i] = (U8)k_prev;
+    }
+    loco_expand_shared_model(state->shared_k, state->bit_depth, model);
+
+    return status;
+}
+
+I32 loco_compressed_size_bound(
+        I32 width,
+        I32 height,
+        I32 bit_depth,
+        I32 n_segs,
+        const LocoCompressOptions *options)
+{
+    LocoCompressOptions default_options;
+    if (options == NULL) {
+        loco_init_compress_options(&default_options);
+        options = &default_options;
+    }
+
+    /* The parameters loco_check_image() requires, other than the buffer */
+    if (width < LOCO_MIN_IMAGE_WIDTH || width > LOCO_MAX_IMAGE_WIDTH
+            || height < LOCO_MIN_IMAGE_HEIGHT || height > LOCO_MAX_IMAGE_HEIGHT
+            || n_segs < 1 || n_segs > LOCO_MAX_SEGS
+            || width*height < n_segs*LOCO_MIN_SEGMENT_PIXELS
+            || bit_depth < 0 || bit_depth > BITDEPTH_12BIT) {
+        return 0;
+    }
+
+    /* Balanced bands depend on the image, so they are bounded as one band
+       of the whole image carrying the headers and padding of all of them */
+    LocoRect seg_bound[LOCO_MAX_SEGS];
+    I32 n_bound_segs = n_segs;
+    I32 extra_segs = 0;
+    if (options->layout == LOCO_LAYOUT_BALANCED) {
+        if (height < n_segs) {
+            return 0;
+        }
+        seg_bound[0].xstart = 0;
+        seg_bound[0].xend = width;
+        seg_bound[0].ystart = 0;
+        seg_bound[0].yend = height;
+        n_bound_segs = 1;
+        extra_segs = n_segs - 1;
+    } else if (!loco_setup_layout(width, height, n_segs, options->layout,
+            NULL, seg_bound)) {
+        return 0;
+    }
+
+    I32 max_bytes = 0x7fffffff;     // larger bounds are not returned
+    I32 word_bits = (I32)(8*sizeof(LocoBitstreamType));
+    I32 bitdepth = (bit_depth <= BITDEPTH_8BIT) ? BITDEPTH_8BIT : BITDEPTH_12BIT;
+    I32 layout_bits = loco_layout_header_bits(options->layout, n_segs);
+    I32 raw_header_bits = (2*HEADER_CODE_BITS + IMAGEWIDTH_BITS + IMAGEHEIGHT_BITS
+            + 2*SEGINDEX_BITS + HEADER_FLAGS_BITS + layout_bits + 7) & ~7;
+
+    /* Header, and the first two pixels written directly */
+    I32 coded_header_bits = 2*HEADER_CODE_BITS + IMAGEWIDTH_BITS + IMAGEHEIGHT_BITS
+            + 2*SEGINDEX_BITS + HEADER_FLAGS_BITS + NEAR_BITS + layout_bits
+            + 2*bitdepth;
+    /* Each other pixel: k <= bitdepth bits, the unary part and its end bit,
+       and with limited codes, the escaped value in bitdepth bits */
+    I32 pixel_bits;
+    if (options->limit_golomb) {
+        pixel_bits = 2*bitdepth + 1 + ((bitdepth == BITDEPTH_8BIT) ?
+                LIMIT_UNARY_8BIT : LIMIT_UNARY_12BIT);
+    } else {
+        pixel_bits = 1 << bitdepth;
+    }
+
+    I32 bound_bytes = (I32)sizeof(LocoBitstreamType); // spare word
+    if (options->shared_model != NULL) {
+        /* The shared model in segment 0's header, at its largest */
+        bound_bytes += ((LOCO_NCONTEXTS*(1 + SHARED_K_BITS) + word_bits - 1)
+                / word_bits) * (I32)sizeof(LocoBitstreamType);
+    }
+    if (extra_segs > 0) {
+        /* The other bands' headers, and a word of padding for every band */
+        bound_bytes += n_segs*(I32)sizeof(LocoBitstreamType) + extra_segs
+                * (((options->raw_fallback) ? raw_header_bits : coded_header_bits)/8 + 1);
+    }
+    I32 max_words = max_bytes / (I32)sizeof(LocoBitstreamType);
+    for (I32 seg=0; seg<n_bound_segs; seg++) {
+        I32 n_pixels = (seg_bound[seg].xend - seg_bound[seg].xstart)
+                * (seg_bound[seg].yend - seg_bound[seg].ystart);
+        I32 seg_words;
+        if (options->raw_fallback) {
+            seg_words = (raw_header_bits + n_pixels*bitdepth + word_bits - 1)
+                    / word_bits;
+        } else {
+            /* Count the whole words of each pixel apart from its other
+               bits, so that bounds up to max_bytes do not overflow */
+            I32 n_coded = n_pixels - 2;
+            I32 pixel_words = pixel_bits / word_bits;
+            I32 tail_words = (coded_header_bits + n_coded*(pixel_bits % word_bits)
+                    + word_bits - 1) / word_bits;
+            if (pixel_words > 0 && n_coded > (max_words - tail_words) / pixel_words) {
+                return (options->target_bytes > 0) ? options->target_bytes : 0;
+            }
+            seg_words = tail_words + n_coded*pixel_words;
+        }
+        if (seg_words > (max_bytes - bound_bytes) / (I32)sizeof(LocoBitstreamType)) {
+            return (options->target_bytes > 0) ? options->target_bytes : 0;
+        }
+        bound_bytes += seg_words * (I32)sizeof(LocoBitstreamType);
+    }
+
+    /* Rate control stops at the target */
+    if (options->target_bytes > 0 && options->target_bytes < bound_bytes) {
+        bound_bytes = options->target_bytes;
+    }
+    return bound_bytes;
+}
+
+// Check if an image is valid for compression
+I32 loco_check_image(const LocoImage *image)
+{
+    I32 status = 0;
+
+    LOCO_ASSERT(image != NULL);
+
+    /* Check that image dimensions are not too large */
+    if (image->width > LOCO_MAX_IMAGE_WIDTH) {
+        status |= LOCO_BIG_WIDTH_FLAG | LOCO_ABORT_COMPRESSION_FLAG;
+    }
+    if (image->height > LOCO_MAX_IMAGE_HEIGHT) {
+        status |= LOCO_BIG_HEIGHT_FLAG | LOCO_ABORT_COMPRESSION_FLAG;
+    }
+
+    /* Check that image_width is compatible with image_space_width */
+    if (image->width > image->space_width) {
+        status |= LOCO_BAD_SPACE_WIDTH_FLAG | LOCO_ABORT_COMPRESSION_FLAG;
+    }
+
+    /* Check that image dimensions are not too small */
+    if (image->width < LOCO_MIN_IMAGE_WIDTH) {
+        status |= LOCO_SMALL_WIDTH_FLAG | LOCO_ABORT_COMPRESSION_FLAG;
+    }
+    if (image->height < LOCO_MIN_IMAGE_HEIGHT) {
+        status |= LOCO_SMALL_HEIGHT_FLAG | LOCO_ABORT_COMPRESSION_FLAG;
+    }
+
+    /* Check that the average number of pixels per segment is not too small */
+    if (image->width*image->height < image->n_segs*LOCO_MIN_SEGMENT_PIXELS) {
+        status |= LOCO_SMALL_IMAGE_FLAG | LOCO_ABORT_COMPRESSION_FLAG;
+    }
+
+    /* Check that the number of segments is in the proper range */
+    if (image->n_segs < 1 || image->n_segs > LOCO_MAX_SEGS) {
+        status |= LOCO_BAD_N_SEGS_FLAG | LOCO_ABORT_COMPRESSION_FLAG;
+    }
+
+    // Check bit width is acceptable
+    if (image->bit_depth < 0 || image->bit_depth > BITDEPTH_12BIT) {
+        status |= LOCO_BAD_BIT_DEPTH_FLAG | LOCO_ABORT_COMPRESSION_FLAG;
+    }
+
+    // Check image size is at least space width * height * size(LocoPixelType)
+    if(image->space_width*image->height*sizeof(LocoPixelType) > image->size_data_bytes){
+        status |= LOCO_SMALL_BUFFER_FLAG | LOCO_ABORT_COMPRESSION_FLAG;
+    }
+
+    return status;
+}
+
+/* Open the next packet of the segment being packetized, in the next slot
+   of the ring. Returns 0 if the ring is full. */
+LOCO_PRIVATE I32 loco_open_packet(LocoCompressState *state)
+{
+    LOCO_ASSERT(state != NULL);
+    LOCO_ASSERT(state->packets != NULL);
+
+    LocoPacketOutput *packets = state->packets;
+    if (packets->packet_done == NULL && packets->n_packets_out >= packets->n_packets) {
+        state->packets_exhausted = 1;
+        state->packet_payload = NULL;
+        state->p_out = NULL;
+        state->p_stop = NULL;
+        return 0;
+    }
+
+    I32 packet_words = packets->packet_bytes / (I32)sizeof(LocoBitstreamType);
+    LocoBitstreamType *packet = packets->data
+            + (packets->n_packets_out % packets->n_packets) * packet_words;
+    state->packet_payload = packet
+            + LOCO_PACKET_HEADER_BYTES / (I32)sizeof(LocoBitstreamType);
+    state->p_out = state->packet_payload;
+    state->p_stop = packet + packet_words;
+    return 1;
+}
+
+/* Write the header of the open packet, if any, and pass the packet on */
+LOCO_PRIVATE void loco_finish_packet(LocoCompressState *state, I32 last)
+{
+    LOCO_ASSERT(state != NULL);
+    LOCO_ASSERT(state->packets != NULL);
+
+    if (state->packet_payload == NULL) {
+        return;
+    }
+    LocoPacketOutput *packets = state->packets;
+    I32 payload_words = (I32)(state->p_out - state->packet_payload);
+    I32 payload_bytes = payload_words * (I32)sizeof(LocoBitstreamType);
+    U32 bit_offset = 8 * sizeof(LocoBitstreamType) * (U32)state->packet_seg_words;
+    LocoBitstreamType *packet = state->packet_payload
+            - LOCO_PACKET_HEADER_BYTES / (I32)sizeof(LocoBitstreamType);
+
+    U8 *header = (U8*)packet;
+    header[0] = (U8)(state->packet_seg | (last ? LOCO_PACKET_LAST_FLAG : 0));
+    header[1] = (U8)state->n_segs;
+    header[2] = (U8)(payload_bytes >> 8);
+    header[3] = (U8)payload_bytes;
+    header[4] = (U8)(bit_offset >> 24);
+    header[5] = (U8)(bit_offset >> 16);
+    header[6] = (U8)(bit_offset >> 8);
+    header[7] = (U8)bit_offset;
+
+    state->packet_seg_words += payload_words;
+    state->packet_payload = NULL;
+    packets->n_packets_out++;
+    if (packets->packet_done != NULL) {
+        packets->packet_done(packets->context, packet, packets->n_packets_out - 1);
+    }
+}
+
+/* Called when the output is full. With packetized output, move on to the
+   next packet; returns 0 if there is no more room for output. */
+LOCO_PRIVATE I32 loco_next_packet(LocoCompressState *state)
+{
+    LOCO_ASSERT(state != NULL);
+
+    if (state->packets == NULL || state->packet_payload == NULL) {
+        return 0;
+    }
+    loco_finish_packet(state, 0);
+    return loco_open_packet(state);
+}
+
+// Set the near-lossless bound for the segments that follow
+LOCO_PRIVATE void loco_set_near(LocoCompressState * state, I32 near)
+{
+    LOCO_ASSERT(state != NULL);
+    LOCO_ASSERT_1(0 <= near && near <= LOCO_MAX_NEAR, near);
+
+    state->near = near;
+    if (near > 0) {
+        state->header_flags |= HEADER_FLAG_NEAR;
+    } else {
+        state->header_flags &= ~HEADER_FLAG_NEAR;
+    }
+}
+
+// Code a segment, from a fresh output word, storing it raw if that is smaller
+// and raw fallback is on
+LOCO_PRIVATE void loco_code_segment(LocoCompressState * state, I32 seg)
+{
+    loco_begin_segment(state, seg);
+    loco_code_segment_rows(state, seg, LOCO_MAX_IMAGE_HEIGHT);
+}
+
+// Start coding a segment, from a fresh output word
+LOCO_PRIVATE void loco_begin_segment(LocoCompressState * state, I32 seg)
+{
+    LOCO_ASSERT(state != NULL);
+    LOCO_ASSERT_1(0 <= seg && seg < state->n_segs, seg);
+
+    /* Reset bitstream output word */
+    state->bit_count = 8*sizeof(LocoBitstreamType)-1;
+    state->out_word = 0;
+    state->seg_bits = 0;
+
+    state->p_seg_start = state->p_out;
+    loco_start_segment(state, seg);
+    state->seg_y = state->seg_bound[seg].ystart;
+}
+
+/* Code up to n_rows more rows of a segment. With raw fallback, give up on
+   coding once the segment can no longer be smaller than when stored raw,
+   and store it raw. */
+LOCO_PRIVATE void loco_code_segment_rows(LocoCompressState * state, I32 seg,
+        I32 n_rows)
+{
+    LOCO_ASSERT(state != NULL);
+    LOCO_ASSERT_1(0 <= seg && seg < state->n_segs, seg);
+    LOCO_ASSERT_1(n_rows > 0, n_rows);
+
+    I32 yend = state->seg_bound[seg].yend;
+    I32 y_stop = (n_rows < yend - state->seg_y) ? state->seg_y + n_rows : yend;
+    if (state->raw_fallback) {
+        I32 raw_bits = loco_raw_segment_bits(state, seg);
+        for (; state->seg_y < y_stop && state->seg_bits <= raw_bits; state->seg_y++) {
+            loco_compress_rows(state, seg, state->seg_y, state->seg_y+1);
+        }
+        if (state->seg_bits > raw_bits) {
+            loco_store_raw_segment(state, seg, state->p_seg_start);
+            state->seg_y = yend;
+        }
+    } else if (state->seg_y < y_stop) {
+        loco_compress_rows(state, seg, state->seg_y, y_stop);
+        state->seg_y = y_stop;
+    }
+}
+
+// Bytes a segment codes to with the given near-lossless bound, padded to a
+// whole word. Nothing is written, and statistics are not gathered.
+LOCO_PRIVATE I32 loco_segment_bytes(LocoCompressState * state, I32 seg, I32 near)
+{
+    LOCO_ASSERT(state != NULL);
+
+    I32 size_only = state->size_only;
+    LocoCompressStats *seg_stats = state->seg_stats;
+    state->size_only = 1;
+    state->seg_stats = NULL;
+    loco_set_near(state, near);
+    loco_code_segment(state, seg);
+    state->size_only = size_only;
+    state->seg_stats = seg_stats;
+
+    I32 word_bits = (I32)(8*sizeof(LocoBitstreamType));
+    return ((state->seg_bits + word_bits - 1) / word_bits)
+            * (I32)sizeof(LocoBitstreamType);
+}
+
+/* Near-lossless bounds tried by rate control, in increasing order */
+LOCO_PRIVATE const I16 loco_near_ladder[] =
+    {0, 1, 2, 3, 4, 6, 8, 12, 16, 24, 32, 48, 64, 96, LOCO_MAX_NEAR};
+enum { LOCO_NEAR_LADDER_LEN = sizeof(loco_near_ladder)/sizeof(loco_near_ladder[0]) };
+
+/* Near-lossless bound of a rung of the ladder; the first rung is the
+   requested bound */
+LOCO_PRIVATE I32 loco_rung_near(const LocoCompressOptions * options, I32 first,
+        I32 rung)
+{
+    LOCO_ASSERT(options != NULL);
+    LOCO_ASSERT_1(0 <= rung && rung < LOCO_NEAR_LADDER_LEN, rung);
+
+    return (rung == first) ? options->near : loco_near_ladder[rung];
+}
+
+/* Bytes a segment codes to at a rung, from seg_bytes, the segment's cache
+   of sizes by rung (negative if not yet found), coding it if need be */
+LOCO_PRIVATE I32 loco_rung_bytes(LocoCompressState * state,
+        const LocoCompressOptions * options, I32 first, I32 seg, I32 rung,
+        I32 seg_bytes[])
+{
+    LOCO_ASSERT(seg_bytes != NULL);
+    LOCO_ASSERT_1(0 <= rung && rung < LOCO_NEAR_LADDER_LEN, rung);
+
+    if (seg_bytes[rung] < 0) {
+        seg_bytes[rung] = loco_segment_bytes(state, seg,
+                loco_rung_near(options, first, rung));
+    }
+    return seg_bytes[rung];
+}
+
+/* Choose per-segment near-lossless bounds, and if necessary segments to
+   drop, so the coded segments fit in budget bytes.  Segment sizes at each
+   bound are found by coding without output, and cached, since segments are
+   coded independently.
+
+   The smallest bound (at least options->near) at which all kept segments fit
+   is used for every kept segment; then, in order of priority, segments are
+   given the next smaller bound while the remaining budget allows.  If the
+   largest bound does not fit, the lowest priority segment (the last, among
+   equals) is dropped, and the search repeated. */
+LOCO_PRIVATE I32 loco_allocate_budget(LocoCompressState * state,
+        const LocoCompressOptions * options, I32 budget,
+        I32 seg_near[LOCO_MAX_SEGS], I32 seg_keep[LOCO_MAX_SEGS])
+{
+    LOCO_ASSERT(state != NULL);
+    LOCO_ASSERT(options != NULL);
+    LOCO_ASSERT(seg_near != NULL);
+    LOCO_ASSERT(seg_keep != NULL);
+
+    I32 n_segs = state->n_segs;
+    I32 bytes[LOCO_MAX_SEGS][LOCO_NEAR_LADDER_LEN];
+    I32 priority[LOCO_MAX_SEGS];
+    I32 status = 0;
+
+    for (I32 seg=0; seg<n_segs; seg++) {
+        priority[seg] = (options->seg_priority != NULL) ? options->seg_priority[seg] : 0;
+        for (I32 i=0; i<LOCO_NEAR_LADDER_LEN; i++) {
+            bytes[seg][i] = -1;
+        }
+    }
+
+    /* The first rung is the requested bound */
+    I32 first = 0;
+    while (first < LOCO_NEAR_LADDER_LEN - 1 && loco_near_ladder[first] < options->near) {
+        first++;
+    }
+    I32 rung = -1;
+    I32 n_kept = n_segs;
+    while (n_kept > 0) {
+        /* Find the smallest rung at which the kept segments fit. Sizes
+           decrease with the bound, so search by bisection. */
+        I32 lo = first;
+        I32 hi = LOCO_NEAR_LADDER_LEN - 1;
+        I32 total = 0;
+        for (I32 seg=0; seg<n_segs; seg++) {
+            if (seg_keep[seg]) {
+                total += loco_rung_bytes(state, options, first, seg, hi,
+                        bytes[seg]);
+            }
+        }
+        if (total <= budget) {
+            while (lo < hi) {
+                I32 mid = (lo + hi) / 2;
+                total = 0;
+                for (I32 seg=0; seg<n_segs; seg++) {
+                    if (seg_keep[seg]) {
+                        total += loco_rung_bytes(state, options, first, seg, mid,
+                                bytes[seg]);
+                    }
+                }
+                if (total <= budget) {
+                    hi = mid;
+                } else {
+                    lo = mid + 1;
+                }
+            }
+            rung = hi;
+            break;
+        }
+
+        /* Nothing fits; drop the least important kept segment */
+        I32 drop = -1;
+        for (I32 seg=0; seg<n_segs; seg++) {
+            if (seg_keep[seg] && (drop < 0 || priority[seg] <= priority[drop])) {
+                drop = seg;
+            }
+        }
+        seg_keep[drop] = 0;
+        n_kept--;
+        status |= LOCO_SEGMENTS_DROPPED_FLAG;
+    }
+
+    if (rung < 0) {
+        /* Every segment was dropped */
+        return status;
+    }
+
+    I32 slack = budget;
+    for (I32 seg=0; seg<n_segs; seg++) {
+        seg_near[seg] = loco_rung_near(options, first, rung);
+        if (seg_keep[seg]) {
+            slack -= loco_rung_bytes(state, options, first, seg, rung, bytes[seg]);
+        }
+    }
+    LOCO_ASSERT_1(slack >= 0, slack);
+
+    /* Give the next smaller bound to segments that fit it, most important
+       (then first) segments first */
+    if (rung > first) {
+        I32 done[LOCO_MAX_SEGS];
+        for (I32 seg=0; seg<n_segs; seg++) {
+            done[seg] = !seg_keep[seg];
+        }
+        for (;;) {
+            I32 next = -1;
+            for (I32 seg=0; seg<n_segs; seg++) {
+                if (!done[seg] && (next < 0 || priority[seg] > priority[next])) {
+                    next = seg;
+                }
+            }
+            if (next < 0) {
+                break;
+            }
+            done[next] = 1;
+            I32 smaller = loco_rung_bytes(state, options, first, next, rung - 1,
+                    bytes[next]);
+            I32 extra = smaller - loco_rung_bytes(state, options, first, next,
+                    rung, bytes[next]);
+            if (extra <= slack) {
+                seg_near[next] = loco_rung_near(options, first, rung - 1);
+                slack -= extra;
+            }
+        }
+    }
+
+    return status;
+}
+
+// Initialize context statistics, and write the header and first two pixels
+LOCO_PRIVATE void loco_start_segment(LocoCompressState * state, I32 seg)
+{
+    LOCO_ASSERT(state != NULL);
+    LOCO_ASSERT_1(0 <= seg && seg < state->n_segs, seg);
+    LOCO_ASSERT_1(state->bit_depth > 0 && state->bit_depth <= BITDEPTH_12BIT,
+            state->bit_depth);
+
+    I32 is_8bit = (state->bit_depth <= BITDEPTH_8BIT);
+    I32 bitdepth = is_8bit ? BITDEPTH_8BIT : BITDEPTH_12BIT;
+    I32 xstart = state->seg_bound[seg].xstart;
+    I32 ystart = state->seg_bound[seg].ystart;
+
+    loco_init_contexts(state, seg);
+
+    loco_write_header(state, seg, state->header_flags);
+
+    LOCO_ASSERT_2(ystart < LOCO_MAX_IMAGE_HEIGHT - 1,
+            ystart, LOCO_MAX_IMAGE_HEIGHT);
+
+    // Write first two pixels directly
+    loco_write_integer(state, state->image_rows[ystart][xstart],   bitdepth);
+    loco_write_integer(state, state->image_rows[ystart][xstart+1], bitdepth);
+    if (state->near > 0 || state->ref_data != NULL) {
+        for (I32 x=xstart; x<xstart+2; x++) {
+            I32 base = (state->ref_data == NULL) ? 0 : state->ref_data[
+                    ystart*state->ref_space_width + x]
+                    - (is_8bit ? PMAX_8BIT : PMAX_12BIT);
+            state->near_rows[ystart & 1][x] = (LocoPixelType)(
+                    state->image_rows[ystart][x] - base);
+        }
+    }
+}
+
+// Initialize context statistics, from the segment's prior if there is one
+LOCO_PRIVATE void loco_init_contexts(LocoCompressState * state, I32 seg)
+{
+    LOCO_ASSERT(state != NULL);
+    LOCO_ASSERT_1(0 <= seg && seg < state->n_segs, seg);
+
+    const LocoContextModel *prior = loco_segment_prior(state, seg);
+    if (prior != NULL) {
+        for (I32 i=0;i<LOCO_NCONTEXTS;i++) {
+            state->c_count[i] = prior->c_count[i];
+            state->c_mag_sum[i] = prior->c_mag_sum[i];
+            state->c_sum[i] = prior->c_sum[i];
+            state->c_bias[i] = prior->c_bias[i];
+        }
+    } else {
+        I32 is_8bit = (state->bit_depth <= BITDEPTH_8BIT);
+        I16 initcc = is_8bit ? INITCC_8BIT : INITCC_12BIT;
+        I32 initcms = is_8bit ? INITCMS_8BIT : INITCMS_12BIT;
+        for (I32 i=0;i<LOCO_NCONTEXTS;i++) {
+            state->c_count[i] = initcc;
+            state->c_mag_sum[i] = initcms;
+            state->c_sum[i] = 0;
+            state->c_bias[i] = 0;
+        }
     }
+}
 
-    /* Check that image_width is compatible with image_space_width */
-    if (image->width > image->space_width) {
-        status |= LOCO_BAD_SPACE_WIDTH_FLAG | LOCO_ABORT_COMPRESSION_FLAG;
-    }
+// The model a segment starts from: the shared model, its prior, or NULL
+LOCO_PRIVATE const LocoContextModel * loco_segment_prior(
+        const LocoCompressState * state, I32 seg)
+{
+    LOCO_ASSERT(state != NULL);
 
-    /* Check that image dimensions are not too small */
-    if (image->width < LOCO_MIN_IMAGE_WIDTH) {
-        status |= LOCO_SMALL_WIDTH_FLAG | LOCO_ABORT_COMPRESSION_FLAG;
+    if (state->header_flags & HEADER_FLAG_SHARED) {
+        return &state->shared_model;
     }
-    if (image->height < LOCO_MIN_IMAGE_HEIGHT) {
-        status |= LOCO_SMALL_HEIGHT_FLAG | LOCO_ABORT_COMPRESSION_FLAG;
+    if (state->priors != NULL) {
+        return &state->priors[seg];
     }
+    return NULL;
+}
 
-    /* Check that the average number of pixels per segment is not too small */
-    if (image->width*image->height < image->n_segs*LOCO_MIN_SEGMENT_PIXELS) {
-        status |= LOCO_SMALL_IMAGE_FLAG | LOCO_ABORT_COMPRESSION_FLAG;
-    }
+// Golomb parameter k of a context's statistics, as the coder computes it
+LOCO_PRIVATE I32 loco_shared_k(I32 count, I32 mag_sum)
+{
+    LOCO_ASSERT_1(count > 0, count);
 
-    /* Check that the number of segments is in the proper range */
-    if (image->n_segs < 1 || image->n_segs > LOCO_MAX_SEGS) {
-        status |= LOCO_BAD_N_SEGS_FLAG | LOCO_ABORT_COMPRESSION_FLAG;
+    I32 k = 0;
+    while (k < BITDEPTH_12BIT && (count << k) <= mag_sum) {
+        k++;
     }
+    return k;
+}
 
-    // Check bit width is acceptable
-    if (image->bit_depth < 0 || image->bit_depth > BITDEPTH_12BIT) {
-        status |= LOCO_BAD_BIT_DEPTH_FLAG | LOCO_ABORT_COMPRESSION_FLAG;
+/* Keep the Golomb parameter of each context of model, and count the bits
+   they take in segment 0's header. Segments start from the model those
+   parameters stand for. */
+LOCO_PRIVATE void loco_set_shared_model(LocoCompressState * state,
+        const LocoContextModel * model)
+{
+    LOCO_ASSERT(state != NULL);
+    LOCO_ASSERT(model != NULL);
+
+    I32 k_prev = 0;
+    state->shared_bits = 0;
+    for (I32 i=0; i<LOCO_NCONTEXTS; i++) {
+        I32 k = loco_shared_k(model->c_count[i], model->c_mag_sum[i]);
+        state->shared_k[i] = (U8)k;
+        state->shared_bits += (k == k_prev) ? 1 : 1 + SHARED_K_BITS;
+        k_prev = k;
     }
+    loco_expand_shared_model(state->shared_k, state->bit_depth,
+            &state->shared_model);
+}
 
-    // Check image size is at least space width * height * size(LocoPixelType)
-    if(image->space_width*image->height*sizeof(LocoPixelType) > image->size_data_bytes){
-        status |= LOCO_SMALL_BUFFER_FLAG | LOCO_ABORT_COMPRESSION_FLAG;
+// Code rows y_begin to y_end-1 of a segment, for the image's bit depth
+LOCO_PRIVATE void loco_compress_rows(LocoCompressState * state,
+        I32 seg, I32 y_begin, I32 y_end)
+{
+    LOCO_ASSERT(state != NULL);
+    if (state->near > 0 || state->ref_data != NULL) {
+        loco_compress_rows_near(state, seg, y_begin, y_end);
+    } else if (state->bit_depth <= BITDEPTH_8BIT) {
+        loco_compress_rows_8bit(state, seg, y_begin, y_end);
+    } else {
+        loco_compress_rows_12bit(state, seg, y_begin, y_end);
     }
-
-    return status;
 }
 
-LOCO_PRIVATE void loco_compress_segment_8bit(LocoCompressState * state,
-        I32 seg, I32 xstart, I32 xend,
-        I32 ystart, I32 yend)
+LOCO_PRIVATE void loco_compress_rows_8bit(LocoCompressState * state,
+        I32 seg, I32 y_begin, I32 y_end)
 {
     LOCO_ASSERT(state != NULL);
+    LOCO_ASSERT_1(0 <= seg && seg < state->n_segs, seg);
 
     I32 est;
     I32 residual;
@@ -656,36 +1860,23 @@ LOCO_PRIVATE void loco_compress_segment_8bit(LocoCompressState * state,
     I32 ctxt1s = 0;
     I32 loop_cnt;
     I32 loop_limit;
+    I32 mapped_residual;
+    I32 unary;
+    I32 unary_limit = state->unary_limit;
     LocoPixelType *p_line_start;
     LocoPixelType *p_line_start_p1;
     LocoPixelType *p_line_end;
     LocoPixelType *p_pixel;
     LocoPixelType *p_pixel_m1 = NULL;
 
-    // Initialize context statistics
-    for (I32 i=0;i<LOCO_NCONTEXTS;i++) {
-        state->c_count[i] = INITCC_8BIT;
-        state->c_mag_sum[i] = INITCMS_8BIT;
-        state->c_sum[i] = 0;
-        state->c_bias[i] = 0;
-    }
-
-    // Write segment header
-    loco_write_integer(state, HEADER_CODE_FOR_8BIT, HEADER_CODE_BITS);
-    loco_write_integer(state, state->image_width-1, IMAGEWIDTH_BITS);
-    loco_write_integer(state, state->image_height-1, IMAGEHEIGHT_BITS);
-    loco_write_integer(state, state->n_segs-1, SEGINDEX_BITS);
-    loco_write_integer(state, seg, SEGINDEX_BITS);
-
-    LOCO_ASSERT_2(ystart < LOCO_MAX_IMAGE_HEIGHT - 1,
-            ystart, LOCO_MAX_IMAGE_HEIGHT);
-
-    // Write first two pixels directly
-    loco_write_integer(state, state->image_rows[ystart][xstart],   BITDEPTH_8BIT);
-    loco_write_integer(state, state->image_rows[ystart][xstart+1], BITDEPTH_8BIT);
+    I32 xstart = state->seg_bound[seg].xstart;
+    I32 xend = state->seg_bound[seg].xend;
+    I32 ystart = state->seg_bound[seg].ystart;
+    LOCO_ASSERT_3(ystart <= y_begin && y_begin <= y_end
+            && y_end <= state->seg_bound[seg].yend, ystart, y_begin, y_end);
 
     // Main encoding loop
-    for (I32 y=ystart; y<yend; y++) {
+    for (I32 y=y_begin; y<y_end; y++) {
         p_line_start = state->image_rows[y] + xstart;
         p_line_start_p1 = p_line_start + 1;
         p_line_end = state->image_rows[y] + xend-1;
@@ -819,36 +2010,59 @@ LOCO_PRIVATE void loco_compress_segment_8bit(LocoCompressState * state,
             }
             state->c_sum[context] = sum;
 
-            // Write the "uncoded" portion of the residual
+            mapped_residual = residual;
             loop_limit = 8*sizeof(I32);
-            for (loop_cnt = 0; kshift<=msum && loop_cnt < loop_limit; loop_cnt++) {
-                WRITE_BIT(residual & 01);
-                residual >>= 1;
-                kshift <<= 1;
+            if (state->size_only) {
+                /* Count the bits of the code, without writing them */
+                for (loop_cnt = 0; kshift<=msum && loop_cnt < loop_limit; loop_cnt++) {
+                    kshift <<= 1;
+                }
+                LOCO_ASSERT_2(loop_cnt < loop_limit, loop_cnt, loop_limit);
+                residual >>= loop_cnt;
+                unary = (residual < unary_limit) ? residual : unary_limit;
+                state->seg_bits += loop_cnt + unary + 1;
+            } else {
+                // Write the "uncoded" portion of the residual
+                for (loop_cnt = 0; kshift<=msum && loop_cnt < loop_limit; loop_cnt++) {
+                    WRITE_BIT(residual & 01);
+                    residual >>= 1;
+                    kshift <<= 1;
+                }
+                LOCO_ASSERT_2(loop_cnt < loop_limit, loop_cnt, loop_limit);
+
+                /* Unary Encode the rest of the residual, up to the limit */
+                unary = (residual < unary_limit) ? residual : unary_limit;
+                state->bit_count -= unary;
+                while (state->bit_count < 0) {
+                    if (state->p_out < state->p_stop || loco_next_packet(state)) {
+                        *state->p_out++ = FIX_WORD(state->out_word, state->is_little_endian);
+                    }
+                    state->out_word = 0;
+                    state->bit_count += 8*sizeof(LocoBitstreamType);
+                }
+                WRITE_BIT(1);
+
+                state->seg_bits += loop_cnt + unary + 1;
+            }
+            if (unary == unary_limit) {
+                /* Escape: the rest of the residual follows in full */
+                loco_write_integer(state, residual, BITDEPTH_8BIT);
             }
-            LOCO_ASSERT_2(loop_cnt < loop_limit, loop_cnt, loop_limit);
 
-            /* Unary Encode the rest of the residual */
-            state->bit_count -= residual;
-            while (state->bit_count < 0) {
-                if (state->p_out < state->p_stop) {
-                    *state->p_out++ = FIX_WORD(state->out_word, state->is_little_endian);
-                }
-                state->out_word = 0;
-                state->bit_count += 8*sizeof(LocoBitstreamType);
+            if (state->seg_stats != NULL) {
+                loco_stats_record_pixel(state, mapped_residual, loop_cnt, unary);
             }
-            WRITE_BIT(1);
 
         } while (p_pixel <= p_line_end);
 
     }
 }
 
-LOCO_PRIVATE void loco_compress_segment_12bit(LocoCompressState * state,
-        I32 seg, I32 xstart, I32 xend,
-        I32 ystart, I32 yend)
+LOCO_PRIVATE void loco_compress_rows_12bit(LocoCompressState * state,
+        I32 seg, I32 y_begin, I32 y_end)
 {
     LOCO_ASSERT(state != NULL);
+    LOCO_ASSERT_1(0 <= seg && seg < state->n_segs, seg);
 
     I32 est;
     I32 residual;
@@ -866,36 +2080,23 @@ LOCO_PRIVATE void loco_compress_segment_12bit(LocoCompressState * state,
     I32 ctxt1s = 0;
     I32 loop_cnt;
     I32 loop_limit;
+    I32 mapped_residual;
+    I32 unary;
+    I32 unary_limit = state->unary_limit;
     LocoPixelType *p_line_start;
     LocoPixelType *p_line_start_p1;
     LocoPixelType *p_line_end;
     LocoPixelType *p_pixel;
     LocoPixelType *p_pixel_m1 = NULL;
 
-    // Initialize context statistics
-    for (I32 i=0;i<LOCO_NCONTEXTS;i++) {
-        state->c_count[i] = INITCC_12BIT;
-        state->c_mag_sum[i] = INITCMS_12BIT;
-        state->c_sum[i] = 0;
-        state->c_bias[i] = 0;
-    }
-
-    // Write segment header
-    loco_write_integer(state, HEADER_CODE_FOR_12BIT, HEADER_CODE_BITS);
-    loco_write_integer(state, state->image_width-1, IMAGEWIDTH_BITS);
-    loco_write_integer(state, state->image_height-1, IMAGEHEIGHT_BITS);
-    loco_write_integer(state, state->n_segs-1, SEGINDEX_BITS);
-    loco_write_integer(state, seg, SEGINDEX_BITS);
-
-    LOCO_ASSERT_2(ystart < LOCO_MAX_IMAGE_HEIGHT-1,
-            ystart, LOCO_MAX_IMAGE_HEIGHT);
-
-    // Write first two pixels directly
-    loco_write_integer(state, state->image_rows[ystart][xstart], BITDEPTH_12BIT);
-    loco_write_integer(state, state->image_rows[ystart][xstart+1], BITDEPTH_12BIT);
+    I32 xstart = state->seg_bound[seg].xstart;
+    I32 xend = state->seg_bound[seg].xend;
+    I32 ystart = state->seg_bound[seg].ystart;
+    LOCO_ASSERT_3(ystart <= y_begin && y_begin <= y_end
+            && y_end <= state->seg_bound[seg].yend, ystart, y_begin, y_end);
 
     // Main encoding loop
-    for (I32 y=ystart; y<yend; y++) {
+    for (I32 y=y_begin; y<y_end; y++) {
         p_line_start = state->image_rows[y] + xstart;
         p_line_start_p1 = p_line_start + 1;
         p_line_end = state->image_rows[y] + xend-1;
@@ -1029,37 +2230,707 @@ LOCO_PRIVATE void loco_compress_segment_12bit(LocoCompressState * state,
             }
             state->c_sum[context] = sum;
 
-            /* Write the "uncoded" portion of the residual */
+            mapped_residual = residual;
             loop_limit = 8*sizeof(I32);
-            for (loop_cnt = 0; kshift<=msum && loop_cnt < loop_limit; loop_cnt++) {
-                WRITE_BIT(residual & 01);
-                residual >>= 1;
-                kshift <<= 1;
+            if (state->size_only) {
+                /* Count the bits of the code, without writing them */
+                for (loop_cnt = 0; kshift<=msum && loop_cnt < loop_limit; loop_cnt++) {
+                    kshift <<= 1;
+                }
+                LOCO_ASSERT_2(loop_cnt < loop_limit, loop_cnt, loop_limit);
+                residual >>= loop_cnt;
+                unary = (residual < unary_limit) ? residual : unary_limit;
+                state->seg_bits += loop_cnt + unary + 1;
+            } else {
+                /* Write the "uncoded" portion of the residual */
+                for (loop_cnt = 0; kshift<=msum && loop_cnt < loop_limit; loop_cnt++) {
+                    WRITE_BIT(residual & 01);
+                    residual >>= 1;
+                    kshift <<= 1;
+                }
+                LOCO_ASSERT_2(loop_cnt < loop_limit, loop_cnt, loop_limit);
+
+                /* Unary Encode the rest of the residual, up to the limit */
+                unary = (residual < unary_limit) ? residual : unary_limit;
+                state->bit_count -= unary;
+                while (state->bit_count < 0) {
+                    if (state->p_out < state->p_stop || loco_next_packet(state)) {
+                        *state->p_out++ = FIX_WORD(state->out_word, state->is_little_endian);
+                    }
+                    state->out_word = 0;
+                    state->bit_count += 8*sizeof(LocoBitstreamType);
+                }
+                WRITE_BIT(1);
+
+                state->seg_bits += loop_cnt + unary + 1;
+            }
+            if (unary == unary_limit) {
+                /* Escape: the rest of the residual follows in full */
+                loco_write_integer(state, residual, BITDEPTH_12BIT);
             }
-            LOCO_ASSERT_2(loop_cnt < loop_limit, loop_cnt, loop_limit);
 
-            /* Unary Encode the rest of the residual */
-            state->bit_count -= residual;
-            while (state->bit_count < 0) {
-                if (state->p_out < state->p_stop) {
-                    *state->p_out++ = FIX_WORD(state->out_word, state->is_little_endian);
-                }
-                state->out_word = 0;
-                state->bit_count += 8*sizeof(LocoBitstreamType);
+            if (state->seg_stats != NULL) {
+                loco_stats_record_pixel(state, mapped_residual, loop_cnt, unary);
             }
-            WRITE_BIT(1);
 
         } while (p_pixel <= p_line_end);
 
     }
 }
 
+/* Code rows y_begin to y_end-1 of a segment near-losslessly, as in JPEG-LS:
+   residuals are quantized so each reconstructed pixel is within state->near
+   of the original. Prediction and contexts use the reconstructed pixels,
+   which are kept for the current and previous rows in state->near_rows.
+   This follows the 8 and 12 bit coders, but is parameterized by bit depth
+   at run time.
+   With a reference frame, this also codes temporally predicted rows, near
+   or lossless: the rows kept are then the reconstructed pixels less the
+   reference (offset by pmax to stay positive), so prediction and contexts
+   work on the difference between frames, and the reference is added back
+   to the estimate. */
+LOCO_PRIVATE void loco_compress_rows_near(LocoCompressState * state,
+        I32 seg, I32 y_begin, I32 y_end)
+{
+    LOCO_ASSERT(state != NULL);
+    LOCO_ASSERT_1(0 <= seg && seg < state->n_segs, seg);
+    LOCO_ASSERT_1((state->near > 0 || state->ref_data != NULL)
+            && state->near <= LOCO_MAX_NEAR, state->near);
+
+    I32 xstart = state->seg_bound[seg].xstart;
+    I32 xend = state->seg_bound[seg].xend;
+    I32 ystart = state->seg_bound[seg].ystart;
+    LOCO_ASSERT_3(ystart <= y_begin && y_begin <= y_end
+            && y_end <= state->seg_bound[seg].yend, ystart, y_begin, y_end);
+
+    I32 is_8bit = (state->bit_depth <= BITDEPTH_8BIT);
+    I32 pmax = is_8bit ? PMAX_8BIT : PMAX_12BIT;
+    I32 near = state->near;
+    I32 step = 2*near + 1;
+    I32 range = (pmax + 2*near)/step + 1;
+
+    for (I32 y=y_begin; y<y_end; y++) {
+        const LocoPixelType *p_orig = state->image_rows[y];
+        LocoPixelType *p_rec = state->near_rows[y & 1];
+        const LocoPixelType *p_above = state->near_rows[(y-1) & 1];
+        const LocoPixelType *p_ref = (state->ref_data == NULL) ? NULL
+                : state->ref_data + y*state->ref_space_width;
+
+        for (I32 x=xstart+2*(y==ystart); x<xend; x++) {
+            I32 est;
+            I32 context_info;
+            I32 context;
+            I32 b = (x > xstart) ? p_rec[x-1] : 0;  // left
+
+            if (y==ystart) { // top row
+                est = b;
+                context_info = loco_context_info_table[
+                        loco_gfour_to_ctxt(state, b - p_rec[x-2])];
+                context = (context_info>>1) | 0x90;
+            } else if (x == xstart) { // left side
+                I32 a = p_above[x];
+                est = a;
+                context_info = loco_context_info_table[
+                        loco_g_to_ctxt(state, p_above[x+1] - a)];
+                context = (context_info>>1) | 0x12;
+            } else {
+                I32 a = p_above[x];
+                I32 c = p_above[x-1];
+                if (a > b) {
+                    est = (c >= a) ? b : ((c <= b) ? a : a + b - c);
+                } else {
+                    est = (c >= b) ? a : ((c <= a) ? b : a + b - c);
+                }
+                I32 ctxt = (loco_g_to_ctxt(state, c - b)>>3)
+                        | (loco_g_to_ctxt(state, a - c)<<3);
+                if (x == xstart+1) { // left side + 1
+                    context_info = loco_context_info_table[ctxt
+                            | loco_g_to_ctxt(state, p_above[x+1] - a)];
+                    context = (context_info>>1) | 0x02;
+                } else if (x == xend-1) { // right side
+                    context_info = loco_context_info_table[ctxt
+                            | loco_gfour_to_ctxt(state, b - p_rec[x-2])];
+                    context = (context_info>>1) | 0x80;
+                } else {
+                    context_info = loco_context_info_table[ctxt
+                            | loco_gfour_to_ctxt(state, b - p_rec[x-2])
+                            | loco_g_to_ctxt(state, p_above[x+1] - a)];
+                    context = context_info>>1;
+                }
+            }
+
+            /* Incorporate the reference and the context-based bias into the
+               pixel estimate, clip it, and compute the residual */
+            I32 base = (p_ref == NULL) ? 0 : p_ref[x] - pmax;
+            est += base;
+            I32 invert = context_info & 01;
+            est += invert ? -state->c_bias[context] : state->c_bias[context];
+            if (est < 0) {
+                est = 0;
+            } else if (est > pmax) {
+                est = pmax;
+            } else {
+                // in allowed range already
+            }
+            I32 residual = invert ? est - p_orig[x] : p_orig[x] - est;
+
+            /* Quantize the residual, and reduce it modulo the range */
+            if (residual > 0) {
+                residual = (residual + near)/step;
+            } else {
+                residual = -((near - residual)/step);
+            }
+            if (residual < 0) {
+                residual += range;
+            }
+            if (residual >= (range + 1)/2) {
+                residual -= range;
+            }
+
+            /* Reconstruct the pixel as the decompressor will */
+            I32 rec = est + (invert ? -residual : residual)*step;
+            if (rec < -near) {
+                rec += range*step;
+            } else if (rec > pmax + near) {
+                rec -= range*step;
+            } else {
+                // no adjustment
+            }
+            if (rec < 0) {
+                rec = 0;
+            } else if (rec > pmax) {
+                rec = pmax;
+            } else {
+                // in allowed range already
+            }
+            p_rec[x] = (LocoPixelType)(rec - base);
+
+            loco_code_residual(state, context, residual);
+        }
+    }
+}
+
+/* Plan a row for the pipeline's coder: each pixel's estimate from its
+   neighbours, and its context, as loco_compress_rows_8bit() and
+   loco_compress_rows_12bit() find them. Only the pixels are read. */
+LOCO_PRIVATE void loco_plan_row(const LocoCompressState * state,
+        I32 seg, I32 y, LocoRowPlan * plan)
+{
+    LOCO_ASSERT(state != NULL);
+    LOCO_ASSERT(plan != NULL);
+    LOCO_ASSERT_1(0 <= seg && seg < state->n_segs, seg);
+
+    I32 xstart = state->seg_bound[seg].xstart;
+    I32 xend = state->seg_bound[seg].xend;
+    I32 ystart = state->seg_bound[seg].ystart;
+    LOCO_ASSERT_3(ystart <= y && y < state->seg_bound[seg].yend,
+            ystart, y, state->seg_bound[seg].yend);
+
+    const LocoPixelType *p_row = state->image_rows[y];
+    const LocoPixelType *p_above = (y > ystart) ? state->image_rows[y-1] : NULL;
+    for (I32 x=xstart+2*(y==ystart); x<xend; x++) {
+        I32 est;
+        I32 context_info;
+        I32 context;
+        I32 b = (x > xstart) ? p_row[x-1] : 0;  // left
+        if (y==ystart) { // top row
+            est = b;
+            context_info = loco_context_info_table[
+                    loco_gfour_to_ctxt(state, b - p_row[x-2])];
+            context = (context_info>>1) | 0x90;
+        } else if (x == xstart) { // left side
+            I32 a = p_above[x];
+            est = a;
+            context_info = loco_context_info_table[
+                    loco_g_to_ctxt(state, p_above[x+1] - a)];
+            context = (context_info>>1) | 0x12;
+        } else {
+            I32 a = p_above[x];
+            I32 c = p_above[x-1];
+            if (a > b) {
+                est = (c >= a) ? b : ((c <= b) ? a : a + b - c);
+            } else {
+                est = (c >= b) ? a : ((c <= a) ? b : a + b - c);
+            }
+            I32 ctxt = (loco_g_to_ctxt(state, c - b)>>3)
+                    | (loco_g_to_ctxt(state, a - c)<<3);
+            if (x == xstart+1) { // left side + 1
+                context_info = loco_context_info_table[ctxt
+                        | loco_g_to_ctxt(state, p_above[x+1] - a)];
+                context = (context_info>>1) | 0x02;
+            } else if (x == xend-1) { // right side
+                context_info = loco_context_info_table[ctxt
+                        | loco_gfour_to_ctxt(state, b - p_row[x-2])];
+                context = (context_info>>1) | 0x80;
+            } else {
+                context_info = loco_context_info_table[ctxt
+                        | loco_gfour_to_ctxt(state, b - p_row[x-2])
+                        | loco_g_to_ctxt(state, p_above[x+1] - a)];
+                context = context_info>>1;
+            }
+        }
+        plan->est[x - xstart] = (I16)est;
+        plan->context_info[x - xstart] = (U16)((context << 1) | (context_info & 01));
+    }
+}
+
+/* Code a planned row, as the lossless coders would: correct each estimate
+   for the context's bias, and code the residual */
+LOCO_PRIVATE void loco_code_planned_row(LocoCompressState * state,
+        I32 seg, I32 y, const LocoRowPlan * plan)
+{
+    LOCO_ASSERT(state != NULL);
+    LOCO_ASSERT(plan != NULL);
+    LOCO_ASSERT_1(0 <= seg && seg < state->n_segs, seg);
+
+    I32 xstart = state->seg_bound[seg].xstart;
+    I32 xend = state->seg_bound[seg].xend;
+    I32 ystart = state->seg_bound[seg].ystart;
+    I32 is_8bit = (state->bit_depth <= BITDEPTH_8BIT);
+    I32 pmax = is_8bit ? PMAX_8BIT : PMAX_12BIT;
+    I32 sign_bit = is_8bit ? RESIDUAL_SIGN_BIT_8BIT : RESIDUAL_SIGN_BIT_12BIT;
+
+    const LocoPixelType *p_row = state->image_rows[y];
+    for (I32 x=xstart+2*(y==ystart); x<xend; x++) {
+        I32 est = plan->est[x - xstart];
+        I32 context = plan->context_info[x - xstart] >> 1;
+        I32 invert = plan->context_info[x - xstart] & 01;
+
+        est += invert ? -state->c_bias[context] : state->c_bias[context];
+        if (est < 0) {
+            est = 0;
+        } else if (est > pmax) {
+            est = pmax;
+        } else {
+            // in allowed range already
+        }
+        I32 residual = invert ? est - p_row[x] : p_row[x] - est;
+
+        /* Remap the residual to the range of a pixel, as the 8 and 12 bit
+           coders do */
+        residual &= pmax;
+        residual = (residual ^ sign_bit) - sign_bit;
+
+        loco_code_residual(state, context, residual);
+    }
+}
+
+/* Adapt a context's statistics to a residual, and code the residual, as the
+   8 and 12 bit coders do */
+LOCO_PRIVATE void loco_code_residual(LocoCompressState * state,
+        I32 context, I32 residual)
+{
+    LOCO_ASSERT(state != NULL);
+
+    I32 maxn = (state->bit_depth <= BITDEPTH_8BIT) ? MAXN_8BIT : MAXN_12BIT;
+    I32 n = state->c_count[context]++;
+    I32 msum = state->c_mag_sum[context] & MSUM_MASK;
+    I32 sum = state->c_sum[context] + residual;
+    if (sum > 0) {
+        state->c_bias[context]++;
+        sum -= (n + 1);
+    } else if (sum < -(n+1)) {
+        state->c_bias[context]--;
+        sum += (n + 1);
+    } else {
+        // no adjustment
+    }
+    I32 mapped_residual;
+    if (residual < 0) {
+        state->c_mag_sum[context] -= residual;
+        mapped_residual = ~(residual << 1);
+    } else {
+        state->c_mag_sum[context] += residual;
+        mapped_residual = residual << 1;
+    }
+    if (n == maxn-1) {
+        state->c_count[context] >>= 1;
+        state->c_mag_sum[context] >>= 1;
+        sum >>= 1;  /* NOTE: sign extension required (may not be portable) */
+    }
+    state->c_sum[context] = sum;
+
+    loco_write_residual(state, mapped_residual, n, msum);
+}
+
+// Write a mapped residual with the Golomb parameter for count n and magnitude
+// sum msum, as the 8 and 12 bit coders do
+LOCO_PRIVATE void loco_write_residual(LocoCompressState * state,
+        I32 mapped_residual, I32 n, I32 msum)
+{
+    LOCO_ASSERT(state != NULL);
+
+    I32 residual = mapped_residual;
+    I32 kshift = n;
+    I32 loop_cnt;
+    I32 loop_limit = 8*sizeof(I32);
+    I32 unary;
+    I32 bitdepth = (state->bit_depth <= BITDEPTH_8BIT) ? BITDEPTH_8BIT : BITDEPTH_12BIT;
+
+    for (loop_cnt = 0; kshift<=msum && loop_cnt < loop_limit; loop_cnt++) {
+        kshift <<= 1;
+    }
+    LOCO_ASSERT_2(loop_cnt < loop_limit, loop_cnt, loop_limit);
+
+    loco_write_integer(state, residual, loop_cnt);
+    residual >>= loop_cnt;
+    unary = (residual < state->unary_limit) ? residual : state->unary_limit;
+    state->seg_bits += unary + 1;
+    if (!state->size_only) {
+        state->bit_count -= unary;
+        while (state->bit_count < 0) {
+            if (state->p_out < state->p_stop || loco_next_packet(state)) {
+                *state->p_out++ = FIX_WORD(state->out_word, state->is_little_endian);
+            }
+            state->out_word = 0;
+            state->bit_count += 8*sizeof(LocoBitstreamType);
+        }
+        WRITE_BIT(1);
+    }
+    if (unary == state->unary_limit) {
+        /* Escape: the rest of the residual follows in full */
+        loco_write_integer(state, residual, bitdepth);
+    }
+
+    if (state->seg_stats != NULL) {
+        loco_stats_record_pixel(state, mapped_residual, loop_cnt, unary);
+    }
+}
+
+LOCO_PRIVATE I32 loco_g_to_ctxt(const LocoCompressState * state, I32 g)
+{
+    return (state->bit_depth <= BITDEPTH_8BIT) ? G_TO_CTXT_8BIT(g) : G_TO_CTXT_12BIT(g);
+}
+
+LOCO_PRIVATE I32 loco_gfour_to_ctxt(const LocoCompressState * state, I32 g)
+{
+    return (state->bit_depth <= BITDEPTH_8BIT) ?
+            GFOUR_TO_CTXT_8BIT(g) : GFOUR_TO_CTXT_12BIT(g);
+}
+
+// Write a segment header. If there are flags, the header is extended.
+LOCO_PRIVATE void loco_write_header(LocoCompressState * state, I32 seg, I32 flags)
+{
+    LOCO_ASSERT(state != NULL);
+    LOCO_ASSERT_1((flags & ~HEADER_FLAGS_KNOWN) == 0, flags);
+
+    I32 depth_code = (state->bit_depth <= BITDEPTH_8BIT) ?
+            HEADER_CODE_FOR_8BIT : HEADER_CODE_FOR_12BIT;
+
+    loco_write_integer(state, (flags != 0) ? HEADER_CODE_EXTENDED : depth_code,
+            HEADER_CODE_BITS);
+    loco_write_integer(state, state->image_width-1, IMAGEWIDTH_BITS);
+    loco_write_integer(state, state->image_height-1, IMAGEHEIGHT_BITS);
+    loco_write_integer(state, state->n_segs-1, SEGINDEX_BITS);
+    loco_write_integer(state, seg, SEGINDEX_BITS);
+    if (flags != 0) {
+        loco_write_integer(state, depth_code, HEADER_CODE_BITS);
+        loco_write_integer(state, flags, HEADER_FLAGS_BITS);
+    }
+    if (flags & HEADER_FLAG_NEAR) {
+        loco_write_integer(state, state->near, NEAR_BITS);
+    }
+    if (flags & HEADER_FLAG_LAYOUT) {
+        loco_write_integer(state, state->layout, LAYOUT_BITS);
+        if (state->layout == LOCO_LAYOUT_BALANCED) {
+            for (I32 band=0; band<state->n_segs-1; band++) {
+                loco_write_integer(state, state->band_end[band], IMAGEHEIGHT_BITS);
+            }
+        }
+    }
+    if ((flags & HEADER_FLAG_SHARED) && seg == 0) {
+        I32 k_prev = 0;
+        for (I32 i=0; i<LOCO_NCONTEXTS; i++) {
+            I32 k = state->shared_k[i];
+            loco_write_integer(state, k != k_prev, 1);
+            if (k != k_prev) {
+                loco_write_integer(state, k, SHARED_K_BITS);
+            }
+            k_prev = k;
+        }
+    }
+}
+
+// Bits a segment header takes to describe the layout
+LOCO_PRIVATE I32 loco_layout_header_bits(I32 layout, I32 n_segs)
+{
+    if (layout == LOCO_LAYOUT_GRID) {
+        return 0;
+    }
+    if (layout == LOCO_LAYOUT_BALANCED) {
+        return LAYOUT_BITS + (n_segs-1)*IMAGEHEIGHT_BITS;
+    }
+    return LAYOUT_BITS;
+}
+
+/* Choose the end rows of balanced bands, so that each band holds about as
+   many bits as the others. A pixel is guessed to take one bit more than its
+   MED residual's magnitude has bits, a rough Golomb code length. */
+LOCO_PRIVATE void loco_balance_bands(LocoCompressState * state)
+{
+    LOCO_ASSERT(state != NULL);
+    LOCO_ASSERT_2(state->image_height >= state->n_segs,
+            state->image_height, state->n_segs);
+
+    I32 height = state->image_height;
+    I32 n_segs = state->n_segs;
+
+    // Total cost, under 2^31 even for 16 bit pixels
+    I32 total = 0;
+    for (I32 y=0; y<height; y++) {
+        total += loco_row_cost(state, y);
+    }
+
+    I32 band = 0;
+    I32 cost = 0;
+    for (I32 y=0; y<height-1 && band<n_segs-1; y++) {
+        cost += loco_row_cost(state, y);
+        /* (band+1)/n_segs of the total, without overflow */
+        I32 target = (total/n_segs)*(band+1) + ((total%n_segs)*(band+1))/n_segs;
+        if (cost >= target || height-(y+1) == n_segs-1-band) {
+            state->band_end[band] = y+1;
+            band++;
+        }
+    }
+    LOCO_ASSERT_2(band == n_segs-1, band, n_segs);
+    state->band_end[n_segs-1] = height;
+}
+
+// Rough coded size of a row of the image, for balancing bands
+LOCO_PRIVATE I32 loco_row_cost(const LocoCompressState * state, I32 y)
+{
+    LOCO_ASSERT(state != NULL);
+    LOCO_ASSERT_1(0 <= y && y < state->image_height, y);
+
+    const LocoPixelType *row = state->image_rows[y];
+    const LocoPixelType *up = (y > 0) ? state->image_rows[y-1] : NULL;
+    I32 cost = 0;
+    for (I32 x=0; x<state->image_width; x++) {
+        I32 a = (x > 0) ? row[x-1] : ((up != NULL) ? up[x] : 0);
+        I32 b = (up != NULL) ? up[x] : a;
+        I32 c = (up != NULL && x > 0) ? up[x-1] : b;
+        I32 est;
+        if (c >= a && c >= b) {
+            est = (a < b) ? a : b;
+        } else if (c <= a && c <= b) {
+            est = (a > b) ? a : b;
+        } else {
+            est = a + b - c;
+        }
+        I32 residual = row[x] - est;
+        if (residual < 0) {
+            residual = -residual;
+        }
+        cost++;
+        for (; residual != 0; residual >>= 1) {
+            cost++;
+        }
+    }
+    return cost;
+}
+
+// Size of a segment stored raw, padded to a whole word
+LOCO_PRIVATE I32 loco_raw_segment_bits(LocoCompressState * state, I32 seg)
+{
+    LOCO_ASSERT(state != NULL);
+    LOCO_ASSERT_1(0 <= seg && seg < state->n_segs, seg);
+
+    I32 bitdepth = (state->bit_depth <= BITDEPTH_8BIT) ? BITDEPTH_8BIT : BITDEPTH_12BIT;
+    I32 n_pixels = (state->seg_bound[seg].xend - state->seg_bound[seg].xstart)
+            * (state->seg_bound[seg].yend - state->seg_bound[seg].ystart);
+    I32 header_bits = 2*HEADER_CODE_BITS + IMAGEWIDTH_BITS + IMAGEHEIGHT_BITS
+            + 2*SEGINDEX_BITS + HEADER_FLAGS_BITS
+            + loco_layout_header_bits(state->layout, state->n_segs)
+            + ((seg == 0) ? state->shared_bits : 0);
+    I32 word_bits = (I32)(8*sizeof(LocoBitstreamType));
+
+    return ((((header_bits + 7) & ~7) + n_pixels*bitdepth + word_bits - 1)
+            / word_bits) * word_bits;
+}
+
+/* Replace the coded segment, which started at p_seg_start, with the pixels
+   stored raw: the extended header, padding to a whole byte, then each pixel
+   most significant bit first, so 8 bit pixels are one byte each, and two
+   12 bit pixels are three bytes. */
+LOCO_PRIVATE void loco_store_raw_segment(LocoCompressState * state, I32 seg,
+        LocoBitstreamType *p_seg_start)
+{
+    LOCO_ASSERT(state != NULL);
+    LOCO_ASSERT_1(0 <= seg && seg < state->n_segs, seg);
+
+    I32 bitdepth = (state->bit_depth <= BITDEPTH_8BIT) ? BITDEPTH_8BIT : BITDEPTH_12BIT;
+
+    state->p_out = p_seg_start;
+    state->bit_count = 8*sizeof(LocoBitstreamType)-1;
+    state->out_word = 0;
+    state->seg_bits = 0;
+    state->seg_uncoded = 1;
+    if (state->seg_stats != NULL) {
+        state->seg_stats->raw = 1;
+    }
+
+    /* The shared model is not used, but segment 0 still carries it */
+    I32 shared = (seg == 0) ? (state->header_flags & HEADER_FLAG_SHARED) : 0;
+    loco_write_header(state, seg, HEADER_FLAG_RAW | shared
+            | (state->header_flags & HEADER_FLAG_LAYOUT));
+    loco_write_integer(state, 0, (8 - (state->seg_bits & 7)) & 7);
+
+    if (state->size_only) {
+        state->seg_bits += bitdepth
+                * (state->seg_bound[seg].xend - state->seg_bound[seg].xstart)
+                * (state->seg_bound[seg].yend - state->seg_bound[seg].ystart);
+        return;
+    }
+    for (I32 y = state->seg_bound[seg].ystart; y < state->seg_bound[seg].yend; y++) {
+        for (I32 x = state->seg_bound[seg].xstart; x < state->seg_bound[seg].xend; x++) {
+            I32 val = state->image_rows[y][x];
+            for (I32 bit = bitdepth - 1; bit >= 0; bit--) {
+                WRITE_BIT((val >> bit) & 01);
+            }
+        }
+        state->seg_bits += bitdepth
+                * (state->seg_bound[seg].xend - state->seg_bound[seg].xstart);
+    }
+}
+
 LOCO_PRIVATE void loco_write_integer(
         LocoCompressState * state, I32 val, I32 bits)
 {
     LOCO_ASSERT(state != NULL);
+    state->seg_bits += bits;
+    if (state->size_only) {
+        return;
+    }
     for (I32 bits_local = bits; bits_local > 0; bits_local--) {
         WRITE_BIT(val & 01);
         val >>= 1;
     }
 }
+
+// Reset statistics gathering for a segment. seg_stats may be NULL.
+LOCO_PRIVATE void loco_stats_begin_segment(LocoCompressState * state,
+        LocoCompressStats * seg_stats, I32 seg)
+{
+    LOCO_ASSERT(state != NULL);
+    LOCO_ASSERT_1(0 <= seg && seg < state->n_segs, seg);
+
+    state->seg_stats = seg_stats;
+    state->stats_abs_sum_lo = 0;
+    state->stats_abs_sum_hi = 0;
+    if (seg_stats == NULL) {
+        return;
+    }
+
+    seg_stats->n_pixels = (state->seg_bound[seg].xend - state->seg_bound[seg].xstart)
+            * (state->seg_bound[seg].yend - state->seg_bound[seg].ystart);
+    seg_stats->n_bits = 0;
+    seg_stats->bits_per_pixel_q8 = 0;
+    seg_stats->mean_abs_residual_q8 = 0;
+    for (I32 i = 0; i < LOCO_STATS_K_BINS; i++) {
+        seg_stats->k_hist[i] = 0;
+    }
+    for (I32 i = 0; i < LOCO_STATS_UNARY_BINS; i++) {
+        seg_stats->unary_hist[i] = 0;
+    }
+    seg_stats->max_unary = 0;
+    seg_stats->n_contexts_used = 0;
+    seg_stats->truncated = 0;
+    seg_stats->raw = 0;
+    seg_stats->near = 0;
+    seg_stats->dropped = 0;
+}
+
+// Record the coding of one pixel. Only called when gathering statistics.
+LOCO_PRIVATE void loco_stats_record_pixel(LocoCompressState * state,
+        I32 mapped_residual, I32 k, I32 unary)
+{
+    LOCO_ASSERT(state != NULL);
+    LOCO_ASSERT(state->seg_stats != NULL);
+    LOCO_ASSERT_1(mapped_residual >= 0, mapped_residual);
+
+    LocoCompressStats * seg_stats = state->seg_stats;
+
+    // magnitude of the residual, before remapping to a nonnegative integer
+    U32 abs_residual = (U32)((mapped_residual + 1) >> 1);
+    state->stats_abs_sum_lo += abs_residual;
+    if (state->stats_abs_sum_lo < abs_residual) {
+        state->stats_abs_sum_hi++;
+    }
+
+    seg_stats->k_hist[(k < LOCO_STATS_K_BINS) ? k : LOCO_STATS_K_BINS-1]++;
+    seg_stats->unary_hist[(unary < LOCO_STATS_UNARY_BINS)
+                          ? unary : LOCO_STATS_UNARY_BINS-1]++;
+    if (unary > seg_stats->max_unary) {
+        seg_stats->max_unary = unary;
+    }
+}
+
+// Finish statistics for a segment, given how many bits were actually stored.
+LOCO_PRIVATE void loco_stats_end_segment(LocoCompressState * state,
+        I32 n_stored_bits, I32 initcc)
+{
+    LOCO_ASSERT(state != NULL);
+
+    LocoCompressStats * seg_stats = state->seg_stats;
+    if (seg_stats == NULL) {
+        return;
+    }
+    state->seg_stats = NULL;
+
+    // a context that was used has a count that differs from its initial
+    // value, since counts are only halved after growing past the initial value
+    // (with a prior, this can miss a context halved back to its prior count)
+    const LocoContextModel *prior = loco_segment_prior(state, state->seg);
+    for (I32 i = 0; i < LOCO_NCONTEXTS && !seg_stats->dropped; i++) {
+        I32 start_count = (prior != NULL) ? prior->c_count[i] : initcc;
+        seg_stats->n_contexts_used += (state->c_count[i] != start_count);
+    }
+
+    seg_stats->n_bits = state->seg_bits;
+    seg_stats->truncated = (n_stored_bits < state->seg_bits);
+
+    LOCO_ASSERT_1(seg_stats->n_pixels > 2, seg_stats->n_pixels);
+    seg_stats->bits_per_pixel_q8 = loco_scaled_quotient(
+            (U32)state->seg_bits >> 24, (U32)state->seg_bits << 8,
+            (U32)seg_stats->n_pixels);
+    seg_stats->mean_abs_residual_q8 = loco_scaled_quotient(
+            (state->stats_abs_sum_hi << 8) | (state->stats_abs_sum_lo >> 24),
+            state->stats_abs_sum_lo << 8, (U32)(seg_stats->n_pixels - 2));
+}
+
+/* Compute the quotient of a 64 bit numerator (num_hi * 2^32 + num_lo) and a
+   32 bit denominator, using only 32 bit types. The caller guarantees the
+   quotient fits in an I32. */
+LOCO_PRIVATE I32 loco_scaled_quotient(U32 num_hi, U32 num_lo, U32 den)
+{
+    LOCO_ASSERT(den > 0);
+    LOCO_ASSERT_2(den <= 0x7fffffff, num_hi, den);
+
+    U32 rem = 0;
+    U32 quot = 0;
+    for (I32 i = 63; i >= 0; i--) {
+        U32 bit = (i >= 32) ? ((num_hi >> (i - 32)) & 01) : ((num_lo >> i) & 01);
+        rem = (rem << 1) | bit;
+        quot <<= 1;
+        if (rem >= den) {
+            rem -= den;
+            quot |= 01;
+        }
+    }
+    LOCO_ASSERT_1(quot <= 0x7fffffff, quot);
+    return (I32)quot;
+}
+
+/* Compute a * b / den with a 64 bit intermediate product, using only 32 bit
+   types. The caller guarantees the quotient fits in an I32. */
+LOCO_PRIVATE I32 loco_mul_div(U32 a, U32 b, U32 den)
+{
+    U32 p0 = (a & 0xffff) * (b & 0xffff);
+    U32 p1 = (a & 0xffff) * (b >> 16);
+    U32 p2 = (a >> 16) * (b & 0xffff);
+    U32 p3 = (a >> 16) * (b >> 16);
+    U32 mid = (p0 >> 16) + (p1 & 0xffff) + (p2 & 0xffff);
+
+    return loco_scaled_quotient(p3 + (p1 >> 16) + (p2 >> 16) + (mid >> 16),
+            (p0 & 0xffff) | (mid << 16), den);
+}
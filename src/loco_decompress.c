@@ -44,12 +44,6 @@
 #include <loco/loco_conf_private.h>
 #include <loco/loco_private.h>
 
-// Macros for performing context-determination-related table lookups
-#define G_TO_CTXT_8BIT(g)  deloco_g_table_8bit[(g) & 511]
-#define G_TO_CTXT_12BIT(g)  deloco_g_table_12bit[((g)>>3) & 1023]
-#define GFOUR_TO_CTXT_8BIT(g)  deloco_gfour_table_8bit[(g) & 511]
-#define GFOUR_TO_CTXT_12BIT(g)  deloco_gfour_table_12bit[((g)>>3) & 1023]
-
 // Constants
 enum {
     PRANGE_12BIT = 4096,
@@ -60,133 +54,50 @@ enum {
     RMAX_8BIT = 127,
 };
 
-// lookup tables
-LOCO_PRIVATE const U8 deloco_g_table_8bit[512] =
-    {0,0,1,1,1,2,2,2, 2,2,2,2,2,3,3,3, 3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3,
-     3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3,
-     3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3,
-     3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3,
-     3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3,
-     3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3,
-     3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3,
-     3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3,
-
-     7,7,7,7,7,7,7,7, 7,7,7,7,7,7,7,7, 7,7,7,7,7,7,7,7, 7,7,7,7,7,7,7,7,
-     7,7,7,7,7,7,7,7, 7,7,7,7,7,7,7,7, 7,7,7,7,7,7,7,7, 7,7,7,7,7,7,7,7,
-     7,7,7,7,7,7,7,7, 7,7,7,7,7,7,7,7, 7,7,7,7,7,7,7,7, 7,7,7,7,7,7,7,7,
-     7,7,7,7,7,7,7,7, 7,7,7,7,7,7,7,7, 7,7,7,7,7,7,7,7, 7,7,7,7,7,7,7,7,
-     7,7,7,7,7,7,7,7, 7,7,7,7,7,7,7,7, 7,7,7,7,7,7,7,7, 7,7,7,7,7,7,7,7,
-     7,7,7,7,7,7,7,7, 7,7,7,7,7,7,7,7, 7,7,7,7,7,7,7,7, 7,7,7,7,7,7,7,7,
-     7,7,7,7,7,7,7,7, 7,7,7,7,7,7,7,7, 7,7,7,7,7,7,7,7, 7,7,7,7,7,7,7,7,
-     7,7,7,7,7,7,7,7, 7,7,7,7,7,7,7,7, 7,7,7,7,6,6,6,6, 6,6,6,6,5,5,5,0};
-
-LOCO_PRIVATE const U8 deloco_gfour_table_8bit[512] =
-    {0,0,0,0,0,0,1,1, 1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1,
-     1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1,
-     1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1,
-     1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1,
-     1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1,
-     1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1,
-     1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1,
-     1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1,
-
-     3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3,
-     3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3,
-     3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3,
-     3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3,
-     3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3,
-     3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3,
-     3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3,
-     3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3, 3,3,3,0,0,0,0,0};
-
-LOCO_PRIVATE const U8 deloco_g_table_12bit[1024] =
-    {0,0,1,1,1,1,2,2, 2,2,2,2,2,2,2,2, 3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3,
-     3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3,
-     3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3,
-     3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3,
-     3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3,
-     3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3,
-     3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3,
-     3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3,
-
-     3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3,
-     3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3,
-     3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3,
-     3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3,
-     3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3,
-     3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3,
-     3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3,
-     3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3,
-
-     7,7,7,7,7,7,7,7, 7,7,7,7,7,7,7,7, 7,7,7,7,7,7,7,7, 7,7,7,7,7,7,7,7,
-     7,7,7,7,7,7,7,7, 7,7,7,7,7,7,7,7, 7,7,7,7,7,7,7,7, 7,7,7,7,7,7,7,7,
-     7,7,7,7,7,7,7,7, 7,7,7,7,7,7,7,7, 7,7,7,7,7,7,7,7, 7,7,7,7,7,7,7,7,
-     7,7,7,7,7,7,7,7, 7,7,7,7,7,7,7,7, 7,7,7,7,7,7,7,7, 7,7,7,7,7,7,7,7,
-     7,7,7,7,7,7,7,7, 7,7,7,7,7,7,7,7, 7,7,7,7,7,7,7,7, 7,7,7,7,7,7,7,7,
-     7,7,7,7,7,7,7,7, 7,7,7,7,7,7,7,7, 7,7,7,7,7,7,7,7, 7,7,7,7,7,7,7,7,
-     7,7,7,7,7,7,7,7, 7,7,7,7,7,7,7,7, 7,7,7,7,7,7,7,7, 7,7,7,7,7,7,7,7,
-     7,7,7,7,7,7,7,7, 7,7,7,7,7,7,7,7, 7,7,7,7,7,7,7,7, 7,7,7,7,7,7,7,7,
-
-     7,7,7,7,7,7,7,7, 7,7,7,7,7,7,7,7, 7,7,7,7,7,7,7,7, 7,7,7,7,7,7,7,7,
-     7,7,7,7,7,7,7,7, 7,7,7,7,7,7,7,7, 7,7,7,7,7,7,7,7, 7,7,7,7,7,7,7,7,
-     7,7,7,7,7,7,7,7, 7,7,7,7,7,7,7,7, 7,7,7,7,7,7,7,7, 7,7,7,7,7,7,7,7,
-     7,7,7,7,7,7,7,7, 7,7,7,7,7,7,7,7, 7,7,7,7,7,7,7,7, 7,7,7,7,7,7,7,7,
-     7,7,7,7,7,7,7,7, 7,7,7,7,7,7,7,7, 7,7,7,7,7,7,7,7, 7,7,7,7,7,7,7,7,
-     7,7,7,7,7,7,7,7, 7,7,7,7,7,7,7,7, 7,7,7,7,7,7,7,7, 7,7,7,7,7,7,7,7,
-     7,7,7,7,7,7,7,7, 7,7,7,7,7,7,7,7, 7,7,7,7,7,7,7,7, 7,7,7,7,7,7,7,7,
-     7,7,7,7,7,7,7,7, 7,7,7,7,7,7,7,7, 6,6,6,6,6,6,6,6, 6,6,5,5,5,5,0,0};
-
-LOCO_PRIVATE const U8 deloco_gfour_table_12bit[1024] =
-    {0,0,0,0,0,0,0,0, 1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1,
-     1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1,
-     1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1,
-     1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1,
-     1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1,
-     1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1,
-     1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1,
-     1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1,
-
-     1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1,
-     1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1,
-     1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1,
-     1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1,
-     1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1,
-     1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1,
-     1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1,
-     1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1,
-
-     3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3,
-     3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3,
-     3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3,
-     3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3,
-     3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3,
-     3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3,
-     3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3,
-     3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3,
-
-     3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3,
-     3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3,
-     3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3,
-     3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3,
-     3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3,
-     3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3,
-     3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3,
-     3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3, 3,3,3,3,3,3,3,3, 0,0,0,0,0,0,0,0};
-
+// A pixel's neighbours, as gathered for prediction and contexts
+enum {
+    NB_W,       // left
+    NB_WW,      // two to the left
+    NB_N,       // above
+    NB_NW,      // above left
+    NB_NE,      // above right
+    NB_REF,     // the reference pixel, if temporal, otherwise 0
+    N_NEIGHBOURS,
+};
 
 // function prototypes
 LOCO_PRIVATE void deloco_init_bitstream(LocoDecompressState * state,
         U8 *datastart, I32 segdatabits);
 LOCO_PRIVATE I32 deloco_read_int(LocoDecompressState * state, I32 *pval, I32 nbits);
+LOCO_PRIVATE I32 deloco_read_header(LocoDecompressState * state,
+        I32 *header_code, I32 *width, I32 *height, I32 *n_segs, I32 *seg,
+        I32 *header_flags, I32 *near, I32 *layout, I32 band_end[LOCO_MAX_SEGS]);
+LOCO_PRIVATE I32 deloco_same_layout(const LocoDecompressState * state,
+        I32 layout, const I32 band_end[LOCO_MAX_SEGS]);
 LOCO_PRIVATE I32 deloco_read_bit(LocoDecompressState * deloco);
 LOCO_PRIVATE I32 deloco_decompress_segment(LocoDecompressState * deloco, I32 seg);
+LOCO_PRIVATE void deloco_start_segment(LocoDecompressState * deloco, I32 seg);
+LOCO_PRIVATE I32 deloco_continue_segment(LocoDecompressState * deloco);
+LOCO_PRIVATE I32 deloco_unpack_raw_segment(LocoDecompressState * deloco);
 LOCO_PRIVATE I32 deloco_decode_value(LocoDecompressState * deloco, I32 k);
 LOCO_PRIVATE void deloco_find_context(LocoDecompressState * deloco,
-        I32 x, I32 y, I32 xstart, I32 xend, I32 ystart);
+        const I32 nb[N_NEIGHBOURS], I32 x, I32 y, I32 xstart, I32 xend,
+        I32 ystart);
 LOCO_PRIVATE I32 deloco_g_to_ctxt(LocoDecompressState * deloco, I32 g);
 LOCO_PRIVATE I32 deloco_gfour_to_ctxt(LocoDecompressState * deloco, I32 g);
-LOCO_PRIVATE I32 deloco_estimate(LocoDecompressState * deloco,
+LOCO_PRIVATE I32 deloco_estimate(const I32 nb[N_NEIGHBOURS],
         I32 x, I32 y, I32 xstart, I32 ystart);
+LOCO_PRIVATE void deloco_neighbours(const LocoDecompressState * deloco,
+        I32 x, I32 y, I32 ystart, I32 nb[N_NEIGHBOURS]);
+LOCO_PRIVATE void deloco_neighbours_temporal(const LocoDecompressState * deloco,
+        I32 x, I32 y, I32 ystart, I32 nb[N_NEIGHBOURS]);
+LOCO_PRIVATE void deloco_store_model(const LocoDecompressState * deloco,
+        LocoContextModel * model);
+LOCO_PRIVATE void deloco_prior_model(const LocoDecompressState * deloco,
+        const LocoDecompressOptions * options, I32 seg, I32 bit_depth,
+        LocoContextModel * model);
+LOCO_PRIVATE I32 deloco_reference_fits(const LocoImage * reference,
+        I32 header_code, I32 width, I32 height);
 
 // functions
 
@@ -195,6 +106,39 @@ I32 loco_decompress(
     const LocoCompressedSegments * compressed_in,
     LocoImage *image_out,
     LocoSegmentData seg_data[LOCO_MAX_SEGS])
+{
+    return loco_decompress_ext(state, compressed_in, NULL, image_out, seg_data);
+}
+
+I32 loco_decompress_with_reference(
+    LocoDecompressState * state,
+    const LocoCompressedSegments * compressed_in,
+    const LocoImage *reference,
+    LocoImage *image_out,
+    LocoSegmentData seg_data[LOCO_MAX_SEGS])
+{
+    LocoDecompressOptions options;
+    loco_init_decompress_options(&options);
+    options.reference = reference;
+    return loco_decompress_ext(state, compressed_in, &options, image_out,
+            seg_data);
+}
+
+void loco_init_decompress_options(LocoDecompressOptions *options)
+{
+    LOCO_ASSERT(options != NULL);
+
+    options->reference = NULL;
+    options->priors = NULL;
+    options->models_out = NULL;
+}
+
+I32 loco_decompress_ext(
+    LocoDecompressState * state,
+    const LocoCompressedSegments * compressed_in,
+    const LocoDecompressOptions *options,
+    LocoImage *image_out,
+    LocoSegmentData seg_data[LOCO_MAX_SEGS])
 {
     LOCO_ASSERT(state != NULL);
     LOCO_ASSERT(image_out != NULL);
@@ -207,6 +151,10 @@ I32 loco_decompress(
     I32 i;
     I32 j;
     I32 header_code;
+    I32 header_flags;
+    I32 near;
+    I32 layout;
+    I32 band_end[LOCO_MAX_SEGS];
     I32 width;
     I32 height;
     I32 cur_n_segs;
@@ -220,10 +168,19 @@ I32 loco_decompress(
     U32 seg_flag_duplicateseg = 0x0;
     U32 seg_flag_badheadercode = 0x0;
     U32 seg_flag_missingdata = 0x0;
+    U32 seg_flag_noreference = 0x0;
+    LocoDecompressOptions default_options;
 
     LOCO_COMPILE_ASSERT(LOCO_MAX_SEGS <= 32, too_many_loco_segs);
 
+    if (options == NULL) {
+        loco_init_decompress_options(&default_options);
+        options = &default_options;
+    }
+    const LocoImage *reference = options->reference;
+
     status = 0;
+    state->have_shared = 0;
     if (compressed_in->n_segs<1 || compressed_in->n_segs>LOCO_MAX_SEGS) {
         status |= DELOCO_BADNUMDATASEG_FLAG;
         LOCO_WARN2(LOCO_DECOMPRESS_BAD_NSEGS,
@@ -235,31 +192,70 @@ I32 loco_decompress(
 
     have_parameters = 0;
 
+    /* Find the shared model, if segment 0 carries one */
+    for (i=0; i<compressed_in->n_segs && !state->have_shared; i++) {
+        LOCO_ASSERT(compressed_in->seg_ptr[i] != NULL);
+        deloco_init_bitstream(state, compressed_in->seg_ptr[i],
+                compressed_in->n_bits[i]);
+        if (deloco_read_header(state, &header_code, &width, &height,
+                &cur_n_segs, &seg, &header_flags, &near, &layout, band_end)
+                && seg == 0 && (header_flags & HEADER_FLAG_SHARED)
+                && !(header_flags & ~HEADER_FLAGS_KNOWN)) {
+            loco_expand_shared_model(state->shared_k,
+                    (header_code == HEADER_CODE_FOR_8BIT) ?
+                        BITDEPTH_8BIT : BITDEPTH_12BIT,
+                    &state->shared_model);
+            state->have_shared = 1;
+        }
+    }
+
     for (i=0; i<compressed_in->n_segs; i++) {
         seg_data[i].status = 0;
         LOCO_ASSERT(compressed_in->seg_ptr[i] != NULL);
         deloco_init_bitstream(state, compressed_in->seg_ptr[i],
                 compressed_in->n_bits[i]);
-        (void)deloco_read_int(state, &header_code, HEADER_CODE_BITS);
-        (void)deloco_read_int(state, &width, IMAGEWIDTH_BITS);
-        (void)deloco_read_int(state, &height, IMAGEHEIGHT_BITS);
-        (void)deloco_read_int(state, &cur_n_segs, SEGINDEX_BITS);
-        (void)deloco_read_int(state, &seg, SEGINDEX_BITS);
-        if (state->out_of_bits) {
+        if (!deloco_read_header(state, &header_code, &width, &height,
+                &cur_n_segs, &seg, &header_flags, &near, &layout, band_end)) {
             seg_data[i].status |= DELOCO_SHORTDATASEG_FLAG;
             seg_flag_shortdataseg |= (0x1<<i);
             continue;
         }
-        width++;
-        height++;
-        cur_n_segs++;
 
         /* Record actual segment number (before checking whether it is valid) */
         seg_data[i].real_num = seg;
 
+        if (header_flags & ~HEADER_FLAGS_KNOWN) {
+            seg_data[i].status |= DELOCO_BAD_HEADER_CODE_FLAG;
+            seg_flag_badheadercode |= (0x1<<i);
+            continue;
+        }
+
+        if ((header_flags & HEADER_FLAG_TEMPORAL)
+                && !deloco_reference_fits(reference, header_code, width, height)) {
+            seg_data[i].status |= DELOCO_NO_REFERENCE_FLAG;
+            seg_flag_noreference |= (0x1<<i);
+            continue;
+        }
+
+        if ((header_flags & HEADER_FLAG_PRIOR) && (options->priors == NULL
+                || seg >= cur_n_segs
+                || !loco_check_context_model(&options->priors[seg],
+                    8*(header_code==HEADER_CODE_FOR_8BIT)
+                    + 12*(header_code==HEADER_CODE_FOR_12BIT)))) {
+            seg_data[i].status |= DELOCO_NO_PRIOR_FLAG;
+            seg_flag_noreference |= (0x1<<i);
+            continue;
+        }
+        if ((header_flags & HEADER_FLAG_SHARED) && !state->have_shared) {
+            seg_data[i].status |= DELOCO_NO_PRIOR_FLAG;
+            seg_flag_noreference |= (0x1<<i);
+            continue;
+        }
+
         if (have_parameters) {
             if (state->header_code!=header_code || state->image_width!=width ||
-                    state->image_height!=height || state->n_segs!=cur_n_segs) {
+                    state->image_height!=height || state->n_segs!=cur_n_segs ||
+                    !deloco_same_layout(state, layout, band_end)) {
                 seg_data[i].status |= DELOCO_INCONSISTENTDATA_FLAG;
                 seg_flag_inconsistentdata |= (0x1<<i);
                 continue;
@@ -286,7 +282,9 @@ I32 loco_decompress(
             if (width<LOCO_MIN_IMAGE_WIDTH || width>LOCO_MAX_IMAGE_WIDTH ||
                     height<LOCO_MIN_IMAGE_HEIGHT || height>LOCO_MAX_IMAGE_HEIGHT ||
                     cur_n_segs<1 || cur_n_segs>LOCO_MAX_SEGS ||
-                    width*height < cur_n_segs*LOCO_MIN_SEGMENT_PIXELS) {
+                    width*height < cur_n_segs*LOCO_MIN_SEGMENT_PIXELS ||
+                    !loco_setup_layout(width, height, cur_n_segs, layout,
+                        band_end, state->seg_bound)) {
                 seg_data[i].status |= DELOCO_BADDATA_FLAG;
                 seg_flag_baddata |= (0x1<<i);
                 continue;
@@ -298,6 +296,14 @@ I32 loco_decompress(
             state->image_width = width;
             state->image_height = height;
             state->n_segs = cur_n_segs;
+            state->layout = layout;
+            /* Only a balanced layout has band ends in the header, one for
+               each band but the last */
+            if (layout == LOCO_LAYOUT_BALANCED) {
+                for (j=0; j<cur_n_segs-1; j++) {
+                    state->band_end[j] = band_end[j];
+                }
+            }
 
             image_out->bit_depth = 8*(header_code==HEADER_CODE_FOR_8BIT) +
                     12*(header_code==HEADER_CODE_FOR_12BIT);
@@ -329,9 +335,6 @@ I32 loco_decompress(
                     state->image[y][x] = 0;
                 }
             }
-
-            loco_setup_segs(state->image_width, state->image_height, state->n_segs,
-                    state->seg_bound);
         }
 
         /* If we haven't moved on to the next data segment at this point,
@@ -343,12 +346,45 @@ I32 loco_decompress(
                 - state->seg_bound[seg].ystart;
         seg_data[i].bound_n_samples = state->seg_bound[seg].xend
                 - state->seg_bound[seg].xstart;
+        state->header_flags = header_flags;
+        state->near = near;
+        if (header_flags & HEADER_FLAG_TEMPORAL) {
+            state->ref_data = reference->data;
+            state->ref_space_width = reference->space_width;
+        }
+        state->prior = NULL;
+        if (header_flags & HEADER_FLAG_SHARED) {
+            state->prior = &state->shared_model;
+        } else if (header_flags & HEADER_FLAG_PRIOR) {
+            state->prior = &options->priors[seg];
+        }
         seg_data[i].n_missing_pixels = deloco_decompress_segment(state, seg);
-        if (seg_data[i].n_missing_pixels > 0) {
+        if (state->bad_code) {
+            seg_data[i].status |= DELOCO_BADDATA_FLAG;
+            seg_flag_baddata |= (0x1<<i);
+        } else if (seg_data[i].n_missing_pixels > 0) {
             seg_data[i].status |= DELOCO_MISSING_DATA_FLAG;
             seg_flag_missingdata |= (0x1<<i);
         }
         seg_decoded[seg] = 1;
+        if (options->models_out == NULL) {
+            // no models wanted
+        } else if (header_flags & HEADER_FLAG_RAW) {
+            /* As the compressor, a raw segment outputs its prior */
+            deloco_prior_model(state, options, seg, image_out->bit_depth,
+                    &options->models_out[seg]);
+        } else {
+            deloco_store_model(state, &options->models_out[seg]);
+        }
+    }
+
+    if (have_parameters && options->models_out != NULL) {
+        for (j=0; j<state->n_segs; j++) {
+            if (!seg_decoded[j]) {
+                deloco_prior_model(state, options, j, image_out->bit_depth,
+                        &options->models_out[j]);
+            }
+        }
     }
 
     if (!have_parameters) {
@@ -359,19 +395,505 @@ I32 loco_decompress(
 
     if (seg_flag_shortdataseg || seg_flag_inconsistentdata
             || seg_flag_baddata || seg_flag_duplicateseg
-            || seg_flag_badheadercode || seg_flag_missingdata) {
-        LOCO_WARN6(LOCO_DECOMPRESS_BAD_SEGS,
+            || seg_flag_badheadercode || seg_flag_missingdata
+            || seg_flag_noreference) {
+        LOCO_WARN7(LOCO_DECOMPRESS_BAD_SEGS,
                 "In loco_decompress(), one or more segment issues: "
                 "Short data: 0x%04x Inconsistent: 0x%04x Bad data: 0x%04x "
-                "Duplicates: 0x%04x Bad header: 0x%04x Missing data: 0x%04x.",
+                "Duplicates: 0x%04x Bad header: 0x%04x Missing data: 0x%04x "
+                "No reference or prior: 0x%04x.",
                 seg_flag_shortdataseg, seg_flag_inconsistentdata, seg_flag_baddata,
-                seg_flag_duplicateseg, seg_flag_badheadercode, seg_flag_missingdata);
+                seg_flag_duplicateseg, seg_flag_badheadercode, seg_flag_missingdata,
+                seg_flag_noreference);
     }
 
     return status;
 }
 
 
+I32 loco_peek(
+    LocoDecompressState * state,
+    const LocoCompressedSegments * compressed_in,
+    LocoImageInfo *info)
+{
+    LOCO_ASSERT(state != NULL);
+    LOCO_ASSERT(compressed_in != NULL);
+    LOCO_ASSERT(info != NULL);
+
+    I32 header_code;
+    I32 header_flags;
+    I32 near;
+    I32 layout;
+    I32 band_end[LOCO_MAX_SEGS];
+    I32 width;
+    I32 height;
+    I32 n_segs;
+    I32 seg;
+
+    if (compressed_in->n_segs<1 || compressed_in->n_segs>LOCO_MAX_SEGS) {
+        LOCO_WARN2(LOCO_DECOMPRESS_BAD_NSEGS,
+                "In loco_peek(), compressed_in->n_segs (%d) "
+                "was less than 1 or greater than %d.",
+                compressed_in->n_segs, LOCO_MAX_SEGS);
+        return DELOCO_BADNUMDATASEG_FLAG;
+    }
+
+    for (I32 i=0; i<compressed_in->n_segs; i++) {
+        LOCO_ASSERT(compressed_in->seg_ptr[i] != NULL);
+        deloco_init_bitstream(state, compressed_in->seg_ptr[i],
+                compressed_in->n_bits[i]);
+        if (!deloco_read_header(state, &header_code, &width, &height,
+                &n_segs, &seg, &header_flags, &near, &layout, band_end)) {
+            continue;
+        }
+        if (header_flags & ~HEADER_FLAGS_KNOWN
+                || (header_code != HEADER_CODE_FOR_12BIT
+                    && header_code != HEADER_CODE_FOR_8BIT)) {
+            continue;
+        }
+        if (width<LOCO_MIN_IMAGE_WIDTH || width>LOCO_MAX_IMAGE_WIDTH ||
+                height<LOCO_MIN_IMAGE_HEIGHT || height>LOCO_MAX_IMAGE_HEIGHT ||
+                n_segs<1 || n_segs>LOCO_MAX_SEGS ||
+                width*height < n_segs*LOCO_MIN_SEGMENT_PIXELS ||
+                !loco_setup_layout(width, height, n_segs, layout, band_end,
+                    info->seg_bound)) {
+            continue;
+        }
+
+        info->width = width;
+        info->height = height;
+        info->bit_depth = (header_code == HEADER_CODE_FOR_8BIT) ?
+                BITDEPTH_8BIT : BITDEPTH_12BIT;
+        info->n_segs = n_segs;
+        info->layout = layout;
+        info->size_data_bytes = width*height*(I32)sizeof(LocoPixelType);
+        info->first_good_seg = i;
+        info->temporal = (header_flags & HEADER_FLAG_TEMPORAL) != 0;
+        return LOCO_OK;
+    }
+
+    LOCO_WARN0(LOCO_DECOMPRESS_NOGOODSEGS,
+            "In loco_peek(), no good segments found.");
+    return DELOCO_NOGOODSEGMENTS_FLAG;
+}
+
+I32 loco_batch_segments(
+    const LocoCompressedImage *batch,
+    const LocoBatchEntry *entry,
+    LocoCompressedSegments *segments)
+{
+    LOCO_ASSERT(batch != NULL);
+    LOCO_ASSERT(batch->data != NULL);
+    LOCO_ASSERT(entry != NULL);
+    LOCO_ASSERT(segments != NULL);
+
+    segments->n_segs = 0;
+    for (I32 seg = 0; seg <= LOCO_MAX_SEGS; seg++) {
+        segments->seg_ptr[seg] = NULL;
+        if (seg < LOCO_MAX_SEGS) {
+            segments->n_bits[seg] = 0;
+        }
+    }
+
+    if (entry->n_segs<1 || entry->n_segs>LOCO_MAX_SEGS) {
+        LOCO_WARN2(LOCO_DECOMPRESS_BAD_NSEGS,
+                "In loco_batch_segments(), entry->n_segs (%d) "
+                "was less than 1 or greater than %d.",
+                entry->n_segs, LOCO_MAX_SEGS);
+        return DELOCO_BADNUMDATASEG_FLAG;
+    }
+    I32 table_bytes = entry->n_segs * (I32)sizeof(LocoBitstreamType);
+    if (entry->offset_bytes < 0
+            || entry->offset_bytes % (I32)sizeof(LocoBitstreamType) != 0
+            || entry->size_bytes < table_bytes
+            || entry->offset_bytes > batch->compressed_size_bytes - entry->size_bytes) {
+        LOCO_WARN4(LOCO_DECOMPRESS_BADDATA,
+                "In loco_batch_segments(), an image of %d B at offset %d "
+                "with %d segments did not fit %d B of packed images.",
+                entry->size_bytes, entry->offset_bytes, entry->n_segs,
+                batch->compressed_size_bytes);
+        return DELOCO_BADDATA_FLAG;
+    }
+
+    /* The table is big-endian, whatever the platform */
+    const U8 *table = (const U8*)batch->data + entry->offset_bytes;
+    U8 *seg_ptr = (U8*)batch->data + entry->offset_bytes + table_bytes;
+    I32 data_bytes = entry->size_bytes - table_bytes;
+    for (I32 seg = 0; seg < entry->n_segs; seg++) {
+        const U8 *word = table + seg * (I32)sizeof(LocoBitstreamType);
+        U32 n_bits = ((U32)word[0] << 24) | ((U32)word[1] << 16)
+                | ((U32)word[2] << 8) | (U32)word[3];
+        if (n_bits % (8*sizeof(LocoBitstreamType)) != 0
+                || n_bits / 8 > (U32)data_bytes) {
+            LOCO_WARN4(LOCO_DECOMPRESS_BADDATA,
+                    "In loco_batch_segments(), segment %d of %d bits "
+                    "did not fit the %d B left of the %d B image.",
+                    seg, (I32)n_bits, data_bytes, entry->size_bytes);
+            return DELOCO_BADDATA_FLAG;
+        }
+        segments->seg_ptr[seg] = seg_ptr;
+        segments->n_bits[seg] = (I32)n_bits;
+        seg_ptr += n_bits / 8;
+        data_bytes -= (I32)(n_bits / 8);
+    }
+    segments->seg_ptr[entry->n_segs] = seg_ptr;
+    segments->n_segs = entry->n_segs;
+    return LOCO_OK;
+}
+
+I32 loco_decompress_batch(
+    LocoDecompressState * state,
+    const LocoCompressedImage *batch,
+    const LocoBatchEntry index[],
+    I32 n_images,
+    LocoImage images_out[],
+    I32 statuses[])
+{
+    LOCO_ASSERT(state != NULL);
+    LOCO_ASSERT(batch != NULL);
+    LOCO_ASSERT(index != NULL);
+    LOCO_ASSERT(images_out != NULL);
+    LOCO_ASSERT(statuses != NULL);
+    LOCO_ASSERT_1(n_images >= 0, n_images);
+
+    I32 batch_status = 0;
+    LocoCompressedSegments segments;
+    LocoSegmentData seg_data[LOCO_MAX_SEGS];
+    for (I32 i=0; i<n_images; i++) {
+        I32 status;
+        if (index[i].size_bytes == 0) {
+            status = DELOCO_NOGOODSEGMENTS_FLAG;
+        } else {
+            status = loco_batch_segments(batch, &index[i], &segments);
+            if (status == LOCO_OK) {
+                status = loco_decompress(state, &segments, &images_out[i],
+                        seg_data);
+            }
+        }
+        statuses[i] = status;
+        batch_status |= status;
+    }
+    return batch_status;
+}
+
+I32 loco_unpack_packets(
+    const LocoBitstreamType *const packets[],
+    I32 n_packets,
+    I32 packet_bytes,
+    LocoCompressedImage *result)
+{
+    LOCO_ASSERT(packets != NULL);
+    LOCO_ASSERT(result != NULL);
+    LOCO_ASSERT(result->data != NULL);
+
+    I32 status = 0;
+    I32 n_segs = 0;
+    I32 cur_seg = -1;
+    I32 cur_last = 0;     // the last packet of cur_seg was unpacked
+    I32 cur_intact = 0;   // no packet of cur_seg was lost so far
+    U8 *out = (U8*)result->data;
+    I32 out_free = (result->size_data_bytes > 0) ? result->size_data_bytes : 0;
+
+    result->compressed_size_bytes = 0;
+    result->segments.n_segs = 0;
+    for (I32 seg = 0; seg <= LOCO_MAX_SEGS; seg++) {
+        result->segments.seg_ptr[seg] = NULL;
+    }
+
+    for (I32 i = 0; i <= n_packets; i++) {
+        I32 seg = n_segs; // past the last segment, to finish it
+        I32 payload_bytes = 0;
+        U32 bit_offset = 0;
+        I32 last = 0;
+        const U8 *header = NULL;
+        if (i < n_packets) {
+            LOCO_ASSERT(packets[i] != NULL);
+            header = (const U8*)packets[i];
+            seg = header[0] & ~LOCO_PACKET_LAST_FLAG;
+            last = (header[0] & LOCO_PACKET_LAST_FLAG) != 0;
+            payload_bytes = (header[2] << 8) | header[3];
+            bit_offset = ((U32)header[4] << 24) | ((U32)header[5] << 16)
+                    | ((U32)header[6] << 8) | (U32)header[7];
+            if (n_segs == 0 && header[1] >= 1 && header[1] <= LOCO_MAX_SEGS) {
+                n_segs = header[1];
+            }
+            if (header[1] != n_segs || seg >= n_segs || seg < cur_seg
+                    || payload_bytes > packet_bytes - LOCO_PACKET_HEADER_BYTES
+                    || payload_bytes % (I32)sizeof(LocoBitstreamType) != 0) {
+                status |= DELOCO_BADDATA_FLAG;
+                continue;
+            }
+        }
+
+        /* Move on to this packet's segment. Segments without packets
+           are empty. */
+        while (cur_seg < seg) {
+            if (cur_seg >= 0 && !(cur_last && cur_intact)) {
+                status |= DELOCO_MISSING_DATA_FLAG;
+            }
+            cur_seg++;
+            cur_last = 0;
+            cur_intact = 1;
+            if (cur_seg < n_segs) {
+                result->segments.seg_ptr[cur_seg] = out;
+                result->segments.n_bits[cur_seg] = 0;
+            }
+        }
+        if (header == NULL) {
+            break;
+        }
+
+        /* Skip repeated packets. Only the part of a segment before a lost
+           packet can be decoded. */
+        if (cur_last || bit_offset < (U32)result->segments.n_bits[seg]) {
+            continue;
+        }
+        if (!cur_intact || bit_offset != (U32)result->segments.n_bits[seg]) {
+            cur_intact = 0;
+            continue;
+        }
+        if (payload_bytes > out_free) {
+            status |= DELOCO_BUFTOOSMALL_FLAG;
+            cur_intact = 0;
+            continue;
+        }
+        const U8 *payload = header + LOCO_PACKET_HEADER_BYTES;
+        for (I32 b = 0; b < payload_bytes; b++) {
+            *out++ = payload[b];
+        }
+        out_free -= payload_bytes;
+        result->segments.n_bits[seg] += 8 * payload_bytes;
+        cur_last = last;
+    }
+
+    result->segments.n_segs = n_segs;
+    result->segments.seg_ptr[n_segs] = out;
+    result->compressed_size_bytes = (I32)(out - (U8*)result->data);
+    if (n_segs == 0) {
+        status |= DELOCO_NOGOODSEGMENTS_FLAG;
+    }
+    return status;
+}
+
+I32 loco_decompress_segment_start(
+    LocoDecompressState * state,
+    U8 *data,
+    I32 n_bits,
+    LocoImage *image_out,
+    LocoSegmentData *seg_data)
+{
+    LOCO_ASSERT(state != NULL);
+    LOCO_ASSERT(data != NULL);
+    LOCO_ASSERT(image_out != NULL);
+    LOCO_ASSERT(image_out->data != NULL);
+    LOCO_ASSERT(seg_data != NULL);
+
+    I32 header_code;
+    I32 header_flags;
+    I32 near;
+    I32 layout;
+    I32 band_end[LOCO_MAX_SEGS];
+    I32 width;
+    I32 height;
+    I32 n_segs;
+    I32 seg;
+
+    seg_data->status = 0;
+    seg_data->n_missing_pixels = 0;
+    deloco_init_bitstream(state, data, n_bits);
+    if (!deloco_read_header(state, &header_code, &width, &height,
+            &n_segs, &seg, &header_flags, &near, &layout, band_end)) {
+        seg_data->status |= DELOCO_SHORTDATASEG_FLAG;
+        return DELOCO_NOGOODSEGMENTS_FLAG;
+    }
+    seg_data->real_num = seg;
+
+    if (header_flags & ~HEADER_FLAGS_KNOWN
+            || (header_code != HEADER_CODE_FOR_12BIT
+                && header_code != HEADER_CODE_FOR_8BIT)) {
+        seg_data->status |= DELOCO_BAD_HEADER_CODE_FLAG;
+        return DELOCO_NOGOODSEGMENTS_FLAG;
+    }
+    if (width<LOCO_MIN_IMAGE_WIDTH || width>LOCO_MAX_IMAGE_WIDTH ||
+            height<LOCO_MIN_IMAGE_HEIGHT || height>LOCO_MAX_IMAGE_HEIGHT ||
+            n_segs<1 || n_segs>LOCO_MAX_SEGS || seg >= n_segs ||
+            width*height < n_segs*LOCO_MIN_SEGMENT_PIXELS ||
+            !loco_setup_layout(width, height, n_segs, layout, band_end,
+                state->seg_bound)) {
+        seg_data->status |= DELOCO_BADDATA_FLAG;
+        return DELOCO_NOGOODSEGMENTS_FLAG;
+    }
+    if (header_flags & HEADER_FLAG_TEMPORAL) {
+        /* No reference frame can be given here */
+        seg_data->status |= DELOCO_NO_REFERENCE_FLAG;
+        return DELOCO_NOGOODSEGMENTS_FLAG;
+    }
+    if (header_flags & (HEADER_FLAG_PRIOR | HEADER_FLAG_SHARED)) {
+        /* Nor can priors or a shared model */
+        seg_data->status |= DELOCO_NO_PRIOR_FLAG;
+        return DELOCO_NOGOODSEGMENTS_FLAG;
+    }
+
+    I32 bit_depth = (header_code == HEADER_CODE_FOR_8BIT) ?
+            BITDEPTH_8BIT : BITDEPTH_12BIT;
+    if (image_out->n_segs == 0) {
+        /* The first segment sets up the image */
+        if (image_out->size_data_bytes < width*height*(I32)sizeof(LocoPixelType)) {
+            LOCO_WARN4(LOCO_DECOMPRESS_BUFTOOSMALL,
+                    "In loco_decompress_segment_start(), %d B output buffer "
+                    "could not hold %d x %d x %u B image.",
+                    image_out->size_data_bytes,
+                    width, height, (U32)sizeof(LocoPixelType));
+            return DELOCO_BUFTOOSMALL_FLAG;
+        }
+        image_out->bit_depth = bit_depth;
+        image_out->width = width;
+        image_out->space_width = width;
+        image_out->height = height;
+        image_out->n_segs = n_segs;
+        for (I32 i=0; i<width*height; i++) {
+            image_out->data[i] = 0;
+        }
+    } else if (image_out->bit_depth != bit_depth || image_out->width != width
+            || image_out->height != height || image_out->n_segs != n_segs) {
+        seg_data->status |= DELOCO_INCONSISTENTDATA_FLAG;
+        return DELOCO_NOGOODSEGMENTS_FLAG;
+    }
+
+    state->header_code = header_code;
+    state->header_flags = header_flags;
+    state->near = near;
+    state->image_width = width;
+    state->image_height = height;
+    state->n_segs = n_segs;
+    state->layout = layout;
+    for (I32 y=0; y<height; y++) {
+        state->image[y] = image_out->data + y*width;
+    }
+
+    seg_data->bound_first_line = state->seg_bound[seg].ystart;
+    seg_data->bound_first_sample = state->seg_bound[seg].xstart;
+    seg_data->bound_n_lines = state->seg_bound[seg].yend - state->seg_bound[seg].ystart;
+    seg_data->bound_n_samples = state->seg_bound[seg].xend - state->seg_bound[seg].xstart;
+
+    deloco_start_segment(state, seg);
+    (void)loco_decompress_segment_continue(state, n_bits, seg_data);
+    return 0;
+}
+
+I32 loco_decompress_segment_continue(
+    LocoDecompressState * state,
+    I32 n_bits,
+    LocoSegmentData *seg_data)
+{
+    LOCO_ASSERT(state != NULL);
+    LOCO_ASSERT(seg_data != NULL);
+    LOCO_ASSERT_2(n_bits >= state->seg_data_bits, n_bits, state->seg_data_bits);
+
+    state->seg_data_bits = n_bits;
+    seg_data->n_missing_pixels = deloco_continue_segment(state);
+    if (state->bad_code) {
+        seg_data->status |= DELOCO_BADDATA_FLAG;
+    } else if (seg_data->n_missing_pixels > 0) {
+        seg_data->status |= DELOCO_MISSING_DATA_FLAG;
+    } else {
+        seg_data->status &= ~DELOCO_MISSING_DATA_FLAG;
+    }
+    return seg_data->n_missing_pixels;
+}
+
+/* Whether a segment's layout is the one already recorded in state */
+LOCO_PRIVATE I32 deloco_same_layout(const LocoDecompressState * state,
+        I32 layout, const I32 band_end[LOCO_MAX_SEGS])
+{
+    LOCO_ASSERT(state != NULL);
+    LOCO_ASSERT(band_end != NULL);
+
+    if (layout != state->layout) {
+        return 0;
+    }
+    if (layout == LOCO_LAYOUT_BALANCED) {
+        for (I32 band=0; band<state->n_segs-1; band++) {
+            if (band_end[band] != state->band_end[band]) {
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+/* Whether a reference frame was given that can predict an image with this
+   bit depth and size */
+LOCO_PRIVATE I32 deloco_reference_fits(const LocoImage * reference,
+        I32 header_code, I32 width, I32 height)
+{
+    if (reference == NULL) {
+        return 0;
+    }
+    LOCO_ASSERT(reference->data != NULL);
+    I32 bit_depth = (header_code == HEADER_CODE_FOR_8BIT) ?
+            BITDEPTH_8BIT : BITDEPTH_12BIT;
+    I32 ref_bit_depth = (reference->bit_depth <= BITDEPTH_8BIT) ?
+            BITDEPTH_8BIT : BITDEPTH_12BIT;
+    return ref_bit_depth == bit_depth && reference->width == width
+            && reference->height == height
+            && reference->space_width >= reference->width
+            && reference->size_data_bytes >= reference->height
+                * reference->space_width * (I32)sizeof(LocoPixelType);
+}
+
+/* Read a segment header, returning 0 if the data ran out. Width, height and
+   number of segments are returned as is, not less one. */
+LOCO_PRIVATE I32 deloco_read_header(LocoDecompressState * state,
+        I32 *header_code, I32 *width, I32 *height, I32 *n_segs, I32 *seg,
+        I32 *header_flags, I32 *near, I32 *layout, I32 band_end[LOCO_MAX_SEGS])
+{
+    LOCO_ASSERT(state != NULL);
+    LOCO_ASSERT(band_end != NULL);
+
+    (void)deloco_read_int(state, header_code, HEADER_CODE_BITS);
+    (void)deloco_read_int(state, width, IMAGEWIDTH_BITS);
+    (void)deloco_read_int(state, height, IMAGEHEIGHT_BITS);
+    (void)deloco_read_int(state, n_segs, SEGINDEX_BITS);
+    (void)deloco_read_int(state, seg, SEGINDEX_BITS);
+    *header_flags = 0;
+    if (*header_code == HEADER_CODE_EXTENDED) {
+        (void)deloco_read_int(state, header_code, HEADER_CODE_BITS);
+        (void)deloco_read_int(state, header_flags, HEADER_FLAGS_BITS);
+    }
+    *near = 0;
+    if (*header_flags & HEADER_FLAG_NEAR) {
+        (void)deloco_read_int(state, near, NEAR_BITS);
+    }
+    *layout = LOCO_LAYOUT_GRID;
+    if (*header_flags & HEADER_FLAG_LAYOUT) {
+        (void)deloco_read_int(state, layout, LAYOUT_BITS);
+        if (*layout == LOCO_LAYOUT_BALANCED) {
+            for (I32 band=0; band<*n_segs && !state->out_of_bits; band++) {
+                (void)deloco_read_int(state, &band_end[band], IMAGEHEIGHT_BITS);
+            }
+        }
+    }
+    if ((*header_flags & HEADER_FLAG_SHARED) && *seg == 0) {
+        I32 k = 0;
+        for (I32 i=0; i<LOCO_NCONTEXTS && !state->out_of_bits; i++) {
+            I32 changed = 0;
+            (void)deloco_read_int(state, &changed, 1);
+            if (changed) {
+                (void)deloco_read_int(state, &k, SHARED_K_BITS);
+            }
+            state->shared_k[i] = (U8)k;
+        }
+    }
+    if (state->out_of_bits) {
+        return 0;
+    }
+    (*width)++;
+    (*height)++;
+    (*n_segs)++;
+    return 1;
+}
+
 LOCO_PRIVATE void deloco_init_bitstream(
         LocoDecompressState * state, U8 *datastart, I32 segdatabits)
 {
@@ -421,32 +943,23 @@ LOCO_PRIVATE I32 deloco_read_bit (LocoDecompressState * deloco)
 LOCO_PRIVATE I32 deloco_decompress_segment(LocoDecompressState * deloco, I32 seg)
 {
     LOCO_ASSERT(deloco != NULL);
-    LOCO_ASSERT_1(0 <= seg && seg < LOCO_MAX_SEGS, seg);
 
-    I32 xstart;
-    I32 xend;
-    I32 ystart;
-    I32 yend;
-    I32 i;
-    I32 est;
-    I32 bias;
-    I32 residual;
-    I32 n;
-    I32 msum;
-    I32 sum;
-    I32 k;
-    I32 x;
-    I32 y;
-    I32 value;
-    I32 n_missing;
+    deloco_start_segment(deloco, seg);
 
-    n_missing = 0;
+    /* Report how many, if any, pixels were not decompressed due to running
+       out of compressed data before decompression of the segment was finished */
+    return deloco_continue_segment(deloco);
+}
 
-    /* Get segment rectangle */
-    xstart = deloco->seg_bound[seg].xstart;
-    xend = deloco->seg_bound[seg].xend;
-    ystart = deloco->seg_bound[seg].ystart;
-    yend = deloco->seg_bound[seg].yend;
+/* Set up decompression of a segment, whose header has been read: the
+   parameters that depend on the bit depth and header flags, the context
+   statistics, and the position of the first pixel */
+LOCO_PRIVATE void deloco_start_segment(LocoDecompressState * deloco, I32 seg)
+{
+    LOCO_ASSERT(deloco != NULL);
+    LOCO_ASSERT_1(0 <= seg && seg < LOCO_MAX_SEGS, seg);
+
+    I32 i;
 
     /* Initialize parameters that depend on the bit depth */
     if (deloco->header_code == HEADER_CODE_FOR_8BIT) {
@@ -469,34 +982,157 @@ LOCO_PRIVATE I32 deloco_decompress_segment(LocoDecompressState * deloco, I32 seg
         deloco->initcms = INITCMS_12BIT;
     }
 
-    /* Initialize context statistics */
-    for (i=0;i<LOCO_NCONTEXTS;i++) {
-        deloco->c_count[i] = deloco->initcc;
-        deloco->c_mag_sum[i] = deloco->initcms;
-        deloco->c_sum[i] = 0;
-        deloco->c_bias[i] = 0;
+    deloco->unary_limit = UNARY_UNLIMITED;
+    if (deloco->header_flags & HEADER_FLAG_LIMIT) {
+        deloco->unary_limit = (deloco->bitdepth == BITDEPTH_8BIT) ?
+                LIMIT_UNARY_8BIT : LIMIT_UNARY_12BIT;
+    }
+
+    /* Initialize context statistics, from the segment's prior or the shared
+       model if it has one */
+    if (deloco->header_flags & (HEADER_FLAG_PRIOR | HEADER_FLAG_SHARED)) {
+        LOCO_ASSERT(deloco->prior != NULL);
+        for (i=0;i<LOCO_NCONTEXTS;i++) {
+            deloco->c_count[i] = deloco->prior->c_count[i];
+            deloco->c_mag_sum[i] = deloco->prior->c_mag_sum[i];
+            deloco->c_sum[i] = deloco->prior->c_sum[i];
+            deloco->c_bias[i] = deloco->prior->c_bias[i];
+        }
+    } else {
+        for (i=0;i<LOCO_NCONTEXTS;i++) {
+            deloco->c_count[i] = deloco->initcc;
+            deloco->c_mag_sum[i] = deloco->initcms;
+            deloco->c_sum[i] = 0;
+            deloco->c_bias[i] = 0;
+        }
+    }
+
+    deloco->bad_code = 0;
+
+    /* Raw pixels start at the byte after the header */
+    deloco->raw_start = (deloco->bit_count + 7) / 8;
+
+    deloco->seg = seg;
+    deloco->resume_x = deloco->seg_bound[seg].xstart;
+    deloco->resume_y = deloco->seg_bound[seg].ystart;
+    deloco->n_left = (deloco->seg_bound[seg].xend - deloco->seg_bound[seg].xstart)
+            * (deloco->seg_bound[seg].yend - deloco->seg_bound[seg].ystart);
+}
+
+/* Store the segment's context statistics as they stand */
+LOCO_PRIVATE void deloco_store_model(const LocoDecompressState * deloco,
+        LocoContextModel * model)
+{
+    LOCO_ASSERT(deloco != NULL);
+    LOCO_ASSERT(model != NULL);
+
+    model->bit_depth = deloco->bitdepth;
+    for (I32 i=0;i<LOCO_NCONTEXTS;i++) {
+        model->c_count[i] = deloco->c_count[i];
+        model->c_mag_sum[i] = deloco->c_mag_sum[i];
+        model->c_sum[i] = deloco->c_sum[i];
+        model->c_bias[i] = deloco->c_bias[i];
+    }
+}
+
+/* Store the model a segment starts from: the shared model if the image has
+   one, its prior if it has a valid one, otherwise the initial values */
+LOCO_PRIVATE void deloco_prior_model(const LocoDecompressState * deloco,
+        const LocoDecompressOptions * options, I32 seg, I32 bit_depth,
+        LocoContextModel * model)
+{
+    LOCO_ASSERT(deloco != NULL);
+    LOCO_ASSERT(options != NULL);
+    LOCO_ASSERT(model != NULL);
+
+    if (deloco->have_shared) {
+        *model = deloco->shared_model;
+    } else if (options->priors != NULL
+            && loco_check_context_model(&options->priors[seg], bit_depth)) {
+        *model = options->priors[seg];
+    } else {
+        loco_init_context_model(model, bit_depth);
+    }
+}
+
+/* Decompress the segment from where it left off, as far as the data goes.
+   A pixel whose code is cut short by the end of the data is left for later.
+   Returns the number of pixels not yet decompressed. */
+LOCO_PRIVATE I32 deloco_continue_segment(LocoDecompressState * deloco)
+{
+    LOCO_ASSERT(deloco != NULL);
+
+    I32 xstart;
+    I32 xend;
+    I32 ystart;
+    I32 yend;
+    I32 est;
+    I32 bias;
+    I32 residual;
+    I32 n;
+    I32 msum;
+    I32 sum;
+    I32 k;
+    I32 x;
+    I32 y;
+    I32 value;
+    I32 pixel_start;
+    I32 near_step;
+    I32 near_range;
+    I32 nb[N_NEIGHBOURS];
+
+    if (deloco->header_flags & HEADER_FLAG_RAW) {
+        return deloco_unpack_raw_segment(deloco);
+    }
+
+    /* Whether the neighbours are less the reference is chosen once for the
+       segment, not for each pixel */
+    void (*neighbours)(const LocoDecompressState *, I32, I32, I32, I32[]) =
+            (deloco->header_flags & HEADER_FLAG_TEMPORAL) ?
+            deloco_neighbours_temporal : deloco_neighbours;
+    if (deloco->bad_code) {
+        return deloco->n_left;
     }
 
+    /* Get segment rectangle */
+    xstart = deloco->seg_bound[deloco->seg].xstart;
+    xend = deloco->seg_bound[deloco->seg].xend;
+    ystart = deloco->seg_bound[deloco->seg].ystart;
+    yend = deloco->seg_bound[deloco->seg].yend;
+
+    /* Residuals are in steps of near_step, and reduced modulo near_range
+       steps; when lossless these are 1 and prange */
+    near_step = 2*deloco->near + 1;
+    near_range = (deloco->pmax + 2*deloco->near)/near_step + 1;
+
     /* Read first two pixels directly */
-    (void)deloco_read_int(deloco, &value, deloco->bitdepth);
-    deloco->image[ystart][xstart]=value;
-    (void)deloco_read_int(deloco, &value, deloco->bitdepth);
-    deloco->image[ystart][xstart+1]=value;
+    deloco->out_of_bits = 0;
+    while (deloco->resume_y == ystart && deloco->resume_x < xstart+2) {
+        pixel_start = deloco->bit_count;
+        if (!deloco_read_int(deloco, &value, deloco->bitdepth)) {
+            deloco->bit_count = pixel_start;
+            return deloco->n_left;
+        }
+        deloco->image[ystart][deloco->resume_x]=value;
+        deloco->resume_x++;
+        deloco->n_left--;
+    }
 
     /*
       Main decoding loop
     */
-    for (y=ystart; y<yend; y++) {
-        for (x=xstart+2*(y==ystart); x<xend; x++) {
+    for (y=deloco->resume_y; y<yend; y++) {
+        for (x=(y==deloco->resume_y) ? deloco->resume_x : xstart; x<xend; x++) {
             /* Determine context */
-            deloco_find_context(deloco, x, y, xstart, xend, ystart);
+            neighbours(deloco, x, y, ystart, nb);
+            deloco_find_context(deloco, nb, x, y, xstart, xend, ystart);
 
             /* Compute pixel estimate, incorporating the context-based bias */
             bias = deloco->c_bias[deloco->context];
             if (deloco->invert_flag) {
-                est = deloco_estimate(deloco, x, y, xstart, ystart) - bias;
+                est = deloco_estimate(nb, x, y, xstart, ystart) - bias;
             } else {
-                est = deloco_estimate(deloco, x, y, xstart, ystart) + bias;
+                est = deloco_estimate(nb, x, y, xstart, ystart) + bias;
             }
 
             /* Clip estimate to allowed range */
@@ -525,8 +1161,22 @@ LOCO_PRIVATE I32 deloco_decompress_segment(LocoDecompressState * deloco, I32 seg
                 necessary as long as the decoder does the same thing
                 as the encoder) */
 
-            /* Decode residual */
+            /* Decode residual. If the data ends within its code, stop here,
+               before the context is updated, to resume when there is more. */
+            pixel_start = deloco->bit_count;
             residual = deloco_decode_value(deloco, k);
+            if (deloco->bad_code) {
+                /* Nothing after a bad code can be trusted */
+                deloco->resume_x = x;
+                deloco->resume_y = y;
+                return deloco->n_left;
+            }
+            if (deloco->out_of_bits) {
+                deloco->bit_count = pixel_start;
+                deloco->resume_x = x;
+                deloco->resume_y = y;
+                return deloco->n_left;
+            }
 
             /* Adjust sum and bias */
             sum += residual;
@@ -565,44 +1215,123 @@ LOCO_PRIVATE I32 deloco_decompress_segment(LocoDecompressState * deloco, I32 seg
             if (deloco->invert_flag) {
                 residual = -residual;
             }
-            value = est + residual;
-            if (value < 0) {
-                value += deloco->prange;
-            } else if (value > deloco->pmax) {
-                value -= deloco->prange;
+            value = est + residual*near_step;
+            if (value < -deloco->near) {
+                value += near_range*near_step;
+            } else if (value > deloco->pmax + deloco->near) {
+                value -= near_range*near_step;
             } else {
                 // no adjustment
             }
+            if (deloco->near > 0) {
+                if (value < 0) {
+                    value = 0;
+                } else if (value > deloco->pmax) {
+                    value = deloco->pmax;
+                } else {
+                    // in allowed range already
+                }
+            }
 
             /* Put pixel value into image */
-            if (!deloco->out_of_bits) {
-                deloco->image[y][x] = value;
-            } else {
-                n_missing++;
-            }
+            deloco->image[y][x] = value;
+            deloco->n_left--;
         }
     }
+    deloco->resume_x = xstart;
+    deloco->resume_y = yend;
 
-    /* Report how many, if any, pixels were not decompressed due to running
-       out of compressed data before decompression of the segment was finished */
-    return n_missing;
+    return deloco->n_left;
 }
 
 
 
 
+/* Unpack a segment stored raw, from where it left off, as far as the data
+   goes. Pixels start at the byte after the header, 8 bit pixels one per
+   byte, and 12 bit pixels two per three bytes, most significant bits first.
+   Returns the number of pixels not yet unpacked. */
+LOCO_PRIVATE I32 deloco_unpack_raw_segment(LocoDecompressState * deloco)
+{
+    LOCO_ASSERT(deloco != NULL);
+
+    I32 xstart = deloco->seg_bound[deloco->seg].xstart;
+    I32 xend = deloco->seg_bound[deloco->seg].xend;
+    I32 ystart = deloco->seg_bound[deloco->seg].ystart;
+    I32 width = xend - xstart;
+    const U8 *data = deloco->data_start;
+    I32 n_bytes = deloco->seg_data_bits / 8;
+    I32 n_pixels = width * (deloco->seg_bound[deloco->seg].yend - ystart);
+    I32 p = n_pixels - deloco->n_left; // index of the next pixel in the segment
+
+    /* Pixels whose bytes have all arrived */
+    I32 n_avail = n_bytes - deloco->raw_start;
+    if (deloco->bitdepth == BITDEPTH_8BIT) {
+        // n_avail pixels
+    } else if (n_avail % 3 == 2) {
+        n_avail = 2*(n_avail/3) + 1;
+    } else {
+        n_avail = 2*(n_avail/3);
+    }
+    if (n_avail > n_pixels) {
+        n_avail = n_pixels;
+    }
+
+    while (p < n_avail) {
+        I32 x = xstart + p % width;
+        LocoPixelType *row = deloco->image[ystart + p / width];
+        I32 row_end = p + (xend - x);
+        if (row_end > n_avail) {
+            row_end = n_avail;
+        }
+        if (deloco->bitdepth == BITDEPTH_8BIT) {
+            for (; p<row_end; p++, x++) {
+                row[x] = data[deloco->raw_start + p];
+            }
+        } else {
+            for (; p<row_end; p++, x++) {
+                I32 pos = deloco->raw_start + (p/2)*3;
+                if (!(p & 1)) {
+                    row[x] = (LocoPixelType)((data[pos] << 4) | (data[pos+1] >> 4));
+                } else {
+                    row[x] = (LocoPixelType)(((data[pos+1] & 0x0f) << 8) | data[pos+2]);
+                }
+            }
+        }
+    }
+    deloco->n_left = n_pixels - p;
+
+    return deloco->n_left;
+}
+
 LOCO_PRIVATE I32 deloco_decode_value(LocoDecompressState * deloco, I32 k)
 {
     I32 i;
     I32 v;
+    I32 unary;
+    I32 escaped;
 
     v = 0;
     for (i=0; i<k; i++) {
         v |= (deloco_read_bit(deloco) << i);
     }
-    while (!deloco_read_bit(deloco) && !deloco->out_of_bits) {
-        v += 01<<k;
+    unary = 0;
+    while (unary < deloco->unary_limit && !deloco_read_bit(deloco)
+            && !deloco->out_of_bits) {
+        unary++;
     }
+    if (unary >= deloco->unary_limit) {
+        /* The encoder ends an escape's unary part at the limit, so
+           another zero means the data is corrupt */
+        if (deloco_read_bit(deloco) == 0) {
+            deloco->bad_code = 1;
+            return 0;
+        }
+        /* Escape: the unary part's value follows in full */
+        (void)deloco_read_int(deloco, &escaped, deloco->bitdepth);
+        unary = escaped;
+    }
+    v += unary<<k;
 
     if (v & 01) {
         v = -((v+1) >> 1);  /* A simpler expression is available */
@@ -615,82 +1344,43 @@ LOCO_PRIVATE I32 deloco_decode_value(LocoDecompressState * deloco, I32 k)
 
 
 
+/* Find the context of a pixel, and whether its residual is inverted, as
+   the compressor does: the quantized gradients index
+   loco_context_info_table. Gradients that would reach outside the segment
+   are left out, and which were is flagged in the context. */
 LOCO_PRIVATE void deloco_find_context(LocoDecompressState * deloco,
-        I32 x, I32 y, I32 xstart, I32 xend, I32 ystart)
+        const I32 nb[N_NEIGHBOURS], I32 x, I32 y, I32 xstart, I32 xend,
+        I32 ystart)
 {
-    I32 ctxt1;
-    I32 ctxt2;
-    I32 ctxt3;
-    I32 ctxt4;
-
-    I32 f1;
-    I32 f3;
-    I32 f4;
-
-    f1 = 0;
-    f3 = 0;
-    f4 = 0;
+    I32 ctxt;
+    I32 edge;
 
     if (y==ystart) {
-        ctxt4 = deloco_gfour_to_ctxt(deloco, (I32)deloco->image[y][x-1]
-                - (I32)deloco->image[y][x-2]);
-        ctxt1 = 00;
-        f1=1;
-        ctxt2 = 00;
-        ctxt3 = 00;
-        f3=1;
+        ctxt = deloco_gfour_to_ctxt(deloco, nb[NB_W] - nb[NB_WW]);
+        edge = 0x90;
     } else if (x==xend-1) {
-        ctxt4 = deloco_gfour_to_ctxt(deloco, (I32)deloco->image[y][x-1]
-                - (I32)deloco->image[y][x-2]);
-        ctxt1 = 00;
-        f1=1;
-        ctxt2 = deloco_g_to_ctxt(deloco, (I32)deloco->image[y-1][x]
-                - (I32)deloco->image[y-1][x-1]);
-        ctxt3 = deloco_g_to_ctxt(deloco, (I32)deloco->image[y-1][x-1]
-                - (I32)deloco->image[y][x-1]);
+        ctxt = deloco_gfour_to_ctxt(deloco, nb[NB_W] - nb[NB_WW])
+             | (deloco_g_to_ctxt(deloco, nb[NB_NW] - nb[NB_W])>>3)
+             | (deloco_g_to_ctxt(deloco, nb[NB_N] - nb[NB_NW])<<3);
+        edge = 0x80;
     } else if (x==xstart) {
-        ctxt4 = 00;
-        f4=1;
-        ctxt1 = deloco_g_to_ctxt(deloco, (I32)deloco->image[y-1][x+1]
-                - (I32)deloco->image[y-1][x]);
-        ctxt2 = 00;
-        ctxt3 = 00;
-        f3=1;
+        ctxt = deloco_g_to_ctxt(deloco, nb[NB_NE] - nb[NB_N]);
+        edge = 0x12;
     } else if (x==xstart+1) {
-        ctxt4 = 00;
-        f4=1;
-        ctxt1 = deloco_g_to_ctxt(deloco, (I32)deloco->image[y-1][x+1]
-                - (I32)deloco->image[y-1][x]);
-        ctxt2 = deloco_g_to_ctxt(deloco, (I32)deloco->image[y-1][x]
-                - (I32)deloco->image[y-1][x-1]);
-        ctxt3 = deloco_g_to_ctxt(deloco, (I32)deloco->image[y-1][x-1]
-                - (I32)deloco->image[y][x-1]);
-    } else {
-        ctxt4 = deloco_gfour_to_ctxt(deloco, (I32)deloco->image[y][x-1]
-                - (I32)deloco->image[y][x-2]);
-        ctxt1 = deloco_g_to_ctxt(deloco, (I32)deloco->image[y-1][x+1]
-                - (I32)deloco->image[y-1][x]);
-        ctxt2 = deloco_g_to_ctxt(deloco, (I32)deloco->image[y-1][x]
-                - (I32)deloco->image[y-1][x-1]);
-        ctxt3 = deloco_g_to_ctxt(deloco, (I32)deloco->image[y-1][x-1]
-                - (I32)deloco->image[y][x-1]);
-    }
-    if ((ctxt2 & 04) || (!ctxt2 && ((ctxt1 & 04) || (!ctxt1 && ((ctxt3 & 04)
-            || (!ctxt3 && (ctxt4 & 02))))))) {
-        deloco->invert_flag = 1;
-        if (ctxt2)
-            ctxt2 ^= 04;
-        if (ctxt1)
-            ctxt1 ^= 04;
-        if (ctxt3)
-            ctxt3 ^= 04;
-        if (ctxt4)
-            ctxt4 ^= 02;
+        ctxt = deloco_g_to_ctxt(deloco, nb[NB_NE] - nb[NB_N])
+             | (deloco_g_to_ctxt(deloco, nb[NB_NW] - nb[NB_W])>>3)
+             | (deloco_g_to_ctxt(deloco, nb[NB_N] - nb[NB_NW])<<3);
+        edge = 0x02;
     } else {
-        deloco->invert_flag = 0;
+        ctxt = deloco_gfour_to_ctxt(deloco, nb[NB_W] - nb[NB_WW])
+             | deloco_g_to_ctxt(deloco, nb[NB_NE] - nb[NB_N])
+             | (deloco_g_to_ctxt(deloco, nb[NB_NW] - nb[NB_W])>>3)
+             | (deloco_g_to_ctxt(deloco, nb[NB_N] - nb[NB_NW])<<3);
+        edge = 0;
     }
-    deloco->context = ctxt4 | (ctxt3 << 2) | (ctxt1 << 5) | (ctxt2 << 8);
-    deloco->context |= (f4 << 1) | (f3 << 4) | (f1 << 7);
+    I32 context_info = loco_context_info_table[ctxt];
+    deloco->invert_flag = context_info & 01;
+    deloco->context = (context_info>>1) | edge;
 }
 
 
@@ -708,10 +1398,10 @@ LOCO_PRIVATE I32 deloco_gfour_to_ctxt(LocoDecompressState * deloco, I32 g)
 }
 
 
-LOCO_PRIVATE I32 deloco_estimate(LocoDecompressState * deloco,
+LOCO_PRIVATE I32 deloco_estimate(const I32 nb[N_NEIGHBOURS],
         I32 x, I32 y, I32 xstart, I32 ystart)
 {
-    LOCO_ASSERT(deloco != NULL);
+    LOCO_ASSERT(nb != NULL);
 
     I32 a;
     I32 b;
@@ -720,13 +1410,13 @@ LOCO_PRIVATE I32 deloco_estimate(LocoDecompressState * deloco,
     I32 est;
 
     if (x==xstart) {
-        est = deloco->image[y-1][x];
+        est = nb[NB_N];
     } else if (y==ystart) {
-        est = deloco->image[y][x-1];
+        est = nb[NB_W];
     } else {
-        a = deloco->image[y-1][x];
-        b = deloco->image[y][x-1];
-        c = deloco->image[y-1][x-1];
+        a = nb[NB_N];
+        b = nb[NB_W];
+        c = nb[NB_NW];
         if (a>b) {
             t=a;
             a=b;
@@ -741,6 +1431,47 @@ LOCO_PRIVATE I32 deloco_estimate(LocoDecompressState * deloco,
         }
     }
 
-    return est;
+    /* Temporal prediction estimates the difference from the reference */
+    return est + nb[NB_REF];
+}
+
+/* Gather a pixel's decompressed neighbours. Those outside the segment are
+   not used, and are read from nearer pixels in the image instead. */
+LOCO_PRIVATE void deloco_neighbours(const LocoDecompressState * deloco,
+        I32 x, I32 y, I32 ystart, I32 nb[N_NEIGHBOURS])
+{
+    const LocoPixelType *row = deloco->image[y];
+    const LocoPixelType *up = deloco->image[(y > ystart) ? y-1 : y];
+    I32 xw = (x > 0) ? x-1 : x;
+    I32 xww = (x > 1) ? x-2 : xw;
+    I32 xe = (x < deloco->image_width-1) ? x+1 : x;
+
+    nb[NB_W] = row[xw];
+    nb[NB_WW] = row[xww];
+    nb[NB_N] = up[x];
+    nb[NB_NW] = up[xw];
+    nb[NB_NE] = up[xe];
+    nb[NB_REF] = 0;
+}
+
+/* Gather a pixel's neighbours, as deloco_neighbours(), less the reference
+   pixels: temporal prediction and contexts work on the difference */
+LOCO_PRIVATE void deloco_neighbours_temporal(const LocoDecompressState * deloco,
+        I32 x, I32 y, I32 ystart, I32 nb[N_NEIGHBOURS])
+{
+    const LocoPixelType *ref = deloco->ref_data + y*deloco->ref_space_width;
+    const LocoPixelType *ref_up = (y > ystart) ?
+            ref - deloco->ref_space_width : ref;
+    I32 xw = (x > 0) ? x-1 : x;
+    I32 xww = (x > 1) ? x-2 : xw;
+    I32 xe = (x < deloco->image_width-1) ? x+1 : x;
+
+    deloco_neighbours(deloco, x, y, ystart, nb);
+    nb[NB_W] -= ref[xw];
+    nb[NB_WW] -= ref[xww];
+    nb[NB_N] -= ref_up[x];
+    nb[NB_NW] -= ref_up[xw];
+    nb[NB_NE] -= ref_up[xe];
+    nb[NB_REF] = ref[x];
 }
 
@@ -0,0 +1,600 @@
+/***********************************************************************
+ * Copyright 2020 by the California Institute of Technology
+ * ALL RIGHTS RESERVED. United States Government Sponsorship acknowledged.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * @file        loco_pool.c
+ * @date        2026-10-18
+ * @brief       Function definitions for the LOCO job pool
+ *
+ * A pool runs compression and decompression jobs on a set of workers, each
+ * with its own pre-allocated states. Jobs are split into tasks (a whole
+ * image, or one segment), which are queued per worker; idle workers steal
+ * the oldest tasks from other workers' queues.
+ *
+ * The pool creates no threads and takes no locks of its own: the caller
+ * runs the workers, and provides locking through LocoPoolHooks. All pool
+ * fields are accessed with the lock held; compression and decompression run
+ * unlocked.
+ *
+ * A state pool holds states allocated once, through the caller's
+ * LocoAllocHooks, and lends them out. The states not lent out are kept
+ * first in its arrays, so taking and giving back a state is a swap.
+ */
+
+#include <loco/loco_pub.h>
+#include <loco/loco_conf_private.h>
+#include <loco/loco_private.h>
+
+enum {
+    TASK_WHOLE_IMAGE = -1,  /* Task is the whole job */
+    TASK_SETUP = -2,        /* Task sets up decompression by segment */
+};
+
+LOCO_PRIVATE I32 loco_pool_job_tasks(const LocoJob *job);
+LOCO_PRIVATE void loco_pool_push(LocoPool *pool, I32 worker, LocoJob *job,
+        I32 seg);
+LOCO_PRIVATE I32 loco_pool_take(LocoPool *pool, I32 worker, LocoPoolTask *task);
+LOCO_PRIVATE void loco_pool_execute(LocoPool *pool, I32 worker,
+        const LocoPoolTask *task);
+LOCO_PRIVATE I32 loco_pool_setup_decompress(LocoPool *pool, I32 worker,
+        LocoJob *job);
+LOCO_PRIVATE void loco_state_pool_free_states(LocoStatePool *pool);
+
+I32 loco_pool_init(
+    LocoPool *pool,
+    I32 n_workers,
+    LocoCompressState *const compress_states[],
+    LocoDecompressState *const decompress_states[],
+    const LocoPoolHooks *hooks)
+{
+    LOCO_ASSERT(pool != NULL);
+    LOCO_ASSERT(compress_states != NULL);
+    LOCO_ASSERT(decompress_states != NULL);
+    LOCO_ASSERT(hooks != NULL);
+    LOCO_ASSERT(hooks->lock != NULL);
+    LOCO_ASSERT(hooks->unlock != NULL);
+    LOCO_ASSERT(hooks->wait != NULL);
+    LOCO_ASSERT(hooks->wake_all != NULL);
+
+    if (n_workers < 1 || n_workers > LOCO_POOL_MAX_WORKERS) {
+        LOCO_WARN2(LOCO_POOL_BAD_PARAMS,
+                "In loco_pool_init(), n_workers (%d) was less than 1 "
+                "or greater than %d.", n_workers, LOCO_POOL_MAX_WORKERS);
+        return LOCO_POOL_BAD_PARAMS_FLAG;
+    }
+
+    for (I32 worker = 0; worker < n_workers; worker++) {
+        LOCO_ASSERT(compress_states[worker] != NULL);
+        LOCO_ASSERT(decompress_states[worker] != NULL);
+        pool->compress_states[worker] = compress_states[worker];
+        pool->decompress_states[worker] = decompress_states[worker];
+        pool->task_first[worker] = 0;
+        pool->n_tasks[worker] = 0;
+    }
+    pool->n_workers = n_workers;
+    pool->hooks = *hooks;
+    pool->n_free = n_workers * LOCO_POOL_MAX_TASKS;
+    pool->next_worker = 0;
+    pool->stopped = 0;
+    return LOCO_OK;
+}
+
+I32 loco_pool_submit(
+    LocoPool *pool,
+    LocoJob *job)
+{
+    LOCO_ASSERT(pool != NULL);
+    LOCO_ASSERT(job != NULL);
+
+    I32 n_tasks = loco_pool_job_tasks(job);
+    if (n_tasks == 0) {
+        LOCO_WARN2(LOCO_POOL_BAD_PARAMS,
+                "In loco_pool_submit(), job kind %d (by segment: %d) "
+                "had bad parameters.", job->kind, job->by_segment);
+        return LOCO_POOL_BAD_PARAMS_FLAG;
+    }
+
+    job->status = 0;
+    job->done = 0;
+    job->n_tasks_left = 1;
+    job->n_good_segs = 0;
+
+    pool->hooks.lock(pool->hooks.context);
+    I32 status = LOCO_OK;
+    if (pool->stopped) {
+        status = LOCO_POOL_STOPPED_FLAG;
+    } else if (n_tasks > pool->n_free) {
+        status = LOCO_POOL_FULL_FLAG;
+    } else {
+        /* Promise space for all the tasks, including any queued later */
+        pool->n_free -= n_tasks;
+        if (job->kind == LOCO_JOB_DECOMPRESS && job->by_segment) {
+            loco_pool_push(pool, pool->next_worker, job, TASK_SETUP);
+        } else if (job->by_segment) {
+            job->n_tasks_left = n_tasks;
+            for (I32 seg = 0; seg < n_tasks; seg++) {
+                loco_pool_push(pool, pool->next_worker, job, seg);
+            }
+        } else {
+            loco_pool_push(pool, pool->next_worker, job, TASK_WHOLE_IMAGE);
+        }
+        pool->next_worker = (pool->next_worker + 1) % pool->n_workers;
+        pool->hooks.wake_all(pool->hooks.context);
+    }
+    pool->hooks.unlock(pool->hooks.context);
+    return status;
+}
+
+void loco_pool_run_worker(
+    LocoPool *pool,
+    I32 worker)
+{
+    LOCO_ASSERT(pool != NULL);
+    LOCO_ASSERT_2(0 <= worker && worker < pool->n_workers, worker, pool->n_workers);
+
+    LocoPoolTask task;
+    pool->hooks.lock(pool->hooks.context);
+    for (;;) {
+        if (loco_pool_take(pool, worker, &task)) {
+            pool->hooks.unlock(pool->hooks.context);
+            loco_pool_execute(pool, worker, &task);
+            pool->hooks.lock(pool->hooks.context);
+        } else if (pool->stopped) {
+            break;
+        } else {
+            pool->hooks.wait(pool->hooks.context);
+        }
+    }
+    pool->hooks.unlock(pool->hooks.context);
+}
+
+I32 loco_pool_run_task(
+    LocoPool *pool,
+    I32 worker)
+{
+    LOCO_ASSERT(pool != NULL);
+    LOCO_ASSERT_2(0 <= worker && worker < pool->n_workers, worker, pool->n_workers);
+
+    LocoPoolTask task;
+    pool->hooks.lock(pool->hooks.context);
+    I32 have_task = loco_pool_take(pool, worker, &task);
+    pool->hooks.unlock(pool->hooks.context);
+    if (have_task) {
+        loco_pool_execute(pool, worker, &task);
+    }
+    return have_task;
+}
+
+I32 loco_pool_wait(
+    LocoPool *pool,
+    LocoJob *job)
+{
+    LOCO_ASSERT(pool != NULL);
+    LOCO_ASSERT(job != NULL);
+
+    pool->hooks.lock(pool->hooks.context);
+    while (!job->done) {
+        pool->hooks.wait(pool->hooks.context);
+    }
+    I32 status = job->status;
+    pool->hooks.unlock(pool->hooks.context);
+    return status;
+}
+
+void loco_pool_stop(
+    LocoPool *pool)
+{
+    LOCO_ASSERT(pool != NULL);
+
+    pool->hooks.lock(pool->hooks.context);
+    pool->stopped = 1;
+    pool->hooks.wake_all(pool->hooks.context);
+    pool->hooks.unlock(pool->hooks.context);
+}
+
+I32 loco_working_sizes(
+    I32 width,
+    I32 height,
+    I32 bit_depth,
+    I32 n_segs,
+    const LocoCompressOptions *options,
+    LocoWorkingSizes *sizes)
+{
+    LOCO_ASSERT(sizes != NULL);
+
+    I32 compressed_bytes = loco_compressed_size_bound(width, height, bit_depth,
+            n_segs, options);
+    if (compressed_bytes == 0) {
+        LOCO_WARN4(LOCO_POOL_BAD_PARAMS,
+                "In loco_working_sizes(), a %d x %d image of %d bits in "
+                "%d segments cannot be compressed.",
+                width, height, bit_depth, n_segs);
+        return LOCO_POOL_BAD_PARAMS_FLAG;
+    }
+    /* The bound checked the size; the image's bytes must also fit an I32 */
+    if (height > 0x7fffffff / (width * (I32)sizeof(LocoPixelType))) {
+        LOCO_WARN2(LOCO_POOL_BAD_PARAMS,
+                "In loco_working_sizes(), a %d x %d image has more bytes "
+                "than an I32 holds.", width, height);
+        return LOCO_POOL_BAD_PARAMS_FLAG;
+    }
+
+    sizes->compress_state_bytes = (I32)sizeof(LocoCompressState);
+    sizes->decompress_state_bytes = (I32)sizeof(LocoDecompressState);
+    sizes->image_bytes = width * height * (I32)sizeof(LocoPixelType);
+    sizes->compressed_bytes = compressed_bytes;
+    return LOCO_OK;
+}
+
+I32 loco_state_pool_init(
+    LocoStatePool *pool,
+    I32 n_compress,
+    I32 n_decompress,
+    const LocoAllocHooks *alloc,
+    const LocoPoolHooks *hooks)
+{
+    LOCO_ASSERT(pool != NULL);
+    LOCO_ASSERT(alloc != NULL);
+    LOCO_ASSERT(alloc->allocate != NULL);
+    LOCO_ASSERT(alloc->release != NULL);
+    LOCO_ASSERT(hooks != NULL);
+    LOCO_ASSERT(hooks->lock != NULL);
+    LOCO_ASSERT(hooks->unlock != NULL);
+
+    pool->n_compress = 0;
+    pool->n_decompress = 0;
+    pool->n_compress_free = 0;
+    pool->n_decompress_free = 0;
+    if (n_compress < 0 || n_compress > LOCO_STATE_POOL_MAX_STATES
+            || n_decompress < 0 || n_decompress > LOCO_STATE_POOL_MAX_STATES) {
+        LOCO_WARN4(LOCO_POOL_BAD_PARAMS,
+                "In loco_state_pool_init(), n_compress (%d) or n_decompress "
+                "(%d) was less than %d or greater than %d.",
+                n_compress, n_decompress, 0, LOCO_STATE_POOL_MAX_STATES);
+        return LOCO_POOL_BAD_PARAMS_FLAG;
+    }
+    pool->alloc = *alloc;
+    pool->hooks = *hooks;
+
+    I32 status = LOCO_OK;
+    while (status == LOCO_OK && pool->n_compress < n_compress) {
+        void *state = alloc->allocate(alloc->context,
+                (I32)sizeof(LocoCompressState), LOCO_STATE_ALIGN_BYTES);
+        if (state == NULL) {
+            status = LOCO_POOL_NO_MEMORY_FLAG;
+        } else {
+            pool->compress_states[pool->n_compress] = (LocoCompressState *)state;
+            pool->n_compress++;
+        }
+    }
+    while (status == LOCO_OK && pool->n_decompress < n_decompress) {
+        void *state = alloc->allocate(alloc->context,
+                (I32)sizeof(LocoDecompressState), LOCO_STATE_ALIGN_BYTES);
+        if (state == NULL) {
+            status = LOCO_POOL_NO_MEMORY_FLAG;
+        } else {
+            pool->decompress_states[pool->n_decompress] =
+                    (LocoDecompressState *)state;
+            pool->n_decompress++;
+        }
+    }
+
+    if (status != LOCO_OK) {
+        LOCO_WARN4(LOCO_POOL_NO_MEMORY,
+                "In loco_state_pool_init(), only %d of %d compression and "
+                "%d of %d decompression states could be allocated.",
+                pool->n_compress, n_compress, pool->n_decompress, n_decompress);
+        loco_state_pool_free_states(pool);
+        return status;
+    }
+    pool->n_compress_free = n_compress;
+    pool->n_decompress_free = n_decompress;
+    return LOCO_OK;
+}
+
+LocoCompressState *loco_state_pool_acquire_compress(
+    LocoStatePool *pool)
+{
+    LOCO_ASSERT(pool != NULL);
+
+    LocoCompressState *state = NULL;
+    pool->hooks.lock(pool->hooks.context);
+    if (pool->n_compress_free > 0) {
+        pool->n_compress_free--;
+        state = pool->compress_states[pool->n_compress_free];
+    }
+    pool->hooks.unlock(pool->hooks.context);
+    return state;
+}
+
+LocoDecompressState *loco_state_pool_acquire_decompress(
+    LocoStatePool *pool)
+{
+    LOCO_ASSERT(pool != NULL);
+
+    LocoDecompressState *state = NULL;
+    pool->hooks.lock(pool->hooks.context);
+    if (pool->n_decompress_free > 0) {
+        pool->n_decompress_free--;
+        state = pool->decompress_states[pool->n_decompress_free];
+    }
+    pool->hooks.unlock(pool->hooks.context);
+    return state;
+}
+
+void loco_state_pool_release_compress(
+    LocoStatePool *pool,
+    LocoCompressState *state)
+{
+    LOCO_ASSERT(pool != NULL);
+    LOCO_ASSERT(state != NULL);
+
+    pool->hooks.lock(pool->hooks.context);
+    I32 i = pool->n_compress_free;
+    while (i < pool->n_compress && pool->compress_states[i] != state) {
+        i++;
+    }
+    /* The state must be one of the pool's, lent out */
+    LOCO_ASSERT_2(i < pool->n_compress, i, pool->n_compress);
+    pool->compress_states[i] = pool->compress_states[pool->n_compress_free];
+    pool->compress_states[pool->n_compress_free] = state;
+    pool->n_compress_free++;
+    pool->hooks.unlock(pool->hooks.context);
+}
+
+void loco_state_pool_release_decompress(
+    LocoStatePool *pool,
+    LocoDecompressState *state)
+{
+    LOCO_ASSERT(pool != NULL);
+    LOCO_ASSERT(state != NULL);
+
+    pool->hooks.lock(pool->hooks.context);
+    I32 i = pool->n_decompress_free;
+    while (i < pool->n_decompress && pool->decompress_states[i] != state) {
+        i++;
+    }
+    /* The state must be one of the pool's, lent out */
+    LOCO_ASSERT_2(i < pool->n_decompress, i, pool->n_decompress);
+    pool->decompress_states[i] = pool->decompress_states[pool->n_decompress_free];
+    pool->decompress_states[pool->n_decompress_free] = state;
+    pool->n_decompress_free++;
+    pool->hooks.unlock(pool->hooks.context);
+}
+
+void loco_state_pool_free(
+    LocoStatePool *pool)
+{
+    LOCO_ASSERT(pool != NULL);
+    LOCO_ASSERT_2(pool->n_compress_free == pool->n_compress,
+            pool->n_compress_free, pool->n_compress);
+    LOCO_ASSERT_2(pool->n_decompress_free == pool->n_decompress,
+            pool->n_decompress_free, pool->n_decompress);
+
+    loco_state_pool_free_states(pool);
+}
+
+/* Free every state a state pool has allocated, and empty it */
+LOCO_PRIVATE void loco_state_pool_free_states(LocoStatePool *pool)
+{
+    LOCO_ASSERT(pool != NULL);
+
+    for (I32 i = 0; i < pool->n_compress; i++) {
+        pool->alloc.release(pool->alloc.context, pool->compress_states[i]);
+    }
+    for (I32 i = 0; i < pool->n_decompress; i++) {
+        pool->alloc.release(pool->alloc.context, pool->decompress_states[i]);
+    }
+    pool->n_compress = 0;
+    pool->n_decompress = 0;
+    pool->n_compress_free = 0;
+    pool->n_decompress_free = 0;
+}
+
+/* Number of tasks a job needs, or 0 if its parameters are bad */
+LOCO_PRIVATE I32 loco_pool_job_tasks(const LocoJob *job)
+{
+    LOCO_ASSERT(job != NULL);
+
+    if (job->kind == LOCO_JOB_COMPRESS) {
+        if (job->image == NULL || (job->by_segment ?
+                (job->seg_out == NULL || job->segments == NULL)
+                : job->result == NULL)) {
+            return 0;
+        }
+        if (!job->by_segment) {
+            return 1;
+        }
+        if (job->image->n_segs < 1 || job->image->n_segs > LOCO_MAX_SEGS) {
+            return 0;
+        }
+        return job->image->n_segs;
+    }
+    if (job->kind == LOCO_JOB_DECOMPRESS) {
+        if (job->compressed_in == NULL || job->image_out == NULL
+                || job->seg_data == NULL) {
+            return 0;
+        }
+        if (!job->by_segment) {
+            return 1;
+        }
+        if (job->compressed_in->n_segs < 1
+                || job->compressed_in->n_segs > LOCO_MAX_SEGS) {
+            return 0;
+        }
+        return 1 + job->compressed_in->n_segs; // and one to set up
+    }
+    return 0;
+}
+
+/* Queue a task, whose space has been promised, on the worker's queue, or
+   if that is full, the next with room. Called locked. */
+LOCO_PRIVATE void loco_pool_push(LocoPool *pool, I32 worker, LocoJob *job,
+        I32 seg)
+{
+    LOCO_ASSERT(pool != NULL);
+
+    for (I32 i = 0; i < pool->n_workers
+            && pool->n_tasks[worker] == LOCO_POOL_MAX_TASKS; i++) {
+        worker = (worker + 1) % pool->n_workers;
+    }
+    LOCO_ASSERT_1(pool->n_tasks[worker] < LOCO_POOL_MAX_TASKS, worker);
+
+    I32 slot = (pool->task_first[worker] + pool->n_tasks[worker])
+            % LOCO_POOL_MAX_TASKS;
+    pool->tasks[worker][slot].job = job;
+    pool->tasks[worker][slot].seg = seg;
+    pool->n_tasks[worker]++;
+}
+
+/* Take the newest task from the worker's queue, or else steal the oldest
+   task from another worker. Returns 0 if there are none. Called locked. */
+LOCO_PRIVATE I32 loco_pool_take(LocoPool *pool, I32 worker, LocoPoolTask *task)
+{
+    LOCO_ASSERT(pool != NULL);
+    LOCO_ASSERT(task != NULL);
+
+    if (pool->n_tasks[worker] > 0) {
+        pool->n_tasks[worker]--;
+        *task = pool->tasks[worker][(pool->task_first[worker]
+                + pool->n_tasks[worker]) % LOCO_POOL_MAX_TASKS];
+        pool->n_free++;
+        return 1;
+    }
+    for (I32 i = 1; i < pool->n_workers; i++) {
+        I32 victim = (worker + i) % pool->n_workers;
+        if (pool->n_tasks[victim] > 0) {
+            *task = pool->tasks[victim][pool->task_first[victim]];
+            pool->task_first[victim] = (pool->task_first[victim] + 1)
+                    % LOCO_POOL_MAX_TASKS;
+            pool->n_tasks[victim]--;
+            pool->n_free++;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Run a task, unlocked, then record it, and finish its job if it was the
+   last task. */
+LOCO_PRIVATE void loco_pool_execute(LocoPool *pool, I32 worker,
+        const LocoPoolTask *task)
+{
+    LOCO_ASSERT(pool != NULL);
+    LOCO_ASSERT(task != NULL);
+
+    LocoJob *job = task->job;
+    LOCO_ASSERT(job != NULL);
+    LocoCompressState *compress_state = pool->compress_states[worker];
+    LocoDecompressState *decompress_state = pool->decompress_states[worker];
+    I32 seg = task->seg;
+    I32 status;
+    I32 good = 0;
+
+    if (seg == TASK_SETUP) {
+        status = loco_pool_setup_decompress(pool, worker, job);
+    } else if (job->kind == LOCO_JOB_COMPRESS && seg == TASK_WHOLE_IMAGE) {
+        status = loco_compress_ext(compress_state, job->image, job->options,
+                job->result, job->stats);
+    } else if (job->kind == LOCO_JOB_COMPRESS) {
+        status = loco_compress_segment(compress_state, job->image, job->options,
+                seg, &job->seg_out[seg], job->segments,
+                (job->stats != NULL) ? &job->stats[seg] : NULL);
+    } else if (seg == TASK_WHOLE_IMAGE) {
+        status = loco_decompress(decompress_state, job->compressed_in,
+                job->image_out, job->seg_data);
+    } else {
+        status = loco_decompress_segment_start(decompress_state,
+                job->compressed_in->seg_ptr[seg], job->compressed_in->n_bits[seg],
+                job->image_out, &job->seg_data[seg]);
+        /* A bad segment does not make the image bad, unless all are */
+        good = (status == LOCO_OK);
+        status &= ~DELOCO_NOGOODSEGMENTS_FLAG;
+    }
+
+    pool->hooks.lock(pool->hooks.context);
+    job->status |= status;
+    job->n_good_segs += good;
+    job->n_tasks_left--;
+    I32 finished = (job->n_tasks_left == 0);
+    if (finished && job->by_segment) {
+        if (job->kind == LOCO_JOB_COMPRESS) {
+            job->segments->n_segs = job->image->n_segs;
+        } else if (job->n_good_segs == 0 && job->status == 0) {
+            /* Set up, but no segment could be decompressed */
+            job->status |= DELOCO_NOGOODSEGMENTS_FLAG;
+        }
+    }
+    pool->hooks.unlock(pool->hooks.context);
+
+    if (finished) {
+        /* The callback may free the job once it is done, so call it first */
+        if (job->job_done != NULL) {
+            job->job_done(job->context, job);
+        }
+        pool->hooks.lock(pool->hooks.context);
+        job->done = 1;
+        pool->hooks.wake_all(pool->hooks.context);
+        pool->hooks.unlock(pool->hooks.context);
+    }
+}
+
+/* Set up the image for decompression by segment, as loco_decompress() does,
+   and queue a task for each segment. Returns the status if the image could
+   not be set up. */
+LOCO_PRIVATE I32 loco_pool_setup_decompress(LocoPool *pool, I32 worker,
+        LocoJob *job)
+{
+    LOCO_ASSERT(pool != NULL);
+    LOCO_ASSERT(job != NULL);
+
+    const LocoCompressedSegments *compressed_in = job->compressed_in;
+    LocoImage *image_out = job->image_out;
+    I32 n_segs = compressed_in->n_segs;
+    LocoImageInfo info;
+    I32 status = loco_peek(pool->decompress_states[worker], compressed_in, &info);
+    if (status == LOCO_OK && image_out->size_data_bytes < info.size_data_bytes) {
+        LOCO_WARN4(LOCO_DECOMPRESS_BUFTOOSMALL,
+                "In loco_pool_run_worker(), %d B output buffer "
+                "could not hold %d x %d x %u B image.",
+                image_out->size_data_bytes,
+                info.width, info.height, (U32)sizeof(LocoPixelType));
+        status = DELOCO_BUFTOOSMALL_FLAG;
+    }
+
+    if (status == LOCO_OK) {
+        image_out->bit_depth = info.bit_depth;
+        image_out->width = info.width;
+        image_out->space_width = info.width;
+        image_out->height = info.height;
+        image_out->n_segs = info.n_segs;
+        for (I32 i = 0; i < info.width * info.height; i++) {
+            image_out->data[i] = 0;
+        }
+    }
+
+    pool->hooks.lock(pool->hooks.context);
+    if (status == LOCO_OK) {
+        job->n_tasks_left += n_segs;
+        for (I32 seg = 0; seg < n_segs; seg++) {
+            loco_pool_push(pool, worker, job, seg);
+        }
+        pool->hooks.wake_all(pool->hooks.context);
+    } else {
+        pool->n_free += n_segs; // space promised to the segments
+    }
+    pool->hooks.unlock(pool->hooks.context);
+    return status;
+}
@@ -5,9 +5,14 @@
 #include "gtest/gtest.h"
 #include <time.h>
 #include <sys/time.h>
+#include <math.h>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 
 #include <loco/loco_pub.h>
 #include <loco/loco_private.h>
+#include <loco/loco.hpp>
 
 extern "C"
 {
@@ -900,6 +905,3052 @@ TEST(LocoTest, Image) {
 
 }
 
+TEST(LocoTest, CompressStats) {
+
+    int n_rows = 480;
+    int n_cols = 480;
+    unsigned int max_val = 0x0FFF;
+    int n_segs = 10;
+
+    alloc_global_bufs(n_rows, n_cols);
+    make_random_input(max_val);
+
+    LocoImage image;
+    image.width = n_cols;
+    image.height = n_rows;
+    image.space_width = n_cols;
+    image.n_segs = n_segs;
+    image.bit_depth = 12;
+    image.data = image_input_buf;
+    image.size_data_bytes = image_buf_bytes;
+
+    LocoCompressedImage compressed;
+    compressed.size_data_bytes = compressed_buf_bytes;
+    compressed.data = image_compressed_buf;
+
+    I32 flags = loco_compress(loco_state, &image, &compressed);
+    ASSERT_EQ(flags, LOCO_OK);
+    I32 plain_size = compressed.compressed_size_bytes;
+    I32 plain_bits[LOCO_MAX_SEGS];
+    for (int i = 0; i < n_segs; i++) {
+        plain_bits[i] = compressed.segments.n_bits[i];
+    }
+
+    printf("stats do not change the output\n");
+    LocoCompressStats stats[LOCO_MAX_SEGS];
+    flags = loco_compress_with_stats(loco_state, &image, &compressed, stats);
+    ASSERT_EQ(flags, LOCO_OK);
+    EXPECT_EQ(compressed.compressed_size_bytes, plain_size);
+
+    I32 total_pixels = 0;
+    for (int i = 0; i < n_segs; i++) {
+        EXPECT_EQ(compressed.segments.n_bits[i], plain_bits[i]);
+        // stored bits are the coded bits, padded to a whole word
+        EXPECT_EQ(compressed.segments.n_bits[i],
+                (stats[i].n_bits + 31) / 32 * 32);
+        EXPECT_EQ(stats[i].truncated, 0);
+        EXPECT_GT(stats[i].n_contexts_used, 0);
+        EXPECT_LE(stats[i].n_contexts_used, LOCO_NCONTEXTS);
+
+        I32 k_total = 0;
+        I32 unary_total = 0;
+        for (int k = 0; k < LOCO_STATS_K_BINS; k++) {
+            k_total += stats[i].k_hist[k];
+        }
+        for (int u = 0; u < LOCO_STATS_UNARY_BINS; u++) {
+            unary_total += stats[i].unary_hist[u];
+        }
+        EXPECT_EQ(k_total, stats[i].n_pixels - 2);
+        EXPECT_EQ(unary_total, stats[i].n_pixels - 2);
+        EXPECT_EQ(stats[i].bits_per_pixel_q8,
+                (I32)(((long long)stats[i].n_bits << 8) / stats[i].n_pixels));
+
+        // uniform 12 bit noise has a mean residual magnitude near 1024
+        EXPECT_GT(stats[i].mean_abs_residual_q8, 900 << 8);
+        EXPECT_LT(stats[i].mean_abs_residual_q8, 1150 << 8);
+        total_pixels += stats[i].n_pixels;
+    }
+    EXPECT_EQ(total_pixels, n_rows * n_cols);
+
+    printf("flat image uses few contexts and short codes\n");
+    make_single_color_input(max_val/2);
+    flags = loco_compress_with_stats(loco_state, &image, &compressed, stats);
+    ASSERT_EQ(flags, LOCO_OK);
+    for (int i = 0; i < n_segs; i++) {
+        EXPECT_EQ(stats[i].mean_abs_residual_q8, 0);
+        EXPECT_EQ(stats[i].max_unary, 0);
+        // contexts start with nonzero magnitude sums, so early pixels use k > 0
+        EXPECT_GT(stats[i].k_hist[0], (stats[i].n_pixels - 2) * 9 / 10);
+        EXPECT_LT(stats[i].n_contexts_used, 8);
+    }
+
+    printf("truncated segments are reported\n");
+    make_random_input(max_val);
+    compressed.size_data_bytes = compressed_buf_bytes / 4;
+    flags = loco_compress_with_stats(loco_state, &image, &compressed, stats);
+    EXPECT_EQ(flags, LOCO_BUFFER_FILLED_FLAG);
+    EXPECT_EQ(stats[0].truncated, 0);
+    EXPECT_EQ(stats[n_segs-1].truncated, 1);
+
+    free_global_bufs();
+}
+
+void check_size_only(LocoImage *image)
+{
+    LocoCompressedImage compressed;
+    compressed.size_data_bytes = compressed_buf_bytes;
+    compressed.data = image_compressed_buf;
+
+    LocoCompressStats stats[LOCO_MAX_SEGS];
+    I32 flags = loco_compress_with_stats(loco_state, image, &compressed, stats);
+    ASSERT_EQ(flags, LOCO_OK);
+
+    LocoCompressOptions options;
+    loco_init_compress_options(&options);
+    options.size_only = 1;
+
+    LocoCompressedImage sized;
+    sized.size_data_bytes = 0;
+    sized.data = NULL;
+    LocoCompressStats sized_stats[LOCO_MAX_SEGS];
+    flags = loco_compress_ext(loco_state, image, &options, &sized, sized_stats);
+    EXPECT_EQ(flags, LOCO_OK);
+
+    printf("compressed size: %d, size only: %d\n",
+            compressed.compressed_size_bytes, sized.compressed_size_bytes);
+    EXPECT_EQ(sized.compressed_size_bytes, compressed.compressed_size_bytes);
+    EXPECT_EQ(sized.segments.n_segs, image->n_segs);
+    for (int i = 0; i < image->n_segs; i++) {
+        EXPECT_EQ(sized.segments.n_bits[i], compressed.segments.n_bits[i]);
+        EXPECT_EQ(sized_stats[i].n_bits, stats[i].n_bits);
+        EXPECT_EQ(sized_stats[i].k_hist[1], stats[i].k_hist[1]);
+        EXPECT_EQ(sized_stats[i].max_unary, stats[i].max_unary);
+        EXPECT_TRUE(sized.segments.seg_ptr[i] == NULL);
+    }
+
+    printf("size only without stats\n");
+    flags = loco_compress_ext(loco_state, image, &options, &sized, NULL);
+    EXPECT_EQ(flags, LOCO_OK);
+    EXPECT_EQ(sized.compressed_size_bytes, compressed.compressed_size_bytes);
+}
+
+TEST(LocoTest, SizeOnly) {
+
+    int n_rows = 480;
+    int n_cols = 480;
+
+    alloc_global_bufs(n_rows, n_cols);
+
+    LocoImage image;
+    image.width = n_cols;
+    image.height = n_rows;
+    image.space_width = n_cols;
+    image.data = image_input_buf;
+    image.size_data_bytes = image_buf_bytes;
+
+    make_random_input(0x0FF);
+    image.bit_depth = 8;
+    image.n_segs = 7;
+    check_size_only(&image);
+
+    make_random_input(0x0FFF);
+    image.bit_depth = 12;
+    image.n_segs = 1;
+    check_size_only(&image);
+
+    make_single_color_input(0x0FF);
+    image.bit_depth = 8;
+    image.n_segs = LOCO_MAX_SEGS;
+    check_size_only(&image);
+
+    free_global_bufs();
+
+    uint32_t* frog_image = (uint32_t*) ReadImage(&n_cols, &n_rows,
+            "../test/frog.bmp", IMAGEIO_U8 | IMAGEIO_RGBA);
+    ASSERT_TRUE(frog_image != NULL);
+    alloc_global_bufs(n_rows, n_cols);
+    for (int row = 0; row < n_rows; row++) {
+        for (int col = 0; col < n_cols; col++) {
+            U8* u8p = (U8*)(&frog_image[row*n_cols+col]);
+            image_input_buf[(row * n_cols) + col] = (LocoPixelType)(16*(
+                    u8p[0] * .3 + u8p[1] * .6 + u8p[2] * .1));
+        }
+    }
+    free(frog_image);
+
+    image.width = n_cols;
+    image.height = n_rows;
+    image.space_width = n_cols;
+    image.data = image_input_buf;
+    image.size_data_bytes = image_buf_bytes;
+    image.bit_depth = 12;
+    image.n_segs = 16;
+    check_size_only(&image);
+
+    free_global_bufs();
+}
+
+// check an estimate of the compressed size is within tol_pct percent
+void check_estimate(LocoImage *image, int sample_period, double tol_pct)
+{
+    LocoCompressOptions options;
+    loco_init_compress_options(&options);
+    options.size_only = 1;
+    LocoCompressedImage sized;
+    I32 flags = loco_compress_ext(loco_state, image, &options, &sized, NULL);
+    EXPECT_EQ(flags, LOCO_OK);
+
+    LocoCompressedImage estimate;
+    estimate.data = NULL;
+    flags = loco_estimate_size(loco_state, image, sample_period, &estimate);
+    EXPECT_EQ(flags, LOCO_OK);
+    EXPECT_EQ(estimate.segments.n_segs, image->n_segs);
+
+    double err_pct = 100.0 * (estimate.compressed_size_bytes
+            - sized.compressed_size_bytes) / sized.compressed_size_bytes;
+    printf("size: %d, estimate: %d (period %d), error: %.2f%%\n",
+            sized.compressed_size_bytes, estimate.compressed_size_bytes,
+            sample_period, err_pct);
+    EXPECT_LE(fabs(err_pct), tol_pct);
+
+    int sum_bytes = 0;
+    for (int i = 0; i < image->n_segs; i++) {
+        EXPECT_EQ(estimate.segments.n_bits[i] % 32, 0);
+        sum_bytes += estimate.segments.n_bits[i] / 8;
+    }
+    EXPECT_EQ(sum_bytes, estimate.compressed_size_bytes);
+}
+
+TEST(LocoTest, EstimateSize) {
+
+    int n_rows = 480;
+    int n_cols = 480;
+
+    alloc_global_bufs(n_rows, n_cols);
+
+    LocoImage image;
+    image.width = n_cols;
+    image.height = n_rows;
+    image.space_width = n_cols;
+    image.data = image_input_buf;
+    image.size_data_bytes = image_buf_bytes;
+
+    make_random_input(0x0FFF);
+    image.bit_depth = 12;
+    image.n_segs = 5;
+    check_estimate(&image, 1, 0);
+    check_estimate(&image, LOCO_ESTIMATE_SAMPLE_PERIOD, 4);
+
+    make_random_input(0x0FF);
+    image.bit_depth = 8;
+    image.n_segs = LOCO_MAX_SEGS;
+    check_estimate(&image, LOCO_ESTIMATE_SAMPLE_PERIOD, 4);
+
+    make_single_color_input(0x0FF);
+    image.n_segs = 1;
+    check_estimate(&image, LOCO_ESTIMATE_SAMPLE_PERIOD, 1);
+
+    // smooth gradient
+    for (int row = 0; row < n_rows; row++) {
+        for (int col = 0; col < n_cols; col++) {
+            image_input_buf[row * n_cols + col] =
+                    (LocoPixelType)((3 * row + 5 * col + (row * col) % 7) & 0x0FFF);
+        }
+    }
+    image.bit_depth = 12;
+    image.n_segs = 8;
+    check_estimate(&image, LOCO_ESTIMATE_SAMPLE_PERIOD, 1);
+
+    free_global_bufs();
+
+    uint32_t* frog_image = (uint32_t*) ReadImage(&n_cols, &n_rows,
+            "../test/frog.bmp", IMAGEIO_U8 | IMAGEIO_RGBA);
+    ASSERT_TRUE(frog_image != NULL);
+    alloc_global_bufs(n_rows, n_cols);
+    for (int row = 0; row < n_rows; row++) {
+        for (int col = 0; col < n_cols; col++) {
+            U8* u8p = (U8*)(&frog_image[row*n_cols+col]);
+            image_input_buf[(row * n_cols) + col] = (LocoPixelType)(16*(
+                    u8p[0] * .3 + u8p[1] * .6 + u8p[2] * .1));
+        }
+    }
+    free(frog_image);
+
+    image.width = n_cols;
+    image.height = n_rows;
+    image.space_width = n_cols;
+    image.data = image_input_buf;
+    image.size_data_bytes = image_buf_bytes;
+    image.bit_depth = 12;
+    image.n_segs = 1;
+    check_estimate(&image, LOCO_ESTIMATE_SAMPLE_PERIOD, 3);
+    image.n_segs = 16;
+    check_estimate(&image, LOCO_ESTIMATE_SAMPLE_PERIOD, 3);
+    check_estimate(&image, 3, 3);
+
+    free_global_bufs();
+}
+
+TEST(LocoTest, RawFallback) {
+
+    int n_rows = 480;
+    int n_cols = 480;
+
+    alloc_global_bufs(n_rows, n_cols);
+
+    LocoImage image;
+    image.width = n_cols;
+    image.height = n_rows;
+    image.space_width = n_cols;
+    image.data = image_input_buf;
+    image.size_data_bytes = image_buf_bytes;
+
+    LocoCompressedImage compressed;
+    compressed.data = image_compressed_buf;
+    compressed.size_data_bytes = compressed_buf_bytes;
+
+    LocoImage decompressed;
+    decompressed.data = image_decompressed_buf;
+    decompressed.size_data_bytes = image_buf_bytes;
+    LocoSegmentData seg_data[LOCO_MAX_SEGS];
+
+    LocoCompressOptions options;
+    loco_init_compress_options(&options);
+    EXPECT_EQ(options.raw_fallback, 0);
+    options.raw_fallback = 1;
+    LocoCompressStats stats[LOCO_MAX_SEGS];
+
+    // noise: every segment is stored raw, and decodes exactly
+    for (int bit_depth = 8; bit_depth <= 12; bit_depth += 4) {
+        make_random_input(1 << bit_depth);
+        image.bit_depth = bit_depth;
+        image.n_segs = 5;
+        I32 flags = loco_compress_ext(loco_state, &image, &options, &compressed, stats);
+        EXPECT_EQ(flags, LOCO_OK);
+        int raw_bytes = 0;
+        for (int i = 0; i < image.n_segs; i++) {
+            EXPECT_EQ(stats[i].raw, 1);
+            EXPECT_EQ((stats[i].n_bits + 31) / 32 * 32, compressed.segments.n_bits[i]);
+            // 6 byte header, pixels, padding to a word
+            EXPECT_EQ(compressed.segments.n_bits[i],
+                    (6*8 + stats[i].n_pixels * bit_depth + 31) / 32 * 32);
+            raw_bytes += compressed.segments.n_bits[i] / 8;
+        }
+        printf("%d bit noise raw size: %d\n", bit_depth, raw_bytes);
+        EXPECT_EQ(raw_bytes, compressed.compressed_size_bytes);
+        EXPECT_LE(raw_bytes, n_rows * n_cols * bit_depth / 8 + 8 * image.n_segs);
+
+        flags = loco_decompress(loco_dec_state, &compressed.segments,
+                &decompressed, seg_data);
+        EXPECT_EQ(flags, LOCO_OK);
+        EXPECT_EQ(decompressed.bit_depth, bit_depth);
+        for (int i = 0; i < image.n_segs; i++) {
+            EXPECT_EQ(seg_data[i].status, 0);
+            EXPECT_EQ(seg_data[i].n_missing_pixels, 0);
+        }
+        check_error();
+
+        // same sizes without writing
+        LocoCompressOptions sized_options = options;
+        sized_options.size_only = 1;
+        LocoCompressedImage sized;
+        flags = loco_compress_ext(loco_state, &image, &sized_options, &sized, NULL);
+        EXPECT_EQ(flags, LOCO_OK);
+        EXPECT_EQ(sized.compressed_size_bytes, compressed.compressed_size_bytes);
+
+        // a truncated raw segment is missing the pixels at its end
+        compressed.segments.n_bits[0] -= 32;
+        flags = loco_decompress(loco_dec_state, &compressed.segments,
+                &decompressed, seg_data);
+        EXPECT_EQ(flags, LOCO_OK);
+        EXPECT_EQ(seg_data[0].status, DELOCO_MISSING_DATA_FLAG);
+        EXPECT_GT(seg_data[0].n_missing_pixels, 0);
+        EXPECT_LE(seg_data[0].n_missing_pixels, 32 / bit_depth + 1);
+    }
+
+    // noise in the top half only: only top segments are stored raw
+    make_random_input(1 << 12);
+    for (int row = n_rows / 2; row < n_rows; row++) {
+        for (int col = 0; col < n_cols; col++) {
+            image_truth_buf[(row*n_cols)+col] = (LocoPixelType)(row + col);
+            image_input_buf[(row*n_cols)+col] = (LocoPixelType)(row + col);
+        }
+    }
+    image.bit_depth = 12;
+    image.n_segs = 4;
+    I32 flags = loco_compress_ext(loco_state, &image, &options, &compressed, stats);
+    EXPECT_EQ(flags, LOCO_OK);
+    EXPECT_EQ(stats[0].raw, 1);
+    EXPECT_EQ(stats[3].raw, 0);
+    flags = loco_decompress(loco_dec_state, &compressed.segments,
+            &decompressed, seg_data);
+    EXPECT_EQ(flags, LOCO_OK);
+    check_error();
+
+    // a buffer that fills up without the fallback holds the raw segments
+    make_random_input(1 << 12);
+    image.n_segs = 2;
+    flags = loco_compress_ext(loco_state, &image, &options, &compressed, NULL);
+    EXPECT_EQ(flags, LOCO_OK);
+    compressed.size_data_bytes = compressed.compressed_size_bytes + 4;
+    flags = loco_compress_ext(loco_state, &image, &options, &compressed, NULL);
+    EXPECT_EQ(flags, LOCO_OK);
+    flags = loco_compress(loco_state, &image, &compressed);
+    EXPECT_EQ(flags, LOCO_BUFFER_FILLED_FLAG);
+    compressed.size_data_bytes = compressed_buf_bytes;
+
+    // unknown header flags are rejected
+    flags = loco_compress_ext(loco_state, &image, &options, &compressed, NULL);
+    U8 *seg1 = compressed.segments.seg_ptr[1];
+    seg1[5] |= 0x04; // set flag 0x80; flags are header bits 38-45, lsb first
+    flags = loco_decompress(loco_dec_state, &compressed.segments,
+            &decompressed, seg_data);
+    EXPECT_EQ(flags, LOCO_OK);
+    EXPECT_EQ(seg_data[0].status, 0);
+    EXPECT_EQ(seg_data[1].status, DELOCO_BAD_HEADER_CODE_FLAG);
+
+    free_global_bufs();
+
+    // compressible images are unchanged by the fallback
+    uint32_t* frog_image = (uint32_t*) ReadImage(&n_cols, &n_rows,
+            "../test/frog.bmp", IMAGEIO_U8 | IMAGEIO_RGBA);
+    ASSERT_TRUE(frog_image != NULL);
+    alloc_global_bufs(n_rows, n_cols);
+    for (int row = 0; row < n_rows; row++) {
+        for (int col = 0; col < n_cols; col++) {
+            U8* u8p = (U8*)(&frog_image[row*n_cols+col]);
+            image_input_buf[(row * n_cols) + col] = (LocoPixelType)(
+                    u8p[0] * .3 + u8p[1] * .6 + u8p[2] * .1);
+        }
+    }
+    free(frog_image);
+
+    image.width = n_cols;
+    image.height = n_rows;
+    image.space_width = n_cols;
+    image.data = image_input_buf;
+    image.size_data_bytes = image_buf_bytes;
+    image.bit_depth = 8;
+    image.n_segs = 16;
+    compressed.data = image_compressed_buf;
+    compressed.size_data_bytes = compressed_buf_bytes;
+    flags = loco_compress(loco_state, &image, &compressed);
+    EXPECT_EQ(flags, LOCO_OK);
+    LocoBitstreamType *plain = (LocoBitstreamType*) malloc(compressed_buf_bytes);
+    ASSERT_TRUE(plain != NULL);
+    int plain_bytes = compressed.compressed_size_bytes;
+    memcpy(plain, image_compressed_buf, plain_bytes);
+    flags = loco_compress_ext(loco_state, &image, &options, &compressed, NULL);
+    EXPECT_EQ(flags, LOCO_OK);
+    EXPECT_EQ(compressed.compressed_size_bytes, plain_bytes);
+    EXPECT_EQ(memcmp(plain, image_compressed_buf, plain_bytes), 0);
+    free(plain);
+
+    free_global_bufs();
+}
+
+TEST(LocoTest, LimitedGolomb) {
+
+    int n_rows = 480;
+    int n_cols = 480;
+
+    alloc_global_bufs(n_rows, n_cols);
+
+    LocoImage image;
+    image.width = n_cols;
+    image.height = n_rows;
+    image.space_width = n_cols;
+    image.data = image_input_buf;
+    image.size_data_bytes = image_buf_bytes;
+
+    LocoCompressedImage compressed;
+    compressed.data = image_compressed_buf;
+    compressed.size_data_bytes = compressed_buf_bytes;
+
+    LocoImage decompressed;
+    decompressed.data = image_decompressed_buf;
+    decompressed.size_data_bytes = image_buf_bytes;
+    LocoSegmentData seg_data[LOCO_MAX_SEGS];
+
+    LocoCompressOptions options;
+    loco_init_compress_options(&options);
+    EXPECT_EQ(options.limit_golomb, 0);
+    LocoCompressOptions limit_options = options;
+    limit_options.limit_golomb = 1;
+    LocoCompressStats stats[LOCO_MAX_SEGS];
+
+    for (int bit_depth = 8; bit_depth <= 12; bit_depth += 4) {
+        int limit = (bit_depth == 8) ? LIMIT_UNARY_8BIT : LIMIT_UNARY_12BIT;
+        int max_val = (1 << bit_depth) - 1;
+
+        // dark image, with hot pixels as far from the prediction as can be
+        int hot_val = (max_val + 1) / 2;
+        make_single_color_input(0);
+        for (int i = 0; i < 200; i++) {
+            int row = rand() % n_rows;
+            int col = rand() % n_cols;
+            image_truth_buf[(row*n_cols)+col] = hot_val;
+            image_input_buf[(row*n_cols)+col] = hot_val;
+        }
+        image.bit_depth = bit_depth;
+        image.n_segs = 6;
+
+        I32 flags = loco_compress_ext(loco_state, &image, &options, &compressed, stats);
+        EXPECT_EQ(flags, LOCO_OK);
+        int unlimited_size = compressed.compressed_size_bytes;
+        EXPECT_GT(stats[0].max_unary, limit);
+
+        flags = loco_compress_ext(loco_state, &image, &limit_options, &compressed, stats);
+        EXPECT_EQ(flags, LOCO_OK);
+        printf("%d bit hot pixels, unlimited: %d, limited: %d\n",
+                bit_depth, unlimited_size, compressed.compressed_size_bytes);
+        EXPECT_LT(compressed.compressed_size_bytes, unlimited_size);
+        for (int i = 0; i < image.n_segs; i++) {
+            EXPECT_LE(stats[i].max_unary, limit);
+        }
+
+        flags = loco_decompress(loco_dec_state, &compressed.segments,
+                &decompressed, seg_data);
+        EXPECT_EQ(flags, LOCO_OK);
+        for (int i = 0; i < image.n_segs; i++) {
+            EXPECT_EQ(seg_data[i].status, 0);
+        }
+        check_error();
+
+        LocoCompressOptions sized_options = limit_options;
+        sized_options.size_only = 1;
+        LocoCompressedImage sized;
+        flags = loco_compress_ext(loco_state, &image, &sized_options, &sized, NULL);
+        EXPECT_EQ(flags, LOCO_OK);
+        EXPECT_EQ(sized.compressed_size_bytes, compressed.compressed_size_bytes);
+
+        // noise: bounded bits per pixel, and exact decode
+        make_random_input(max_val + 1);
+        flags = loco_compress_ext(loco_state, &image, &limit_options, &compressed, stats);
+        EXPECT_EQ(flags, LOCO_OK);
+        for (int i = 0; i < image.n_segs; i++) {
+            EXPECT_LE(stats[i].max_unary, limit);
+            EXPECT_LE(stats[i].n_bits, stats[i].n_pixels * (2 * bit_depth + limit + 1));
+        }
+        flags = loco_decompress(loco_dec_state, &compressed.segments,
+                &decompressed, seg_data);
+        EXPECT_EQ(flags, LOCO_OK);
+        check_error();
+
+        // a run of zeros longer than any code stops the segment at the limit
+        U8 *seg1 = compressed.segments.seg_ptr[1];
+        memset(seg1 + compressed.segments.n_bits[1] / 16, 0, 16);
+        flags = loco_decompress(loco_dec_state, &compressed.segments,
+                &decompressed, seg_data);
+        EXPECT_EQ(flags, LOCO_OK);
+        EXPECT_EQ(seg_data[0].status, 0);
+        EXPECT_EQ(seg_data[1].status, DELOCO_BADDATA_FLAG);
+        EXPECT_GT(seg_data[1].n_missing_pixels, 0);
+    }
+
+    free_global_bufs();
+}
+
+// compress with the given near-lossless bound, decompress, check the error
+// is within the bound, and return the compressed size
+int check_near(LocoImage *image, LocoCompressOptions *options)
+{
+    LocoCompressedImage compressed;
+    compressed.data = image_compressed_buf;
+    compressed.size_data_bytes = compressed_buf_bytes;
+    I32 flags = loco_compress_ext(loco_state, image, options, &compressed, NULL);
+    EXPECT_EQ(flags, LOCO_OK);
+
+    LocoCompressOptions sized_options = *options;
+    sized_options.size_only = 1;
+    LocoCompressedImage sized;
+    flags = loco_compress_ext(loco_state, image, &sized_options, &sized, NULL);
+    EXPECT_EQ(flags, LOCO_OK);
+    EXPECT_EQ(sized.compressed_size_bytes, compressed.compressed_size_bytes);
+
+    LocoImage decompressed;
+    decompressed.data = image_decompressed_buf;
+    decompressed.size_data_bytes = image_buf_bytes;
+    LocoSegmentData seg_data[LOCO_MAX_SEGS];
+    flags = loco_decompress(loco_dec_state, &compressed.segments,
+            &decompressed, seg_data);
+    EXPECT_EQ(flags, LOCO_OK);
+    for (int i = 0; i < image->n_segs; i++) {
+        EXPECT_EQ(seg_data[i].status, 0);
+    }
+
+    int max_err = 0;
+    for (int row = 0; row < image->height; row++) {
+        for (int col = 0; col < image->width; col++) {
+            int err = abs(image->data[row * image->space_width + col]
+                    - image_decompressed_buf[row * image->width + col]);
+            if (err > max_err) {
+                max_err = err;
+            }
+        }
+    }
+    printf("near %d: size %d, max error %d\n", options->near,
+            compressed.compressed_size_bytes, max_err);
+    EXPECT_LE(max_err, options->near);
+    return compressed.compressed_size_bytes;
+}
+
+TEST(LocoTest, NearLossless) {
+
+    int n_rows = 480;
+    int n_cols = 480;
+
+    alloc_global_bufs(n_rows, n_cols);
+
+    LocoImage image;
+    image.width = n_cols;
+    image.height = n_rows;
+    image.space_width = n_cols;
+    image.data = image_input_buf;
+    image.size_data_bytes = image_buf_bytes;
+
+    LocoCompressOptions options;
+    loco_init_compress_options(&options);
+    EXPECT_EQ(options.near, 0);
+
+    // noisy 12 bit ramp, where lossless gains are small
+    for (int row = 0; row < n_rows; row++) {
+        for (int col = 0; col < n_cols; col++) {
+            image_input_buf[row * n_cols + col] = (LocoPixelType)(
+                    1000 + 2 * row + col + rand() % 64);
+        }
+    }
+    image.bit_depth = 12;
+    image.n_segs = 9;
+    int lossless_size = check_near(&image, &options);
+    int last_size = lossless_size;
+    for (options.near = 1; options.near <= 3; options.near++) {
+        int size = check_near(&image, &options);
+        EXPECT_LT(size, last_size);
+        last_size = size;
+    }
+    EXPECT_LT(last_size, lossless_size * 3 / 4);
+
+    // with the limited code and raw fallback, near the ends of the range
+    options.near = 2;
+    options.limit_golomb = 1;
+    options.raw_fallback = 1;
+    make_random_input(1 << 12);
+    check_near(&image, &options);
+    options.near = LOCO_MAX_NEAR;
+    check_near(&image, &options);
+
+    make_random_input(1 << 8);
+    image.bit_depth = 8;
+    image.n_segs = LOCO_MAX_SEGS;
+    options.near = 1;
+    check_near(&image, &options);
+    make_single_color_input(PMAX_8BIT);
+    check_near(&image, &options);
+    make_single_color_input(0);
+    check_near(&image, &options);
+
+    // out of range
+    LocoCompressedImage compressed;
+    compressed.data = image_compressed_buf;
+    compressed.size_data_bytes = compressed_buf_bytes;
+    options.near = LOCO_MAX_NEAR + 1;
+    I32 flags = loco_compress_ext(loco_state, &image, &options, &compressed, NULL);
+    EXPECT_EQ(flags, LOCO_BAD_OPTIONS_FLAG | LOCO_ABORT_COMPRESSION_FLAG);
+    options.near = -1;
+    flags = loco_compress_ext(loco_state, &image, &options, &compressed, NULL);
+    EXPECT_EQ(flags, LOCO_BAD_OPTIONS_FLAG | LOCO_ABORT_COMPRESSION_FLAG);
+
+    free_global_bufs();
+
+    uint32_t* frog_image = (uint32_t*) ReadImage(&n_cols, &n_rows,
+            "../test/frog.bmp", IMAGEIO_U8 | IMAGEIO_RGBA);
+    ASSERT_TRUE(frog_image != NULL);
+    alloc_global_bufs(n_rows, n_cols);
+    for (int row = 0; row < n_rows; row++) {
+        for (int col = 0; col < n_cols; col++) {
+            U8* u8p = (U8*)(&frog_image[row*n_cols+col]);
+            image_input_buf[(row * n_cols) + col] = (LocoPixelType)(16*(
+                    u8p[0] * .3 + u8p[1] * .6 + u8p[2] * .1));
+        }
+    }
+    free(frog_image);
+
+    image.width = n_cols;
+    image.height = n_rows;
+    image.space_width = n_cols;
+    image.data = image_input_buf;
+    image.size_data_bytes = image_buf_bytes;
+    image.bit_depth = 12;
+    image.n_segs = 16;
+    loco_init_compress_options(&options);
+    last_size = check_near(&image, &options);
+    for (options.near = 1; options.near <= 16; options.near *= 2) {
+        int size = check_near(&image, &options);
+        EXPECT_LT(size, last_size);
+        last_size = size;
+    }
+
+    free_global_bufs();
+}
+
+// compress to a target size, and check each kept segment decodes to within
+// its near-lossless bound; return the number of segments dropped
+int check_rate_control(LocoImage *image, LocoCompressOptions *options)
+{
+    LocoCompressedImage compressed;
+    compressed.data = image_compressed_buf;
+    compressed.size_data_bytes = compressed_buf_bytes;
+    LocoCompressStats stats[LOCO_MAX_SEGS];
+    I32 flags = loco_compress_ext(loco_state, image, options, &compressed, stats);
+    EXPECT_EQ(flags & ~LOCO_SEGMENTS_DROPPED_FLAG, LOCO_OK);
+    EXPECT_LE(compressed.compressed_size_bytes, options->target_bytes);
+
+    LocoImage decompressed;
+    decompressed.data = image_decompressed_buf;
+    decompressed.size_data_bytes = image_buf_bytes;
+    LocoSegmentData seg_data[LOCO_MAX_SEGS];
+    I32 dec_flags = loco_decompress(loco_dec_state, &compressed.segments,
+            &decompressed, seg_data);
+
+    int n_dropped = 0;
+    int max_near = 0;
+    for (int i = 0; i < image->n_segs; i++) {
+        if (stats[i].dropped) {
+            n_dropped++;
+            EXPECT_EQ(compressed.segments.n_bits[i], 0);
+            EXPECT_EQ(seg_data[i].status, DELOCO_SHORTDATASEG_FLAG);
+            continue;
+        }
+        EXPECT_EQ(dec_flags, LOCO_OK);
+        EXPECT_EQ(seg_data[i].status, 0);
+        EXPECT_GE(stats[i].near, options->near);
+        if (stats[i].near > max_near) {
+            max_near = stats[i].near;
+        }
+        int max_err = 0;
+        for (int row = seg_data[i].bound_first_line;
+                row < seg_data[i].bound_first_line + seg_data[i].bound_n_lines; row++) {
+            for (int col = seg_data[i].bound_first_sample;
+                    col < seg_data[i].bound_first_sample + seg_data[i].bound_n_samples;
+                    col++) {
+                int err = abs(image->data[row * image->space_width + col]
+                        - image_decompressed_buf[row * image->width + col]);
+                if (err > max_err) {
+                    max_err = err;
+                }
+            }
+        }
+        EXPECT_LE(max_err, stats[i].near);
+    }
+    EXPECT_EQ((flags & LOCO_SEGMENTS_DROPPED_FLAG) != 0, n_dropped > 0);
+    printf("target %d: size %d, max near %d, dropped %d\n", options->target_bytes,
+            compressed.compressed_size_bytes, max_near, n_dropped);
+    return n_dropped;
+}
+
+TEST(LocoTest, RateControl) {
+
+    int n_rows;
+    int n_cols;
+    uint32_t* frog_image = (uint32_t*) ReadImage(&n_cols, &n_rows,
+            "../test/frog.bmp", IMAGEIO_U8 | IMAGEIO_RGBA);
+    ASSERT_TRUE(frog_image != NULL);
+    alloc_global_bufs(n_rows, n_cols);
+    for (int row = 0; row < n_rows; row++) {
+        for (int col = 0; col < n_cols; col++) {
+            U8* u8p = (U8*)(&frog_image[row*n_cols+col]);
+            image_input_buf[(row * n_cols) + col] = (LocoPixelType)(16*(
+                    u8p[0] * .3 + u8p[1] * .6 + u8p[2] * .1));
+        }
+    }
+    free(frog_image);
+
+    LocoImage image;
+    image.width = n_cols;
+    image.height = n_rows;
+    image.space_width = n_cols;
+    image.data = image_input_buf;
+    image.size_data_bytes = image_buf_bytes;
+    image.bit_depth = 12;
+    image.n_segs = 16;
+
+    LocoCompressedImage compressed;
+    compressed.data = image_compressed_buf;
+    compressed.size_data_bytes = compressed_buf_bytes;
+    I32 flags = loco_compress(loco_state, &image, &compressed);
+    EXPECT_EQ(flags, LOCO_OK);
+    int lossless_bytes = compressed.compressed_size_bytes;
+    LocoBitstreamType *lossless = (LocoBitstreamType*) malloc(lossless_bytes);
+    ASSERT_TRUE(lossless != NULL);
+    memcpy(lossless, image_compressed_buf, lossless_bytes);
+
+    LocoCompressOptions options;
+    loco_init_compress_options(&options);
+    EXPECT_EQ(options.target_bytes, 0);
+    EXPECT_TRUE(options.seg_priority == NULL);
+
+    // a target the lossless image fits is met losslessly
+    options.target_bytes = lossless_bytes;
+    EXPECT_EQ(check_rate_control(&image, &options), 0);
+    flags = loco_compress_ext(loco_state, &image, &options, &compressed, NULL);
+    EXPECT_EQ(flags, LOCO_OK);
+    EXPECT_EQ(compressed.compressed_size_bytes, lossless_bytes);
+    EXPECT_EQ(memcmp(lossless, image_compressed_buf, lossless_bytes), 0);
+    free(lossless);
+
+    // smaller targets are met with every segment, where plain compression
+    // would lose segments
+    options.target_bytes = lossless_bytes / 2;
+    EXPECT_EQ(check_rate_control(&image, &options), 0);
+    compressed.size_data_bytes = options.target_bytes;
+    flags = loco_compress(loco_state, &image, &compressed);
+    EXPECT_EQ(flags, LOCO_BUFFER_FILLED_FLAG);
+    compressed.size_data_bytes = compressed_buf_bytes;
+
+    options.near = 2;
+    EXPECT_EQ(check_rate_control(&image, &options), 0);
+    options.near = 0;
+    options.target_bytes = lossless_bytes / 3;
+    EXPECT_EQ(check_rate_control(&image, &options), 0);
+
+    // the result buffer also limits the size
+    options.target_bytes = lossless_bytes;
+    compressed.size_data_bytes = lossless_bytes / 3;
+    flags = loco_compress_ext(loco_state, &image, &options, &compressed, NULL);
+    EXPECT_EQ(flags, LOCO_OK);
+    EXPECT_LE(compressed.compressed_size_bytes, lossless_bytes / 3);
+    compressed.size_data_bytes = compressed_buf_bytes;
+
+    // the code takes at least a bit per pixel, so below that segments must
+    // be dropped; the least important go first
+    options.target_bytes = n_rows * n_cols / 16;
+    EXPECT_GT(check_rate_control(&image, &options), 0);
+    I32 priority[LOCO_MAX_SEGS];
+    for (int i = 0; i < image.n_segs; i++) {
+        priority[i] = 1;
+    }
+    priority[0] = 0;
+    options.seg_priority = priority;
+    LocoCompressStats stats[LOCO_MAX_SEGS];
+    flags = loco_compress_ext(loco_state, &image, &options, &compressed, stats);
+    EXPECT_EQ(flags, LOCO_SEGMENTS_DROPPED_FLAG);
+    EXPECT_EQ(stats[0].dropped, 1);
+    EXPECT_EQ(stats[1].dropped, 0);
+
+    options.seg_priority = NULL;
+    options.target_bytes = 16;
+    EXPECT_EQ(check_rate_control(&image, &options), image.n_segs);
+
+    options.target_bytes = -1;
+    flags = loco_compress_ext(loco_state, &image, &options, &compressed, NULL);
+    EXPECT_EQ(flags, LOCO_BAD_OPTIONS_FLAG | LOCO_ABORT_COMPRESSION_FLAG);
+
+    free_global_bufs();
+}
+
+// compress into a buffer of exactly the bound, which must hold everything
+void check_size_bound(LocoImage *image, LocoCompressOptions *options)
+{
+    I32 bound = loco_compressed_size_bound(image->width, image->height,
+            image->bit_depth, image->n_segs, options);
+    ASSERT_GT(bound, 0);
+    LocoBitstreamType *bound_buf = (LocoBitstreamType*) malloc(bound);
+    ASSERT_TRUE(bound_buf != NULL);
+    LocoCompressedImage compressed;
+    compressed.data = bound_buf;
+    compressed.size_data_bytes = bound;
+    I32 flags = loco_compress_ext(loco_state, image, options, &compressed, NULL);
+    EXPECT_EQ(flags, LOCO_OK);
+    EXPECT_LT(compressed.compressed_size_bytes, bound);
+    printf("%dx%d %d bit, %d segs: %d bytes, bound %d\n", image->width,
+            image->height, image->bit_depth, image->n_segs,
+            compressed.compressed_size_bytes, bound);
+    free(bound_buf);
+}
+
+TEST(LocoTest, SizeBound) {
+
+    int n_rows = 16;
+    int n_cols = 16;
+
+    alloc_global_bufs(n_rows, n_cols);
+
+    LocoImage image;
+    image.width = n_cols;
+    image.height = n_rows;
+    image.space_width = n_cols;
+    image.data = image_input_buf;
+    image.size_data_bytes = image_buf_bytes;
+    image.n_segs = 1;
+
+    LocoCompressOptions options;
+    loco_init_compress_options(&options);
+
+    // hot pixels on a dark background code to long unary tails
+    for (int bit_depth = 8; bit_depth <= 12; bit_depth += 4) {
+        for (int row = 0; row < n_rows; row++) {
+            for (int col = 0; col < n_cols; col++) {
+                image_input_buf[row*n_cols+col] =
+                        ((row + col) % 2) ? (1 << bit_depth) - 1 : 0;
+            }
+        }
+        image.bit_depth = bit_depth;
+        options.limit_golomb = 0;
+        options.raw_fallback = 0;
+        check_size_bound(&image, &options);
+        options.limit_golomb = 1;
+        check_size_bound(&image, &options);
+        options.near = 3;
+        check_size_bound(&image, &options);
+        options.near = 0;
+        options.raw_fallback = 1;
+        check_size_bound(&image, &options);
+        EXPECT_LE(loco_compressed_size_bound(n_cols, n_rows, bit_depth, 1, &options),
+                LOCO_RAW_FALLBACK_BOUND_BYTES(n_cols, n_rows, bit_depth, 1));
+    }
+    free_global_bufs();
+
+    // noise stored raw fills the bound, but for the spare word; the macro
+    // is a little larger, and a constant expression
+    n_rows = 480;
+    n_cols = 480;
+    alloc_global_bufs(n_rows, n_cols);
+    image.width = n_cols;
+    image.height = n_rows;
+    image.space_width = n_cols;
+    image.data = image_input_buf;
+    image.size_data_bytes = image_buf_bytes;
+    image.n_segs = 7;
+    static LocoBitstreamType pool[LOCO_RAW_FALLBACK_BOUND_BYTES(480, 480, 12, 7)
+            / sizeof(LocoBitstreamType)];
+    loco_init_compress_options(&options);
+    options.raw_fallback = 1;
+    for (int bit_depth = 8; bit_depth <= 12; bit_depth += 4) {
+        make_random_input(1 << bit_depth);
+        image.bit_depth = bit_depth;
+        I32 bound = loco_compressed_size_bound(n_cols, n_rows, bit_depth,
+                image.n_segs, &options);
+        EXPECT_LE(bound, LOCO_RAW_FALLBACK_BOUND_BYTES(n_cols, n_rows, bit_depth,
+                image.n_segs));
+        EXPECT_LE(bound, (I32)sizeof(pool));
+        LocoCompressedImage compressed;
+        compressed.data = pool;
+        compressed.size_data_bytes = bound;
+        I32 flags = loco_compress_ext(loco_state, &image, &options, &compressed, NULL);
+        EXPECT_EQ(flags, LOCO_OK);
+        EXPECT_EQ(compressed.compressed_size_bytes + (I32)sizeof(LocoBitstreamType),
+                bound);
+        check_size_bound(&image, &options);
+    }
+    free_global_bufs();
+
+    // the unlimited code has no bound that fits for large images
+    loco_init_compress_options(&options);
+    EXPECT_EQ(loco_compressed_size_bound(LOCO_MAX_IMAGE_WIDTH,
+            LOCO_MAX_IMAGE_HEIGHT, 12, 1, &options), 0);
+    EXPECT_EQ(loco_compressed_size_bound(LOCO_MAX_IMAGE_WIDTH,
+            LOCO_MAX_IMAGE_HEIGHT, 12, 1, NULL), 0);
+    EXPECT_EQ(loco_compressed_size_bound(2048, 2056, 12, 8, NULL), 0);
+    // but up to 2^31 bytes, it is counted without overflow: 512 bytes for
+    // each 12 bit pixel, 32 for each 8 bit pixel
+    EXPECT_GE(loco_compressed_size_bound(1024, 1024, 12, 1, NULL),
+            (1024 * 1024 - 2) * 512);
+    EXPECT_LE(loco_compressed_size_bound(1024, 1024, 12, 1, NULL),
+            1024 * 1024 * 512 + 16);
+    EXPECT_GE(loco_compressed_size_bound(LOCO_MAX_IMAGE_WIDTH,
+            LOCO_MAX_IMAGE_HEIGHT, 8, 1, NULL),
+            (LOCO_MAX_IMAGE_WIDTH * LOCO_MAX_IMAGE_HEIGHT - 2) * 32);
+    // limited codes take at most 60 bits per pixel
+    options.limit_golomb = 1;
+    EXPECT_GE(loco_compressed_size_bound(LOCO_MAX_IMAGE_WIDTH,
+            LOCO_MAX_IMAGE_HEIGHT, 12, 1, &options),
+            LOCO_MAX_IMAGE_WIDTH * LOCO_MAX_IMAGE_HEIGHT / 8 * 60 - 16);
+    EXPECT_LE(loco_compressed_size_bound(LOCO_MAX_IMAGE_WIDTH,
+            LOCO_MAX_IMAGE_HEIGHT, 12, 1, &options),
+            LOCO_MAX_IMAGE_WIDTH * LOCO_MAX_IMAGE_HEIGHT / 8 * 60 + 16);
+
+    // rate control never exceeds the target
+    options.target_bytes = 1000;
+    EXPECT_EQ(loco_compressed_size_bound(LOCO_MAX_IMAGE_WIDTH,
+            LOCO_MAX_IMAGE_HEIGHT, 12, 1, &options), 1000);
+
+    // parameters that cannot be compressed
+    EXPECT_EQ(loco_compressed_size_bound(LOCO_MIN_IMAGE_WIDTH - 1, 100, 8, 1, NULL), 0);
+    EXPECT_EQ(loco_compressed_size_bound(100, LOCO_MAX_IMAGE_HEIGHT + 1, 8, 1, NULL), 0);
+    EXPECT_EQ(loco_compressed_size_bound(100, 100, 13, 1, NULL), 0);
+    EXPECT_EQ(loco_compressed_size_bound(100, 100, 8, LOCO_MAX_SEGS + 1, NULL), 0);
+    EXPECT_EQ(loco_compressed_size_bound(20, 20, 8, 3, NULL), 0);
+}
+
+TEST(LocoTest, ScatterOutput) {
+
+    int n_rows;
+    int n_cols;
+    uint32_t* frog_image = (uint32_t*) ReadImage(&n_cols, &n_rows,
+            "../test/frog.bmp", IMAGEIO_U8 | IMAGEIO_RGBA);
+    ASSERT_TRUE(frog_image != NULL);
+    alloc_global_bufs(n_rows, n_cols);
+    for (int row = 0; row < n_rows; row++) {
+        for (int col = 0; col < n_cols; col++) {
+            U8* u8p = (U8*)(&frog_image[row*n_cols+col]);
+            image_input_buf[(row * n_cols) + col] = (LocoPixelType)(16*(
+                    u8p[0] * .3 + u8p[1] * .6 + u8p[2] * .1));
+            image_truth_buf[(row * n_cols) + col] =
+                    image_input_buf[(row * n_cols) + col];
+        }
+    }
+    free(frog_image);
+
+    LocoImage image;
+    image.width = n_cols;
+    image.height = n_rows;
+    image.space_width = n_cols;
+    image.data = image_input_buf;
+    image.size_data_bytes = image_buf_bytes;
+    image.bit_depth = 12;
+    image.n_segs = 8;
+
+    LocoCompressedImage compressed;
+    compressed.data = image_compressed_buf;
+    compressed.size_data_bytes = compressed_buf_bytes;
+    I32 flags = loco_compress(loco_state, &image, &compressed);
+    ASSERT_EQ(flags, LOCO_OK);
+
+    // each segment in its own buffer, as big as any segment can be
+    I32 seg_buf_bytes = loco_compressed_size_bound(n_cols, n_rows, 12,
+            image.n_segs, NULL);
+    LocoSegmentBuffer seg_out[LOCO_MAX_SEGS];
+    for (int i = 0; i < image.n_segs; i++) {
+        seg_out[i].data = (LocoBitstreamType*) malloc(seg_buf_bytes);
+        ASSERT_TRUE(seg_out[i].data != NULL);
+        seg_out[i].size_data_bytes = seg_buf_bytes;
+    }
+
+    // the same segments as contiguous output, decoded in place
+    LocoCompressedSegments segments;
+    flags = loco_compress_scatter(loco_state, &image, NULL, seg_out, &segments, NULL);
+    EXPECT_EQ(flags, LOCO_OK);
+    EXPECT_EQ(segments.n_segs, image.n_segs);
+    for (int i = 0; i < image.n_segs; i++) {
+        EXPECT_EQ(segments.seg_ptr[i], (U8*)seg_out[i].data);
+        EXPECT_EQ(segments.n_bits[i], compressed.segments.n_bits[i]);
+        EXPECT_EQ(memcmp(segments.seg_ptr[i], compressed.segments.seg_ptr[i],
+                segments.n_bits[i] / 8), 0);
+    }
+    LocoImage decompressed;
+    decompressed.data = image_decompressed_buf;
+    decompressed.size_data_bytes = image_buf_bytes;
+    LocoSegmentData seg_data[LOCO_MAX_SEGS];
+    flags = loco_decompress(loco_dec_state, &segments, &decompressed, seg_data);
+    EXPECT_EQ(flags, LOCO_OK);
+    check_error();
+
+    // segments coded in parallel, each thread with its own state
+    for (int i = 0; i < image.n_segs; i++) {
+        memset(seg_out[i].data, 0, seg_buf_bytes);
+    }
+    LocoCompressedSegments par_segments;
+    const int n_threads = 3;
+    I32 thread_flags[n_threads];
+    std::thread threads[n_threads];
+    for (int t = 0; t < n_threads; t++) {
+        threads[t] = std::thread([&, t]() {
+            LocoCompressState *state =
+                    (LocoCompressState*) malloc(sizeof(LocoCompressState));
+            thread_flags[t] = (state == NULL) ? -1 : LOCO_OK;
+            for (int i = t; i < image.n_segs && state != NULL; i += n_threads) {
+                thread_flags[t] |= loco_compress_segment(state, &image, NULL, i,
+                        &seg_out[i], &par_segments, NULL);
+            }
+            free(state);
+        });
+    }
+    for (int t = 0; t < n_threads; t++) {
+        threads[t].join();
+        EXPECT_EQ(thread_flags[t], LOCO_OK);
+    }
+    par_segments.n_segs = image.n_segs;
+    for (int i = 0; i < image.n_segs; i++) {
+        EXPECT_EQ(par_segments.seg_ptr[i], (U8*)seg_out[i].data);
+        EXPECT_EQ(par_segments.n_bits[i], compressed.segments.n_bits[i]);
+        EXPECT_EQ(memcmp(par_segments.seg_ptr[i], compressed.segments.seg_ptr[i],
+                par_segments.n_bits[i] / 8), 0);
+    }
+
+    // a full buffer cuts short only its own segment
+    seg_out[2].size_data_bytes = compressed.segments.n_bits[2] / 64 * 4;
+    LocoCompressStats stats[LOCO_MAX_SEGS];
+    flags = loco_compress_scatter(loco_state, &image, NULL, seg_out, &segments, stats);
+    EXPECT_EQ(flags, LOCO_BUFFER_FILLED_FLAG);
+    for (int i = 0; i < image.n_segs; i++) {
+        EXPECT_EQ(stats[i].truncated, i == 2);
+        EXPECT_EQ(segments.n_bits[i], (i == 2) ? seg_out[2].size_data_bytes * 8
+                : compressed.segments.n_bits[i]);
+    }
+    flags = loco_decompress(loco_dec_state, &segments, &decompressed, seg_data);
+    EXPECT_EQ(flags, LOCO_OK);
+    for (int i = 0; i < image.n_segs; i++) {
+        EXPECT_EQ(seg_data[i].status, (i == 2) ? DELOCO_MISSING_DATA_FLAG : 0);
+        EXPECT_EQ(seg_data[i].n_missing_pixels > 0, i == 2);
+    }
+    seg_out[2].size_data_bytes = seg_buf_bytes;
+
+    // options apply as for contiguous output
+    LocoCompressOptions options;
+    loco_init_compress_options(&options);
+    options.near = 2;
+    options.target_bytes = compressed.compressed_size_bytes / 3;
+    flags = loco_compress_ext(loco_state, &image, &options, &compressed, NULL);
+    EXPECT_EQ(flags, LOCO_OK);
+    flags = loco_compress_scatter(loco_state, &image, &options, seg_out, &segments, NULL);
+    EXPECT_EQ(flags, LOCO_OK);
+    for (int i = 0; i < image.n_segs; i++) {
+        EXPECT_EQ(segments.n_bits[i], compressed.segments.n_bits[i]);
+        EXPECT_EQ(memcmp(segments.seg_ptr[i], compressed.segments.seg_ptr[i],
+                segments.n_bits[i] / 8), 0);
+    }
+
+    // without output
+    options.size_only = 1;
+    options.target_bytes = 0;
+    LocoSegmentBuffer no_out[LOCO_MAX_SEGS];
+    for (int i = 0; i < image.n_segs; i++) {
+        no_out[i].data = NULL;
+        no_out[i].size_data_bytes = 0;
+    }
+    flags = loco_compress_scatter(loco_state, &image, &options, no_out, &segments, NULL);
+    EXPECT_EQ(flags, LOCO_OK);
+    EXPECT_GT(segments.n_bits[0], 0);
+
+    // one segment cannot be rate controlled, and must exist
+    options.size_only = 0;
+    options.target_bytes = 1000;
+    flags = loco_compress_segment(loco_state, &image, &options, 0, &seg_out[0],
+            &segments, NULL);
+    EXPECT_EQ(flags, LOCO_BAD_OPTIONS_FLAG | LOCO_ABORT_COMPRESSION_FLAG);
+    options.target_bytes = 0;
+    flags = loco_compress_segment(loco_state, &image, &options, image.n_segs,
+            &seg_out[0], &segments, NULL);
+    EXPECT_EQ(flags, LOCO_BAD_OPTIONS_FLAG | LOCO_ABORT_COMPRESSION_FLAG);
+
+    for (int i = 0; i < image.n_segs; i++) {
+        free(seg_out[i].data);
+    }
+    free_global_bufs();
+}
+
+// collects packets passed on from a small ring
+typedef struct {
+    U8 *packets;
+    int packet_bytes;
+    int n_packets;
+} PacketSink;
+
+void sink_packet(void *context, const LocoBitstreamType *packet, I32 index)
+{
+    PacketSink *sink = (PacketSink*)context;
+    EXPECT_EQ(index, sink->n_packets);
+    memcpy(sink->packets + index * sink->packet_bytes, packet, sink->packet_bytes);
+    sink->n_packets++;
+}
+
+TEST(LocoTest, PacketOutput) {
+
+    int n_rows;
+    int n_cols;
+    uint32_t* frog_image = (uint32_t*) ReadImage(&n_cols, &n_rows,
+            "../test/frog.bmp", IMAGEIO_U8 | IMAGEIO_RGBA);
+    ASSERT_TRUE(frog_image != NULL);
+    alloc_global_bufs(n_rows, n_cols);
+    for (int row = 0; row < n_rows; row++) {
+        for (int col = 0; col < n_cols; col++) {
+            U8* u8p = (U8*)(&frog_image[row*n_cols+col]);
+            image_input_buf[(row * n_cols) + col] = (LocoPixelType)(16*(
+                    u8p[0] * .3 + u8p[1] * .6 + u8p[2] * .1));
+            image_truth_buf[(row * n_cols) + col] =
+                    image_input_buf[(row * n_cols) + col];
+        }
+    }
+    free(frog_image);
+
+    LocoImage image;
+    image.width = n_cols;
+    image.height = n_rows;
+    image.space_width = n_cols;
+    image.data = image_input_buf;
+    image.size_data_bytes = image_buf_bytes;
+    image.bit_depth = 12;
+    image.n_segs = 8;
+
+    LocoCompressedImage compressed;
+    compressed.data = image_compressed_buf;
+    compressed.size_data_bytes = compressed_buf_bytes;
+    I32 flags = loco_compress(loco_state, &image, &compressed);
+    ASSERT_EQ(flags, LOCO_OK);
+
+    const int packet_bytes = 256;
+    const int payload_bytes = packet_bytes - LOCO_PACKET_HEADER_BYTES;
+    int expected_packets = 0;
+    for (int i = 0; i < image.n_segs; i++) {
+        expected_packets += (compressed.segments.n_bits[i] / 8 + payload_bytes - 1)
+                / payload_bytes;
+    }
+
+    LocoPacketOutput packets;
+    packets.packet_bytes = packet_bytes;
+    packets.n_packets = expected_packets + 10;
+    packets.data = (LocoBitstreamType*) malloc(packets.n_packets * packet_bytes);
+    ASSERT_TRUE(packets.data != NULL);
+    packets.packet_done = NULL;
+    packets.context = NULL;
+    flags = loco_compress_packets(loco_state, &image, NULL, &packets, NULL);
+    EXPECT_EQ(flags, LOCO_OK);
+    EXPECT_EQ(packets.n_packets_out, expected_packets);
+    printf("%d bytes in %d packets of %d bytes\n",
+            compressed.compressed_size_bytes, packets.n_packets_out, packet_bytes);
+
+    // headers carry the segment and bit offset
+    U8 *first = (U8*)packets.data;
+    EXPECT_EQ(first[0], 0);
+    EXPECT_EQ(first[1], image.n_segs);
+    EXPECT_EQ((first[2] << 8) | first[3], payload_bytes);
+    EXPECT_EQ(first[4] | first[5] | first[6] | first[7], 0);
+    U8 *second = first + packet_bytes;
+    EXPECT_EQ(second[0], 0);
+    EXPECT_EQ((second[6] << 8) | second[7], 8 * payload_bytes);
+
+    // all packets reassemble to the contiguous output
+    const LocoBitstreamType *received[LOCO_MAX_SEGS * 256];
+    ASSERT_LE(expected_packets, LOCO_MAX_SEGS * 256);
+    for (int p = 0; p < packets.n_packets_out; p++) {
+        received[p] = packets.data + p * packet_bytes / sizeof(LocoBitstreamType);
+    }
+    LocoCompressedImage unpacked;
+    unpacked.data = (LocoBitstreamType*) malloc(compressed_buf_bytes);
+    ASSERT_TRUE(unpacked.data != NULL);
+    unpacked.size_data_bytes = compressed_buf_bytes;
+    flags = loco_unpack_packets(received, packets.n_packets_out, packet_bytes, &unpacked);
+    EXPECT_EQ(flags, 0);
+    EXPECT_EQ(unpacked.segments.n_segs, image.n_segs);
+    EXPECT_EQ(unpacked.compressed_size_bytes, compressed.compressed_size_bytes);
+    EXPECT_EQ(memcmp(unpacked.data, compressed.data, compressed.compressed_size_bytes), 0);
+    for (int i = 0; i < image.n_segs; i++) {
+        EXPECT_EQ(unpacked.segments.n_bits[i], compressed.segments.n_bits[i]);
+    }
+    LocoImage decompressed;
+    decompressed.data = image_decompressed_buf;
+    decompressed.size_data_bytes = image_buf_bytes;
+    LocoSegmentData seg_data[LOCO_MAX_SEGS];
+    flags = loco_decompress(loco_dec_state, &unpacked.segments, &decompressed, seg_data);
+    EXPECT_EQ(flags, LOCO_OK);
+    check_error();
+
+    // a lost packet loses the rest of its segment only; repeats are skipped
+    int lost = 0;
+    while ((((U8*)received[lost])[0] & ~LOCO_PACKET_LAST_FLAG) != 3) {
+        lost++;
+    }
+    lost++;
+    int n_received = 0;
+    for (int p = 0; p < packets.n_packets_out; p++) {
+        if (p != lost) {
+            received[n_received++] = packets.data
+                    + p * packet_bytes / sizeof(LocoBitstreamType);
+        }
+        if (p == 1) {
+            received[n_received++] = packets.data
+                    + p * packet_bytes / sizeof(LocoBitstreamType);
+        }
+    }
+    flags = loco_unpack_packets(received, n_received, packet_bytes, &unpacked);
+    EXPECT_EQ(flags, DELOCO_MISSING_DATA_FLAG);
+    EXPECT_EQ(unpacked.segments.n_bits[3], 8 * payload_bytes);
+    flags = loco_decompress(loco_dec_state, &unpacked.segments, &decompressed, seg_data);
+    EXPECT_EQ(flags, LOCO_OK);
+    for (int i = 0; i < image.n_segs; i++) {
+        EXPECT_EQ(seg_data[i].status, (i == 3) ? DELOCO_MISSING_DATA_FLAG : 0);
+    }
+
+    // a ring of two packets, passed on as they fill, gives the same packets
+    PacketSink sink;
+    sink.packets = (U8*) malloc(expected_packets * packet_bytes);
+    ASSERT_TRUE(sink.packets != NULL);
+    sink.packet_bytes = packet_bytes;
+    sink.n_packets = 0;
+    LocoPacketOutput ring = packets;
+    ring.n_packets = 2;
+    ring.data = (LocoBitstreamType*) malloc(ring.n_packets * packet_bytes);
+    ASSERT_TRUE(ring.data != NULL);
+    ring.packet_done = sink_packet;
+    ring.context = &sink;
+    flags = loco_compress_packets(loco_state, &image, NULL, &ring, NULL);
+    EXPECT_EQ(flags, LOCO_OK);
+    EXPECT_EQ(ring.n_packets_out, expected_packets);
+    EXPECT_EQ(sink.n_packets, expected_packets);
+    for (int p = 0; p < expected_packets; p++) {
+        U8 *a = sink.packets + p * packet_bytes;
+        U8 *b = (U8*)packets.data + p * packet_bytes;
+        int used = LOCO_PACKET_HEADER_BYTES + ((a[2] << 8) | a[3]);
+        EXPECT_EQ(memcmp(a, b, used), 0);
+    }
+
+    // without a callback, a full ring cuts segments short
+    ring.packet_done = NULL;
+    LocoCompressStats stats[LOCO_MAX_SEGS];
+    flags = loco_compress_packets(loco_state, &image, NULL, &ring, stats);
+    EXPECT_EQ(flags, LOCO_BUFFER_FILLED_FLAG);
+    EXPECT_EQ(ring.n_packets_out, 2);
+    EXPECT_EQ(stats[0].truncated, 1);
+
+    LocoCompressOptions options;
+    loco_init_compress_options(&options);
+    options.raw_fallback = 1;
+    flags = loco_compress_packets(loco_state, &image, &options, &packets, NULL);
+    EXPECT_EQ(flags, LOCO_BAD_OPTIONS_FLAG | LOCO_ABORT_COMPRESSION_FLAG);
+    packets.packet_bytes = LOCO_MIN_PACKET_BYTES - 4;
+    flags = loco_compress_packets(loco_state, &image, NULL, &packets, NULL);
+    EXPECT_EQ(flags, LOCO_BAD_OPTIONS_FLAG | LOCO_ABORT_COMPRESSION_FLAG);
+
+    free(ring.data);
+    free(sink.packets);
+    free(unpacked.data);
+    free(packets.data);
+    free_global_bufs();
+}
+
+// decompress each segment as its data arrives in pieces of step_bits,
+// interleaving the segments, and check the result matches loco_decompress
+void check_incremental(LocoImage *image, LocoCompressOptions *options, int step_bits)
+{
+    LocoCompressedImage compressed;
+    compressed.data = image_compressed_buf;
+    compressed.size_data_bytes = compressed_buf_bytes;
+    I32 flags = loco_compress_ext(loco_state, image, options, &compressed, NULL);
+    ASSERT_EQ(flags, LOCO_OK);
+
+    LocoImage decompressed;
+    decompressed.data = image_decompressed_buf;
+    decompressed.size_data_bytes = image_buf_bytes;
+    decompressed.n_segs = 0;
+    LocoSegmentData seg_data[LOCO_MAX_SEGS];
+    LocoDecompressState *states[LOCO_MAX_SEGS];
+    int arrived[LOCO_MAX_SEGS];
+    for (int i = 0; i < image->n_segs; i++) {
+        states[i] = (LocoDecompressState*) malloc(sizeof(LocoDecompressState));
+        ASSERT_TRUE(states[i] != NULL);
+        arrived[i] = 0;
+    }
+
+    int n_calls = 0;
+    int done = 0;
+    while (!done) {
+        done = 1;
+        for (int i = 0; i < image->n_segs; i++) {
+            int n_bits = compressed.segments.n_bits[i];
+            if (arrived[i] == n_bits) {
+                continue;
+            }
+            done = 0;
+            int was_missing = seg_data[i].n_missing_pixels;
+            int was_arrived = arrived[i];
+            arrived[i] += step_bits;
+            if (arrived[i] > n_bits) {
+                arrived[i] = n_bits;
+            }
+            if (was_arrived == 0 || seg_data[i].status & DELOCO_SHORTDATASEG_FLAG) {
+                flags = loco_decompress_segment_start(states[i],
+                        compressed.segments.seg_ptr[i], arrived[i],
+                        &decompressed, &seg_data[i]);
+                if (flags != LOCO_OK) {
+                    EXPECT_EQ(flags, DELOCO_NOGOODSEGMENTS_FLAG);
+                    EXPECT_EQ(seg_data[i].status, DELOCO_SHORTDATASEG_FLAG);
+                    continue;
+                }
+            } else {
+                loco_decompress_segment_continue(states[i], arrived[i], &seg_data[i]);
+                EXPECT_LE(seg_data[i].n_missing_pixels, was_missing);
+            }
+            n_calls++;
+            EXPECT_EQ(seg_data[i].n_missing_pixels > 0,
+                    (seg_data[i].status & DELOCO_MISSING_DATA_FLAG) != 0);
+        }
+    }
+    for (int i = 0; i < image->n_segs; i++) {
+        EXPECT_EQ(seg_data[i].status, 0);
+        EXPECT_EQ(seg_data[i].n_missing_pixels, 0);
+        EXPECT_EQ(seg_data[i].real_num, i);
+        free(states[i]);
+    }
+    printf("%d segments decompressed in %d calls\n", image->n_segs, n_calls);
+
+    // the same as decompressing at once
+    LocoPixelType *incremental = (LocoPixelType*) malloc(image_buf_bytes);
+    ASSERT_TRUE(incremental != NULL);
+    memcpy(incremental, image_decompressed_buf, image_buf_bytes);
+    flags = loco_decompress(loco_dec_state, &compressed.segments, &decompressed, seg_data);
+    EXPECT_EQ(flags, LOCO_OK);
+    EXPECT_EQ(memcmp(incremental, image_decompressed_buf, image_buf_bytes), 0);
+    free(incremental);
+}
+
+TEST(LocoTest, IncrementalDecode) {
+
+    int n_rows;
+    int n_cols;
+    uint32_t* frog_image = (uint32_t*) ReadImage(&n_cols, &n_rows,
+            "../test/frog.bmp", IMAGEIO_U8 | IMAGEIO_RGBA);
+    ASSERT_TRUE(frog_image != NULL);
+    alloc_global_bufs(n_rows, n_cols);
+
+    LocoImage image;
+    image.width = n_cols;
+    image.height = n_rows;
+    image.space_width = n_cols;
+    image.data = image_input_buf;
+    image.size_data_bytes = image_buf_bytes;
+    image.n_segs = 6;
+
+    LocoCompressOptions options;
+    loco_init_compress_options(&options);
+
+    for (int bit_depth = 8; bit_depth <= 12; bit_depth += 4) {
+        image.bit_depth = bit_depth;
+        for (int row = 0; row < n_rows; row++) {
+            for (int col = 0; col < n_cols; col++) {
+                U8* u8p = (U8*)(&frog_image[row*n_cols+col]);
+                image_input_buf[(row * n_cols) + col] = (LocoPixelType)(
+                        (1 << (bit_depth - 8)) * (u8p[0] * .3 + u8p[1] * .6 + u8p[2] * .1));
+                image_truth_buf[(row * n_cols) + col] =
+                        image_input_buf[(row * n_cols) + col];
+            }
+        }
+        // pieces that split headers, pixels and bytes
+        check_incremental(&image, &options, 7);
+        check_incremental(&image, &options, 1000);
+        check_error();
+        options.limit_golomb = 1;
+        options.near = 2;
+        check_incremental(&image, &options, 333);
+        options.limit_golomb = 0;
+        options.near = 0;
+
+        // raw segments
+        make_random_input(1 << bit_depth);
+        options.raw_fallback = 1;
+        check_incremental(&image, &options, 7);
+        check_incremental(&image, &options, 1000);
+        check_error();
+        options.raw_fallback = 0;
+    }
+    free(frog_image);
+
+    // segments must agree with the first
+    LocoCompressedImage compressed;
+    compressed.data = image_compressed_buf;
+    compressed.size_data_bytes = compressed_buf_bytes;
+    I32 flags = loco_compress(loco_state, &image, &compressed);
+    ASSERT_EQ(flags, LOCO_OK);
+    LocoImage decompressed;
+    decompressed.data = image_decompressed_buf;
+    decompressed.size_data_bytes = image_buf_bytes;
+    decompressed.n_segs = 0;
+    LocoSegmentData seg_data;
+    flags = loco_decompress_segment_start(loco_dec_state, compressed.segments.seg_ptr[0],
+            compressed.segments.n_bits[0], &decompressed, &seg_data);
+    EXPECT_EQ(flags, LOCO_OK);
+    EXPECT_EQ(decompressed.n_segs, image.n_segs);
+    EXPECT_EQ(decompressed.width, n_cols);
+    decompressed.n_segs = 2;
+    flags = loco_decompress_segment_start(loco_dec_state, compressed.segments.seg_ptr[1],
+            compressed.segments.n_bits[1], &decompressed, &seg_data);
+    EXPECT_EQ(flags, DELOCO_NOGOODSEGMENTS_FLAG);
+    EXPECT_EQ(seg_data.status, DELOCO_INCONSISTENTDATA_FLAG);
+
+    decompressed.n_segs = 0;
+    decompressed.size_data_bytes = 16;
+    flags = loco_decompress_segment_start(loco_dec_state, compressed.segments.seg_ptr[1],
+            compressed.segments.n_bits[1], &decompressed, &seg_data);
+    EXPECT_EQ(flags, DELOCO_BUFTOOSMALL_FLAG);
+
+    free_global_bufs();
+}
+
+void check_time_sliced(LocoImage *image, LocoCompressOptions *options, int pixel_budget)
+{
+    LocoCompressedImage compressed;
+    compressed.data = image_compressed_buf;
+    compressed.size_data_bytes = compressed_buf_bytes;
+    LocoCompressStats stats[LOCO_MAX_SEGS];
+    I32 flags = loco_compress_ext(loco_state, image, options, &compressed, stats);
+
+    LocoCompressedImage sliced;
+    sliced.data = (LocoBitstreamType*) malloc(compressed_buf_bytes);
+    ASSERT_TRUE(sliced.data != NULL);
+    sliced.size_data_bytes = compressed.size_data_bytes;
+    LocoCompressStats sliced_stats[LOCO_MAX_SEGS];
+    I32 sliced_flags = loco_compress_start(loco_state, image, options, &sliced, sliced_stats);
+    EXPECT_EQ(sliced_flags, LOCO_IN_PROGRESS_FLAG);
+    int n_calls = 0;
+    while (sliced_flags == LOCO_IN_PROGRESS_FLAG) {
+        sliced_flags = loco_compress_continue(loco_state, pixel_budget);
+        n_calls++;
+    }
+    EXPECT_GE(n_calls, image->width * image->height
+            / (pixel_budget > image->width ? pixel_budget + image->width : image->width));
+
+    // identical to compressing at once
+    EXPECT_EQ(sliced_flags, flags);
+    EXPECT_EQ(sliced.compressed_size_bytes, compressed.compressed_size_bytes);
+    EXPECT_EQ(sliced.segments.n_segs, compressed.segments.n_segs);
+    for (int i = 0; i < image->n_segs; i++) {
+        EXPECT_EQ(sliced.segments.n_bits[i], compressed.segments.n_bits[i]);
+        EXPECT_EQ(memcmp(&sliced_stats[i], &stats[i], sizeof(stats[i])), 0);
+    }
+    EXPECT_EQ(memcmp(sliced.data, compressed.data, compressed.compressed_size_bytes), 0);
+    free(sliced.data);
+}
+
+TEST(LocoTest, TimeSliced) {
+
+    int n_rows;
+    int n_cols;
+    uint32_t* frog_image = (uint32_t*) ReadImage(&n_cols, &n_rows,
+            "../test/frog.bmp", IMAGEIO_U8 | IMAGEIO_RGBA);
+    ASSERT_TRUE(frog_image != NULL);
+    alloc_global_bufs(n_rows, n_cols);
+
+    LocoImage image;
+    image.width = n_cols;
+    image.height = n_rows;
+    image.space_width = n_cols;
+    image.data = image_input_buf;
+    image.size_data_bytes = image_buf_bytes;
+    image.n_segs = 5;
+
+    LocoCompressOptions options;
+    loco_init_compress_options(&options);
+
+    for (int bit_depth = 8; bit_depth <= 12; bit_depth += 4) {
+        image.bit_depth = bit_depth;
+        for (int row = 0; row < n_rows; row++) {
+            for (int col = 0; col < n_cols; col++) {
+                U8* u8p = (U8*)(&frog_image[row*n_cols+col]);
+                image_input_buf[(row * n_cols) + col] = (LocoPixelType)(
+                        (1 << (bit_depth - 8)) * (u8p[0] * .3 + u8p[1] * .6 + u8p[2] * .1));
+            }
+        }
+        // budgets below a row, a few rows, and several segments
+        check_time_sliced(&image, &options, 1);
+        check_time_sliced(&image, &options, 1000);
+        check_time_sliced(&image, &options, 50000);
+        options.limit_golomb = 1;
+        options.near = 2;
+        check_time_sliced(&image, &options, 1000);
+        options.limit_golomb = 0;
+        options.near = 0;
+        options.size_only = 1;
+        check_time_sliced(&image, &options, 1000);
+        options.size_only = 0;
+
+        // raw segments, given up on part way
+        make_random_input(1 << bit_depth);
+        options.raw_fallback = 1;
+        check_time_sliced(&image, &options, 1);
+        check_time_sliced(&image, &options, 1000);
+        options.raw_fallback = 0;
+    }
+    free(frog_image);
+
+    // a buffer that fills up
+    LocoCompressedImage compressed;
+    compressed.data = image_compressed_buf;
+    compressed.size_data_bytes = 4096;
+    LocoCompressedImage sliced;
+    sliced.data = (LocoBitstreamType*) malloc(4096);
+    ASSERT_TRUE(sliced.data != NULL);
+    sliced.size_data_bytes = 4096;
+    I32 flags = loco_compress(loco_state, &image, &compressed);
+    EXPECT_EQ(flags, LOCO_BUFFER_FILLED_FLAG);
+    flags = loco_compress_start(loco_state, &image, NULL, &sliced, NULL);
+    while (flags == LOCO_IN_PROGRESS_FLAG) {
+        flags = loco_compress_continue(loco_state, 3000);
+    }
+    EXPECT_EQ(flags, LOCO_BUFFER_FILLED_FLAG);
+    EXPECT_EQ(memcmp(&sliced.segments.n_bits, &compressed.segments.n_bits,
+            sizeof(compressed.segments.n_bits)), 0);
+    EXPECT_EQ(memcmp(sliced.data, compressed.data, 4096), 0);
+    free(sliced.data);
+
+    // rate control cannot be sliced
+    options.target_bytes = 4096;
+    flags = loco_compress_start(loco_state, &image, &options, &compressed, NULL);
+    EXPECT_EQ(flags, LOCO_BAD_OPTIONS_FLAG | LOCO_ABORT_COMPRESSION_FLAG);
+
+    free_global_bufs();
+}
+
+TEST(LocoTest, Peek) {
+
+    alloc_global_bufs(300, 500);
+    make_random_input(256);
+
+    LocoImage image;
+    image.width = 500;
+    image.height = 300;
+    image.space_width = 500;
+    image.data = image_input_buf;
+    image.size_data_bytes = image_buf_bytes;
+    image.bit_depth = 8;
+    image.n_segs = 7;
+
+    LocoCompressOptions options;
+    loco_init_compress_options(&options);
+    options.raw_fallback = 1;
+    options.near = 1;
+
+    LocoCompressedImage compressed;
+    compressed.data = image_compressed_buf;
+    compressed.size_data_bytes = compressed_buf_bytes;
+    I32 flags = loco_compress_ext(loco_state, &image, &options, &compressed, NULL);
+    ASSERT_EQ(flags, LOCO_OK);
+
+    // the same parameters and rectangles as decompression finds
+    LocoImageInfo info;
+    flags = loco_peek(loco_dec_state, &compressed.segments, &info);
+    EXPECT_EQ(flags, LOCO_OK);
+    EXPECT_EQ(info.width, 500);
+    EXPECT_EQ(info.height, 300);
+    EXPECT_EQ(info.bit_depth, 8);
+    EXPECT_EQ(info.n_segs, 7);
+    EXPECT_EQ(info.size_data_bytes, 500 * 300 * (int)sizeof(LocoPixelType));
+    EXPECT_EQ(info.first_good_seg, 0);
+
+    LocoImage decompressed;
+    decompressed.data = image_decompressed_buf;
+    decompressed.size_data_bytes = info.size_data_bytes;
+    LocoSegmentData seg_data[LOCO_MAX_SEGS];
+    flags = loco_decompress(loco_dec_state, &compressed.segments, &decompressed, seg_data);
+    EXPECT_EQ(flags, LOCO_OK);
+    for (int i = 0; i < info.n_segs; i++) {
+        EXPECT_EQ(info.seg_bound[i].ystart, seg_data[i].bound_first_line);
+        EXPECT_EQ(info.seg_bound[i].xstart, seg_data[i].bound_first_sample);
+        EXPECT_EQ(info.seg_bound[i].yend - info.seg_bound[i].ystart,
+                seg_data[i].bound_n_lines);
+        EXPECT_EQ(info.seg_bound[i].xend - info.seg_bound[i].xstart,
+                seg_data[i].bound_n_samples);
+    }
+
+    // bad segments are skipped
+    LocoCompressedSegments segments = compressed.segments;
+    segments.n_bits[0] = 20;
+    U8 bad_header[8] = {0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff};
+    segments.seg_ptr[1] = bad_header;
+    segments.n_bits[1] = 64;
+    flags = loco_peek(loco_dec_state, &segments, &info);
+    EXPECT_EQ(flags, LOCO_OK);
+    EXPECT_EQ(info.first_good_seg, 2);
+    EXPECT_EQ(info.n_segs, 7);
+
+    segments.n_segs = 2;
+    flags = loco_peek(loco_dec_state, &segments, &info);
+    EXPECT_EQ(flags, DELOCO_NOGOODSEGMENTS_FLAG);
+    segments.n_segs = 0;
+    flags = loco_peek(loco_dec_state, &segments, &info);
+    EXPECT_EQ(flags, DELOCO_BADNUMDATASEG_FLAG);
+
+    free_global_bufs();
+}
+
+// compress with a layout, decompress, and return the spread of segment sizes
+double check_layout(LocoImage *image, LocoCompressOptions *options)
+{
+    LocoCompressedImage compressed;
+    compressed.data = image_compressed_buf;
+    compressed.size_data_bytes = compressed_buf_bytes;
+    I32 flags = loco_compress_ext(loco_state, image, options, &compressed, NULL);
+    EXPECT_EQ(flags, LOCO_OK);
+    EXPECT_LE(compressed.compressed_size_bytes, loco_compressed_size_bound(
+            image->width, image->height, image->bit_depth, image->n_segs, options));
+
+    LocoImageInfo info;
+    flags = loco_peek(loco_dec_state, &compressed.segments, &info);
+    EXPECT_EQ(flags, LOCO_OK);
+    EXPECT_EQ(info.layout, options->layout);
+
+    LocoImage decompressed;
+    decompressed.data = image_decompressed_buf;
+    decompressed.size_data_bytes = image_buf_bytes;
+    LocoSegmentData seg_data[LOCO_MAX_SEGS];
+    flags = loco_decompress(loco_dec_state, &compressed.segments, &decompressed, seg_data);
+    EXPECT_EQ(flags, LOCO_OK);
+    int min_bits = compressed.segments.n_bits[0];
+    int max_bits = compressed.segments.n_bits[0];
+    int n_pixels = 0;
+    for (int i = 0; i < image->n_segs; i++) {
+        EXPECT_EQ(seg_data[i].status, 0);
+        EXPECT_EQ(info.seg_bound[i].ystart, seg_data[i].bound_first_line);
+        EXPECT_EQ(info.seg_bound[i].xstart, seg_data[i].bound_first_sample);
+        if (options->layout == LOCO_LAYOUT_STRIPS) {
+            EXPECT_EQ(seg_data[i].bound_n_lines, image->height);
+        } else if (options->layout != LOCO_LAYOUT_GRID) {
+            EXPECT_EQ(seg_data[i].bound_n_samples, image->width);
+        }
+        if (options->layout == LOCO_LAYOUT_BANDS || options->layout == LOCO_LAYOUT_STRIPS) {
+            int across = (options->layout == LOCO_LAYOUT_BANDS) ?
+                    image->height : image->width;
+            int size = (options->layout == LOCO_LAYOUT_BANDS) ?
+                    seg_data[i].bound_n_lines : seg_data[i].bound_n_samples;
+            EXPECT_GE(size, across / image->n_segs);
+            EXPECT_LE(size, across / image->n_segs + 1);
+        }
+        n_pixels += seg_data[i].bound_n_lines * seg_data[i].bound_n_samples;
+        min_bits = std::min(min_bits, (int)compressed.segments.n_bits[i]);
+        max_bits = std::max(max_bits, (int)compressed.segments.n_bits[i]);
+    }
+    EXPECT_EQ(n_pixels, image->width * image->height);
+    if (options->near == 0) {
+        check_error();
+    }
+    return (double)max_bits / min_bits;
+}
+
+TEST(LocoTest, Layouts) {
+
+    int n_rows;
+    int n_cols;
+    uint32_t* frog_image = (uint32_t*) ReadImage(&n_cols, &n_rows,
+            "../test/frog.bmp", IMAGEIO_U8 | IMAGEIO_RGBA);
+    ASSERT_TRUE(frog_image != NULL);
+    alloc_global_bufs(n_rows, n_cols);
+
+    LocoImage image;
+    image.width = n_cols;
+    image.height = n_rows;
+    image.space_width = n_cols;
+    image.data = image_input_buf;
+    image.size_data_bytes = image_buf_bytes;
+    image.n_segs = 7;
+
+    LocoCompressOptions options;
+    loco_init_compress_options(&options);
+
+    for (int bit_depth = 8; bit_depth <= 12; bit_depth += 4) {
+        image.bit_depth = bit_depth;
+        for (int row = 0; row < n_rows; row++) {
+            for (int col = 0; col < n_cols; col++) {
+                U8* u8p = (U8*)(&frog_image[row*n_cols+col]);
+                image_input_buf[(row * n_cols) + col] = (LocoPixelType)(
+                        (1 << (bit_depth - 8)) * (u8p[0] * .3 + u8p[1] * .6 + u8p[2] * .1));
+                image_truth_buf[(row * n_cols) + col] =
+                        image_input_buf[(row * n_cols) + col];
+            }
+        }
+        double spread[4];
+        for (int layout = LOCO_LAYOUT_GRID; layout <= LOCO_LAYOUT_BALANCED; layout++) {
+            options.layout = layout;
+            spread[layout] = check_layout(&image, &options);
+            printf("layout %d, largest / smallest segment: %.2f\n", layout, spread[layout]);
+            options.near = 3;
+            options.limit_golomb = 1;
+            (void)check_layout(&image, &options);
+            options.near = 0;
+            options.limit_golomb = 0;
+        }
+        // balanced bands are closer in size than equal bands
+        EXPECT_LT(spread[LOCO_LAYOUT_BALANCED], spread[LOCO_LAYOUT_BANDS]);
+
+        // raw segments carry the layout too
+        make_random_input(1 << bit_depth);
+        options.raw_fallback = 1;
+        for (int layout = LOCO_LAYOUT_GRID; layout <= LOCO_LAYOUT_BALANCED; layout++) {
+            options.layout = layout;
+            (void)check_layout(&image, &options);
+        }
+        options.raw_fallback = 0;
+    }
+    free(frog_image);
+
+    // the grid is unchanged, and other layouts need enough rows or columns
+    options.layout = LOCO_LAYOUT_GRID;
+    EXPECT_EQ(loco_compressed_size_bound(400, 4, 8, 8, &options),
+            loco_compressed_size_bound(400, 4, 8, 8, NULL));
+    options.layout = LOCO_LAYOUT_BANDS;
+    EXPECT_EQ(loco_compressed_size_bound(400, 4, 8, 8, &options), 0);
+    options.layout = LOCO_LAYOUT_BALANCED;
+    EXPECT_EQ(loco_compressed_size_bound(400, 4, 8, 8, &options), 0);
+    options.layout = LOCO_LAYOUT_STRIPS;
+    EXPECT_GT(loco_compressed_size_bound(400, 4, 8, 8, &options), 0);
+    EXPECT_EQ(loco_compressed_size_bound(4, 400, 8, 8, &options), 0);
+
+    image.width = 400;
+    image.height = 4;
+    image.space_width = 400;
+    image.n_segs = 8;
+    image.bit_depth = 8;
+    LocoCompressedImage compressed;
+    compressed.data = image_compressed_buf;
+    compressed.size_data_bytes = compressed_buf_bytes;
+    options.layout = LOCO_LAYOUT_BANDS;
+    I32 flags = loco_compress_ext(loco_state, &image, &options, &compressed, NULL);
+    EXPECT_EQ(flags, LOCO_BAD_OPTIONS_FLAG | LOCO_ABORT_COMPRESSION_FLAG);
+    options.layout = LOCO_LAYOUT_BALANCED + 1;
+    flags = loco_compress_ext(loco_state, &image, &options, &compressed, NULL);
+    EXPECT_EQ(flags, LOCO_BAD_OPTIONS_FLAG | LOCO_ABORT_COMPRESSION_FLAG);
+    options.layout = LOCO_LAYOUT_STRIPS;
+    flags = loco_compress_ext(loco_state, &image, &options, &compressed, NULL);
+    EXPECT_EQ(flags, LOCO_OK);
+
+    free_global_bufs();
+}
+
+// pool locking with a mutex and condition variable
+struct PoolLock {
+    std::mutex mutex;
+    std::condition_variable cond;
+};
+
+void pool_lock(void *context)
+{
+    PoolLock *lock = (PoolLock*) context;
+    lock->mutex.lock();
+}
+
+void pool_unlock(void *context)
+{
+    PoolLock *lock = (PoolLock*) context;
+    lock->mutex.unlock();
+}
+
+void pool_wait(void *context)
+{
+    PoolLock *lock = (PoolLock*) context;
+    std::unique_lock<std::mutex> held(lock->mutex, std::adopt_lock);
+    lock->cond.wait(held);
+    held.release();
+}
+
+void pool_wake_all(void *context)
+{
+    PoolLock *lock = (PoolLock*) context;
+    lock->cond.notify_all();
+}
+
+void pool_nothing(void *context)
+{
+    (void)context;
+}
+
+void count_job(void *context, LocoJob *job)
+{
+    EXPECT_FALSE(job->done);
+    (*(int*)context)++;
+}
+
+TEST(LocoTest, Pool) {
+
+    int n_rows;
+    int n_cols;
+    uint32_t* frog_image = (uint32_t*) ReadImage(&n_cols, &n_rows,
+            "../test/frog.bmp", IMAGEIO_U8 | IMAGEIO_RGBA);
+    ASSERT_TRUE(frog_image != NULL);
+    alloc_global_bufs(n_rows, n_cols);
+    for (int row = 0; row < n_rows; row++) {
+        for (int col = 0; col < n_cols; col++) {
+            U8* u8p = (U8*)(&frog_image[row*n_cols+col]);
+            image_input_buf[(row * n_cols) + col] = (LocoPixelType)(16*(
+                    u8p[0] * .3 + u8p[1] * .6 + u8p[2] * .1));
+        }
+    }
+    free(frog_image);
+
+    LocoImage image;
+    image.width = n_cols;
+    image.height = n_rows;
+    image.space_width = n_cols;
+    image.data = image_input_buf;
+    image.size_data_bytes = image_buf_bytes;
+    image.bit_depth = 12;
+    image.n_segs = 8;
+
+    LocoCompressedImage compressed;
+    compressed.data = image_compressed_buf;
+    compressed.size_data_bytes = compressed_buf_bytes;
+    I32 flags = loco_compress(loco_state, &image, &compressed);
+    ASSERT_EQ(flags, LOCO_OK);
+
+    const int n_workers = 4;
+    LocoCompressState *compress_states[n_workers];
+    LocoDecompressState *decompress_states[n_workers];
+    for (int i = 0; i < n_workers; i++) {
+        compress_states[i] = (LocoCompressState*) malloc(sizeof(LocoCompressState));
+        decompress_states[i] = (LocoDecompressState*) malloc(sizeof(LocoDecompressState));
+        ASSERT_TRUE(compress_states[i] != NULL);
+        ASSERT_TRUE(decompress_states[i] != NULL);
+    }
+    PoolLock pool_lock_data;
+    LocoPoolHooks hooks = {pool_lock, pool_unlock, pool_wait, pool_wake_all,
+            &pool_lock_data};
+    LocoPool *pool = (LocoPool*) malloc(sizeof(LocoPool));
+    ASSERT_TRUE(pool != NULL);
+    flags = loco_pool_init(pool, n_workers, compress_states, decompress_states, &hooks);
+    ASSERT_EQ(flags, LOCO_OK);
+    std::thread workers[n_workers];
+    for (int i = 0; i < n_workers; i++) {
+        workers[i] = std::thread(loco_pool_run_worker, pool, i);
+    }
+
+    // each kind of job, whole and by segment
+    const int n_jobs = 12;
+    LocoJob jobs[n_jobs];
+    LocoCompressedImage results[n_jobs];
+    LocoSegmentBuffer seg_out[n_jobs][LOCO_MAX_SEGS];
+    LocoCompressedSegments segments[n_jobs];
+    LocoImage images_out[n_jobs];
+    LocoSegmentData seg_data[n_jobs][LOCO_MAX_SEGS];
+    int n_done = 0;
+    for (int j = 0; j < n_jobs; j++) {
+        LocoJob *job = &jobs[j];
+        memset(job, 0, sizeof(*job));
+        job->kind = (j % 4 < 2) ? LOCO_JOB_COMPRESS : LOCO_JOB_DECOMPRESS;
+        job->by_segment = j % 2;
+        job->job_done = count_job;
+        job->context = &n_done;
+        if (job->kind == LOCO_JOB_COMPRESS) {
+            job->image = &image;
+            results[j].data = (LocoBitstreamType*) malloc(compressed_buf_bytes);
+            ASSERT_TRUE(results[j].data != NULL);
+            results[j].size_data_bytes = compressed_buf_bytes;
+            job->result = &results[j];
+            for (int i = 0; i < image.n_segs; i++) {
+                seg_out[j][i].data = results[j].data + i * (compressed_buf_bytes / 32);
+                seg_out[j][i].size_data_bytes = compressed_buf_bytes / 32 * 4;
+            }
+            job->seg_out = seg_out[j];
+            job->segments = &segments[j];
+        } else {
+            job->compressed_in = &compressed.segments;
+            images_out[j].data = (LocoPixelType*) malloc(image_buf_bytes);
+            ASSERT_TRUE(images_out[j].data != NULL);
+            images_out[j].size_data_bytes = image_buf_bytes;
+            job->image_out = &images_out[j];
+            job->seg_data = seg_data[j];
+        }
+        flags = loco_pool_submit(pool, job);
+        EXPECT_EQ(flags, LOCO_OK);
+    }
+
+    for (int j = 0; j < n_jobs; j++) {
+        LocoJob *job = &jobs[j];
+        flags = loco_pool_wait(pool, job);
+        EXPECT_EQ(flags, LOCO_OK);
+        EXPECT_TRUE(job->done);
+        if (job->kind == LOCO_JOB_COMPRESS) {
+            LocoCompressedSegments *out = job->by_segment ?
+                    &segments[j] : &results[j].segments;
+            EXPECT_EQ(out->n_segs, image.n_segs);
+            for (int i = 0; i < image.n_segs; i++) {
+                EXPECT_EQ(out->n_bits[i], compressed.segments.n_bits[i]);
+                EXPECT_EQ(memcmp(out->seg_ptr[i], compressed.segments.seg_ptr[i],
+                        out->n_bits[i] / 8), 0);
+            }
+            free(results[j].data);
+        } else {
+            EXPECT_EQ(images_out[j].width, n_cols);
+            EXPECT_EQ(images_out[j].n_segs, image.n_segs);
+            EXPECT_EQ(memcmp(images_out[j].data, image_input_buf, image_buf_bytes), 0);
+            for (int i = 0; i < image.n_segs; i++) {
+                EXPECT_EQ(seg_data[j][i].status, 0);
+            }
+            free(images_out[j].data);
+        }
+    }
+    EXPECT_EQ(n_done, n_jobs);
+
+    // a segment that cannot be decompressed fails the job only if all do
+    LocoCompressedSegments bad = compressed.segments;
+    bad.n_bits[0] = 10;
+    LocoJob job;
+    memset(&job, 0, sizeof(job));
+    job.kind = LOCO_JOB_DECOMPRESS;
+    job.by_segment = 1;
+    job.compressed_in = &bad;
+    job.image_out = &images_out[0];
+    images_out[0].data = image_decompressed_buf;
+    images_out[0].size_data_bytes = image_buf_bytes;
+    job.seg_data = seg_data[0];
+    EXPECT_EQ(loco_pool_submit(pool, &job), LOCO_OK);
+    EXPECT_EQ(loco_pool_wait(pool, &job), LOCO_OK);
+    EXPECT_EQ(seg_data[0][0].status, DELOCO_SHORTDATASEG_FLAG);
+    bad.n_segs = 1;
+    EXPECT_EQ(loco_pool_submit(pool, &job), LOCO_OK);
+    EXPECT_EQ(loco_pool_wait(pool, &job), DELOCO_NOGOODSEGMENTS_FLAG);
+    images_out[0].size_data_bytes = 16;
+    job.compressed_in = &compressed.segments;
+    EXPECT_EQ(loco_pool_submit(pool, &job), LOCO_OK);
+    EXPECT_EQ(loco_pool_wait(pool, &job), DELOCO_BUFTOOSMALL_FLAG);
+
+    loco_pool_stop(pool);
+    for (int i = 0; i < n_workers; i++) {
+        workers[i].join();
+    }
+    EXPECT_EQ(loco_pool_submit(pool, &job), LOCO_POOL_STOPPED_FLAG);
+    EXPECT_EQ(pool->n_free, n_workers * LOCO_POOL_MAX_TASKS);
+
+    // one thread, running tasks itself, until the queues are full
+    LocoPoolHooks no_hooks = {pool_nothing, pool_nothing, pool_nothing, pool_nothing, NULL};
+    flags = loco_pool_init(pool, 1, compress_states, decompress_states, &no_hooks);
+    ASSERT_EQ(flags, LOCO_OK);
+    LocoJob fill[LOCO_POOL_MAX_TASKS];
+    results[0].data = image_compressed_buf;
+    for (int i = 0; i < image.n_segs; i++) {
+        seg_out[0][i].data = results[0].data + i * (compressed_buf_bytes / 32);
+    }
+    int n_submitted = 0;
+    for (;;) {
+        fill[n_submitted] = jobs[1];
+        fill[n_submitted].seg_out = seg_out[0];
+        fill[n_submitted].segments = &segments[0];
+        if (loco_pool_submit(pool, &fill[n_submitted]) != LOCO_OK) {
+            break;
+        }
+        n_submitted++;
+    }
+    EXPECT_EQ(n_submitted, LOCO_POOL_MAX_TASKS / image.n_segs);
+    n_done = 0;
+    while (loco_pool_run_task(pool, 0)) {
+    }
+    EXPECT_EQ(n_done, n_submitted);
+    for (int j = 0; j < n_submitted; j++) {
+        EXPECT_TRUE(fill[j].done);
+        EXPECT_EQ(fill[j].status, LOCO_OK);
+    }
+
+    job.kind = 7;
+    EXPECT_EQ(loco_pool_submit(pool, &job), LOCO_POOL_BAD_PARAMS_FLAG);
+    EXPECT_EQ(loco_pool_init(pool, LOCO_POOL_MAX_WORKERS + 1, compress_states,
+            decompress_states, &no_hooks), LOCO_POOL_BAD_PARAMS_FLAG);
+
+    free(pool);
+    for (int i = 0; i < n_workers; i++) {
+        free(compress_states[i]);
+        free(decompress_states[i]);
+    }
+    free_global_bufs();
+}
+
+TEST(LocoTest, Temporal) {
+
+    int n_rows;
+    int n_cols;
+    uint32_t* frog_image = (uint32_t*) ReadImage(&n_cols, &n_rows,
+            "../test/frog.bmp", IMAGEIO_U8 | IMAGEIO_RGBA);
+    ASSERT_TRUE(frog_image != NULL);
+    alloc_global_bufs(n_rows, n_cols);
+    LocoPixelType *prev_buf = (LocoPixelType*) malloc(image_buf_bytes);
+    LocoPixelType *ref_buf = (LocoPixelType*) malloc(image_buf_bytes);
+    LocoBitstreamType *intra_buf = (LocoBitstreamType*) malloc(compressed_buf_bytes);
+    ASSERT_TRUE(prev_buf != NULL);
+    ASSERT_TRUE(ref_buf != NULL);
+    ASSERT_TRUE(intra_buf != NULL);
+
+    for (int bit_depth = 8; bit_depth <= 12; bit_depth += 4) {
+        int pmax = (1 << bit_depth) - 1;
+        // the previous frame, and this one: a little noise, and a block moved
+        for (int row = 0; row < n_rows; row++) {
+            for (int col = 0; col < n_cols; col++) {
+                U8* u8p = (U8*)(&frog_image[row*n_cols+col]);
+                prev_buf[(row * n_cols) + col] = (LocoPixelType)((pmax + 1) / 256 * (
+                        u8p[0] * .3 + u8p[1] * .6 + u8p[2] * .1));
+            }
+        }
+        for (int row = 0; row < n_rows; row++) {
+            for (int col = 0; col < n_cols; col++) {
+                int moved = (row >= 100 && row < 200 && col >= 100 && col < 200);
+                int value = prev_buf[(row * n_cols) + col + 3 * moved] + rand() % 3 - 1;
+                value = (value < 0) ? 0 : ((value > pmax) ? pmax : value);
+                image_truth_buf[(row * n_cols) + col] = (LocoPixelType)value;
+                image_input_buf[(row * n_cols) + col] = (LocoPixelType)value;
+            }
+        }
+
+        for (int near = 0; near <= 2; near += 2) {
+            printf("Temporal: bit depth %d, near %d\n", bit_depth, near);
+            LocoImage prev;
+            prev.width = n_cols;
+            prev.height = n_rows;
+            prev.space_width = n_cols;
+            prev.data = prev_buf;
+            prev.size_data_bytes = image_buf_bytes;
+            prev.bit_depth = bit_depth;
+            prev.n_segs = 4;
+            LocoImage image = prev;
+            image.data = image_input_buf;
+
+            LocoCompressOptions options;
+            loco_init_compress_options(&options);
+            options.near = near;
+
+            // the reference is the previous frame as the decompressor has it
+            LocoCompressedImage compressed;
+            compressed.data = image_compressed_buf;
+            compressed.size_data_bytes = compressed_buf_bytes;
+            I32 flags = loco_compress_ext(loco_state, &prev, &options, &compressed, NULL);
+            ASSERT_EQ(flags, LOCO_OK);
+            LocoImage reference;
+            reference.data = ref_buf;
+            reference.size_data_bytes = image_buf_bytes;
+            LocoSegmentData seg_data[LOCO_MAX_SEGS];
+            flags = loco_decompress(loco_dec_state, &compressed.segments,
+                    &reference, seg_data);
+            ASSERT_EQ(flags, LOCO_OK);
+
+            LocoCompressedImage intra;
+            intra.data = intra_buf;
+            intra.size_data_bytes = compressed_buf_bytes;
+            flags = loco_compress_ext(loco_state, &image, &options, &intra, NULL);
+            ASSERT_EQ(flags, LOCO_OK);
+
+            options.reference = &reference;
+            flags = loco_compress_ext(loco_state, &image, &options, &compressed, NULL);
+            ASSERT_EQ(flags, LOCO_OK);
+            printf("intra %d B, temporal %d B\n", intra.compressed_size_bytes,
+                    compressed.compressed_size_bytes);
+            EXPECT_LT(compressed.compressed_size_bytes, intra.compressed_size_bytes);
+
+            LocoImageInfo info;
+            flags = loco_peek(loco_dec_state, &compressed.segments, &info);
+            EXPECT_EQ(flags, LOCO_OK);
+            EXPECT_EQ(info.temporal, 1);
+
+            LocoImage decompressed;
+            decompressed.data = image_decompressed_buf;
+            decompressed.size_data_bytes = image_buf_bytes;
+            flags = loco_decompress_with_reference(loco_dec_state, &compressed.segments,
+                    &reference, &decompressed, seg_data);
+            EXPECT_EQ(flags, LOCO_OK);
+            int max_err = 0;
+            for (int i = 0; i < n_rows * n_cols; i++) {
+                int err = ABS(image_decompressed_buf[i] - image_truth_buf[i]);
+                max_err = (err > max_err) ? err : max_err;
+            }
+            EXPECT_EQ(max_err, near);
+
+            // segments needing a reference are not decompressed without one
+            flags = loco_decompress(loco_dec_state, &compressed.segments,
+                    &decompressed, seg_data);
+            EXPECT_EQ(flags, DELOCO_NOGOODSEGMENTS_FLAG);
+            for (int seg = 0; seg < compressed.segments.n_segs; seg++) {
+                EXPECT_EQ(seg_data[seg].status, DELOCO_NO_REFERENCE_FLAG);
+            }
+            flags = loco_decompress_segment_start(loco_dec_state,
+                    compressed.segments.seg_ptr[0], compressed.segments.n_bits[0],
+                    &decompressed, seg_data);
+            EXPECT_EQ(flags, DELOCO_NOGOODSEGMENTS_FLAG);
+            EXPECT_EQ(seg_data[0].status, DELOCO_NO_REFERENCE_FLAG);
+            reference.height--;
+            flags = loco_decompress_with_reference(loco_dec_state, &compressed.segments,
+                    &reference, &decompressed, seg_data);
+            EXPECT_EQ(flags, DELOCO_NOGOODSEGMENTS_FLAG);
+
+            // the reference must match the image
+            flags = loco_compress_ext(loco_state, &image, &options, &compressed, NULL);
+            EXPECT_EQ(flags, LOCO_BAD_OPTIONS_FLAG | LOCO_ABORT_COMPRESSION_FLAG);
+            reference.height++;
+        }
+    }
+
+    free(frog_image);
+    free(prev_buf);
+    free(ref_buf);
+    free(intra_buf);
+    free_global_bufs();
+}
+
+TEST(LocoTest, Batch) {
+
+    alloc_global_bufs(200, 300);
+    for (int row = 0; row < n_rows; row++) {
+        for (int col = 0; col < n_cols; col++) {
+            image_input_buf[(row*n_cols)+col] = (LocoPixelType)(
+                    (row/2 + col/3 + rand() % 16) % 256);
+        }
+    }
+
+    // small images of varied sizes, depths and segment counts
+    const int n_images = 20;
+    LocoImage images[n_images];
+    for (int i = 0; i < n_images; i++) {
+        images[i].width = 16 + 7 * i;
+        images[i].height = 16 + 3 * i;
+        images[i].space_width = n_cols;
+        images[i].data = image_input_buf + (i * 5) * n_cols + i * 3;
+        images[i].size_data_bytes = image_buf_bytes - ((i * 5) * n_cols + i * 3)
+                * (int)sizeof(LocoPixelType);
+        images[i].bit_depth = (i % 2) ? 12 : 8;
+        images[i].n_segs = 1 + i % 4;
+    }
+
+    LocoCompressOptions options;
+    loco_init_compress_options(&options);
+    LocoCompressedImage batch;
+    batch.data = image_compressed_buf;
+    batch.size_data_bytes = compressed_buf_bytes;
+    LocoBatchEntry index[n_images];
+    I32 flags = loco_compress_batch(loco_state, images, n_images, &options,
+            &batch, index);
+    ASSERT_EQ(flags, LOCO_OK);
+
+    // each image is as loco_compress_ext() would compress it
+    LocoBitstreamType *single_buf = (LocoBitstreamType*) malloc(compressed_buf_bytes);
+    ASSERT_TRUE(single_buf != NULL);
+    int offset_bytes = 0;
+    for (int i = 0; i < n_images; i++) {
+        LocoCompressedImage single;
+        single.data = single_buf;
+        single.size_data_bytes = compressed_buf_bytes;
+        flags = loco_compress_ext(loco_state, &images[i], &options, &single, NULL);
+        ASSERT_EQ(flags, LOCO_OK);
+        EXPECT_EQ(index[i].status, LOCO_OK);
+        EXPECT_EQ(index[i].offset_bytes, offset_bytes);
+        EXPECT_EQ(index[i].n_segs, images[i].n_segs);
+        EXPECT_EQ(index[i].size_bytes,
+                index[i].n_segs * 4 + single.compressed_size_bytes);
+
+        LocoCompressedSegments segments;
+        flags = loco_batch_segments(&batch, &index[i], &segments);
+        ASSERT_EQ(flags, LOCO_OK);
+        for (int seg = 0; seg < single.segments.n_segs; seg++) {
+            EXPECT_EQ(segments.n_bits[seg], single.segments.n_bits[seg]);
+        }
+        EXPECT_EQ(memcmp(segments.seg_ptr[0], single.data,
+                single.compressed_size_bytes), 0);
+        offset_bytes += index[i].size_bytes;
+    }
+    EXPECT_EQ(batch.compressed_size_bytes, offset_bytes);
+
+    // decompress them all
+    LocoImage images_out[n_images];
+    I32 statuses[n_images];
+    for (int i = 0; i < n_images; i++) {
+        images_out[i].size_data_bytes = images[i].width * images[i].height
+                * (int)sizeof(LocoPixelType);
+        images_out[i].data = (LocoPixelType*) malloc(images_out[i].size_data_bytes);
+        ASSERT_TRUE(images_out[i].data != NULL);
+    }
+    flags = loco_decompress_batch(loco_dec_state, &batch, index, n_images,
+            images_out, statuses);
+    EXPECT_EQ(flags, LOCO_OK);
+    for (int i = 0; i < n_images; i++) {
+        EXPECT_EQ(statuses[i], LOCO_OK);
+        EXPECT_EQ(images_out[i].width, images[i].width);
+        EXPECT_EQ(images_out[i].height, images[i].height);
+        int errors = 0;
+        for (int row = 0; row < images[i].height; row++) {
+            for (int col = 0; col < images[i].width; col++) {
+                errors += images_out[i].data[row * images[i].width + col]
+                        != images[i].data[row * n_cols + col];
+            }
+        }
+        EXPECT_EQ(errors, 0);
+    }
+
+    // the same sizes without output
+    LocoBatchEntry size_index[n_images];
+    LocoCompressedImage sized;
+    sized.data = NULL;
+    sized.size_data_bytes = 0;
+    options.size_only = 1;
+    flags = loco_compress_batch(loco_state, images, n_images, &options,
+            &sized, size_index);
+    EXPECT_EQ(flags, LOCO_OK);
+    EXPECT_EQ(sized.compressed_size_bytes, batch.compressed_size_bytes);
+    for (int i = 0; i < n_images; i++) {
+        EXPECT_EQ(size_index[i].offset_bytes, index[i].offset_bytes);
+        EXPECT_EQ(size_index[i].size_bytes, index[i].size_bytes);
+    }
+    options.size_only = 0;
+
+    // a bad image is skipped; the rest are still compressed
+    images[3].width = 0;
+    LocoBatchEntry skip_index[n_images];
+    flags = loco_compress_batch(loco_state, images, n_images, &options,
+            &batch, skip_index);
+    EXPECT_TRUE(flags & LOCO_SMALL_WIDTH_FLAG);
+    EXPECT_TRUE(flags & LOCO_ABORT_COMPRESSION_FLAG);
+    EXPECT_EQ(skip_index[3].size_bytes, 0);
+    EXPECT_EQ(skip_index[3].status, flags);
+    EXPECT_EQ(skip_index[4].offset_bytes, skip_index[2].offset_bytes
+            + skip_index[2].size_bytes);
+    flags = loco_decompress_batch(loco_dec_state, &batch, skip_index, n_images,
+            images_out, statuses);
+    EXPECT_EQ(flags, DELOCO_NOGOODSEGMENTS_FLAG);
+    EXPECT_EQ(statuses[3], DELOCO_NOGOODSEGMENTS_FLAG);
+    EXPECT_EQ(statuses[4], LOCO_OK);
+    images[3].width = 16 + 7 * 3;
+
+    // the buffer fills partway through an image
+    int cut = 10;
+    batch.size_data_bytes = index[cut].offset_bytes + index[cut].n_segs * 4 + 8;
+    flags = loco_compress_batch(loco_state, images, n_images, &options,
+            &batch, index);
+    EXPECT_EQ(flags, LOCO_BUFFER_FILLED_FLAG);
+    for (int i = 0; i < n_images; i++) {
+        EXPECT_EQ(index[i].status, (i < cut) ? LOCO_OK : LOCO_BUFFER_FILLED_FLAG);
+        if (i > cut) {
+            EXPECT_EQ(index[i].size_bytes, 0);
+        }
+    }
+    EXPECT_EQ(index[cut].size_bytes, index[cut].n_segs * 4 + 8);
+    EXPECT_EQ(batch.compressed_size_bytes, batch.size_data_bytes);
+    flags = loco_decompress_batch(loco_dec_state, &batch, index, n_images,
+            images_out, statuses);
+    for (int i = 0; i < cut; i++) {
+        EXPECT_EQ(statuses[i], LOCO_OK);
+    }
+    EXPECT_EQ(statuses[n_images - 1], DELOCO_NOGOODSEGMENTS_FLAG);
+    batch.size_data_bytes = compressed_buf_bytes;
+
+    // bad entries
+    LocoCompressedSegments segments;
+    LocoBatchEntry entry = index[0];
+    entry.n_segs = 0;
+    EXPECT_EQ(loco_batch_segments(&batch, &entry, &segments), DELOCO_BADNUMDATASEG_FLAG);
+    entry = index[0];
+    entry.offset_bytes = batch.compressed_size_bytes;
+    EXPECT_EQ(loco_batch_segments(&batch, &entry, &segments), DELOCO_BADDATA_FLAG);
+    entry = index[0];
+    entry.size_bytes = entry.n_segs * 4 + 4;
+    EXPECT_EQ(loco_batch_segments(&batch, &entry, &segments), DELOCO_BADDATA_FLAG);
+
+    // rate control is for single images
+    options.target_bytes = 1000;
+    flags = loco_compress_batch(loco_state, images, n_images, &options,
+            &batch, index);
+    EXPECT_EQ(flags, LOCO_BAD_OPTIONS_FLAG | LOCO_ABORT_COMPRESSION_FLAG);
+
+    for (int i = 0; i < n_images; i++) {
+        free(images_out[i].data);
+    }
+    free(single_buf);
+    free_global_bufs();
+}
+
+TEST(LocoTest, ContextPriors) {
+
+    int n_rows;
+    int n_cols;
+    uint32_t* frog_image = (uint32_t*) ReadImage(&n_cols, &n_rows,
+            "../test/frog.bmp", IMAGEIO_U8 | IMAGEIO_RGBA);
+    ASSERT_TRUE(frog_image != NULL);
+    alloc_global_bufs(n_rows, n_cols);
+    LocoBitstreamType *plain_buf = (LocoBitstreamType*) malloc(compressed_buf_bytes);
+    ASSERT_TRUE(plain_buf != NULL);
+    static LocoContextModel models[LOCO_MAX_SEGS];
+    static LocoContextModel next_models[LOCO_MAX_SEGS];
+    static LocoContextModel dec_models[LOCO_MAX_SEGS];
+    const int n_segs = 32;
+
+    for (int bit_depth = 8; bit_depth <= 12; bit_depth += 4) {
+        printf("ContextPriors: bit depth %d\n", bit_depth);
+        int pmax = (1 << bit_depth) - 1;
+        LocoImage image;
+        image.width = n_cols;
+        image.height = n_rows;
+        image.space_width = n_cols;
+        image.data = image_input_buf;
+        image.size_data_bytes = image_buf_bytes;
+        image.bit_depth = bit_depth;
+        image.n_segs = n_segs;
+        LocoCompressOptions options;
+        loco_init_compress_options(&options);
+        LocoCompressedImage compressed;
+        compressed.data = image_compressed_buf;
+        compressed.size_data_bytes = compressed_buf_bytes;
+        LocoCompressedImage plain;
+        plain.data = plain_buf;
+        plain.size_data_bytes = compressed_buf_bytes;
+
+        // the first frame gives each segment's model
+        for (int i = 0; i < n_rows * n_cols; i++) {
+            U8* u8p = (U8*)(&frog_image[i]);
+            image_input_buf[i] = (LocoPixelType)((pmax + 1) / 256 * (
+                    u8p[0] * .3 + u8p[1] * .6 + u8p[2] * .1));
+        }
+        options.models_out = models;
+        I32 flags = loco_compress_ext(loco_state, &image, &options, &compressed, NULL);
+        ASSERT_EQ(flags, LOCO_OK);
+        for (int seg = 0; seg < n_segs; seg++) {
+            EXPECT_EQ(models[seg].bit_depth, bit_depth);
+            EXPECT_TRUE(loco_check_context_model(&models[seg], bit_depth));
+        }
+
+        // the next frame, a little different, starts from them
+        for (int i = 0; i < n_rows * n_cols; i++) {
+            int value = image_input_buf[i] + rand() % 3 - 1;
+            value = (value < 0) ? 0 : ((value > pmax) ? pmax : value);
+            image_input_buf[i] = (LocoPixelType)value;
+            image_truth_buf[i] = (LocoPixelType)value;
+        }
+        options.models_out = NULL;
+        flags = loco_compress_ext(loco_state, &image, &options, &plain, NULL);
+        ASSERT_EQ(flags, LOCO_OK);
+        options.priors = models;
+        options.models_out = next_models;
+        flags = loco_compress_ext(loco_state, &image, &options, &compressed, NULL);
+        ASSERT_EQ(flags, LOCO_OK);
+        printf("without priors %d B, with priors %d B\n",
+                plain.compressed_size_bytes, compressed.compressed_size_bytes);
+        EXPECT_LT(compressed.compressed_size_bytes, plain.compressed_size_bytes);
+
+        // decompressing with the same priors ends with the same models
+        LocoImage decompressed;
+        decompressed.data = image_decompressed_buf;
+        decompressed.size_data_bytes = image_buf_bytes;
+        LocoSegmentData seg_data[LOCO_MAX_SEGS];
+        LocoDecompressOptions dec_options;
+        loco_init_decompress_options(&dec_options);
+        dec_options.priors = models;
+        dec_options.models_out = dec_models;
+        flags = loco_decompress_ext(loco_dec_state, &compressed.segments,
+                &dec_options, &decompressed, seg_data);
+        EXPECT_EQ(flags, LOCO_OK);
+        EXPECT_EQ(memcmp(image_decompressed_buf, image_truth_buf,
+                n_rows * n_cols * sizeof(LocoPixelType)), 0);
+        EXPECT_EQ(memcmp(dec_models, next_models, n_segs * sizeof(LocoContextModel)), 0);
+
+        // segments with priors are not decompressed without them
+        flags = loco_decompress(loco_dec_state, &compressed.segments,
+                &decompressed, seg_data);
+        EXPECT_EQ(flags, DELOCO_NOGOODSEGMENTS_FLAG);
+        for (int seg = 0; seg < n_segs; seg++) {
+            EXPECT_EQ(seg_data[seg].status, DELOCO_NO_PRIOR_FLAG);
+        }
+        flags = loco_decompress_segment_start(loco_dec_state,
+                compressed.segments.seg_ptr[0], compressed.segments.n_bits[0],
+                &decompressed, seg_data);
+        EXPECT_EQ(flags, DELOCO_NOGOODSEGMENTS_FLAG);
+        EXPECT_EQ(seg_data[0].status, DELOCO_NO_PRIOR_FLAG);
+
+        // a prior must be valid for the bit depth
+        I16 count = models[5].c_count[7];
+        models[5].c_count[7] = 0;
+        flags = loco_compress_ext(loco_state, &image, &options, &compressed, NULL);
+        EXPECT_EQ(flags, LOCO_BAD_OPTIONS_FLAG | LOCO_ABORT_COMPRESSION_FLAG);
+        models[5].c_count[7] = count;
+        models[5].bit_depth = 20 - bit_depth;
+        flags = loco_compress_ext(loco_state, &image, &options, &compressed, NULL);
+        EXPECT_EQ(flags, LOCO_BAD_OPTIONS_FLAG | LOCO_ABORT_COMPRESSION_FLAG);
+
+        // models from noise, near-lossless, and raw segments chain as priors
+        for (int i = 0; i < n_rows * n_cols; i++) {
+            image_input_buf[i] = (LocoPixelType)(((i / n_cols) < n_rows / 2) ?
+                    rand() % (pmax + 1) : (i % n_cols) * pmax / n_cols);
+        }
+        options.raw_fallback = 1;
+        for (int near = 0; near <= 2; near += 2) {
+            options.near = near;
+            loco_init_context_model(&models[5], bit_depth);
+            options.priors = models;
+            options.models_out = next_models;
+            flags = loco_compress_ext(loco_state, &image, &options, &compressed, NULL);
+            ASSERT_EQ(flags, LOCO_OK);
+            for (int seg = 0; seg < n_segs; seg++) {
+                EXPECT_TRUE(loco_check_context_model(&next_models[seg], bit_depth));
+            }
+            dec_options.priors = models;
+            flags = loco_decompress_ext(loco_dec_state, &compressed.segments,
+                    &dec_options, &decompressed, seg_data);
+            EXPECT_EQ(flags, LOCO_OK);
+            EXPECT_EQ(memcmp(dec_models, next_models,
+                    n_segs * sizeof(LocoContextModel)), 0);
+            memcpy(models, next_models, sizeof(models));
+        }
+    }
+
+    free(frog_image);
+    free(plain_buf);
+    free_global_bufs();
+}
+
+TEST(LocoTest, SharedModel) {
+
+    int n_rows;
+    int n_cols;
+    uint32_t* frog_image = (uint32_t*) ReadImage(&n_cols, &n_rows,
+            "../test/frog.bmp", IMAGEIO_U8 | IMAGEIO_RGBA);
+    ASSERT_TRUE(frog_image != NULL);
+    alloc_global_bufs(n_rows, n_cols);
+    LocoBitstreamType *plain_buf = (LocoBitstreamType*) malloc(compressed_buf_bytes);
+    ASSERT_TRUE(plain_buf != NULL);
+    static LocoContextModel model;
+    const int n_segs = 31;
+
+    for (int bit_depth = 8; bit_depth <= 12; bit_depth += 4) {
+        int pmax = (1 << bit_depth) - 1;
+        for (int i = 0; i < n_rows * n_cols; i++) {
+            U8* u8p = (U8*)(&frog_image[i]);
+            image_input_buf[i] = (LocoPixelType)((pmax + 1) / 256 * (
+                    u8p[0] * .3 + u8p[1] * .6 + u8p[2] * .1));
+            image_truth_buf[i] = image_input_buf[i];
+        }
+        LocoImage image;
+        image.width = n_cols;
+        image.height = n_rows;
+        image.space_width = n_cols;
+        image.data = image_input_buf;
+        image.size_data_bytes = image_buf_bytes;
+        image.bit_depth = bit_depth;
+        image.n_segs = n_segs;
+        LocoCompressedImage compressed;
+        compressed.data = image_compressed_buf;
+        compressed.size_data_bytes = compressed_buf_bytes;
+        LocoCompressedImage plain;
+        plain.data = plain_buf;
+        plain.size_data_bytes = compressed_buf_bytes;
+        LocoImage decompressed;
+        decompressed.data = image_decompressed_buf;
+        decompressed.size_data_bytes = image_buf_bytes;
+        LocoSegmentData seg_data[LOCO_MAX_SEGS];
+
+        for (int near = 0; near <= 2; near += 2) {
+            printf("SharedModel: bit depth %d, near %d\n", bit_depth, near);
+            LocoCompressOptions options;
+            loco_init_compress_options(&options);
+            options.near = near;
+            I32 flags = loco_compress_ext(loco_state, &image, &options, &plain, NULL);
+            ASSERT_EQ(flags, LOCO_OK);
+
+            // segments sharing a model learned from the image code smaller
+            flags = loco_learn_shared_model(loco_state, &image, &options, &model);
+            ASSERT_EQ(flags, LOCO_OK);
+            EXPECT_TRUE(loco_check_context_model(&model, bit_depth));
+            options.shared_model = &model;
+            flags = loco_compress_ext(loco_state, &image, &options, &compressed, NULL);
+            ASSERT_EQ(flags, LOCO_OK);
+            printf("separate %d B, shared %d B\n", plain.compressed_size_bytes,
+                    compressed.compressed_size_bytes);
+            EXPECT_LT(compressed.compressed_size_bytes, plain.compressed_size_bytes);
+            EXPECT_LE(compressed.compressed_size_bytes, loco_compressed_size_bound(
+                    n_cols, n_rows, bit_depth, n_segs, &options));
+
+            flags = loco_decompress(loco_dec_state, &compressed.segments,
+                    &decompressed, seg_data);
+            EXPECT_EQ(flags, LOCO_OK);
+            int max_err = 0;
+            for (int i = 0; i < n_rows * n_cols; i++) {
+                int err = ABS(image_decompressed_buf[i] - image_truth_buf[i]);
+                max_err = (err > max_err) ? err : max_err;
+            }
+            EXPECT_EQ(max_err, near);
+
+            // other segments decode in any order, but need segment 0
+            LocoCompressedSegments others;
+            others.n_segs = n_segs - 1;
+            for (int seg = 1; seg < n_segs; seg++) {
+                others.seg_ptr[n_segs - 1 - seg] = compressed.segments.seg_ptr[seg];
+                others.n_bits[n_segs - 1 - seg] = compressed.segments.n_bits[seg];
+            }
+            flags = loco_decompress(loco_dec_state, &others, &decompressed, seg_data);
+            EXPECT_EQ(flags, DELOCO_NOGOODSEGMENTS_FLAG);
+            for (int seg = 0; seg < n_segs - 1; seg++) {
+                EXPECT_EQ(seg_data[seg].status, DELOCO_NO_PRIOR_FLAG);
+            }
+            others.n_segs = n_segs;
+            others.seg_ptr[n_segs - 1] = compressed.segments.seg_ptr[0];
+            others.n_bits[n_segs - 1] = compressed.segments.n_bits[0];
+            flags = loco_decompress(loco_dec_state, &others, &decompressed, seg_data);
+            EXPECT_EQ(flags, LOCO_OK);
+            EXPECT_EQ(ABS(image_decompressed_buf[n_rows * n_cols - 1]
+                    - image_truth_buf[n_rows * n_cols - 1]) <= near, true);
+            flags = loco_decompress_segment_start(loco_dec_state,
+                    compressed.segments.seg_ptr[1], compressed.segments.n_bits[1],
+                    &decompressed, seg_data);
+            EXPECT_EQ(flags, DELOCO_NOGOODSEGMENTS_FLAG);
+            EXPECT_EQ(seg_data[0].status, DELOCO_NO_PRIOR_FLAG);
+
+            // segment 0 could be dropped by rate control
+            options.target_bytes = plain.compressed_size_bytes;
+            flags = loco_compress_ext(loco_state, &image, &options, &compressed, NULL);
+            EXPECT_EQ(flags, LOCO_BAD_OPTIONS_FLAG | LOCO_ABORT_COMPRESSION_FLAG);
+        }
+
+        // segment 0 carries the model even when stored raw
+        for (int i = 0; i < n_rows * n_cols; i++) {
+            image_input_buf[i] = (LocoPixelType)(((i / n_cols) < n_rows / 4) ?
+                    rand() % (pmax + 1) : image_truth_buf[i]);
+            image_truth_buf[i] = image_input_buf[i];
+        }
+        LocoCompressOptions options;
+        loco_init_compress_options(&options);
+        options.raw_fallback = 1;
+        I32 flags = loco_learn_shared_model(loco_state, &image, &options, &model);
+        ASSERT_EQ(flags, LOCO_OK);
+        options.shared_model = &model;
+        LocoCompressStats stats[LOCO_MAX_SEGS];
+        flags = loco_compress_ext(loco_state, &image, &options, &compressed, stats);
+        ASSERT_EQ(flags, LOCO_OK);
+        EXPECT_EQ(stats[0].raw, 1);
+        EXPECT_LE(compressed.compressed_size_bytes, loco_compressed_size_bound(
+                n_cols, n_rows, bit_depth, n_segs, &options));
+        flags = loco_decompress(loco_dec_state, &compressed.segments,
+                &decompressed, seg_data);
+        EXPECT_EQ(flags, LOCO_OK);
+        EXPECT_EQ(memcmp(image_decompressed_buf, image_truth_buf,
+                n_rows * n_cols * sizeof(LocoPixelType)), 0);
+    }
+
+    free(frog_image);
+    free(plain_buf);
+    free_global_bufs();
+}
+
+I32 run_pipeline(LocoPipeline *pipe, LocoCompressState *state,
+        const LocoImage *image, const LocoCompressOptions *options,
+        LocoCompressedImage *result, LocoCompressStats *stats)
+{
+    static PoolLock pipe_lock_data;
+    LocoPoolHooks hooks = {pool_lock, pool_unlock, pool_wait, pool_wake_all,
+            &pipe_lock_data};
+    I32 flags = loco_pipeline_start(pipe, state, image, options, result,
+            stats, &hooks);
+    std::thread planner(loco_pipeline_run_planner, pipe);
+    I32 coder_flags = loco_pipeline_run_coder(pipe);
+    planner.join();
+    EXPECT_EQ(coder_flags & flags, flags);
+    return coder_flags;
+}
+
+TEST(LocoTest, Pipeline) {
+
+    int n_rows;
+    int n_cols;
+    uint32_t* frog_image = (uint32_t*) ReadImage(&n_cols, &n_rows,
+            "../test/frog.bmp", IMAGEIO_U8 | IMAGEIO_RGBA);
+    ASSERT_TRUE(frog_image != NULL);
+    alloc_global_bufs(n_rows, n_cols);
+    LocoBitstreamType *piped_buf = (LocoBitstreamType*) malloc(compressed_buf_bytes);
+    ASSERT_TRUE(piped_buf != NULL);
+    LocoPipeline *pipe = (LocoPipeline*) malloc(sizeof(LocoPipeline));
+    ASSERT_TRUE(pipe != NULL);
+    static LocoCompressStats stats[LOCO_MAX_SEGS];
+    static LocoCompressStats piped_stats[LOCO_MAX_SEGS];
+
+    for (int bit_depth = 8; bit_depth <= 12; bit_depth += 4) {
+        for (int noise = 0; noise <= 1; noise++) {
+            int pmax = (1 << bit_depth) - 1;
+            srand(7);
+            for (int i = 0; i < n_rows * n_cols; i++) {
+                U8* u8p = (U8*)(&frog_image[i]);
+                image_input_buf[i] = noise ? (LocoPixelType)(rand() & pmax) :
+                        (LocoPixelType)((pmax + 1) / 256 * (
+                        u8p[0] * .3 + u8p[1] * .6 + u8p[2] * .1));
+            }
+            LocoImage image;
+            image.width = n_cols;
+            image.height = n_rows;
+            image.space_width = n_cols;
+            image.data = image_input_buf;
+            image.size_data_bytes = image_buf_bytes;
+            image.bit_depth = bit_depth;
+
+            for (int n_segs = 1; n_segs <= 8; n_segs += 7) {
+                image.n_segs = n_segs;
+                for (int variant = 0; variant < 4; variant++) {
+                    printf("Pipeline: bit depth %d, noise %d, %d segments, "
+                            "variant %d\n", bit_depth, noise, n_segs, variant);
+                    LocoCompressOptions options;
+                    loco_init_compress_options(&options);
+                    options.raw_fallback = (variant == 1);
+                    options.limit_golomb = (variant == 2);
+                    options.size_only = (variant == 3);
+                    LocoCompressedImage compressed;
+                    compressed.data = image_compressed_buf;
+                    compressed.size_data_bytes = compressed_buf_bytes;
+                    LocoCompressedImage piped;
+                    piped.data = piped_buf;
+                    piped.size_data_bytes = compressed_buf_bytes;
+
+                    I32 flags = loco_compress_ext(loco_state, &image, &options,
+                            &compressed, stats);
+                    ASSERT_EQ(flags, LOCO_OK);
+                    I32 piped_flags = run_pipeline(pipe, loco_state, &image,
+                            &options, &piped, piped_stats);
+                    ASSERT_EQ(piped_flags, LOCO_OK);
+
+                    // the same output, segment by segment
+                    ASSERT_EQ(piped.compressed_size_bytes,
+                            compressed.compressed_size_bytes);
+                    ASSERT_EQ(piped.segments.n_segs, compressed.segments.n_segs);
+                    for (int seg = 0; seg < n_segs; seg++) {
+                        EXPECT_EQ(piped.segments.n_bits[seg],
+                                compressed.segments.n_bits[seg]);
+                        EXPECT_EQ(memcmp(&piped_stats[seg], &stats[seg],
+                                sizeof(stats[seg])), 0);
+                    }
+                    if (!options.size_only) {
+                        EXPECT_EQ(memcmp(piped_buf, image_compressed_buf,
+                                compressed.compressed_size_bytes), 0);
+                    }
+                    if (variant == 1) {
+                        EXPECT_EQ(piped_stats[0].raw, noise);
+                    }
+                }
+            }
+
+            // near-lossless is not pipelined
+            LocoCompressOptions options;
+            loco_init_compress_options(&options);
+            options.near = 2;
+            LocoCompressedImage piped;
+            piped.data = piped_buf;
+            piped.size_data_bytes = compressed_buf_bytes;
+            I32 flags = run_pipeline(pipe, loco_state, &image, &options,
+                    &piped, NULL);
+            EXPECT_EQ(flags, LOCO_BAD_OPTIONS_FLAG | LOCO_ABORT_COMPRESSION_FLAG);
+        }
+    }
+
+    free(pipe);
+    free(piped_buf);
+    free(frog_image);
+}
+
+TEST(LocoTest, RowPlanning) {
+
+    // rows planned ahead of coding by the pipeline must code byte for byte
+    // as the 8 and 12 bit coders do, and decode; check every width, so each
+    // edge case of a row is planned next to the others
+    alloc_global_bufs(64, 48);
+    LocoBitstreamType *piped_buf = (LocoBitstreamType*) malloc(compressed_buf_bytes);
+    ASSERT_TRUE(piped_buf != NULL);
+    LocoPipeline *pipe = (LocoPipeline*) malloc(sizeof(LocoPipeline));
+    ASSERT_TRUE(pipe != NULL);
+    LocoCompressOptions options;
+    loco_init_compress_options(&options);
+    options.layout = LOCO_LAYOUT_STRIPS;
+    srand(11);
+    for (int bit_depth = 8; bit_depth <= 12; bit_depth += 4) {
+        int pmax = (1 << bit_depth) - 1;
+        for (int width = LOCO_MIN_IMAGE_WIDTH; width <= n_cols; width++) {
+            // gradients of every size: a ramp, plus noise growing by row
+            for (int row = 0; row < n_rows; row++) {
+                for (int col = 0; col < width; col++) {
+                    int color = (row * 5 + col * col * 3
+                            + rand() % (1 << (row % bit_depth))) & pmax;
+                    image_truth_buf[(row*width)+col] = color;
+                    image_input_buf[(row*width)+col] = color;
+                }
+            }
+            LocoImage image;
+            image.width = width;
+            image.height = n_rows;
+            image.space_width = width;
+            image.data = image_input_buf;
+            image.size_data_bytes = image_buf_bytes;
+            image.bit_depth = bit_depth;
+            image.n_segs = (width >= 16) ? 2 : 1;
+
+            LocoCompressedImage compressed;
+            compressed.data = image_compressed_buf;
+            compressed.size_data_bytes = compressed_buf_bytes;
+            I32 flags = loco_compress_ext(loco_state, &image, &options,
+                    &compressed, NULL);
+            ASSERT_EQ(flags, LOCO_OK);
+            LocoCompressedImage piped;
+            piped.data = piped_buf;
+            piped.size_data_bytes = compressed_buf_bytes;
+            flags = run_pipeline(pipe, loco_state, &image, &options, &piped,
+                    NULL);
+            ASSERT_EQ(flags, LOCO_OK);
+            ASSERT_EQ(piped.compressed_size_bytes,
+                    compressed.compressed_size_bytes);
+            EXPECT_EQ(memcmp(piped_buf, image_compressed_buf,
+                    compressed.compressed_size_bytes), 0)
+                    << "bit depth " << bit_depth << ", width " << width;
+
+            LocoImage decompressed;
+            decompressed.data = image_decompressed_buf;
+            decompressed.size_data_bytes = image_buf_bytes;
+            LocoSegmentData seg_data[LOCO_MAX_SEGS];
+            flags = loco_decompress(loco_dec_state, &compressed.segments,
+                    &decompressed, seg_data);
+            ASSERT_EQ(flags, LOCO_OK);
+            ASSERT_EQ(decompressed.width, width);
+            int errors = 0;
+            for (int i = 0; i < n_rows * width; i++) {
+                errors += (image_decompressed_buf[i] != image_truth_buf[i]);
+            }
+            EXPECT_EQ(errors, 0) << "bit depth " << bit_depth
+                    << ", width " << width;
+        }
+    }
+    free(pipe);
+    free(piped_buf);
+    free_global_bufs();
+}
+
+TEST(LocoTest, CppWrapper) {
+
+    // the wrapper codes straight from and into the caller's buffers, and
+    // gives the same image back, for 16 bit and 8 bit pixels
+    const int width = 40;
+    const int height = 30;
+    const int stride = 48;
+    std::vector<uint16_t> pixels(height * stride, 0xffff);
+    std::vector<uint8_t> pixels8(height * width);
+    srand(5);
+    for (int row = 0; row < height; row++) {
+        for (int col = 0; col < width; col++) {
+            pixels[row * stride + col] = (row * 31 + col * 7 + rand() % 64) & 0xfff;
+            pixels8[row * width + col] = (row + col * 3 + rand() % 16) & 0xff;
+        }
+    }
+
+    I32 bound = loco_compressed_size_bound(width, height, 12, 2, NULL);
+    ASSERT_GT(bound, 0);
+    std::vector<LocoBitstreamType> out(bound / sizeof(LocoBitstreamType) + 1);
+
+    loco::Encoder<12> first;
+    loco::Encoder<12> encoder(std::move(first));
+    loco::ImageView<uint16_t> view(pixels, width, height, stride);
+    loco::Compressed compressed = encoder.compress(view, 2, out);
+    ASSERT_TRUE(compressed.ok());
+    EXPECT_EQ(compressed.segments().n_segs, 2);
+    EXPECT_EQ(compressed.segments().seg_ptr[0], (U8 *)out.data());
+    EXPECT_LE(compressed.size_bytes(), bound);
+
+    loco::Decoder<12> decoder;
+    std::vector<uint16_t> decoded(width * height);
+    loco::Decompressed<uint16_t> result =
+            decoder.decompress(compressed.segments(), loco::Span<uint16_t>(decoded));
+    ASSERT_TRUE(result.ok());
+    EXPECT_EQ(result.image.width, width);
+    EXPECT_EQ(result.image.height, height);
+    EXPECT_EQ(result.n_segs, 2);
+    int errors = 0;
+    for (int row = 0; row < height; row++) {
+        for (int col = 0; col < width; col++) {
+            errors += (result.image.row(row)[col] != pixels[row * stride + col]);
+        }
+    }
+    EXPECT_EQ(errors, 0);
+
+    // 8 bit data is refused by a 12 bit decoder and the other way round
+    loco::Decoder<8> decoder8;
+    std::vector<uint8_t> decoded8(width * height);
+    EXPECT_EQ(decoder8.decompress(compressed.segments(),
+            loco::Span<uint8_t>(decoded8)).status, DELOCO_BADDATA_FLAG);
+
+    loco::Encoder<8> encoder8;
+    loco::ImageView<const uint8_t> view8(
+            loco::Span<const uint8_t>(pixels8.data(), pixels8.size()),
+            width, height);
+    compressed = encoder8.compress(view8, 1, out);
+    ASSERT_TRUE(compressed.ok());
+    EXPECT_EQ(decoder.decompress(compressed.segments(),
+            loco::Span<uint16_t>(decoded)).status, DELOCO_BADDATA_FLAG);
+    loco::Decompressed<uint8_t> result8 =
+            decoder8.decompress(compressed.segments(), loco::Span<uint8_t>(decoded8));
+    ASSERT_TRUE(result8.ok());
+    EXPECT_EQ(decoded8, pixels8);
+
+    // a view larger than its pixels is refused before coding
+    loco::ImageView<uint16_t> bad(loco::Span<uint16_t>(pixels.data(),
+            pixels.size() - 1), width, height, stride);
+    compressed = encoder.compress(bad, 1, out);
+    EXPECT_EQ(compressed.status,
+            LOCO_SMALL_BUFFER_FLAG | LOCO_ABORT_COMPRESSION_FLAG);
+
+    // as is a view of more bytes than an I32 holds (its pixels are not read)
+    const int huge = 40000;
+    loco::ImageView<uint16_t> too_big(loco::Span<uint16_t>(pixels.data(),
+            (size_t)huge * huge), huge, huge, huge);
+    compressed = encoder.compress(too_big, 1, out);
+    EXPECT_EQ(compressed.status,
+            LOCO_SMALL_BUFFER_FLAG | LOCO_ABORT_COMPRESSION_FLAG);
+
+    // an output buffer larger than that is used in part (only what the
+    // image needs is written)
+    compressed = encoder.compress(view, 2, loco::Span<LocoBitstreamType>(
+            out.data(), ((size_t)1 << 31) / sizeof(LocoBitstreamType) + 1));
+    ASSERT_TRUE(compressed.ok());
+    EXPECT_EQ(compressed.image.size_data_bytes, 0x7fffffff);
+    EXPECT_LE(compressed.size_bytes(), bound);
+}
+
+// allocation from an arena, sized up front, which frees nothing itself
+struct Arena {
+    std::vector<unsigned char> memory;
+    size_t used;
+    int n_allocated;
+    int n_released;
+    int fail_after;     // allocations to make before failing, or -1
+};
+
+void *arena_allocate(void *context, I32 size_bytes, I32 align_bytes)
+{
+    Arena *arena = (Arena*) context;
+    uintptr_t address = (uintptr_t)arena->memory.data() + arena->used;
+    size_t start = arena->used + (align_bytes - address % align_bytes) % align_bytes;
+    if (arena->n_allocated == arena->fail_after
+            || start + size_bytes > arena->memory.size()) {
+        return NULL;
+    }
+    arena->used = start + size_bytes;
+    arena->n_allocated++;
+    return arena->memory.data() + start;
+}
+
+void arena_release(void *context, void *ptr)
+{
+    Arena *arena = (Arena*) context;
+    EXPECT_TRUE(ptr != NULL);
+    arena->n_released++;
+}
+
+TEST(LocoTest, StatePool) {
+
+    const int width = 64;
+    const int height = 48;
+    const int n_segs = 4;
+    LocoWorkingSizes sizes;
+    ASSERT_EQ(loco_working_sizes(width, height, 12, n_segs, NULL, &sizes), LOCO_OK);
+    EXPECT_EQ(sizes.compress_state_bytes, (I32)sizeof(LocoCompressState));
+    EXPECT_EQ(sizes.decompress_state_bytes, (I32)sizeof(LocoDecompressState));
+    EXPECT_EQ(sizes.image_bytes, width * height * (I32)sizeof(LocoPixelType));
+    EXPECT_EQ(sizes.compressed_bytes,
+            loco_compressed_size_bound(width, height, 12, n_segs, NULL));
+    EXPECT_EQ(loco_working_sizes(2, height, 12, n_segs, NULL, &sizes),
+            LOCO_POOL_BAD_PARAMS_FLAG);
+
+    // a 1024 x 1024 12 bit image: unlimited codes are bounded at 4096 bits
+    // a pixel, and limited ones by the escape
+    LocoCompressOptions limited;
+    loco_init_compress_options(&limited);
+    limited.limit_golomb = 1;
+    ASSERT_EQ(loco_working_sizes(1024, 1024, 12, 1, NULL, &sizes), LOCO_OK);
+    EXPECT_EQ(sizes.image_bytes, 1024 * 1024 * (I32)sizeof(LocoPixelType));
+    EXPECT_EQ(sizes.compressed_bytes,
+            loco_compressed_size_bound(1024, 1024, 12, 1, NULL));
+    EXPECT_GT(sizes.compressed_bytes, (1024 * 1024 - 2) * 512);
+    ASSERT_EQ(loco_working_sizes(1024, 1024, 12, 1, &limited, &sizes), LOCO_OK);
+    EXPECT_EQ(sizes.image_bytes, 1024 * 1024 * (I32)sizeof(LocoPixelType));
+    EXPECT_EQ(sizes.compressed_bytes,
+            loco_compressed_size_bound(1024, 1024, 12, 1, &limited));
+    EXPECT_LE(sizes.compressed_bytes,
+            1024 * 1024 * (2 * 12 + 1 + LIMIT_UNARY_12BIT) / 8 + 64);
+    // larger, only limited codes have a bound
+    EXPECT_EQ(loco_working_sizes(2048, 2056, 12, 1, NULL, &sizes),
+            LOCO_POOL_BAD_PARAMS_FLAG);
+    EXPECT_EQ(loco_working_sizes(2048, 2056, 12, 1, &limited, &sizes), LOCO_OK);
+    ASSERT_EQ(loco_working_sizes(width, height, 12, n_segs, NULL, &sizes), LOCO_OK);
+
+    // exactly enough memory for the states, with room to align them
+    const int n_compress = 2;
+    const int n_decompress = 3;
+    Arena arena;
+    arena.memory.resize(n_compress * (sizes.compress_state_bytes
+            + LOCO_STATE_ALIGN_BYTES) + n_decompress
+            * (sizes.decompress_state_bytes + LOCO_STATE_ALIGN_BYTES));
+    arena.used = 0;
+    arena.n_allocated = 0;
+    arena.n_released = 0;
+    arena.fail_after = -1;
+    LocoAllocHooks alloc = {arena_allocate, arena_release, &arena};
+    PoolLock pool_lock_data;
+    LocoPoolHooks hooks = {pool_lock, pool_unlock, pool_wait, pool_wake_all,
+            &pool_lock_data};
+
+    LocoStatePool pool;
+    EXPECT_EQ(loco_state_pool_init(&pool, LOCO_STATE_POOL_MAX_STATES + 1, 0,
+            &alloc, &hooks), LOCO_POOL_BAD_PARAMS_FLAG);
+    arena.fail_after = 3;
+    EXPECT_EQ(loco_state_pool_init(&pool, n_compress, n_decompress, &alloc, &hooks),
+            LOCO_POOL_NO_MEMORY_FLAG);
+    EXPECT_EQ(arena.n_released, 3);
+    arena.used = 0;
+    arena.n_allocated = 0;
+    arena.n_released = 0;
+    arena.fail_after = -1;
+    ASSERT_EQ(loco_state_pool_init(&pool, n_compress, n_decompress, &alloc, &hooks),
+            LOCO_OK);
+    EXPECT_EQ(arena.n_allocated, n_compress + n_decompress);
+
+    // every state can be lent out once, and comes back
+    LocoCompressState *taken[n_compress];
+    for (int i = 0; i < n_compress; i++) {
+        taken[i] = loco_state_pool_acquire_compress(&pool);
+        ASSERT_TRUE(taken[i] != NULL);
+        EXPECT_EQ((uintptr_t)taken[i] % LOCO_STATE_ALIGN_BYTES, 0u);
+    }
+    EXPECT_TRUE(taken[0] != taken[1]);
+    EXPECT_TRUE(loco_state_pool_acquire_compress(&pool) == NULL);
+    loco_state_pool_release_compress(&pool, taken[0]);
+    EXPECT_TRUE(loco_state_pool_acquire_compress(&pool) == taken[0]);
+    for (int i = 0; i < n_compress; i++) {
+        loco_state_pool_release_compress(&pool, taken[i]);
+    }
+
+    // threads share the states frame after frame, with buffers sized up
+    // front, and nothing more is allocated
+    std::vector<LocoPixelType> pixels(sizes.image_bytes / sizeof(LocoPixelType));
+    for (int i = 0; i < width * height; i++) {
+        pixels[i] = (i * 37 + (i / width) * 11) & 0xfff;
+    }
+    const int n_threads = 4;
+    const int n_frames = 5;
+    int errors[n_threads] = {0};
+    std::thread threads[n_threads];
+    for (int t = 0; t < n_threads; t++) {
+        threads[t] = std::thread([&, t]() {
+            std::vector<LocoBitstreamType> compressed_buf(
+                    sizes.compressed_bytes / sizeof(LocoBitstreamType) + 1);
+            std::vector<LocoPixelType> decoded(pixels.size());
+            for (int frame = 0; frame < n_frames; frame++) {
+                LocoCompressState *state;
+                while ((state = loco_state_pool_acquire_compress(&pool)) == NULL) {
+                    std::this_thread::yield();
+                }
+                LocoImage image;
+                image.width = width;
+                image.height = height;
+                image.space_width = width;
+                image.data = pixels.data();
+                image.size_data_bytes = sizes.image_bytes;
+                image.bit_depth = 12;
+                image.n_segs = n_segs;
+                LocoCompressedImage compressed;
+                compressed.data = compressed_buf.data();
+                compressed.size_data_bytes = sizes.compressed_bytes;
+                errors[t] += (loco_compress(state, &image, &compressed) != LOCO_OK);
+                loco_state_pool_release_compress(&pool, state);
+
+                LocoDecompressState *dec_state;
+                while ((dec_state = loco_state_pool_acquire_decompress(&pool)) == NULL) {
+                    std::this_thread::yield();
+                }
+                LocoImage decompressed;
+                decompressed.data = decoded.data();
+                decompressed.size_data_bytes = sizes.image_bytes;
+                LocoSegmentData seg_data[LOCO_MAX_SEGS];
+                errors[t] += (loco_decompress(dec_state, &compressed.segments,
+                        &decompressed, seg_data) != LOCO_OK);
+                loco_state_pool_release_decompress(&pool, dec_state);
+                errors[t] += (decoded != pixels);
+            }
+        });
+    }
+    for (int t = 0; t < n_threads; t++) {
+        threads[t].join();
+        EXPECT_EQ(errors[t], 0) << "thread " << t;
+    }
+    EXPECT_EQ(arena.n_allocated, n_compress + n_decompress);
+
+    loco_state_pool_free(&pool);
+    EXPECT_EQ(arena.n_released, n_compress + n_decompress);
+}
+
 TEST(LocoDeathTest, Asserts) {
 
 
@@ -1189,4 +4240,222 @@ TEST(LocoTest, Performance) {
     fclose(csv_ptr);
 }
 
+// CPU time of the calling thread alone
+double get_thread_cpu_time(void) {
+    timespec time;
+    int ret = clock_gettime(CLOCK_THREAD_CPUTIME_ID, &time);
+    EXPECT_EQ(ret, 0);
+    return (double)time.tv_sec + (double)time.tv_nsec * .000000001;
+}
+
+void run_timed_planner(LocoPipeline *pipe, double *cpu_s)
+{
+    double start = get_thread_cpu_time();
+    loco_pipeline_run_planner(pipe);
+    *cpu_s = get_thread_cpu_time() - start;
+}
+
+// run_pipeline(), timing each stage by the CPU time of its own thread, which
+// leaves out waiting for the other stage, and the other stage's work on a
+// shared core
+I32 run_timed_pipeline(LocoPipeline *pipe, LocoCompressState *state,
+        const LocoImage *image, LocoCompressedImage *result,
+        double *coder_cpu_s, double *planner_cpu_s)
+{
+    static PoolLock pipe_lock_data;
+    LocoPoolHooks hooks = {pool_lock, pool_unlock, pool_wait, pool_wake_all,
+            &pipe_lock_data};
+    I32 flags = loco_pipeline_start(pipe, state, image, NULL, result, NULL,
+            &hooks);
+    std::thread planner(run_timed_planner, pipe, planner_cpu_s);
+    double start = get_thread_cpu_time();
+    I32 coder_flags = loco_pipeline_run_coder(pipe);
+    *coder_cpu_s = get_thread_cpu_time() - start;
+    planner.join();
+    EXPECT_EQ(coder_flags & flags, flags);
+    return coder_flags;
+}
+
+TEST(LocoTest, PipelinePerformance) {
+
+    // one segment, as the pipeline is for: the best of several runs of the
+    // serial coder (loco_compress_ext(), by loco_compress_rows()), and of
+    // the two stage pipeline, on the frog tiled to a larger image. With a
+    // core for each stage, the pipeline takes as long as its slower stage,
+    // so the CPU time of each stage is reported, against the serial coder's
+    static int num_runs = 10;
+    int frog_rows;
+    int frog_cols;
+    uint32_t* frog_image = (uint32_t*) ReadImage(&frog_cols, &frog_rows,
+            "../test/frog.bmp", IMAGEIO_U8 | IMAGEIO_RGBA);
+    ASSERT_TRUE(frog_image != NULL);
+    alloc_global_bufs(2048, 2048);
+    LocoBitstreamType *piped_buf = (LocoBitstreamType*) malloc(compressed_buf_bytes);
+    ASSERT_TRUE(piped_buf != NULL);
+    LocoPipeline *pipe = (LocoPipeline*) malloc(sizeof(LocoPipeline));
+    ASSERT_TRUE(pipe != NULL);
+
+    for (int bit_depth = 8; bit_depth <= 12; bit_depth += 4) {
+        for (int noise = 0; noise <= 1; noise++) {
+            int pmax = (1 << bit_depth) - 1;
+            srand(7);
+            for (int row = 0; row < n_rows; row++) {
+                for (int col = 0; col < n_cols; col++) {
+                    U8* u8p = (U8*)(&frog_image[(row % frog_rows) * frog_cols
+                            + (col % frog_cols)]);
+                    int color = (pmax + 1) / 256 * (int)(
+                            u8p[0] * .3 + u8p[1] * .6 + u8p[2] * .1);
+                    if (noise) {
+                        color += rand() % ((pmax + 1) / 16);
+                    }
+                    image_input_buf[(row * n_cols) + col] =
+                            (LocoPixelType)(color & pmax);
+                }
+            }
+            LocoImage image;
+            image.width = n_cols;
+            image.height = n_rows;
+            image.space_width = n_cols;
+            image.data = image_input_buf;
+            image.size_data_bytes = image_buf_bytes;
+            image.bit_depth = bit_depth;
+            image.n_segs = 1;
+            LocoCompressedImage compressed;
+            compressed.data = image_compressed_buf;
+            compressed.size_data_bytes = compressed_buf_bytes;
+            LocoCompressedImage piped;
+            piped.data = piped_buf;
+            piped.size_data_bytes = compressed_buf_bytes;
+
+            double serial_s = 1e9;
+            double piped_s = 1e9;
+            double serial_cpu_s = 1e9;
+            double coder_cpu_s = 1e9;
+            double planner_cpu_s = 1e9;
+            for (int run = 0; run < num_runs; run++) {
+                double start = get_wall_time();
+                double start_cpu = get_thread_cpu_time();
+                ASSERT_EQ(loco_compress_ext(loco_state, &image, NULL,
+                        &compressed, NULL), LOCO_OK);
+                serial_cpu_s = std::min(serial_cpu_s,
+                        get_thread_cpu_time() - start_cpu);
+                serial_s = std::min(serial_s, get_wall_time() - start);
+                double coder_s;
+                double planner_s;
+                start = get_wall_time();
+                ASSERT_EQ(run_timed_pipeline(pipe, loco_state, &image,
+                        &piped, &coder_s, &planner_s), LOCO_OK);
+                piped_s = std::min(piped_s, get_wall_time() - start);
+                coder_cpu_s = std::min(coder_cpu_s, coder_s);
+                planner_cpu_s = std::min(planner_cpu_s, planner_s);
+            }
+            ASSERT_EQ(piped.compressed_size_bytes, compressed.compressed_size_bytes);
+            EXPECT_EQ(memcmp(piped_buf, image_compressed_buf,
+                    compressed.compressed_size_bytes), 0);
+            printf("bit depth %d, noise %d: serial %.1f ms, pipelined %.1f ms "
+                    "(%u hardware threads)\n", bit_depth, noise,
+                    1e3 * serial_s, 1e3 * piped_s,
+                    std::thread::hardware_concurrency());
+            printf("    CPU: serial %.1f ms, coder stage %.1f ms, planner "
+                    "stage %.1f ms\n", 1e3 * serial_cpu_s, 1e3 * coder_cpu_s,
+                    1e3 * planner_cpu_s);
+        }
+    }
+
+    free(pipe);
+    free(piped_buf);
+    free_global_bufs();
+    free(frog_image);
+}
+
+TEST(LocoTest, BatchPerformance) {
+
+    // the frog tiled to a larger image, compressed whole, then cut into
+    // 64 x 64 tiles, one loco_compress_ext() call each, and as one batch:
+    // the same pixels, so per image setup shows as time per pixel
+    static int num_runs = 10;
+    const int tile = 64;
+    int frog_rows;
+    int frog_cols;
+    uint32_t* frog_image = (uint32_t*) ReadImage(&frog_cols, &frog_rows,
+            "../test/frog.bmp", IMAGEIO_U8 | IMAGEIO_RGBA);
+    ASSERT_TRUE(frog_image != NULL);
+    alloc_global_bufs(2048, 2048);
+    for (int row = 0; row < n_rows; row++) {
+        for (int col = 0; col < n_cols; col++) {
+            U8* u8p = (U8*)(&frog_image[(row % frog_rows) * frog_cols
+                    + (col % frog_cols)]);
+            image_input_buf[(row * n_cols) + col] = (LocoPixelType)(
+                    u8p[0] * .3 + u8p[1] * .6 + u8p[2] * .1);
+        }
+    }
+    int n_tiles = (n_rows / tile) * (n_cols / tile);
+    LocoImage *tiles = (LocoImage*) malloc(n_tiles * sizeof(LocoImage));
+    LocoBatchEntry *index = (LocoBatchEntry*) malloc(n_tiles * sizeof(LocoBatchEntry));
+    LocoPixelType *tile_buf = (LocoPixelType*) malloc(image_buf_bytes);
+    ASSERT_TRUE(tiles != NULL && index != NULL && tile_buf != NULL);
+    for (int i = 0; i < n_tiles; i++) {
+        int row = i / (n_cols / tile) * tile;
+        int col = i % (n_cols / tile) * tile;
+        tiles[i].width = tile;
+        tiles[i].height = tile;
+        tiles[i].space_width = tile;
+        tiles[i].data = tile_buf + i * tile * tile;
+        tiles[i].size_data_bytes = tile * tile * sizeof(LocoPixelType);
+        for (int y = 0; y < tile; y++) {
+            memcpy(tiles[i].data + y * tile,
+                    image_input_buf + (row + y) * n_cols + col,
+                    tile * sizeof(LocoPixelType));
+        }
+        tiles[i].bit_depth = 8;
+        tiles[i].n_segs = 1;
+    }
+    LocoImage image;
+    image.width = n_cols;
+    image.height = n_rows;
+    image.space_width = n_cols;
+    image.data = image_input_buf;
+    image.size_data_bytes = image_buf_bytes;
+    image.bit_depth = 8;
+    image.n_segs = 1;
+
+    double whole_s = 1e9;
+    double loop_s = 1e9;
+    double batch_s = 1e9;
+    for (int run = 0; run < num_runs; run++) {
+        LocoCompressedImage compressed;
+        compressed.data = image_compressed_buf;
+        compressed.size_data_bytes = compressed_buf_bytes;
+        double start = get_wall_time();
+        ASSERT_EQ(loco_compress_ext(loco_state, &image, NULL, &compressed,
+                NULL), LOCO_OK);
+        whole_s = std::min(whole_s, get_wall_time() - start);
+
+        start = get_wall_time();
+        for (int i = 0; i < n_tiles; i++) {
+            compressed.data = image_compressed_buf;
+            compressed.size_data_bytes = compressed_buf_bytes;
+            ASSERT_EQ(loco_compress_ext(loco_state, &tiles[i], NULL,
+                    &compressed, NULL), LOCO_OK);
+        }
+        loop_s = std::min(loop_s, get_wall_time() - start);
+
+        compressed.data = image_compressed_buf;
+        compressed.size_data_bytes = compressed_buf_bytes;
+        start = get_wall_time();
+        ASSERT_EQ(loco_compress_batch(loco_state, tiles, n_tiles, NULL,
+                &compressed, index), LOCO_OK);
+        batch_s = std::min(batch_s, get_wall_time() - start);
+    }
+    printf("2048 x 2048 whole %.1f ms; %d tiles of %d x %d: one call each "
+            "%.1f ms, batch %.1f ms\n", 1e3 * whole_s, n_tiles, tile, tile,
+            1e3 * loop_s, 1e3 * batch_s);
+
+    free(tile_buf);
+    free(index);
+    free(tiles);
+    free_global_bufs();
+    free(frog_image);
+}
+
 #endif
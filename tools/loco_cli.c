@@ -0,0 +1,828 @@
+/***********************************************************************
+ * Copyright 2026 by the California Institute of Technology
+ * ALL RIGHTS RESERVED. United States Government Sponsorship acknowledged.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * @file        loco_cli.c
+ * @date        2026-10-18
+ * @brief       Command-line tool compressing and decompressing image files
+ *
+ * Usage:
+ *
+ *   loco [-s segs] [-t threads] [-n near] [-r WxH] [-b bits] in out.loco
+ *   loco -d [-t threads] in.loco out.pgm
+ *
+ * Compresses a binary PGM (P5, 8 or 16 bit), or with -r a headerless raw
+ * dump of W x H pixels (one byte each up to 8 bits, otherwise two, little
+ * endian), into a container file; then decompresses the container back,
+ * checks it against the input, and prints the compression ratio and
+ * throughput. With -d, decompresses a container into a PGM.
+ *
+ * Files are read through mmap; raw 16 bit pixels are compressed from the
+ * mapping as they are, on a little endian host. Segments are compressed and
+ * decompressed as jobs on a LocoPool, one worker per thread, with states
+ * from a LocoStatePool.
+ *
+ * A container is, in little endian 32 bit words: "LOCO", the version (1),
+ * the number of segments, and the size in bits of each segment; then each
+ * segment, padded to a whole word.
+ *
+ * This is a POSIX host tool, not flight code: it uses the C library, pthreads
+ * and floating point freely.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE     /* MAP_ANONYMOUS, with glibc */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <loco/loco_pub.h>
+
+#ifndef MAP_NORESERVE
+#define MAP_NORESERVE 0
+#endif
+
+enum {
+    CONTAINER_VERSION = 1,
+    CONTAINER_HEADER_WORDS = 3,     /* magic, version, number of segments */
+    DEFAULT_SEGS = 8,
+    DEFAULT_RAW_BIT_DEPTH = 12,
+    MAX_THREADS = LOCO_POOL_MAX_WORKERS,
+};
+
+static const U8 container_magic[4] = {'L', 'O', 'C', 'O'};
+
+/* A file mapped into memory */
+typedef struct {
+    U8 *data;
+    size_t size;
+} MappedFile;
+
+/* Command-line settings */
+typedef struct {
+    int decompress;
+    int n_segs;
+    int n_threads;
+    int near;
+    int raw;
+    int width;          /* of a raw image */
+    int height;
+    int bit_depth;      /* 0 if not given */
+    const char *in_path;
+    const char *out_path;
+} Settings;
+
+/* Locking for the pools, from a pthread mutex and condition variable */
+typedef struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+} ToolLock;
+
+/* Workers running a LocoPool, and the states they use */
+typedef struct {
+    LocoStatePool states;
+    LocoPool *pool;
+    ToolLock lock;
+    LocoPoolHooks hooks;
+    LocoDecompressState *peek_state;
+    pthread_t threads[MAX_THREADS];
+    int n_threads;
+    int n_running;
+} Workers;
+
+/* One worker's thread */
+typedef struct {
+    LocoPool *pool;
+    I32 index;
+} WorkerArg;
+
+static void tool_lock(void *context)
+{
+    ToolLock *lock = (ToolLock *)context;
+    pthread_mutex_lock(&lock->mutex);
+}
+
+static void tool_unlock(void *context)
+{
+    ToolLock *lock = (ToolLock *)context;
+    pthread_mutex_unlock(&lock->mutex);
+}
+
+static void tool_wait(void *context)
+{
+    ToolLock *lock = (ToolLock *)context;
+    pthread_cond_wait(&lock->cond, &lock->mutex);
+}
+
+static void tool_wake_all(void *context)
+{
+    ToolLock *lock = (ToolLock *)context;
+    pthread_cond_broadcast(&lock->cond);
+}
+
+static void *tool_allocate(void *context, I32 size_bytes, I32 align_bytes)
+{
+    void *ptr = NULL;
+    (void)context;
+    if (posix_memalign(&ptr, (size_t)align_bytes, (size_t)size_bytes) != 0) {
+        return NULL;
+    }
+    return ptr;
+}
+
+static void tool_release(void *context, void *ptr)
+{
+    (void)context;
+    free(ptr);
+}
+
+static double now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + 1e-9 * (double)ts.tv_nsec;
+}
+
+static int host_is_little_endian(void)
+{
+    const U16 one = 1;
+    return *(const U8 *)&one == 1;
+}
+
+static void put_u32(U8 *p, U32 value)
+{
+    p[0] = (U8)value;
+    p[1] = (U8)(value >> 8);
+    p[2] = (U8)(value >> 16);
+    p[3] = (U8)(value >> 24);
+}
+
+static U32 get_u32(const U8 *p)
+{
+    return (U32)p[0] | ((U32)p[1] << 8) | ((U32)p[2] << 16) | ((U32)p[3] << 24);
+}
+
+/* Map a whole file, copy on write, so its pixels can be used in place */
+static int map_file(const char *path, MappedFile *file)
+{
+    file->data = NULL;
+    file->size = 0;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "loco: cannot open %s: %s\n", path, strerror(errno));
+        return 0;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+        fprintf(stderr, "loco: %s is empty or cannot be read\n", path);
+        close(fd);
+        return 0;
+    }
+    void *data = mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        fprintf(stderr, "loco: cannot map %s: %s\n", path, strerror(errno));
+        return 0;
+    }
+    file->data = (U8 *)data;
+    file->size = (size_t)st.st_size;
+    return 1;
+}
+
+static void unmap_file(MappedFile *file)
+{
+    if (file->data != NULL) {
+        munmap(file->data, file->size);
+        file->data = NULL;
+    }
+}
+
+static int bits_for(int max_value)
+{
+    int bits = 0;
+    while ((1 << bits) <= max_value) {
+        bits++;
+    }
+    return bits;
+}
+
+/* Read a PGM header field, skipping white space and comments. Returns the
+   offset after it, or 0 if there is none. */
+static size_t pgm_field(const MappedFile *file, size_t pos, int *value)
+{
+    while (pos < file->size) {
+        if (file->data[pos] == '#') {
+            while (pos < file->size && file->data[pos] != '\n') {
+                pos++;
+            }
+        } else if (file->data[pos] == ' ' || file->data[pos] == '\t'
+                || file->data[pos] == '\r' || file->data[pos] == '\n') {
+            pos++;
+        } else {
+            break;
+        }
+    }
+    if (pos >= file->size || file->data[pos] < '0' || file->data[pos] > '9') {
+        return 0;
+    }
+    *value = 0;
+    while (pos < file->size && file->data[pos] >= '0' && file->data[pos] <= '9'
+            && *value < 0x10000) {
+        *value = *value * 10 + (file->data[pos] - '0');
+        pos++;
+    }
+    return pos;
+}
+
+/* Get the pixels of the input file into image, in place where they can be,
+   otherwise into *copy */
+static int read_input(const Settings *settings, const MappedFile *file,
+        LocoImage *image, LocoPixelType **copy)
+{
+    size_t start = 0;
+    int pixel_bytes;
+    int big_endian = 0;
+    int bit_depth = settings->bit_depth;
+    *copy = NULL;
+
+    if (settings->raw) {
+        image->width = settings->width;
+        image->height = settings->height;
+        if (bit_depth == 0) {
+            bit_depth = DEFAULT_RAW_BIT_DEPTH;
+        }
+        pixel_bytes = (bit_depth <= 8) ? 1 : 2;
+    } else {
+        int maxval = 0;
+        if (file->size < 2 || file->data[0] != 'P' || file->data[1] != '5') {
+            fprintf(stderr, "loco: %s is not a binary PGM (P5)\n",
+                    settings->in_path);
+            return 0;
+        }
+        start = pgm_field(file, 2, &image->width);
+        start = (start == 0) ? 0 : pgm_field(file, start, &image->height);
+        start = (start == 0) ? 0 : pgm_field(file, start, &maxval);
+        if (start == 0 || maxval < 1 || maxval > 65535) {
+            fprintf(stderr, "loco: %s has a bad PGM header\n", settings->in_path);
+            return 0;
+        }
+        start++;    /* the single white space before the pixels */
+        pixel_bytes = (maxval < 256) ? 1 : 2;
+        big_endian = 1;
+        if (bit_depth == 0) {
+            bit_depth = bits_for(maxval);
+        }
+    }
+    if (bit_depth < 1 || bit_depth > 12) {
+        fprintf(stderr, "loco: %d bit pixels cannot be compressed; "
+                "give -b for up to 12 bits\n", bit_depth);
+        return 0;
+    }
+    image->bit_depth = bit_depth;
+    image->space_width = image->width;
+
+    size_t n_pixels = (size_t)image->width * (size_t)image->height;
+    if (image->width <= 0 || image->height <= 0
+            || image->width > LOCO_MAX_IMAGE_WIDTH
+            || image->height > LOCO_MAX_IMAGE_HEIGHT
+            || file->size - start < n_pixels * (size_t)pixel_bytes) {
+        fprintf(stderr, "loco: %s does not hold a %d x %d image of %d byte "
+                "pixels\n", settings->in_path, image->width, image->height,
+                pixel_bytes);
+        return 0;
+    }
+    image->size_data_bytes = (I32)(n_pixels * sizeof(LocoPixelType));
+
+    const U8 *bytes = file->data + start;
+    if (pixel_bytes == 2 && !big_endian && host_is_little_endian()) {
+        image->data = (LocoPixelType *)(void *)file->data;
+    } else {
+        *copy = (LocoPixelType *)malloc(n_pixels * sizeof(LocoPixelType));
+        if (*copy == NULL) {
+            fprintf(stderr, "loco: out of memory\n");
+            return 0;
+        }
+        for (size_t i = 0; i < n_pixels; i++) {
+            U32 value;
+            if (pixel_bytes == 1) {
+                value = bytes[i];
+            } else if (big_endian) {
+                value = ((U32)bytes[2*i] << 8) | bytes[2*i + 1];
+            } else {
+                value = bytes[2*i] | ((U32)bytes[2*i + 1] << 8);
+            }
+            (*copy)[i] = (LocoPixelType)(value & 0xffff);
+        }
+        image->data = *copy;
+    }
+
+    LocoPixelType pmax = (LocoPixelType)((1 << bit_depth) - 1);
+    for (size_t i = 0; i < n_pixels; i++) {
+        if (image->data[i] < 0 || image->data[i] > pmax) {
+            fprintf(stderr, "loco: pixel %zu of %s does not fit in %d bits\n",
+                    i, settings->in_path, bit_depth);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static void *run_worker(void *context)
+{
+    WorkerArg *arg = (WorkerArg *)context;
+    loco_pool_run_worker(arg->pool, arg->index);
+    return NULL;
+}
+
+/* Allocate the states, and start a worker thread for each */
+static int start_workers(Workers *workers, int n_threads, WorkerArg *args)
+{
+    LocoCompressState *compress_states[MAX_THREADS];
+    LocoDecompressState *decompress_states[MAX_THREADS];
+    LocoAllocHooks alloc = {tool_allocate, tool_release, NULL};
+
+    workers->n_threads = n_threads;
+    workers->n_running = 0;
+    workers->peek_state = NULL;
+    pthread_mutex_init(&workers->lock.mutex, NULL);
+    pthread_cond_init(&workers->lock.cond, NULL);
+    workers->hooks.lock = tool_lock;
+    workers->hooks.unlock = tool_unlock;
+    workers->hooks.wait = tool_wait;
+    workers->hooks.wake_all = tool_wake_all;
+    workers->hooks.context = &workers->lock;
+
+    workers->pool = (LocoPool *)malloc(sizeof(LocoPool));
+    if (workers->pool == NULL || loco_state_pool_init(&workers->states,
+            n_threads, n_threads + 1, &alloc, &workers->hooks) != LOCO_OK) {
+        fprintf(stderr, "loco: out of memory for %d threads\n", n_threads);
+        return 0;
+    }
+    for (int i = 0; i < n_threads; i++) {
+        compress_states[i] = loco_state_pool_acquire_compress(&workers->states);
+        decompress_states[i] = loco_state_pool_acquire_decompress(&workers->states);
+    }
+    workers->peek_state = loco_state_pool_acquire_decompress(&workers->states);
+    if (loco_pool_init(workers->pool, n_threads, compress_states,
+            decompress_states, &workers->hooks) != LOCO_OK) {
+        return 0;
+    }
+    for (int i = 0; i < n_threads; i++) {
+        args[i].pool = workers->pool;
+        args[i].index = i;
+        if (pthread_create(&workers->threads[i], NULL, run_worker, &args[i]) != 0) {
+            fprintf(stderr, "loco: cannot start thread %d\n", i);
+            return 0;
+        }
+        workers->n_running++;
+    }
+    return 1;
+}
+
+/* Stop the workers, and give back and free their states */
+static void stop_workers(Workers *workers)
+{
+    if (workers->pool == NULL) {
+        return;
+    }
+    if (workers->n_running > 0) {
+        loco_pool_stop(workers->pool);
+        for (int i = 0; i < workers->n_running; i++) {
+            pthread_join(workers->threads[i], NULL);
+        }
+    }
+    if (workers->peek_state != NULL) {
+        for (int i = 0; i < workers->n_threads; i++) {
+            loco_state_pool_release_compress(&workers->states,
+                    workers->pool->compress_states[i]);
+            loco_state_pool_release_decompress(&workers->states,
+                    workers->pool->decompress_states[i]);
+        }
+        loco_state_pool_release_decompress(&workers->states, workers->peek_state);
+        loco_state_pool_free(&workers->states);
+    }
+    free(workers->pool);
+    workers->pool = NULL;
+    pthread_cond_destroy(&workers->lock.cond);
+    pthread_mutex_destroy(&workers->lock.mutex);
+}
+
+/* Compress image by segment, each into its own part of seg_buf, which is
+   bound bytes per segment, rounded up to a whole word, reserved but only
+   committed as it is written. Golomb codes are limited, so that large 12 bit
+   images have a bound; sizes are computed in size_t, and checked. */
+static I32 compress_image(Workers *workers, const Settings *settings,
+        const LocoImage *image, LocoCompressedSegments *segments,
+        U8 **seg_buf, size_t *seg_buf_bytes)
+{
+    LocoCompressOptions options;
+    loco_init_compress_options(&options);
+    options.near = settings->near;
+    options.limit_golomb = 1;
+
+    *seg_buf = NULL;
+    I32 bound = loco_compressed_size_bound(image->width, image->height,
+            image->bit_depth, image->n_segs, &options);
+    if (bound == 0) {
+        fprintf(stderr, "loco: a %d x %d image cannot be compressed in %d "
+                "segments\n", image->width, image->height, image->n_segs);
+        return LOCO_ABORT_COMPRESSION_FLAG;
+    }
+    size_t seg_bytes = ((size_t)bound + sizeof(LocoBitstreamType) - 1)
+            & ~(sizeof(LocoBitstreamType) - 1);
+    if (seg_bytes > SIZE_MAX / (size_t)image->n_segs) {
+        fprintf(stderr, "loco: %d segments of %zu bytes do not fit in memory\n",
+                image->n_segs, seg_bytes);
+        return LOCO_ABORT_COMPRESSION_FLAG;
+    }
+    *seg_buf_bytes = seg_bytes * (size_t)image->n_segs;
+    void *buf = mmap(NULL, *seg_buf_bytes, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (buf == MAP_FAILED) {
+        fprintf(stderr, "loco: cannot map %zu bytes for the segments\n",
+                *seg_buf_bytes);
+        return LOCO_ABORT_COMPRESSION_FLAG;
+    }
+    *seg_buf = (U8 *)buf;
+
+    LocoSegmentBuffer seg_out[LOCO_MAX_SEGS];
+    for (I32 i = 0; i < image->n_segs; i++) {
+        seg_out[i].data = (LocoBitstreamType *)(void *)(*seg_buf
+                + (size_t)i * seg_bytes);
+        seg_out[i].size_data_bytes = bound;
+    }
+
+    LocoJob job;
+    memset(&job, 0, sizeof(job));
+    job.kind = LOCO_JOB_COMPRESS;
+    job.by_segment = 1;
+    job.image = image;
+    job.options = &options;
+    job.seg_out = seg_out;
+    job.segments = segments;
+    I32 status = loco_pool_submit(workers->pool, &job);
+    if (status == LOCO_OK) {
+        status = loco_pool_wait(workers->pool, &job);
+    }
+    return status;
+}
+
+static int write_container(const char *path, const LocoCompressedSegments *segments,
+        size_t *size_bytes)
+{
+    FILE *out = fopen(path, "wb");
+    if (out == NULL) {
+        fprintf(stderr, "loco: cannot create %s: %s\n", path, strerror(errno));
+        return 0;
+    }
+    U8 header[4 * (CONTAINER_HEADER_WORDS + LOCO_MAX_SEGS)];
+    I32 n_header_words = CONTAINER_HEADER_WORDS + segments->n_segs;
+    memcpy(header, container_magic, sizeof(container_magic));
+    put_u32(header + 4, CONTAINER_VERSION);
+    put_u32(header + 8, (U32)segments->n_segs);
+    for (I32 i = 0; i < segments->n_segs; i++) {
+        put_u32(header + 4 * (CONTAINER_HEADER_WORDS + i), (U32)segments->n_bits[i]);
+    }
+    int ok = (fwrite(header, 4, (size_t)n_header_words, out)
+            == (size_t)n_header_words);
+    *size_bytes = 4 * (size_t)n_header_words;
+    for (I32 i = 0; ok && i < segments->n_segs; i++) {
+        size_t words = ((size_t)segments->n_bits[i] + 31) / 32;
+        ok = (fwrite(segments->seg_ptr[i], 4, words, out) == words);
+        *size_bytes += 4 * words;
+    }
+    if (fclose(out) != 0) {
+        ok = 0;
+    }
+    if (!ok) {
+        fprintf(stderr, "loco: cannot write %s\n", path);
+    }
+    return ok;
+}
+
+/* Find the segments in a mapped container */
+static int read_container(const char *path, const MappedFile *file,
+        LocoCompressedSegments *segments)
+{
+    if (file->size < 4 * CONTAINER_HEADER_WORDS
+            || memcmp(file->data, container_magic, sizeof(container_magic)) != 0
+            || get_u32(file->data + 4) != CONTAINER_VERSION) {
+        fprintf(stderr, "loco: %s is not a loco container\n", path);
+        return 0;
+    }
+    U32 n_segs = get_u32(file->data + 8);
+    size_t pos = 4 * ((size_t)CONTAINER_HEADER_WORDS + n_segs);
+    if (n_segs < 1 || n_segs > LOCO_MAX_SEGS || file->size < pos) {
+        fprintf(stderr, "loco: %s has a bad number of segments\n", path);
+        return 0;
+    }
+    segments->n_segs = (I32)n_segs;
+    for (U32 i = 0; i < n_segs; i++) {
+        U32 n_bits = get_u32(file->data + 4 * (CONTAINER_HEADER_WORDS + i));
+        size_t bytes = 4 * (((size_t)n_bits + 31) / 32);
+        if (n_bits > 0x7fffffff || file->size - pos < bytes) {
+            fprintf(stderr, "loco: %s is cut short in segment %u\n", path, i);
+            return 0;
+        }
+        segments->seg_ptr[i] = file->data + pos;
+        segments->n_bits[i] = (I32)n_bits;
+        pos += bytes;
+    }
+    segments->seg_ptr[n_segs] = file->data + pos;
+    return 1;
+}
+
+/* Decompress segments by segment into a new image, which the caller frees */
+static I32 decompress_image(Workers *workers, const LocoCompressedSegments *segments,
+        LocoImage *image)
+{
+    LocoImageInfo info;
+    I32 status = loco_peek(workers->peek_state, segments, &info);
+    if (status != LOCO_OK) {
+        fprintf(stderr, "loco: cannot read the compressed image (0x%x)\n",
+                (unsigned)status);
+        return status;
+    }
+    image->data = (LocoPixelType *)malloc((size_t)info.size_data_bytes);
+    if (image->data == NULL) {
+        fprintf(stderr, "loco: out of memory\n");
+        return DELOCO_BUFTOOSMALL_FLAG;
+    }
+    image->size_data_bytes = info.size_data_bytes;
+
+    LocoSegmentData seg_data[LOCO_MAX_SEGS];
+    LocoJob job;
+    memset(&job, 0, sizeof(job));
+    job.kind = LOCO_JOB_DECOMPRESS;
+    job.by_segment = 1;
+    job.compressed_in = segments;
+    job.image_out = image;
+    job.seg_data = seg_data;
+    status = loco_pool_submit(workers->pool, &job);
+    if (status == LOCO_OK) {
+        status = loco_pool_wait(workers->pool, &job);
+    }
+    return status;
+}
+
+static int write_pgm(const char *path, const LocoImage *image)
+{
+    FILE *out = fopen(path, "wb");
+    if (out == NULL) {
+        fprintf(stderr, "loco: cannot create %s: %s\n", path, strerror(errno));
+        return 0;
+    }
+    int maxval = (1 << image->bit_depth) - 1;
+    int ok = (fprintf(out, "P5\n%d %d\n%d\n", image->width, image->height,
+            maxval) > 0);
+    for (I32 y = 0; ok && y < image->height; y++) {
+        for (I32 x = 0; ok && x < image->width; x++) {
+            LocoPixelType pixel = image->data[y * image->space_width + x];
+            if (maxval < 256) {
+                ok = (fputc(pixel, out) != EOF);
+            } else {
+                ok = (fputc(pixel >> 8, out) != EOF && fputc(pixel & 0xff, out) != EOF);
+            }
+        }
+    }
+    if (fclose(out) != 0) {
+        ok = 0;
+    }
+    if (!ok) {
+        fprintf(stderr, "loco: cannot write %s\n", path);
+    }
+    return ok;
+}
+
+/* Largest difference between the input and its decompressed image */
+static int max_error(const LocoImage *input, const LocoImage *output)
+{
+    int max = 0;
+    if (output->width != input->width || output->height != input->height) {
+        return 0x10000;
+    }
+    for (I32 y = 0; y < input->height; y++) {
+        for (I32 x = 0; x < input->width; x++) {
+            int error = input->data[y * input->space_width + x]
+                    - output->data[y * output->space_width + x];
+            error = (error < 0) ? -error : error;
+            max = (error > max) ? error : max;
+        }
+    }
+    return max;
+}
+
+static int run_compress(const Settings *settings, Workers *workers)
+{
+    MappedFile in_file;
+    MappedFile container;
+    LocoPixelType *copy = NULL;
+    LocoImage image;
+    LocoImage decompressed;
+    LocoCompressedSegments segments;
+    U8 *seg_buf = NULL;
+    size_t seg_buf_bytes = 0;
+    size_t container_bytes = 0;
+    int ok = 1;
+
+    decompressed.data = NULL;
+    container.data = NULL;
+    container.size = 0;
+    if (!map_file(settings->in_path, &in_file)) {
+        return 0;
+    }
+    image.n_segs = settings->n_segs;
+    ok = read_input(settings, &in_file, &image, &copy);
+
+    double start = now_seconds();
+    I32 status = ok ? compress_image(workers, settings, &image, &segments,
+            &seg_buf, &seg_buf_bytes) : LOCO_OK;
+    double compress_seconds = now_seconds() - start;
+    if (ok && status != LOCO_OK) {
+        fprintf(stderr, "loco: compression failed (0x%x)\n", (unsigned)status);
+        ok = 0;
+    }
+    ok = ok && write_container(settings->out_path, &segments, &container_bytes);
+
+    /* Decompress what was written, as a reader of the file would */
+    double decompress_seconds = 0.0;
+    if (ok && map_file(settings->out_path, &container)
+            && read_container(settings->out_path, &container, &segments)) {
+        start = now_seconds();
+        status = decompress_image(workers, &segments, &decompressed);
+        decompress_seconds = now_seconds() - start;
+        if (status != LOCO_OK) {
+            fprintf(stderr, "loco: decompression failed (0x%x)\n", (unsigned)status);
+            ok = 0;
+        }
+    } else {
+        ok = 0;
+    }
+
+    if (ok) {
+        int error = max_error(&image, &decompressed);
+        if (error > settings->near) {
+            fprintf(stderr, "loco: decompressed image differs from %s by %d\n",
+                    settings->in_path, error);
+            ok = 0;
+        }
+    }
+    if (ok) {
+        double n_pixels = (double)image.width * image.height;
+        printf("%s: %d x %d, %d bits, %d segments, %d threads, near %d\n",
+                settings->in_path, image.width, image.height, image.bit_depth,
+                image.n_segs, workers->n_threads, settings->near);
+        printf("%s: %zu bytes, %.3f bits/pixel, ratio %.3f\n",
+                settings->out_path, container_bytes,
+                8.0 * container_bytes / n_pixels,
+                n_pixels * image.bit_depth / (8.0 * container_bytes));
+        printf("compress %.1f Mpixel/s, decompress %.1f Mpixel/s\n",
+                n_pixels / compress_seconds * 1e-6,
+                n_pixels / decompress_seconds * 1e-6);
+    }
+
+    free(decompressed.data);
+    unmap_file(&container);
+    if (seg_buf != NULL) {
+        munmap(seg_buf, seg_buf_bytes);
+    }
+    free(copy);
+    unmap_file(&in_file);
+    return ok;
+}
+
+static int run_decompress(const Settings *settings, Workers *workers)
+{
+    MappedFile container;
+    LocoCompressedSegments segments;
+    LocoImage image;
+    int ok = 0;
+
+    image.data = NULL;
+    if (!map_file(settings->in_path, &container)) {
+        return 0;
+    }
+    if (read_container(settings->in_path, &container, &segments)) {
+        double start = now_seconds();
+        I32 status = decompress_image(workers, &segments, &image);
+        double seconds = now_seconds() - start;
+        if (status != LOCO_OK) {
+            fprintf(stderr, "loco: decompression failed (0x%x)\n", (unsigned)status);
+        } else if (write_pgm(settings->out_path, &image)) {
+            double n_pixels = (double)image.width * image.height;
+            printf("%s: %d x %d, %d bits, %d segments, %d threads\n",
+                    settings->in_path, image.width, image.height,
+                    image.bit_depth, image.n_segs, workers->n_threads);
+            printf("decompress %.1f Mpixel/s\n", n_pixels / seconds * 1e-6);
+            ok = 1;
+        }
+    }
+    free(image.data);
+    unmap_file(&container);
+    return ok;
+}
+
+static void usage(void)
+{
+    fprintf(stderr,
+            "usage: loco [-s segs] [-t threads] [-n near] [-r WxH] [-b bits] "
+            "in out.loco\n"
+            "       loco -d [-t threads] in.loco out.pgm\n"
+            "  Compresses a binary PGM, or a raw image, into a container,\n"
+            "  decompresses it back, and prints the ratio and throughput.\n"
+            "  -s segs     segments, 1 to %d (default %d)\n"
+            "  -t threads  threads, 1 to %d (default 1)\n"
+            "  -n near     near-lossless error bound (default 0)\n"
+            "  -r WxH      input is raw, W x H pixels: 8 bit, or 16 bit\n"
+            "              little endian for bit depths over 8\n"
+            "  -b bits     bit depth, 1 to 12 (raw default %d, PGM from maxval)\n"
+            "  -d          decompress a container into a PGM\n",
+            LOCO_MAX_SEGS, DEFAULT_SEGS, MAX_THREADS, DEFAULT_RAW_BIT_DEPTH);
+}
+
+static int parse_int(const char *arg, int min, int max, int *value)
+{
+    char *end;
+    long parsed = strtol(arg, &end, 10);
+    if (end == arg || *end != '\0' || parsed < min || parsed > max) {
+        return 0;
+    }
+    *value = (int)parsed;
+    return 1;
+}
+
+int main(int argc, char **argv)
+{
+    Settings settings;
+    memset(&settings, 0, sizeof(settings));
+    settings.n_segs = DEFAULT_SEGS;
+    settings.n_threads = 1;
+
+    int opt;
+    int ok = 1;
+    while (ok && (opt = getopt(argc, argv, "ds:t:n:r:b:")) != -1) {
+        switch (opt) {
+        case 'd':
+            settings.decompress = 1;
+            break;
+        case 's':
+            ok = parse_int(optarg, 1, LOCO_MAX_SEGS, &settings.n_segs);
+            break;
+        case 't':
+            ok = parse_int(optarg, 1, MAX_THREADS, &settings.n_threads);
+            break;
+        case 'n':
+            ok = parse_int(optarg, 0, LOCO_MAX_NEAR, &settings.near);
+            break;
+        case 'r':
+            settings.raw = 1;
+            ok = (sscanf(optarg, "%dx%d", &settings.width, &settings.height) == 2);
+            break;
+        case 'b':
+            ok = parse_int(optarg, 1, 12, &settings.bit_depth);
+            break;
+        default:
+            ok = 0;
+            break;
+        }
+    }
+    if (!ok || argc - optind != 2) {
+        usage();
+        return EXIT_FAILURE;
+    }
+    settings.in_path = argv[optind];
+    settings.out_path = argv[optind + 1];
+
+    Workers workers;
+    WorkerArg args[MAX_THREADS];
+    memset(&workers, 0, sizeof(workers));
+    ok = start_workers(&workers, settings.n_threads, args);
+    if (ok) {
+        ok = settings.decompress ? run_decompress(&settings, &workers)
+                : run_compress(&settings, &workers);
+    }
+    stop_workers(&workers);
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
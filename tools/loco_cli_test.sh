@@ -0,0 +1,41 @@
+#!/bin/sh
+#
+# Smoke test of the loco command-line tool: usage: loco_cli_test.sh path/to/loco
+#
+# Compresses 1024 x 1024 12 bit raw images, a noisy gradient and pure noise,
+# which the tool decompresses and checks against the input; then
+# decompresses the container into a PGM.
+
+set -eu
+
+loco="$1"
+
+# segment buffers, reserved at the bound, must fit a modest address space
+ulimit -v 1048576
+
+dir="$(mktemp -d)"
+trap 'rm -rf "$dir"' EXIT
+
+# 12 bit pixels, two bytes each, little endian
+LC_ALL=C awk 'BEGIN {
+    srand(1);
+    for (y = 0; y < 1024; y++) {
+        for (x = 0; x < 1024; x++) {
+            v = int(2 * x + y + 64 * rand()) % 4096;
+            printf "%c%c", v % 256, int(v / 256);
+        }
+    }
+}' > "$dir/gradient.raw"
+LC_ALL=C awk 'BEGIN {
+    srand(2);
+    for (i = 0; i < 1024 * 1024; i++) {
+        v = int(4096 * rand());
+        printf "%c%c", v % 256, int(v / 256);
+    }
+}' > "$dir/noise.raw"
+
+"$loco" -r 1024x1024 -b 12 -s 8 -t 4 "$dir/gradient.raw" "$dir/gradient.loco"
+"$loco" -r 1024x1024 -b 12 -s 1 "$dir/noise.raw" "$dir/noise.loco"
+"$loco" -r 1024x1024 -b 12 -s 8 -n 2 "$dir/noise.raw" "$dir/near.loco"
+"$loco" -d -t 4 "$dir/gradient.loco" "$dir/gradient.pgm"
+test "$(head -c 17 "$dir/gradient.pgm")" = "$(printf 'P5\n1024 1024\n4095')"
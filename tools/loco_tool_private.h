@@ -0,0 +1,66 @@
+/***********************************************************************
+ * Copyright 2026 by the California Institute of Technology
+ * ALL RIGHTS RESERVED. United States Government Sponsorship acknowledged.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * @file        loco_tool_private.h
+ * @date        2026-10-18
+ * @brief       Definition private macros for the loco command-line tool
+ *
+ * The build copies this file, as loco_conf_private.h, to a directory only
+ * the tool includes, so the tool builds the same in every configuration.
+ */
+
+#ifndef LOCO_CONF_PRIVATE_H
+#define LOCO_CONF_PRIVATE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+
+// private loco functions are preceded by LOCO_PRIVATE
+#ifndef LOCO_PRIVATE
+#define LOCO_PRIVATE static
+#endif
+
+/* A failed assertion is a bug in the tool or library: report it, and abort.
+   Unlike assert(), these stay in release builds. */
+#define LOCO_TOOL_ASSERT(test, fmt, ...) \
+    ((test) ? (void)0 : (fprintf(stderr, \
+    "loco: ASSERT in file %s, line %d" fmt ".\n", \
+    __FILE__, __LINE__, __VA_ARGS__), abort()))
+#define LOCO_ASSERT(test) \
+    LOCO_TOOL_ASSERT(test, "%s", "")
+#define LOCO_ASSERT_1(test, arg1) \
+    LOCO_TOOL_ASSERT(test, ", arg1 = %d", (int)(arg1))
+#define LOCO_ASSERT_2(test, arg1, arg2) \
+    LOCO_TOOL_ASSERT(test, ", arg1 = %d, arg2 = %d", (int)(arg1), (int)(arg2))
+#define LOCO_ASSERT_3(test, arg1, arg2, arg3) \
+    LOCO_TOOL_ASSERT(test, ", arg1 = %d, arg2 = %d, arg3 = %d", \
+    (int)(arg1), (int)(arg2), (int)(arg3))
+
+// warnings go to stderr, apart from the tool's report
+#define LOCO_WARN0(id, fmt) \
+    fprintf(stderr, "loco: WARNING " #id " "fmt"\n")
+#define LOCO_WARN2(id, fmt, arg1, arg2) \
+    fprintf(stderr, "loco: WARNING " #id " "fmt"\n", arg1, arg2)
+#define LOCO_WARN4(id, fmt, arg1, arg2, arg3, arg4) \
+    fprintf(stderr, "loco: WARNING " #id " "fmt"\n", arg1, arg2, arg3, arg4)
+#define LOCO_WARN6(id, fmt, arg1, arg2, arg3, arg4, arg5, arg6) \
+    fprintf(stderr, "loco: WARNING " #id " "fmt"\n", arg1, arg2, arg3, arg4, \
+    arg5, arg6)
+#define LOCO_WARN7(id, fmt, arg1, arg2, arg3, arg4, arg5, arg6, arg7) \
+    fprintf(stderr, "loco: WARNING " #id " "fmt"\n", arg1, arg2, arg3, arg4, \
+    arg5, arg6, arg7)
+
+#endif /* LOCO_CONF_PRIVATE_H */